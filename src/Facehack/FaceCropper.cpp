@@ -0,0 +1,204 @@
+//
+//  FaceCropper.cpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/18.
+//
+//
+
+#include "FaceCropper.hpp"
+#include "KSThreadPool.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+using namespace Kosakasakas;
+using namespace Facehack;
+using namespace Eigen;
+
+namespace
+{
+    //! 作業画像の1画素あたりの1方向の標本数の上限
+    const int MAX_SUPERSAMPLING = 4;
+    
+    /**
+     @brief 範囲をフレームの内側に収める(収まらない場合は中央に置く)
+     @param begin   範囲の先頭
+     @param size    範囲の大きさ
+     @param limit   フレームの大きさ
+     @return 収めた範囲の先頭
+     */
+    inline float Fit(float begin, float size, float limit)
+    {
+        if (size >= limit)
+        {
+            return 0.5f * (limit - size);
+        }
+        return std::min(std::max(begin, 0.0f), limit - size);
+    }
+}
+
+FaceCropper::FaceCropper()
+: m_WorkingWidth(0)
+, m_WorkingHeight(0)
+, m_Margin(0.0f)
+{}
+
+FaceCropper::~FaceCropper()
+{}
+
+bool    FaceCropper::Initialize(int workingWidth, int workingHeight, float margin)
+{
+    if (workingWidth <= 0 || workingHeight <= 0 || margin < 0.0f)
+    {
+        return false;
+    }
+    m_WorkingWidth  = workingWidth;
+    m_WorkingHeight = workingHeight;
+    m_Margin        = margin;
+    return true;
+}
+
+void    FaceCropper::Finalize()
+{
+    m_WorkingWidth  = 0;
+    m_WorkingHeight = 0;
+    m_Vertices.resize(0);
+}
+
+bool    FaceCropper::ComputeRegion(const MorphableBasis& basis,
+                                   const float* pParams,
+                                   const FaceParamLayout& layout,
+                                   int frameWidth,
+                                   int frameHeight,
+                                   FaceRegion& region)
+{
+    if (m_WorkingWidth <= 0 || basis.GetNumVertices() == 0
+        || !m_Projection.Set(pParams, layout, frameWidth, frameHeight))
+    {
+        return false;
+    }
+    basis.ComputeShape(pParams + layout.alpha, pParams + layout.delta, m_Vertices);
+    
+    // カメラの前にある頂点の外接矩形
+    Vector2f minUV  = Vector2f::Constant(std::numeric_limits<float>::max());
+    Vector2f maxUV  = Vector2f::Constant(-std::numeric_limits<float>::max());
+    Vector2f uv;
+    for (int i=0, n=basis.GetNumVertices(); i<n; ++i)
+    {
+        if (m_Projection.Project(m_Vertices.segment<3>(3 * i), uv))
+        {
+            minUV   = minUV.cwiseMin(uv);
+            maxUV   = maxUV.cwiseMax(uv);
+        }
+    }
+    if ((minUV.array() > maxUV.array()).any())
+    {
+        return false;
+    }
+    
+    // 余白を付け、作業画像と同じ縦横比に広げる(作業解像度より小さくはしない)
+    const Vector2f center   = 0.5f * (minUV + maxUV);
+    const Vector2f extent   = maxUV - minUV;
+    const float margin      = m_Margin * extent.maxCoeff();
+    const float aspect      = static_cast<float>(m_WorkingWidth) / m_WorkingHeight;
+    float width     = extent.x() + 2.0f * margin;
+    float height    = extent.y() + 2.0f * margin;
+    width           = std::max(width, height * aspect);
+    width           = std::max(width, static_cast<float>(std::min(m_WorkingWidth, frameWidth)));
+    height          = width / aspect;
+    
+    region.width    = width;
+    region.height   = height;
+    region.x        = Fit(center.x() - 0.5f * width, width, static_cast<float>(frameWidth));
+    region.y        = Fit(center.y() - 0.5f * height, height, static_cast<float>(frameHeight));
+    return true;
+}
+
+bool    FaceCropper::Crop(const unsigned char* pPixels,
+                          int width,
+                          int height,
+                          int numChannels,
+                          const FaceRegion& region,
+                          FaceImage& image) const
+{
+    if (!pPixels || (numChannels != 3 && numChannels != 4)
+        || width <= 0 || height <= 0 || m_WorkingWidth <= 0
+        || region.width <= 0.0f || region.height <= 0.0f)
+    {
+        return false;
+    }
+    if (image.GetWidth() != m_WorkingWidth || image.GetHeight() != m_WorkingHeight)
+    {
+        if (!image.Initialize(m_WorkingWidth, m_WorkingHeight))
+        {
+            return false;
+        }
+    }
+    
+    // 縮小する場合は1画素の範囲を複数点で平均する
+    const float stepX   = region.width / m_WorkingWidth;
+    const float stepY   = region.height / m_WorkingHeight;
+    const int samplesX  = std::min(std::max(static_cast<int>(std::ceil(stepX)), 1), MAX_SUPERSAMPLING);
+    const int samplesY  = std::min(std::max(static_cast<int>(std::ceil(stepY)), 1), MAX_SUPERSAMPLING);
+    const float weight  = 1.0f / (255.0f * samplesX * samplesY);
+    FaceImage::ColorArray& color    = image.GetColor();
+    FaceImage::MaskArray& mask      = image.GetMask();
+    
+    // 画素(x, y)のRGB
+    auto texel  = [&](int x, int y) -> Array3f
+    {
+        const unsigned char* p  = pPixels + (static_cast<size_t>(y) * width + x) * numChannels;
+        return Array3f(p[0], p[1], p[2]);
+    };
+    
+    KSThreadPool& pool  = KSThreadPool::GetDefault();
+    pool.ParallelFor(0, m_WorkingHeight, 8, [&](int begin, int end, int /*worker*/)
+    {
+        for (int y=begin; y<end; ++y)
+        {
+            for (int x=0; x<m_WorkingWidth; ++x)
+            {
+                const int i     = y * m_WorkingWidth + x;
+                const float cx  = region.x + (x + 0.5f) * stepX;
+                const float cy  = region.y + (y + 0.5f) * stepY;
+                if (cx < 0.0f || cy < 0.0f || cx >= width || cy >= height)
+                {
+                    color.col(i).setZero();
+                    mask(i)     = 0.0f;
+                    continue;
+                }
+                
+                Array3f sum = Array3f::Zero();
+                for (int sy=0; sy<samplesY; ++sy)
+                {
+                    // 画素中心を整数にした座標でバイリニア補間する
+                    const float fy  = std::min(std::max(region.y + (y + (sy + 0.5f) / samplesY) * stepY - 0.5f, 0.0f), height - 1.0f);
+                    const int y0    = std::min(static_cast<int>(fy), height - 1);
+                    const int y1    = std::min(y0 + 1, height - 1);
+                    const float ty  = fy - y0;
+                    for (int sx=0; sx<samplesX; ++sx)
+                    {
+                        const float fx  = std::min(std::max(region.x + (x + (sx + 0.5f) / samplesX) * stepX - 0.5f, 0.0f), width - 1.0f);
+                        const int x0    = std::min(static_cast<int>(fx), width - 1);
+                        const int x1    = std::min(x0 + 1, width - 1);
+                        const float tx  = fx - x0;
+                        sum += (1.0f - ty) * ((1.0f - tx) * texel(x0, y0) + tx * texel(x1, y0))
+                             + ty * ((1.0f - tx) * texel(x0, y1) + tx * texel(x1, y1));
+                    }
+                }
+                color.col(i)    = sum * weight;
+                
+                // 4チャンネルの場合は中心に最も近い画素のアルファでマスクを決める
+                mask(i) = 1.0f;
+                if (numChannels == 4)
+                {
+                    const int nx    = std::min(static_cast<int>(cx), width - 1);
+                    const int ny    = std::min(static_cast<int>(cy), height - 1);
+                    mask(i)         = (pPixels[(static_cast<size_t>(ny) * width + nx) * 4 + 3] > 0) ? 1.0f : 0.0f;
+                }
+            }
+        }
+    });
+    return true;
+}
@@ -0,0 +1,103 @@
+//
+//  FaceCropper.hpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/18.
+//
+//
+
+#ifndef FaceCropper_hpp
+#define FaceCropper_hpp
+
+#include "KSMath.h"
+#include "FaceImage.hpp"
+#include "FaceProjection.hpp"
+#include "FaceRegion.hpp"
+#include "MorphableBasis.hpp"
+
+namespace Facehack {
+    
+    /**
+     @brief 顔の範囲の切り出し
+     
+     投影したメッシュの外接矩形に余白を付けた範囲を入力フレームから切り出し、固定の作業解像度に拡大縮小します.
+     範囲は作業画像と同じ縦横比に広げ、フレームに収まる場合はフレームの内側にずらします.
+     作業画像の1画素はフレームの最大4 × 4点のバイリニア補間の平均で作るので、
+     1フレームあたりの計算量は入力フレームの解像度によらず作業解像度だけで決まります.
+     フレームの外の画素はマスクを0にします.
+     */
+    class FaceCropper
+    {
+    public:
+        FaceCropper();
+        virtual ~FaceCropper();
+        
+        /**
+         @brief 初期化
+         @param workingWidth    作業画像の幅
+         @param workingHeight   作業画像の高さ
+         @param margin          外接矩形の長辺に対する余白の割合(片側)
+         @return 初期化の成否
+         */
+        bool    Initialize(int workingWidth, int workingHeight, float margin);
+        void    Finalize();
+        
+        inline int  GetWorkingWidth() const
+        {
+            return m_WorkingWidth;
+        }
+        
+        inline int  GetWorkingHeight() const
+        {
+            return m_WorkingHeight;
+        }
+        
+        /**
+         @brief 顔の範囲の計算
+         @param basis       顔の線形モデル
+         @param pParams     パラメータ配列
+         @param layout      パラメータ配列のレイアウト
+         @param frameWidth  入力フレームの幅
+         @param frameHeight 入力フレームの高さ
+         @param region      出力の範囲
+         @return 計算の成否(カメラの前にある頂点が無い場合などは失敗)
+         */
+        bool    ComputeRegion(const MorphableBasis& basis,
+                              const float* pParams,
+                              const FaceParamLayout& layout,
+                              int frameWidth,
+                              int frameHeight,
+                              FaceRegion& region);
+        
+        /**
+         @brief 範囲の切り出し
+         @param pPixels     入力フレームの画素列(行優先、チャンネルはRGB(A)の順)
+         @param width       入力フレームの幅
+         @param height      入力フレームの高さ
+         @param numChannels チャンネル数(3か4)
+         @param region      切り出す範囲
+         @param image       出力の作業画像
+         @return 切り出しの成否
+         */
+        bool    Crop(const unsigned char* pPixels,
+                     int width,
+                     int height,
+                     int numChannels,
+                     const FaceRegion& region,
+                     FaceImage& image) const;
+    
+    private:
+        //! 作業画像の幅
+        int     m_WorkingWidth;
+        //! 作業画像の高さ
+        int     m_WorkingHeight;
+        //! 余白の割合
+        float   m_Margin;
+        //! 入力フレームの解像度の投影
+        FaceProjection  m_Projection;
+        //! 頂点座標の作業用のベクトル
+        Kosakasakas::KSVectorXf m_Vertices;
+    };
+}
+
+#endif /* FaceCropper_hpp */
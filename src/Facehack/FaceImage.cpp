@@ -0,0 +1,78 @@
+//
+//  FaceImage.cpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/17.
+//
+//
+
+#include "FaceImage.hpp"
+
+using namespace Facehack;
+using namespace Eigen;
+
+FaceImage::FaceImage()
+: m_Width(0)
+, m_Height(0)
+{}
+
+FaceImage::~FaceImage()
+{}
+
+bool    FaceImage::Initialize(int width, int height)
+{
+    if (width <= 0 || height <= 0)
+    {
+        return false;
+    }
+    m_Width     = width;
+    m_Height    = height;
+    m_Color.setZero(3, width * height);
+    m_Mask.setZero(1, width * height);
+    m_TriangleIds.setConstant(1, width * height, -1);
+    m_Barycentrics.setZero(3, width * height);
+    return true;
+}
+
+void    FaceImage::Finalize()
+{
+    m_Width     = 0;
+    m_Height    = 0;
+    m_Color.resize(3, 0);
+    m_Mask.resize(1, 0);
+    m_TriangleIds.resize(1, 0);
+    m_Barycentrics.resize(3, 0);
+}
+
+bool    FaceImage::SetPixels(const unsigned char* pPixels,
+                             int width,
+                             int height,
+                             int numChannels)
+{
+    if (!pPixels || (numChannels != 3 && numChannels != 4))
+    {
+        return false;
+    }
+    if (width != m_Width || height != m_Height)
+    {
+        if (!Initialize(width, height))
+        {
+            return false;
+        }
+    }
+    
+    // チャンネルをストライドにしたMapで1回のキャストにまとめる
+    const int num   = width * height;
+    typedef Map<const Array<unsigned char, Dynamic, Dynamic>, 0, OuterStride<> > PixelMap;
+    PixelMap src(pPixels, numChannels, num, OuterStride<>(numChannels));
+    m_Color = src.topRows<3>().cast<float>() * (1.0f / 255.0f);
+    if (numChannels == 4)
+    {
+        m_Mask  = (src.row(3) > 0).cast<float>();
+    }
+    else
+    {
+        m_Mask.setOnes();
+    }
+    return true;
+}
@@ -0,0 +1,137 @@
+//
+//  FaceImage.hpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/17.
+//
+//
+
+#ifndef FaceImage_hpp
+#define FaceImage_hpp
+
+#include "KSMath.h"
+
+namespace Facehack {
+    
+    /**
+     @brief CPU側に置くRGB画像バッファ
+     
+     エネルギー計算でテクスチャの読み戻しをしないための画像です.
+     画素は行優先(index = y * width + x)で、1画素を1列としてRGBを[0, 1]のfloatで保持します.
+     マスクは画素ごとの0/1で、合成画像では顔が描画された画素を表します.
+     合成画像では、画素ごとに描画された三角形の番号(背景は-1)と、その三角形での重心座標も保持できます.
+     */
+    class FaceImage
+    {
+    public:
+        //! 色配列(3 × 画素数)
+        typedef Eigen::Array<float, 3, Eigen::Dynamic>  ColorArray;
+        //! マスク配列(1 × 画素数)
+        typedef Eigen::Array<float, 1, Eigen::Dynamic>  MaskArray;
+        //! 三角形番号配列(1 × 画素数)
+        typedef Eigen::Array<int, 1, Eigen::Dynamic>    IndexArray;
+        //! 重心座標配列(3 × 画素数)
+        typedef Eigen::Array<float, 3, Eigen::Dynamic>  BarycentricArray;
+        
+        FaceImage();
+        virtual ~FaceImage();
+        
+        /**
+         @brief 初期化
+         
+         指定サイズの黒画像を確保します. マスクと重心座標は全画素0、三角形番号は全画素-1になります.
+         @param width   幅
+         @param height  高さ
+         @return 初期化の成否
+         */
+        bool    Initialize(int width, int height);
+        void    Finalize();
+        
+        /**
+         @brief 8bit画素からの変換
+         
+         ofPixelsなどの8bit画素列を[0, 1]のfloatに変換して取り込みます. サイズが違う場合は確保し直します.
+         4チャンネルの場合はアルファが0より大きい画素をマスクに、それ以外は全画素をマスクにします.
+         @param pPixels     画素列(行優先、チャンネルはRGB(A)の順)
+         @param width       幅
+         @param height      高さ
+         @param numChannels チャンネル数(3か4)
+         @return 変換の成否
+         */
+        bool    SetPixels(const unsigned char* pPixels,
+                          int width,
+                          int height,
+                          int numChannels);
+        
+        inline int  GetWidth() const
+        {
+            return m_Width;
+        }
+        
+        inline int  GetHeight() const
+        {
+            return m_Height;
+        }
+        
+        inline int  GetNumPixels() const
+        {
+            return m_Width * m_Height;
+        }
+        
+        inline ColorArray&  GetColor()
+        {
+            return m_Color;
+        }
+        
+        inline const ColorArray&    GetColor() const
+        {
+            return m_Color;
+        }
+        
+        inline MaskArray&   GetMask()
+        {
+            return m_Mask;
+        }
+        
+        inline const MaskArray& GetMask() const
+        {
+            return m_Mask;
+        }
+        
+        inline IndexArray&  GetTriangleIds()
+        {
+            return m_TriangleIds;
+        }
+        
+        inline const IndexArray&    GetTriangleIds() const
+        {
+            return m_TriangleIds;
+        }
+        
+        inline BarycentricArray&    GetBarycentrics()
+        {
+            return m_Barycentrics;
+        }
+        
+        inline const BarycentricArray&  GetBarycentrics() const
+        {
+            return m_Barycentrics;
+        }
+    
+    private:
+        //! 幅
+        int         m_Width;
+        //! 高さ
+        int         m_Height;
+        //! 色
+        ColorArray  m_Color;
+        //! マスク
+        MaskArray   m_Mask;
+        //! 画素ごとの三角形番号
+        IndexArray  m_TriangleIds;
+        //! 画素ごとの重心座標(透視補正済み)
+        BarycentricArray    m_Barycentrics;
+    };
+}
+
+#endif /* FaceImage_hpp */
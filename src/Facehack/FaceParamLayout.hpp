@@ -0,0 +1,52 @@
+//
+//  FaceParamLayout.hpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/18.
+//
+//
+
+#ifndef FaceParamLayout_hpp
+#define FaceParamLayout_hpp
+
+namespace Facehack {
+    
+    /**
+     @brief パラメータ配列のレイアウト
+     
+     エネルギー項がパラメータ配列から値を読む位置と、ヤコビアンに書き込む列の位置を表します.
+     FacehackParams::GetLayoutでFacehackParams::DataLayoutと同じ配置のものが取れます.
+     openFrameworksに依存しないエネルギー計算クラスに、パラメータの配置を渡すために使います.
+     */
+    struct FaceParamLayout
+    {
+        //! カメラ位置(3)
+        int camPos;
+        //! カメラの注視点(3)
+        int camLookAt;
+        //! カメラの垂直画角(度)
+        int camFov;
+        //! カメラのアスペクト比
+        int camAspect;
+        //! 照明のR(球面調和関数の係数)
+        int gammaR;
+        //! 照明のG
+        int gammaG;
+        //! 照明のB
+        int gammaB;
+        //! 形状の係数α
+        int alpha;
+        //! アルベドの係数β
+        int beta;
+        //! 表情の係数δ
+        int delta;
+        //! 顔の回転(クォータニオン x, y, z, w)
+        int faceQuat;
+        //! 顔の平行移動(3)
+        int faceTrans;
+        //! パラメータの総数(ヤコビアンの列数)
+        int total;
+    };
+}
+
+#endif /* FaceParamLayout_hpp */
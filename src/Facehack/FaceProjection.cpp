@@ -0,0 +1,198 @@
+//
+//  FaceProjection.cpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/18.
+//
+//
+
+#include "FaceProjection.hpp"
+#include <cmath>
+
+using namespace Facehack;
+using namespace Eigen;
+
+namespace
+{
+    //! 外積の行列 [v]x
+    inline Matrix3f CrossMatrix(const Vector3f& v)
+    {
+        Matrix3f m;
+        m <<  0.0f, -v.z(),  v.y(),
+             v.z(),   0.0f, -v.x(),
+            -v.y(),  v.x(),   0.0f;
+        return m;
+    }
+}
+
+FaceProjection::FaceProjection()
+: m_Quat(0.0f, 0.0f, 0.0f, 1.0f)
+, m_InvQuatNorm(1.0f)
+, m_Rotation(Matrix3f::Identity())
+, m_CameraRotation(Matrix3f::Identity())
+, m_ViewRotation(Matrix3f::Identity())
+, m_ViewTranslation(Vector3f::Zero())
+, m_FocalX(1.0f)
+, m_FocalY(1.0f)
+, m_CenterX(0.0f)
+, m_CenterY(0.0f)
+, m_Aspect(1.0f)
+, m_FocalFovDerivative(0.0f)
+, m_Width(0)
+, m_Height(0)
+{}
+
+FaceProjection::~FaceProjection()
+{}
+
+bool    FaceProjection::Set(const float* pParams,
+                            const FaceParamLayout& layout,
+                            int width,
+                            int height)
+{
+    if (width <= 0 || height <= 0)
+    {
+        return false;
+    }
+    
+    // 顔の回転
+    const Vector4f quat = Map<const Vector4f>(pParams + layout.faceQuat);
+    const float norm    = quat.norm();
+    if (norm < 1.0e-8f)
+    {
+        return false;
+    }
+    m_InvQuatNorm   = 1.0f / norm;
+    m_Quat          = quat * m_InvQuatNorm;
+    const float x   = m_Quat(0);
+    const float y   = m_Quat(1);
+    const float z   = m_Quat(2);
+    const float w   = m_Quat(3);
+    m_Rotation << 1.0f - 2.0f * (y * y + z * z), 2.0f * (x * y - z * w),        2.0f * (x * z + y * w),
+                  2.0f * (x * y + z * w),        1.0f - 2.0f * (x * x + z * z), 2.0f * (y * z - x * w),
+                  2.0f * (x * z - y * w),        2.0f * (y * z + x * w),        1.0f - 2.0f * (x * x + y * y);
+    
+    // カメラの姿勢(ofCamera::lookAtと同じく上方向は(0, 1, 0))
+    const Vector3f camPos   = Map<const Vector3f>(pParams + layout.camPos);
+    const Vector3f lookAt   = Map<const Vector3f>(pParams + layout.camLookAt);
+    const Vector3f back     = camPos - lookAt;
+    if (back.norm() < 1.0e-8f)
+    {
+        return false;
+    }
+    const Vector3f zAxis    = back.normalized();
+    const Vector3f xRaw     = Vector3f::UnitY().cross(zAxis);
+    if (xRaw.norm() < 1.0e-8f)
+    {
+        return false;
+    }
+    const Vector3f xAxis    = xRaw.normalized();
+    const Vector3f yAxis    = zAxis.cross(xAxis);
+    m_CameraRotation.row(0) = xAxis.transpose();
+    m_CameraRotation.row(1) = yAxis.transpose();
+    m_CameraRotation.row(2) = zAxis.transpose();
+    
+    const Vector3f trans    = Map<const Vector3f>(pParams + layout.faceTrans);
+    m_ViewRotation      = m_CameraRotation * m_Rotation;
+    m_ViewTranslation   = m_CameraRotation * (trans - camPos);
+    
+    // 透視投影(垂直画角)
+    const float fov     = pParams[layout.camFov];
+    const float aspect  = pParams[layout.camAspect];
+    if (fov <= 0.0f || fov >= 180.0f || aspect <= 0.0f)
+    {
+        return false;
+    }
+    const float halfFov = 0.5f * fov * static_cast<float>(M_PI) / 180.0f;
+    const float focal   = 1.0f / std::tan(halfFov);
+    m_Width     = width;
+    m_Height    = height;
+    m_FocalX    = 0.5f * width * focal / aspect;
+    m_FocalY    = 0.5f * height * focal;
+    m_CenterX   = 0.5f * width;
+    m_CenterY   = 0.5f * height;
+    m_Aspect    = aspect;
+    // f = cot(θ), θ = fov × π / 360 より (df/dfov) / f = -2 / sin(2θ) × π / 360
+    m_FocalFovDerivative    = -2.0f / std::sin(2.0f * halfFov) * static_cast<float>(M_PI) / 360.0f;
+    return true;
+}
+
+bool    FaceProjection::SetRegion(const FaceRegion& region, int width, int height)
+{
+    if (region.width <= 0.0f || region.height <= 0.0f || width <= 0 || height <= 0)
+    {
+        return false;
+    }
+    const float scaleX  = width / region.width;
+    const float scaleY  = height / region.height;
+    m_FocalX    *= scaleX;
+    m_FocalY    *= scaleY;
+    m_CenterX   = (m_CenterX - region.x) * scaleX;
+    m_CenterY   = (m_CenterY - region.y) * scaleY;
+    m_Width     = width;
+    m_Height    = height;
+    return true;
+}
+
+bool    FaceProjection::Project(const Vector3f& v, Vector2f& uv) const
+{
+    const Vector3f e    = ToCamera(v);
+    const float depth   = -e.z();
+    if (depth <= 0.0f)
+    {
+        return false;
+    }
+    uv(0)   = m_CenterX + m_FocalX * e.x() / depth;
+    uv(1)   = m_CenterY - m_FocalY * e.y() / depth;
+    return true;
+}
+
+bool    FaceProjection::ProjectWithJacobian(const Vector3f& v,
+                                            Vector2f& uv,
+                                            PointJacobian& dPoint,
+                                            QuatJacobian& dQuat,
+                                            PointJacobian& dTrans) const
+{
+    if (!Project(v, uv))
+    {
+        return false;
+    }
+    const PointJacobian dCamera = ProjectionJacobian(ToCamera(v));
+    dTrans  = dCamera * m_CameraRotation;
+    dPoint  = dCamera * m_ViewRotation;
+    dQuat   = dTrans * RotationJacobian(v);
+    return true;
+}
+
+FaceProjection::IntrinsicsJacobian  FaceProjection::GetIntrinsicsJacobian(const Vector2f& uv) const
+{
+    const float du  = uv(0) - m_CenterX;
+    const float dv  = uv(1) - m_CenterY;
+    IntrinsicsJacobian d;
+    d << du * m_FocalFovDerivative, -du / m_Aspect,
+         dv * m_FocalFovDerivative, 0.0f;
+    return d;
+}
+
+Matrix<float, 3, 4> FaceProjection::RotationJacobian(const Vector3f& v) const
+{
+    // R(q)・v = (w^2 - u・u)v + 2(u・v)u + 2w(u × v) を単位クォータニオンで微分し、正規化の微分を掛ける
+    const Vector3f u    = m_Quat.head<3>();
+    const float w       = m_Quat(3);
+    Matrix<float, 3, 4> dUnit;
+    dUnit.leftCols<3>() = 2.0f * (u * v.transpose() - v * u.transpose()
+                                  + u.dot(v) * Matrix3f::Identity()
+                                  - w * CrossMatrix(v));
+    dUnit.col(3)        = 2.0f * (w * v + u.cross(v));
+    const Matrix4f dNormalize   = (Matrix4f::Identity() - m_Quat * m_Quat.transpose()) * m_InvQuatNorm;
+    return dUnit * dNormalize;
+}
+
+FaceProjection::PointJacobian   FaceProjection::ProjectionJacobian(const Vector3f& e) const
+{
+    const float invDepth    = -1.0f / e.z();
+    PointJacobian d;
+    d << m_FocalX * invDepth, 0.0f,                 m_FocalX * e.x() * invDepth * invDepth,
+         0.0f,                -m_FocalY * invDepth, -m_FocalY * e.y() * invDepth * invDepth;
+    return d;
+}
@@ -0,0 +1,183 @@
+//
+//  FaceProjection.hpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/18.
+//
+//
+
+#ifndef FaceProjection_hpp
+#define FaceProjection_hpp
+
+#include "KSMath.h"
+#include "FaceParamLayout.hpp"
+#include "FaceRegion.hpp"
+
+namespace Facehack {
+    
+    /**
+     @brief 顔の姿勢とカメラによる投影
+     
+     モデル座標の点vを p = R(q)・v + t で配置し、ofCameraと同じ規約(注視点方向が-Z、上方向(0, 1, 0)、
+     垂直画角とアスペクト比による透視投影)で画像の画素座標(原点は左上)に投影します.
+     投影と同時に、モデル座標の点、クォータニオン、平行移動に関する画素座標の微分も計算できます.
+     クォータニオンは正規化してから回転に使い、その微分も正規化を含めて計算します.
+     ランドマークと画素ごとのヤコビアンで同じ投影を使うためのクラスです.
+     */
+    class FaceProjection
+    {
+    public:
+        //! 画素座標のモデル座標の点に関する微分
+        typedef Eigen::Matrix<float, 2, 3>  PointJacobian;
+        //! 画素座標のクォータニオンに関する微分
+        typedef Eigen::Matrix<float, 2, 4>  QuatJacobian;
+        //! 画素座標の垂直画角とアスペクト比に関する微分
+        typedef Eigen::Matrix<float, 2, 2>  IntrinsicsJacobian;
+        
+        FaceProjection();
+        virtual ~FaceProjection();
+        
+        /**
+         @brief パラメータのセット
+         @param pParams     パラメータ配列
+         @param layout      パラメータ配列のレイアウト
+         @param width       画像の幅
+         @param height      画像の高さ
+         @return セットの成否(クォータニオンが0、カメラ位置と注視点が同じ場合などは失敗)
+         */
+        bool    Set(const float* pParams,
+                    const FaceParamLayout& layout,
+                    int width,
+                    int height);
+        
+        /**
+         @brief 切り出した範囲への投影のセット
+         
+         Setで入力フレームの解像度の投影をセットした後に呼ぶと、以降の投影と微分は
+         入力フレームのregionをwidth × heightに拡大縮小した作業画像の画素座標になります.
+         焦点距離と画像中心を置き換えるだけなので、微分の式はそのまま使えます.
+         @param region  入力フレームの画素座標での範囲
+         @param width   作業画像の幅
+         @param height  作業画像の高さ
+         @return セットの成否(範囲が空の場合は失敗)
+         */
+        bool    SetRegion(const FaceRegion& region, int width, int height);
+        
+        /**
+         @brief カメラ座標への変換
+         @param v   モデル座標の点
+         @return カメラ座標の点(カメラの前方は-Z)
+         */
+        inline Eigen::Vector3f  ToCamera(const Eigen::Vector3f& v) const
+        {
+            return m_ViewRotation * v + m_ViewTranslation;
+        }
+        
+        /**
+         @brief 投影
+         @param v   モデル座標の点
+         @param uv  出力の画素座標
+         @return 点がカメラの前方にあるかどうか
+         */
+        bool    Project(const Eigen::Vector3f& v, Eigen::Vector2f& uv) const;
+        
+        /**
+         @brief 微分付きの投影
+         @param v       モデル座標の点
+         @param uv      出力の画素座標
+         @param dPoint  出力のモデル座標の点に関する微分
+         @param dQuat   出力のクォータニオン(x, y, z, w)に関する微分
+         @param dTrans  出力の平行移動に関する微分
+         @return 点がカメラの前方にあるかどうか
+         */
+        bool    ProjectWithJacobian(const Eigen::Vector3f& v,
+                                    Eigen::Vector2f& uv,
+                                    PointJacobian& dPoint,
+                                    QuatJacobian& dQuat,
+                                    PointJacobian& dTrans) const;
+        
+        /**
+         @brief 投影した画素座標の内部パラメータに関する微分
+         
+         画素座標は画像中心からのずれが焦点距離に比例するので、投影結果だけから計算できます.
+         @param uv  投影した画素座標
+         @return 垂直画角(度)、アスペクト比に関する微分(2 × 2)
+         */
+        IntrinsicsJacobian  GetIntrinsicsJacobian(const Eigen::Vector2f& uv) const;
+        
+        /**
+         @brief 回転した点のクォータニオンに関する微分
+         @param v   モデル座標の点
+         @return R(q)・vのq(x, y, z, w)に関する微分(3 × 4)
+         */
+        Eigen::Matrix<float, 3, 4>  RotationJacobian(const Eigen::Vector3f& v) const;
+        
+        //! 顔の回転
+        inline const Eigen::Matrix3f&   GetRotation() const
+        {
+            return m_Rotation;
+        }
+        
+        //! カメラ座標への回転(顔の回転を含む)
+        inline const Eigen::Matrix3f&   GetViewRotation() const
+        {
+            return m_ViewRotation;
+        }
+        
+        //! ワールド座標からカメラ座標への回転
+        inline const Eigen::Matrix3f&   GetCameraRotation() const
+        {
+            return m_CameraRotation;
+        }
+        
+        inline int  GetWidth() const
+        {
+            return m_Width;
+        }
+        
+        inline int  GetHeight() const
+        {
+            return m_Height;
+        }
+    
+    private:
+        /**
+         @brief カメラ座標から画素座標への微分
+         @param e   カメラ座標の点
+         @return 微分(2 × 3)
+         */
+        PointJacobian   ProjectionJacobian(const Eigen::Vector3f& e) const;
+    
+    private:
+        //! 正規化したクォータニオン(x, y, z, w)
+        Eigen::Vector4f m_Quat;
+        //! クォータニオンのノルムの逆数
+        float           m_InvQuatNorm;
+        //! 顔の回転
+        Eigen::Matrix3f m_Rotation;
+        //! ワールド座標からカメラ座標への回転
+        Eigen::Matrix3f m_CameraRotation;
+        //! モデル座標からカメラ座標への回転
+        Eigen::Matrix3f m_ViewRotation;
+        //! モデル座標からカメラ座標への平行移動
+        Eigen::Vector3f m_ViewTranslation;
+        //! 焦点距離(画素単位, x)
+        float           m_FocalX;
+        //! 焦点距離(画素単位, y)
+        float           m_FocalY;
+        //! 画像中心(x)
+        float           m_CenterX;
+        //! 画像中心(y)
+        float           m_CenterY;
+        //! アスペクト比
+        float           m_Aspect;
+        //! 焦点距離の垂直画角に関する対数微分
+        float           m_FocalFovDerivative;
+        //! 画像の幅
+        int             m_Width;
+        //! 画像の高さ
+        int             m_Height;
+    };
+}
+
+#endif /* FaceProjection_hpp */
@@ -0,0 +1,269 @@
+//
+//  FaceRasterizer.cpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/18.
+//
+//
+
+#include "FaceRasterizer.hpp"
+#include "KSThreadPool.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+using namespace Kosakasakas;
+using namespace Facehack;
+using namespace Eigen;
+
+namespace
+{
+    //! 有向辺abに対する点pの符号付き面積(の2倍)
+    inline float Edge(const Vector3f& a, const Vector3f& b, float px, float py)
+    {
+        return (b.x() - a.x()) * (py - a.y()) - (b.y() - a.y()) * (px - a.x());
+    }
+}
+
+FaceRasterizer::FaceRasterizer()
+{}
+
+FaceRasterizer::~FaceRasterizer()
+{}
+
+bool    FaceRasterizer::Initialize()
+{
+    return true;
+}
+
+void    FaceRasterizer::Finalize()
+{
+    m_Vertices.resize(3, 0);
+    m_Normals.resize(3, 0);
+    m_CameraNormals.resize(3, 0);
+    m_Albedo.resize(3, 0);
+    m_Shading.resize(3, 0);
+    m_Colors.resize(3, 0);
+    m_SHBasis.resize(SH_BASIS_NUM, 0);
+    m_Screen.resize(3, 0);
+    m_TriangleValid.clear();
+    m_TriangleRows.resize(2, 0);
+    m_Depth.resize(1, 0);
+    m_Scratch.resize(0);
+}
+
+bool    FaceRasterizer::Render(const MorphableBasis& basis,
+                               const float* pParams,
+                               const FaceParamLayout& layout,
+                               const FaceProjection& projection,
+                               FaceImage& image)
+{
+    const int width     = projection.GetWidth();
+    const int height    = projection.GetHeight();
+    if (basis.GetNumVertices() == 0 || width <= 0 || height <= 0)
+    {
+        return false;
+    }
+    if (image.GetWidth() != width || image.GetHeight() != height)
+    {
+        if (!image.Initialize(width, height))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        image.GetColor().setZero();
+        image.GetMask().setZero();
+        image.GetTriangleIds().setConstant(-1);
+        image.GetBarycentrics().setZero();
+    }
+    m_Depth.setConstant(1, width * height, std::numeric_limits<float>::infinity());
+    
+    ComputeVertices(basis, pParams, layout, projection);
+    SetupTriangles(basis, width, height);
+    
+    // 行を帯に分けて描画する(帯どうしは書き込み先が重ならない)
+    KSThreadPool& pool  = KSThreadPool::GetDefault();
+    const int grain     = std::max(1, height / (4 * pool.GetNumWorkers()));
+    pool.ParallelFor(0, height, grain, [&](int begin, int end, int /*worker*/)
+    {
+        RasterizeRows(basis, image, begin, end);
+    });
+    return true;
+}
+
+void    FaceRasterizer::ComputeVertices(const MorphableBasis& basis,
+                                        const float* pParams,
+                                        const FaceParamLayout& layout,
+                                        const FaceProjection& projection)
+{
+    const int numVertices   = basis.GetNumVertices();
+    basis.ComputeShape(pParams + layout.alpha, pParams + layout.delta, m_Scratch);
+    m_Vertices  = Map<const VertexArray>(m_Scratch.data(), 3, numVertices);
+    basis.ComputeAlbedo(pParams + layout.beta, m_Scratch);
+    m_Albedo    = Map<const VertexArray>(m_Scratch.data(), 3, numVertices);
+    
+    // 面法線(外積の大きさが面積の2倍)を頂点に足し込む
+    const MorphableBasis::TriangleArray& triangles  = basis.GetTriangles();
+    m_Normals.setZero(3, numVertices);
+    for (int t=0, n=basis.GetNumTriangles(); t<n; ++t)
+    {
+        const Vector3i tri      = triangles.col(t);
+        const Vector3f v0       = m_Vertices.col(tri(0));
+        const Vector3f face     = (m_Vertices.col(tri(1)) - v0).cross(m_Vertices.col(tri(2)) - v0);
+        m_Normals.col(tri(0))   += face;
+        m_Normals.col(tri(1))   += face;
+        m_Normals.col(tri(2))   += face;
+    }
+    
+    m_CameraNormals.resize(3, numVertices);
+    m_SHBasis.resize(SH_BASIS_NUM, numVertices);
+    m_Shading.resize(3, numVertices);
+    m_Colors.resize(3, numVertices);
+    m_Screen.resize(3, numVertices);
+    
+    typedef Map<const SphericalHarmonics::BasisVector> GammaMap;
+    const GammaMap gammaR(pParams + layout.gammaR);
+    const GammaMap gammaG(pParams + layout.gammaG);
+    const GammaMap gammaB(pParams + layout.gammaB);
+    const Matrix3f& viewRotation    = projection.GetViewRotation();
+    
+    KSThreadPool& pool  = KSThreadPool::GetDefault();
+    pool.ParallelFor(0, numVertices, 1024, [&](int begin, int end, int /*worker*/)
+    {
+        SphericalHarmonics::BasisVector h;
+        for (int i=begin; i<end; ++i)
+        {
+            const float norm    = m_Normals.col(i).norm();
+            if (norm > 0.0f)
+            {
+                m_Normals.col(i)    /= norm;
+            }
+            const Vector3f n    = viewRotation * m_Normals.col(i);
+            SphericalHarmonics::Evaluate(n, h);
+            m_CameraNormals.col(i)  = n;
+            m_SHBasis.col(i)        = h;
+            m_Shading.col(i)        << gammaR.dot(h), gammaG.dot(h), gammaB.dot(h);
+            m_Colors.col(i)         = m_Albedo.col(i).cwiseProduct(m_Shading.col(i));
+            
+            // カメラの後ろの頂点は奥行きの逆数を0にして印を付ける
+            const Vector3f v    = m_Vertices.col(i);
+            Vector2f uv;
+            if (projection.Project(v, uv))
+            {
+                m_Screen.col(i) << uv, -1.0f / projection.ToCamera(v).z();
+            }
+            else
+            {
+                m_Screen.col(i).setZero();
+            }
+        }
+    });
+}
+
+void    FaceRasterizer::SetupTriangles(const MorphableBasis& basis, int width, int height)
+{
+    const MorphableBasis::TriangleArray& triangles  = basis.GetTriangles();
+    const int numTriangles  = basis.GetNumTriangles();
+    m_TriangleValid.assign(numTriangles, 0);
+    m_TriangleRows.resize(2, numTriangles);
+    
+    KSThreadPool& pool  = KSThreadPool::GetDefault();
+    pool.ParallelFor(0, numTriangles, 4096, [&](int begin, int end, int /*worker*/)
+    {
+        for (int t=begin; t<end; ++t)
+        {
+            const Vector3f p0   = m_Screen.col(triangles(0, t));
+            const Vector3f p1   = m_Screen.col(triangles(1, t));
+            const Vector3f p2   = m_Screen.col(triangles(2, t));
+            if (p0.z() <= 0.0f || p1.z() <= 0.0f || p2.z() <= 0.0f
+                || std::fabs(Edge(p0, p1, p2.x(), p2.y())) < 1.0e-12f)
+            {
+                continue;
+            }
+            
+            // 画素中心(y + 0.5)が範囲に入る行
+            const float minY    = std::min(p0.y(), std::min(p1.y(), p2.y()));
+            const float maxY    = std::max(p0.y(), std::max(p1.y(), p2.y()));
+            const float minX    = std::min(p0.x(), std::min(p1.x(), p2.x()));
+            const float maxX    = std::max(p0.x(), std::max(p1.x(), p2.x()));
+            const int rowBegin  = std::max(0, static_cast<int>(std::ceil(minY - 0.5f)));
+            const int rowEnd    = std::min(height - 1, static_cast<int>(std::floor(maxY - 0.5f)));
+            if (rowBegin > rowEnd || maxX < 0.5f || minX > width - 0.5f)
+            {
+                continue;
+            }
+            m_TriangleRows(0, t)    = rowBegin;
+            m_TriangleRows(1, t)    = rowEnd;
+            m_TriangleValid[t]      = 1;
+        }
+    });
+}
+
+void    FaceRasterizer::RasterizeRows(const MorphableBasis& basis,
+                                      FaceImage& image,
+                                      int begin,
+                                      int end)
+{
+    const MorphableBasis::TriangleArray& triangles  = basis.GetTriangles();
+    const int width     = image.GetWidth();
+    FaceImage::ColorArray& color            = image.GetColor();
+    FaceImage::MaskArray& mask              = image.GetMask();
+    FaceImage::IndexArray& ids              = image.GetTriangleIds();
+    FaceImage::BarycentricArray& barys      = image.GetBarycentrics();
+    
+    for (int t=0, n=basis.GetNumTriangles(); t<n; ++t)
+    {
+        if (!m_TriangleValid[t] || m_TriangleRows(1, t) < begin || m_TriangleRows(0, t) >= end)
+        {
+            continue;
+        }
+        const Vector3i tri  = triangles.col(t);
+        const Vector3f p0   = m_Screen.col(tri(0));
+        const Vector3f p1   = m_Screen.col(tri(1));
+        const Vector3f p2   = m_Screen.col(tri(2));
+        const float invArea = 1.0f / Edge(p0, p1, p2.x(), p2.y());
+        const int rowBegin  = std::max(m_TriangleRows(0, t), begin);
+        const int rowEnd    = std::min(m_TriangleRows(1, t), end - 1);
+        const float minX    = std::min(p0.x(), std::min(p1.x(), p2.x()));
+        const float maxX    = std::max(p0.x(), std::max(p1.x(), p2.x()));
+        const int colBegin  = std::max(0, static_cast<int>(std::ceil(minX - 0.5f)));
+        const int colEnd    = std::min(width - 1, static_cast<int>(std::floor(maxX - 0.5f)));
+        
+        for (int y=rowBegin; y<=rowEnd; ++y)
+        {
+            const float py  = y + 0.5f;
+            for (int x=colBegin; x<=colEnd; ++x)
+            {
+                // 画面上の重心座標(面積の符号で割るので巻き方向によらない)
+                const float px  = x + 0.5f;
+                const float l0  = Edge(p1, p2, px, py) * invArea;
+                const float l1  = Edge(p2, p0, px, py) * invArea;
+                const float l2  = 1.0f - l0 - l1;
+                if (l0 < 0.0f || l1 < 0.0f || l2 < 0.0f)
+                {
+                    continue;
+                }
+                
+                // 奥行きの逆数は画面上で線形なので、それで透視補正する
+                const Vector3f w(l0 * p0.z(), l1 * p1.z(), l2 * p2.z());
+                const float invDepth    = w.sum();
+                const float depth       = 1.0f / invDepth;
+                const int i             = y * width + x;
+                if (depth >= m_Depth(i))
+                {
+                    continue;
+                }
+                m_Depth(i)      = depth;
+                const Vector3f b    = w * depth;
+                barys.col(i)    = b.array();
+                ids(i)          = t;
+                mask(i)         = 1.0f;
+                color.col(i)    = (m_Colors.col(tri(0)) * b(0)
+                                   + m_Colors.col(tri(1)) * b(1)
+                                   + m_Colors.col(tri(2)) * b(2)).array();
+            }
+        }
+    }
+}
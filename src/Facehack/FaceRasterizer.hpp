@@ -0,0 +1,160 @@
+//
+//  FaceRasterizer.hpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/18.
+//
+//
+
+#ifndef FaceRasterizer_hpp
+#define FaceRasterizer_hpp
+
+#include "KSMath.h"
+#include "FaceImage.hpp"
+#include "FaceProjection.hpp"
+#include "MorphableBasis.hpp"
+#include "SphericalHarmonics.hpp"
+#include <vector>
+
+namespace Facehack {
+    
+    /**
+     @brief CPU側の顔のラスタライザ
+     
+     パラメータ配列から頂点、法線、アルベド、球面調和関数による陰影を計算し、Zバッファで合成画像を描画します.
+     画素ごとに描画した三角形の番号と透視補正した重心座標も書き込むので、
+     画素ごとのヤコビアンは描画結果から解析的に組み立てられます(PhotometricJacobian).
+     画素の色は頂点ごとの色 アルベド × 陰影 を重心座標で補間したものです.
+     法線は面法線の面積重み付き和を正規化したもので、陰影はカメラ座標の法線で計算します.
+     画素(x, y)は画素座標(x + 0.5, y + 0.5)の点で判定します. 裏面のカリングはしません.
+     画像の行を帯に分けてスレッドプールで並列に描画します.
+     */
+    class FaceRasterizer
+    {
+    public:
+        //! 頂点ごとの3次元ベクトル(3 × 頂点数)
+        typedef Eigen::Matrix<float, 3, Eigen::Dynamic> VertexArray;
+        //! 頂点ごとの球面調和関数の基底(SH_BASIS_NUM × 頂点数)
+        typedef Eigen::Matrix<float, SH_BASIS_NUM, Eigen::Dynamic>  SHBasisArray;
+        
+        FaceRasterizer();
+        virtual ~FaceRasterizer();
+        
+        bool    Initialize();
+        void    Finalize();
+        
+        /**
+         @brief 描画
+         
+         画像のサイズは投影にセットしたサイズに合わせます.
+         @param basis       顔の線形モデル
+         @param pParams     パラメータ配列
+         @param layout      パラメータ配列のレイアウト
+         @param projection  投影
+         @param image       出力の合成画像(色、マスク、三角形番号、重心座標)
+         @return 描画の成否
+         */
+        bool    Render(const MorphableBasis& basis,
+                       const float* pParams,
+                       const FaceParamLayout& layout,
+                       const FaceProjection& projection,
+                       FaceImage& image);
+        
+        //! 直前の描画の頂点座標(モデル座標)
+        inline const VertexArray&   GetVertices() const
+        {
+            return m_Vertices;
+        }
+        
+        //! 直前の描画の単位法線(モデル座標)
+        inline const VertexArray&   GetNormals() const
+        {
+            return m_Normals;
+        }
+        
+        //! 直前の描画の単位法線(カメラ座標)
+        inline const VertexArray&   GetCameraNormals() const
+        {
+            return m_CameraNormals;
+        }
+        
+        //! 直前の描画のアルベド
+        inline const VertexArray&   GetAlbedo() const
+        {
+            return m_Albedo;
+        }
+        
+        //! 直前の描画のRGBごとの陰影
+        inline const VertexArray&   GetShading() const
+        {
+            return m_Shading;
+        }
+        
+        //! 直前の描画の球面調和関数の基底
+        inline const SHBasisArray&  GetSHBasis() const
+        {
+            return m_SHBasis;
+        }
+    
+    private:
+        /**
+         @brief 頂点ごとの属性の計算
+         @param basis       顔の線形モデル
+         @param pParams     パラメータ配列
+         @param layout      パラメータ配列のレイアウト
+         @param projection  投影
+         */
+        void    ComputeVertices(const MorphableBasis& basis,
+                                const float* pParams,
+                                const FaceParamLayout& layout,
+                                const FaceProjection& projection);
+        
+        /**
+         @brief 三角形の画面上の範囲の計算
+         @param basis       顔の線形モデル
+         @param width       画像の幅
+         @param height      画像の高さ
+         */
+        void    SetupTriangles(const MorphableBasis& basis, int width, int height);
+        
+        /**
+         @brief 行の帯の描画
+         @param basis   顔の線形モデル
+         @param image   出力の合成画像
+         @param begin   先頭の行
+         @param end     末尾の次の行
+         */
+        void    RasterizeRows(const MorphableBasis& basis,
+                              FaceImage& image,
+                              int begin,
+                              int end);
+    
+    private:
+        //! 頂点座標(モデル座標)
+        VertexArray     m_Vertices;
+        //! 単位法線(モデル座標)
+        VertexArray     m_Normals;
+        //! 単位法線(カメラ座標)
+        VertexArray     m_CameraNormals;
+        //! アルベド
+        VertexArray     m_Albedo;
+        //! 陰影
+        VertexArray     m_Shading;
+        //! 頂点の色(アルベド × 陰影)
+        VertexArray     m_Colors;
+        //! 球面調和関数の基底
+        SHBasisArray    m_SHBasis;
+        //! 画素座標(x, y)と奥行きの逆数
+        VertexArray     m_Screen;
+        //! 三角形が描画範囲にあるかどうか
+        std::vector<char>   m_TriangleValid;
+        //! 三角形の画面上の行の範囲(先頭, 末尾)
+        Eigen::Matrix<int, 2, Eigen::Dynamic>   m_TriangleRows;
+        //! 画素ごとの奥行き
+        Eigen::Array<float, 1, Eigen::Dynamic>  m_Depth;
+        //! 作業用のベクトル
+        Kosakasakas::KSVectorXf m_Scratch;
+    };
+}
+
+#endif /* FaceRasterizer_hpp */
@@ -0,0 +1,35 @@
+//
+//  FaceRegion.hpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/18.
+//
+//
+
+#ifndef FaceRegion_hpp
+#define FaceRegion_hpp
+
+namespace Facehack {
+    
+    /**
+     @brief 入力フレームから切り出す顔の範囲
+     
+     入力フレームの画素座標(原点は左上、画素(x, y)は[x, x + 1) × [y, y + 1))での矩形です.
+     切り出した作業画像の画素(x', y')の中心は、入力フレームの
+     (x + (x' + 0.5) × width / 作業画像の幅, y + (y' + 0.5) × height / 作業画像の高さ) に対応します.
+     フレームの外にはみ出していてもかまいません.
+     */
+    struct FaceRegion
+    {
+        //! 左上のx
+        float x;
+        //! 左上のy
+        float y;
+        //! 幅
+        float width;
+        //! 高さ
+        float height;
+    };
+}
+
+#endif /* FaceRegion_hpp */
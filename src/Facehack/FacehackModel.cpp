@@ -67,8 +67,8 @@ void    FacehackModel::Draw()
     // フレームバッファを有効化
     m_Fbo.begin();
     {
-        // カラー初期化
-        ofClear(0, 0, 0, 255);
+        // カラー初期化(アルファ0の画素は顔のマスクから外れる)
+        ofClear(0, 0, 0, 0);
         // シェーダ有効化
         m_Shader.begin();
         {
@@ -8,12 +8,37 @@
 
 #include "FacehackOptimizer.hpp"
 #include "KSMath.h"
+#include <limits>
 
 using namespace Kosakasakas;
 using namespace Facehack;
 using namespace Eigen;
 
+namespace
+{
+    //! 減衰の係数の初期値
+    const double INITIAL_DAMPING    = 1.0e-3;
+    //! 減衰の係数の下限
+    const double MIN_DAMPING        = 1.0e-7;
+    //! 減衰の係数の上限
+    const double MAX_DAMPING        = 1.0e+7;
+}
+
 FacehackOptimizer::FacehackOptimizer()
+: m_PyramidLevel(0)
+, m_MaxIterations(3)
+, m_IsNewFrame(true)
+, m_IsCalibrationEnabled(false)
+, m_IsIdentityCalibrated(false)
+, m_CalibrationLevel(0)
+, m_IsFaceRegionEnabled(false)
+, m_FaceRegion()
+, m_FrameWidth(0)
+, m_FrameHeight(0)
+, m_FunctionTolerance(1.0e-3f)
+, m_QualityThresholds()
+, m_TrackingQuality()
+, m_ReinitializationIterations(10)
 {}
 
 FacehackOptimizer::~FacehackOptimizer()
@@ -32,45 +57,842 @@ bool FacehackOptimizer::Initialize(const ParamsPtr& pParam,
     m_AlphaValiance     = Map<const AlphaCoeffArray>(alphaVariance);
     m_BetaValiance      = Map<const BetaCoeffArray>(betaVariance);
     m_DeltaValiance     = Map<const DeltaCoeffArray>(deltaVarinace);
-    return true;
+    m_PyramidLevel      = 0;
+    m_PyramidSchedule.clear();
+    m_IsNewFrame        = true;
+    
+    m_IsCalibrationEnabled  = false;
+    m_IsIdentityCalibrated  = false;
+    m_ConstantBlocks.clear();
+    m_ConstantBlocks.push_back({FacehackParams::CAM_POS, FacehackParams::GAMMA_R - FacehackParams::CAM_POS});
+    UpdateConstantBlocks();
+    return m_PhotoEnergy.Initialize(PHOTOMETRIC_L21)
+        && m_Rasterizer.Initialize()
+        && m_PhotoJacobian.Initialize()
+        && m_PixelSampler.Initialize(0)
+        && m_StatisticalPrior.Initialize(FacehackParams::GetLayout(),
+                                         m_AlphaValiance.data(), ALPHA_COEFF_NUM,
+                                         m_BetaValiance.data(), BETA_COEFF_NUM,
+                                         m_DeltaValiance.data(), DELTA_COEFF_NUM,
+                                         W_reg)
+        && m_TrackerState.Initialize(FacehackParams::GetLayout(), DELTA_COEFF_NUM)
+        && m_InputPyramid.Initialize(1);
 }
 
 void    FacehackOptimizer::Finalize()
-{}
+{
+    m_PhotoEnergy.Finalize();
+    m_PixelSampler.Finalize();
+    m_LandmarkEnergy.Finalize();
+    m_LandmarkTrack.Finalize();
+    m_StatisticalPrior.Finalize();
+    m_Rasterizer.Finalize();
+    m_PhotoJacobian.Finalize();
+    m_TrackerState.Finalize();
+    m_IdentityCalibrator.Finalize();
+    m_IsCalibrationEnabled  = false;
+    m_FaceCropper.Finalize();
+    m_IsFaceRegionEnabled   = false;
+    m_RegionImage.Finalize();
+    m_pBasis    = nullptr;
+    m_InputPyramid.Finalize();
+    m_SynthesizedImage.Finalize();
+}
 
 void    FacehackOptimizer::Update(const ofTexture& inputTex)
 {
-    m_InputTex  = inputTex;
+    m_InputTex      = inputTex;
+    m_IsNewFrame    = true;
+}
+
+bool    FacehackOptimizer::Update(const ofPixels& inputPixels)
+{
+    m_IsNewFrame    = true;
+    m_FrameWidth    = static_cast<int>(inputPixels.getWidth());
+    m_FrameHeight   = static_cast<int>(inputPixels.getHeight());
+    m_FaceRegion    = {0.0f, 0.0f, static_cast<float>(m_FrameWidth), static_cast<float>(m_FrameHeight)};
+    if (m_IsFaceRegionEnabled && m_pParam && m_pBasis)
+    {
+        // Solveと同じ予測値でメッシュを投影して範囲を決める
+        FacehackParams::ParamVec params = m_pParam->GetParams();
+        m_TrackerState.Predict(params.data());
+        FaceRegion region;
+        if (m_FaceCropper.ComputeRegion(*m_pBasis, params.data(), FacehackParams::GetLayout(), m_FrameWidth, m_FrameHeight, region)
+            && m_FaceCropper.Crop(inputPixels.getData(), m_FrameWidth, m_FrameHeight, inputPixels.getNumChannels(), region, m_RegionImage))
+        {
+            m_FaceRegion    = region;
+            return m_InputPyramid.Build(m_RegionImage);
+        }
+    }
+    return m_InputPyramid.Build(inputPixels.getData(),
+                                m_FrameWidth,
+                                m_FrameHeight,
+                                inputPixels.getNumChannels());
+}
+
+bool    FacehackOptimizer::SetFaceRegionResolution(int width, int height, float margin)
+{
+    if (width <= 0 || height <= 0)
+    {
+        m_FaceCropper.Finalize();
+        m_IsFaceRegionEnabled   = false;
+        return true;
+    }
+    m_IsFaceRegionEnabled   = m_FaceCropper.Initialize(width, height, margin);
+    return m_IsFaceRegionEnabled;
+}
+
+bool    FacehackOptimizer::SetRegionProjection(const FacehackParams::ParamVec& params,
+                                               int width,
+                                               int height,
+                                               FaceProjection& projection) const
+{
+    return projection.Set(params.data(), FacehackParams::GetLayout(), m_FrameWidth, m_FrameHeight)
+        && projection.SetRegion(m_FaceRegion, width, height);
+}
+
+void    FacehackOptimizer::SetPixelSampling(int numSamples, unsigned int seed)
+{
+    m_PixelSampler.SetNumSamples(numSamples);
+    m_PixelSampler.SetSeed(seed);
+}
+
+bool    FacehackOptimizer::SetPyramidSchedule(const std::vector<int>& iterationsPerLevel)
+{
+    for (int iterations : iterationsPerLevel)
+    {
+        if (iterations < 0)
+        {
+            return false;
+        }
+    }
+    m_PyramidSchedule   = iterationsPerLevel;
+    m_TrackerState.ClearFactorizations();
+    return m_InputPyramid.Initialize(std::max(1, static_cast<int>(iterationsPerLevel.size())));
+}
+
+int     FacehackOptimizer::GetPyramidLevelForIteration(int iteration) const
+{
+    // 粗いレベルから順にスケジュールをたどる
+    for (int level=static_cast<int>(m_PyramidSchedule.size())-1; level>0; --level)
+    {
+        if (iteration < m_PyramidSchedule[level])
+        {
+            return level;
+        }
+        iteration   -= m_PyramidSchedule[level];
+    }
+    return 0;
+}
+
+bool    FacehackOptimizer::GetPyramidLevelSize(int level, int& width, int& height) const
+{
+    if (m_InputPyramid.GetNumLevels() == 0)
+    {
+        return false;
+    }
+    width   = m_InputPyramid.GetLevel(0).GetWidth();
+    height  = m_InputPyramid.GetLevel(0).GetHeight();
+    ImagePyramid::GetLevelSize(level, width, height);
+    return true;
+}
+
+bool    FacehackOptimizer::SetMorphableBasis(const MorphableBasisPtr& pBasis)
+{
+    if (!pBasis || pBasis->GetNumVertices() == 0)
+    {
+        ofLog(OF_LOG_ERROR, "顔の線形モデルが空です.");
+        return false;
+    }
+    m_pBasis    = pBasis;
+    return true;
+}
+
+bool    FacehackOptimizer::SetLandmarkVertices(const std::vector<int>& vertexIndices)
+{
+    if (!m_pBasis)
+    {
+        ofLog(OF_LOG_ERROR, "先にSetMorphableBasisを呼んでください.");
+        return false;
+    }
+    if (!m_LandmarkEnergy.Initialize(*m_pBasis, vertexIndices))
+    {
+        ofLog(OF_LOG_ERROR, "ランドマークの頂点番号が範囲外です.");
+        return false;
+    }
+    m_LandmarkVertices  = vertexIndices;
+    if (m_IsCalibrationEnabled)
+    {
+        m_IdentityCalibrator.SetLandmarkVertices(vertexIndices);
+    }
+    return true;
+}
+
+bool    FacehackOptimizer::LoadLandmarkTrack(const std::string& path)
+{
+    if (!m_LandmarkTrack.Load(path, m_LandmarkEnergy.GetNumLandmarks()))
+    {
+        ofLog(OF_LOG_ERROR, "ランドマークの読み込みに失敗しました. %s", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool    FacehackOptimizer::SetLandmarkFrame(int frame)
+{
+    if (frame < 0 || frame >= m_LandmarkTrack.GetNumFrames())
+    {
+        return false;
+    }
+    return m_LandmarkEnergy.SetObservations(m_LandmarkTrack.GetPoints(frame),
+                                            m_LandmarkTrack.GetConfidences(frame));
+}
+
+bool    FacehackOptimizer::SetLandmarkObservations(const float* pPoints, const float* pConfidences)
+{
+    return m_LandmarkEnergy.SetObservations(pPoints, pConfidences);
+}
+
+void    FacehackOptimizer::SetConstantParameterBlocks(const std::vector<KSParameterBlock>& blocks)
+{
+    m_ConstantBlocks    = blocks;
+    UpdateConstantBlocks();
+}
+
+void    FacehackOptimizer::UpdateConstantBlocks()
+{
+    std::vector<KSParameterBlock> blocks    = m_ConstantBlocks;
+    if (m_IsCalibrationEnabled)
+    {
+        const std::vector<KSParameterBlock>& shared = m_IdentityCalibrator.GetSharedBlocks();
+        blocks.insert(blocks.end(), shared.begin(), shared.end());
+    }
+    m_ParamMask.SetConstantBlocks(blocks);
+    m_TrackerState.ClearFactorizations();
+}
+
+bool    FacehackOptimizer::StartIdentityCalibration(int numKeyframes, float minPoseSpread, int pyramidLevel)
+{
+    if (!m_pBasis)
+    {
+        ofLog(OF_LOG_ERROR, "先にSetMorphableBasisを呼んでください.");
+        return false;
+    }
+    if (!m_IdentityCalibrator.Initialize(m_pBasis,
+                                         FacehackParams::GetLayout(),
+                                         m_AlphaValiance.data(),
+                                         m_BetaValiance.data(),
+                                         m_DeltaValiance.data(),
+                                         W_col,
+                                         W_lan,
+                                         W_reg))
+    {
+        ofLog(OF_LOG_ERROR, "個人性のキャリブレーションの初期化に失敗しました.");
+        return false;
+    }
+    if (!m_LandmarkVertices.empty())
+    {
+        m_IdentityCalibrator.SetLandmarkVertices(m_LandmarkVertices);
+    }
+    m_IdentityCalibrator.SetKeyframeSelection(numKeyframes, minPoseSpread);
+    m_CalibrationLevel      = std::max(pyramidLevel, 0);
+    m_IsCalibrationEnabled  = true;
+    m_IsIdentityCalibrated  = false;
+    UpdateConstantBlocks();
+    return true;
+}
+
+void    FacehackOptimizer::StopIdentityCalibration()
+{
+    m_IdentityCalibrator.Finalize();
+    m_IsCalibrationEnabled  = false;
+    m_IsIdentityCalibrated  = false;
+    UpdateConstantBlocks();
+}
+
+void    FacehackOptimizer::ApplyIdentityCalibration(FacehackParams::ParamVec& params)
+{
+    if (!m_IsCalibrationEnabled || m_IsIdentityCalibrated)
+    {
+        return;
+    }
+    const CalibrationStatus status  = m_IdentityCalibrator.GetStatus();
+    if (status == CALIBRATION_FAILED)
+    {
+        // キーフレームを集め直す
+        ofLog(OF_LOG_WARNING, "個人性のキャリブレーションに失敗しました. キーフレームを集め直します.");
+        m_IdentityCalibrator.Reset();
+    }
+    else if (m_IdentityCalibrator.GetResult(params.data()))
+    {
+        m_IsIdentityCalibrated  = true;
+    }
+}
+
+void    FacehackOptimizer::UpdateIdentityCalibration(const FacehackParams::ParamVec& params)
+{
+    if (!m_IsCalibrationEnabled || m_IsIdentityCalibrated
+        || m_IdentityCalibrator.GetStatus() != CALIBRATION_COLLECTING)
+    {
+        return;
+    }
+    const int level = std::min(m_CalibrationLevel, m_InputPyramid.GetNumLevels() - 1);
+    m_IdentityCalibrator.AddCandidate(m_InputPyramid.GetLevel(level),
+                                      m_FaceRegion,
+                                      m_FrameWidth,
+                                      m_FrameHeight,
+                                      params.data(),
+                                      m_LandmarkEnergy.GetPoints(),
+                                      m_LandmarkEnergy.GetConfidences());
+    if (m_IdentityCalibrator.IsReady())
+    {
+        m_IdentityCalibrator.Start();
+    }
 }
 
 bool    FacehackOptimizer::Solve()
 {
+    if (!m_pParam || !m_pBasis || m_InputPyramid.GetNumLevels() == 0)
+    {
+        ofLog(OF_LOG_ERROR, "顔の線形モデルか入力フレームがセットされていません.");
+        return false;
+    }
+    
+    int numIterations   = m_MaxIterations;
+    if (!m_PyramidSchedule.empty())
+    {
+        numIterations   = 0;
+        for (int iterations : m_PyramidSchedule)
+        {
+            numIterations   += iterations;
+        }
+    }
+    
+    m_ParamMask.Update(FacehackParams::TOTAL_NUM);
+    const bool isNewFrame   = m_IsNewFrame;
+    m_IsNewFrame            = false;
+    m_TrackingQuality       = TrackingQuality();
+    FacehackParams::ParamVec params     = m_pParam->GetParams();
+    ApplyIdentityCalibration(params);
+    if (isNewFrame)
+    {
+        // 前のフレームの解から姿勢と表情を予測する
+        m_TrackerState.Predict(params.data());
+    }
+    double damping  = std::min(std::max(m_TrackerState.GetDamping(INITIAL_DAMPING), MIN_DAMPING), MAX_DAMPING);
+    TrackingQuality quality;
+    if (!Optimize(params, numIterations, damping, quality))
+    {
+        return false;
+    }
+    quality.isReliable  = m_QualityThresholds.IsReliable(quality);
+    
+    // 見失った場合は、ランドマークで姿勢を解き直し、予測と分解を捨ててからもう一度解く
+    FacehackParams::ParamVec reinitialized  = params;
+    if (!quality.isReliable && ReinitializeFromLandmarks(reinitialized))
+    {
+        m_TrackerState.Reset();
+        double reinitDamping    = INITIAL_DAMPING;
+        TrackingQuality reinitQuality;
+        if (!Optimize(reinitialized, numIterations, reinitDamping, reinitQuality))
+        {
+            m_pParam->SetParams(params);
+            return false;
+        }
+        reinitQuality.isReinitialized   = true;
+        reinitQuality.isReliable        = m_QualityThresholds.IsReliable(reinitQuality);
+        reinitQuality.numIterations     += quality.numIterations;
+        if (reinitQuality.isReliable || reinitQuality.cost < quality.cost)
+        {
+            params  = reinitialized;
+            damping = reinitDamping;
+            quality = reinitQuality;
+        }
+        else
+        {
+            quality.isReinitialized = true;
+            quality.numIterations   = reinitQuality.numIterations;
+        }
+    }
+    m_TrackingQuality   = quality;
+    m_pParam->SetParams(params);
+    m_TrackerState.Update(params.data(), damping, isNewFrame);
+    if (isNewFrame && quality.isReliable)
+    {
+        UpdateIdentityCalibration(params);
+    }
+    return true;
+}
+
+bool    FacehackOptimizer::Optimize(FacehackParams::ParamVec& params,
+                                    int numIterations,
+                                    double& damping,
+                                    TrackingQuality& quality)
+{
+    const bool isSampling   = (m_PixelSampler.GetNumSamples() > 0);
+    FacehackParams::ParamVec accepted   = params;
+    float acceptedCost  = std::numeric_limits<float>::infinity();
+    int prevLevel       = -1;
+    bool isCachedStep   = false;
+    bool isStepPending  = false;
+    quality.numIterations   = 0;
+    for (int iteration=0; iteration<numIterations; ++iteration)
+    {
+        // レベルが変わるとコストを比べられないので判定をやり直す
+        const int level = std::min(GetPyramidLevelForIteration(iteration), m_InputPyramid.GetNumLevels() - 1);
+        const bool isLevelChanged   = (level != prevLevel);
+        if (isLevelChanged)
+        {
+            acceptedCost    = std::numeric_limits<float>::infinity();
+            prevLevel       = level;
+        }
+        SetPyramidLevel(level);
+        ++quality.numIterations;
+        
+        // レベルの最初の反復は前に分解した係数行列を使い、右辺だけを作る
+        if (isLevelChanged && m_TrackerState.HasFactorization(level, m_ParamMask.GetNumFree()))
+        {
+            float cost  = 0.0f;
+            accepted    = params;
+            if (!Linearize(accepted, false, cost) || !ApplyCachedStep(accepted, params))
+            {
+                m_pParam->SetParams(accepted);
+                return false;
+            }
+            acceptedCost    = cost;
+            isCachedStep    = true;
+            isStepPending   = true;
+            continue;
+        }
+        
+        float cost  = 0.0f;
+        if (!Linearize(params, true, cost))
+        {
+            m_pParam->SetParams(accepted);
+            return false;
+        }
+        if (!isSampling && cost > acceptedCost)
+        {
+            // ステップを捨て、前の線形化を使って減衰を強めて解き直す
+            damping = std::min(damping * 10.0, MAX_DAMPING);
+            if (isCachedStep && !Linearize(accepted, true, cost))
+            {
+                // 前の分解で解いたステップの場合は、ステップ前の点の係数行列がまだ無い
+                m_pParam->SetParams(accepted);
+                return false;
+            }
+        }
+        else
+        {
+            // コストが下げ止まったらこのレベルの残りの反復を飛ばす
+            const bool isPlateau    = !isSampling && m_FunctionTolerance > 0.0f && std::isfinite(acceptedCost)
+                                   && acceptedCost - cost <= m_FunctionTolerance * acceptedCost;
+            accepted        = params;
+            acceptedCost    = cost;
+            damping         = std::max(damping * 0.1, MIN_DAMPING);
+            if (isPlateau)
+            {
+                isCachedStep    = false;
+                isStepPending   = false;
+                iteration       = GetLevelEndIteration(iteration, numIterations) - 1;
+                continue;
+            }
+        }
+        isCachedStep    = false;
+        if (!ApplyStep(accepted, damping, params))
+        {
+            m_pParam->SetParams(accepted);
+            return false;
+        }
+        isStepPending   = true;
+    }
+    
+    // 最後のステップはまだ評価していないので、コストが増えていたら受け入れた解に戻す
+    if (!Evaluate(params, quality))
+    {
+        m_pParam->SetParams(accepted);
+        return false;
+    }
+    if (isStepPending && !isSampling && quality.cost > acceptedCost)
+    {
+        params  = accepted;
+        if (!Evaluate(params, quality))
+        {
+            return false;
+        }
+    }
+    quality.conditionNumber = EstimateConditionNumber(params);
+    return true;
+}
+
+int     FacehackOptimizer::GetLevelEndIteration(int iteration, int numIterations) const
+{
+    // 粗いレベルから順にスケジュールをたどる
+    int end = 0;
+    for (int level=static_cast<int>(m_PyramidSchedule.size())-1; level>=0; --level)
+    {
+        end += m_PyramidSchedule[level];
+        if (iteration < end)
+        {
+            return std::min(end, numIterations);
+        }
+    }
+    return numIterations;
+}
+
+bool    FacehackOptimizer::Evaluate(const FacehackParams::ParamVec& params, TrackingQuality& quality)
+{
+    m_pParam->SetParams(params);
+    const FaceImage& input          = m_InputPyramid.GetLevel(m_PyramidLevel);
+    const FaceParamLayout layout    = FacehackParams::GetLayout();
+    if (!SetRegionProjection(params, input.GetWidth(), input.GetHeight(), m_Projection)
+        || !m_Rasterizer.Render(*m_pBasis, params.data(), layout, m_Projection, m_SynthesizedImage))
+    {
+        ofLog(OF_LOG_ERROR, "顔の姿勢かカメラのパラメータが不正です.");
+        return false;
+    }
+    quality.photoCost       = GetPhotoConsistency();
+    const float landmarkCost    = GetFeatureAlignment();
+    quality.cost            = quality.photoCost + landmarkCost + GetStatisticalRegularization();
+    
+    // 特徴点整合のコストは W_lan × 信頼度で重み付けした二乗誤差の平均
+    quality.landmarkError   = std::sqrt(std::max(landmarkCost, 0.0f) / W_lan);
+    
+    // 描画した顔の画素のうち、入力フレームでもマスクが立っている画素の割合
+    const FaceImage::MaskArray& synthesizedMask = m_SynthesizedImage.GetMask();
+    const FaceImage::MaskArray& inputMask       = input.GetMask();
+    const int numRendered   = static_cast<int>((synthesizedMask > 0.0f).count());
+    const int numVisible    = static_cast<int>(((synthesizedMask > 0.0f) && (inputMask > 0.0f)).count());
+    quality.visibleRatio    = (numRendered > 0) ? static_cast<float>(numVisible) / numRendered : 0.0f;
+    return std::isfinite(quality.cost);
+}
+
+float   FacehackOptimizer::EstimateConditionNumber(const FacehackParams::ParamVec& params)
+{
+    const int numFree   = static_cast<int>(m_ReducedA.rows());
+    if (numFree == 0 || numFree != m_ParamMask.GetNumFree())
+    {
+        return std::numeric_limits<float>::infinity();
+    }
+    m_DampedA   = m_ReducedA;
+    
+    // クォータニオンの大きさの方向に、クォータニオンのブロックの対角の平均の曲率を足す
+    const std::vector<int>& columnMap   = m_ParamMask.GetColumnMap();
+    int quatColumns[4];
+    bool isQuatFree = true;
+    for (int k=0; k<4; ++k)
+    {
+        quatColumns[k]  = columnMap[FacehackParams::FACE_QUAT + k];
+        isQuatFree      = isQuatFree && (quatColumns[k] >= 0);
+    }
+    const Vector4d quat = params.segment<4>(FacehackParams::FACE_QUAT).cast<double>();
+    if (isQuatFree && quat.norm() > 0.0)
+    {
+        const Vector4d axis = quat.normalized();
+        double curvature    = 0.0;
+        for (int k=0; k<4; ++k)
+        {
+            curvature   += 0.25 * m_ReducedA(quatColumns[k], quatColumns[k]);
+        }
+        for (int j=0; j<4; ++j)
+        {
+            for (int i=0; i<4; ++i)
+            {
+                m_DampedA(quatColumns[i], quatColumns[j])   += curvature * axis(i) * axis(j);
+            }
+        }
+    }
+    
+    // 対角でスケーリングし、残差の無い列を除く
+    std::vector<int> active;
+    for (int i=0; i<numFree; ++i)
+    {
+        if (m_DampedA(i, i) > 0.0)
+        {
+            active.push_back(i);
+        }
+    }
+    const int numActive = static_cast<int>(active.size());
+    if (numActive == 0)
+    {
+        return std::numeric_limits<float>::infinity();
+    }
+    KSMatrixXd scaled(numActive, numActive);
+    for (int j=0; j<numActive; ++j)
+    {
+        for (int i=0; i<numActive; ++i)
+        {
+            scaled(i, j)    = m_DampedA(active[i], active[j])
+                            / std::sqrt(m_DampedA(active[i], active[i]) * m_DampedA(active[j], active[j]));
+        }
+    }
+    
+    // LDLTのピボットの比で見積もる(固有値の比の下界に近い値になる)
+    const LDLT<KSMatrixXd> ldlt(scaled);
+    if (ldlt.info() != Success)
+    {
+        return std::numeric_limits<float>::infinity();
+    }
+    const KSVectorXd pivots = ldlt.vectorD().cwiseAbs();
+    const double minPivot   = pivots.minCoeff();
+    if (minPivot <= 0.0)
+    {
+        return std::numeric_limits<float>::infinity();
+    }
+    return static_cast<float>(pivots.maxCoeff() / minPivot);
+}
+
+bool    FacehackOptimizer::ReinitializeFromLandmarks(FacehackParams::ParamVec& params)
+{
+    if (m_ReinitializationIterations <= 0 || m_FrameWidth <= 0 || m_FrameHeight <= 0)
+    {
+        return false;
+    }
+    
+    // 利用者が姿勢を固定している場合は動かさない
+    const std::vector<int>& columnMap   = m_ParamMask.GetColumnMap();
+    for (int i=FacehackParams::FACE_QUAT; i<FacehackParams::FACE_TRANS+3; ++i)
+    {
+        if (columnMap[i] < 0)
+        {
+            return false;
+        }
+    }
+    if (!m_PoseResidual.Setup(m_LandmarkEnergy, params.data(), FacehackParams::GetLayout(), m_FrameWidth, m_FrameHeight))
+    {
+        return false;
+    }
+    
+    LandmarkPoseResidual::PoseVector pose;
+    m_PoseResidual.GetPose(params.data(), pose);
+    m_PoseOptimizer.Initialize(pose);
+    KSSolveOptions options;
+    options.maxIterations       = m_ReinitializationIterations;
+    options.functionTolerance   = m_FunctionTolerance;
+    const KSSolveSummary summary    = m_PoseOptimizer.Solve(m_PoseResidual, options);
+    if (summary.iterations == 0 || !(summary.finalCost < summary.initialCost))
+    {
+        return false;
+    }
+    m_PoseResidual.SetPose(m_PoseOptimizer.GetParamVec(), params.data());
     return true;
 }
 
+bool    FacehackOptimizer::Linearize(const FacehackParams::ParamVec& params, bool withHessian, float& cost)
+{
+    m_pParam->SetParams(params);
+    const FaceImage& input          = m_InputPyramid.GetLevel(m_PyramidLevel);
+    const FaceParamLayout layout    = FacehackParams::GetLayout();
+    if (!SetRegionProjection(params, input.GetWidth(), input.GetHeight(), m_Projection)
+        || !m_Rasterizer.Render(*m_pBasis, params.data(), layout, m_Projection, m_SynthesizedImage))
+    {
+        ofLog(OF_LOG_ERROR, "顔の姿勢かカメラのパラメータが不正です.");
+        return false;
+    }
+    if (withHessian)
+    {
+        m_NormalA.setZero(layout.total, layout.total);
+    }
+    m_NormalB.setZero(layout.total);
+    
+    // 写真的整合性(可視画素数で正規化)
+    cost                    = GetPhotoConsistency();
+    const int numVisible    = GetNumPhotoVisiblePixels();
+    if (numVisible > 0
+        && m_PhotoJacobian.Setup(m_Rasterizer, *m_pBasis, m_Projection, input, m_SynthesizedImage, params.data(), layout))
+    {
+        const double weight = W_col / static_cast<double>(numVisible);
+        if (withHessian)
+        {
+            m_PhotoJacobian.Accumulate(m_PhotoEnergy.GetPixelIndices(),
+                                       m_PhotoEnergy.GetResidualScales(),
+                                       m_PhotoResidual,
+                                       weight,
+                                       m_NormalA,
+                                       m_NormalB);
+        }
+        else
+        {
+            m_PhotoJacobian.AccumulateGradient(m_PhotoEnergy.GetPixelIndices(),
+                                               m_PhotoEnergy.GetResidualScales(),
+                                               m_PhotoResidual,
+                                               weight,
+                                               m_NormalB);
+        }
+    }
+    
+    // 特徴点整合(信頼度の和で正規化)
+    cost    += GetFeatureAlignment();
+    const float confidence  = m_LandmarkEnergy.GetTotalConfidence();
+    if (m_LandmarkEnergy.GetNumLandmarks() > 0 && confidence > 0.0f && m_LandmarkJacobian.rows() > 0)
+    {
+        const double weight = W_lan / static_cast<double>(confidence);
+        if (withHessian)
+        {
+            m_Accumulator.Accumulate(m_LandmarkA, m_LandmarkB, m_LandmarkJacobian, m_LandmarkResidual);
+            m_NormalA.noalias() += weight * m_LandmarkA;
+            m_NormalB.noalias() += weight * m_LandmarkB;
+        }
+        else
+        {
+            m_NormalB.noalias() += weight * (m_LandmarkJacobian.transpose() * m_LandmarkResidual).cast<double>();
+        }
+    }
+    
+    // 統計的正則化(対角に直接足し込む)
+    cost    += GetStatisticalRegularization();
+    if (withHessian)
+    {
+        m_StatisticalPrior.Accumulate(params.data(), m_NormalA, m_NormalB);
+    }
+    else
+    {
+        m_StatisticalPrior.AccumulateGradient(params.data(), m_NormalB);
+    }
+    
+    // 固定したパラメータの行と列を除く
+    const std::vector<int>& freeIndices = m_ParamMask.GetFreeIndices();
+    const int numFree   = m_ParamMask.GetNumFree();
+    m_ReducedB.resize(numFree);
+    for (int j=0; j<numFree; ++j)
+    {
+        m_ReducedB(j)   = m_NormalB(freeIndices[j]);
+    }
+    if (withHessian)
+    {
+        m_ReducedA.resize(numFree, numFree);
+        for (int j=0; j<numFree; ++j)
+        {
+            for (int i=0; i<numFree; ++i)
+            {
+                m_ReducedA(i, j)    = m_NormalA(freeIndices[i], freeIndices[j]);
+            }
+        }
+    }
+    return std::isfinite(cost);
+}
+
+bool    FacehackOptimizer::ApplyStep(const FacehackParams::ParamVec& base,
+                                     double damping,
+                                     FacehackParams::ParamVec& params)
+{
+    // A + λ(diag(A) + ε) で解く. 残差が無い列(使わない照明の係数など)は動かない
+    m_DampedA   = m_ReducedA;
+    m_DampedA.diagonal().array()    += damping * (m_DampedA.diagonal().array() + 1.0e-9);
+    if (!m_TrackerState.Factorize(m_PyramidLevel, m_DampedA)
+        || !m_TrackerState.Solve(m_PyramidLevel, -m_ReducedB, m_Step))
+    {
+        return false;
+    }
+    AddStep(base, m_Step, params);
+    return true;
+}
+
+bool    FacehackOptimizer::ApplyCachedStep(const FacehackParams::ParamVec& base,
+                                           FacehackParams::ParamVec& params)
+{
+    if (!m_TrackerState.Solve(m_PyramidLevel, -m_ReducedB, m_Step))
+    {
+        return false;
+    }
+    AddStep(base, m_Step, params);
+    return true;
+}
+
+void    FacehackOptimizer::AddStep(const FacehackParams::ParamVec& base,
+                                   const KSVectorXd& step,
+                                   FacehackParams::ParamVec& params) const
+{
+    params  = base;
+    const std::vector<int>& freeIndices = m_ParamMask.GetFreeIndices();
+    for (int k=0, n=static_cast<int>(freeIndices.size()); k<n; ++k)
+    {
+        params(freeIndices[k])  += static_cast<float>(step(k));
+    }
+    
+    // クォータニオンは正規化しておく(投影は正規化して使うので結果は変わらない)
+    const float norm    = params.segment<4>(FacehackParams::FACE_QUAT).norm();
+    if (norm > 0.0f)
+    {
+        params.segment<4>(FacehackParams::FACE_QUAT)    /= norm;
+    }
+}
+
+int     FacehackOptimizer::GetNumPhotoVisiblePixels() const
+{
+    return (m_PixelSampler.GetNumSamples() > 0)
+        ? m_PixelSampler.GetNumVisiblePixels()
+        : m_PhotoEnergy.GetNumVisiblePixels();
+}
+
 float   FacehackOptimizer::GetPhotoConsistency()
 {
-    ofPixels inPixs, synthesizedPixs;
-    m_InputTex.readToPixels(inPixs);
-    m_SynthesizedTex.readToPixels(synthesizedPixs);
+    if (m_InputPyramid.GetNumLevels() == 0)
+    {
+        return 0.0f;
+    }
+    const int level         = std::min(m_PyramidLevel, m_InputPyramid.GetNumLevels() - 1);
+    const FaceImage& input  = m_InputPyramid.GetLevel(level);
     
-    float total = 0.0f;
-    int num     = inPixs.size();
-    for (int i=0; i<num; ++i)
+    // 顔の画素だけの色残差を計算し、可視画素数で正規化する
+    double energy   = 0.0;
+    int numVisible  = 0;
+    if (m_PixelSampler.GetNumSamples() > 0)
+    {
+        // 間引いた画素の重み付き残差で全画素のエネルギーを推定する
+        if (!m_PixelSampler.Sample(input, m_SynthesizedImage))
+        {
+            return 0.0f;
+        }
+        energy      = m_PhotoEnergy.Evaluate(input,
+                                             m_SynthesizedImage,
+                                             m_PixelSampler.GetSamples(),
+                                             m_PixelSampler.GetWeight(),
+                                             m_PhotoResidual);
+        numVisible  = m_PixelSampler.GetNumVisiblePixels();
+    }
+    else
+    {
+        energy      = m_PhotoEnergy.Evaluate(input, m_SynthesizedImage, m_PhotoResidual);
+        numVisible  = m_PhotoEnergy.GetNumVisiblePixels();
+    }
+    if (energy < 0.0 || numVisible == 0)
     {
-        char diff   = inPixs[i] - synthesizedPixs[i];
-        total += abs((float)diff/ 255.0f);
+        return 0.0f;
     }
-    total /= (float)num;
-    return total;
+    return W_col * static_cast<float>(energy / numVisible);
 }
 
 float   FacehackOptimizer::GetFeatureAlignment()
 {
-    return 0.0;
+    if (m_LandmarkEnergy.GetNumLandmarks() == 0 || m_InputPyramid.GetNumLevels() == 0)
+    {
+        return 0.0f;
+    }
+    
+    // 観測は入力フレームの画素座標なので、ピラミッドのレベルや切り出しによらず入力フレームの解像度で投影する
+    const FaceParamLayout layout    = FacehackParams::GetLayout();
+    const float* pParams            = m_pParam->GetParams().data();
+    if (!m_LandmarkProjection.Set(pParams, layout, m_FrameWidth, m_FrameHeight))
+    {
+        return 0.0f;
+    }
+    
+    const double energy     = m_LandmarkEnergy.Evaluate(m_LandmarkProjection,
+                                                        pParams,
+                                                        layout,
+                                                        m_LandmarkResidual,
+                                                        m_LandmarkJacobian);
+    const float confidence  = m_LandmarkEnergy.GetTotalConfidence();
+    if (confidence <= 0.0f)
+    {
+        return 0.0f;
+    }
+    return W_lan * static_cast<float>(energy / confidence);
 }
 
 float   FacehackOptimizer::GetStatisticalRegularization()
 {
-    return 0.0;
+    // W_regは対角成分に含まれている
+    return static_cast<float>(m_StatisticalPrior.Evaluate(m_pParam->GetParams().data()));
 }
@@ -13,6 +13,22 @@
 #include "FacialModel.hpp"
 #include "FacehackParams.hpp"
 #include "FacehackFactory.hpp"
+#include "FaceImage.hpp"
+#include "ImagePyramid.hpp"
+#include "PhotometricEnergy.hpp"
+#include "PixelSampler.hpp"
+#include "MorphableBasis.hpp"
+#include "FaceProjection.hpp"
+#include "LandmarkEnergy.hpp"
+#include "StatisticalPrior.hpp"
+#include "FaceRasterizer.hpp"
+#include "PhotometricJacobian.hpp"
+#include "TrackerState.hpp"
+#include "IdentityCalibrator.hpp"
+#include "FaceCropper.hpp"
+#include "TrackingQuality.hpp"
+#include "KSParameterMask.h"
+#include "KSNormalEquationAccumulator.h"
 
 namespace Facehack {
     
@@ -29,14 +45,395 @@ namespace Facehack {
                            const float* const betaVariance,
                            const float* const deltaVarinace);
         void    Finalize();
+        
+        /**
+         @brief 入力テクスチャの更新
+         
+         次のSolveを新しいフレームとして扱い、前のフレームの解から初期値を予測します.
+         @param inputTex    入力テクスチャ
+         */
         void    Update(const ofTexture& inputTex);
+        
+        /**
+         @brief 入力フレームの更新
+         
+         カメラなどからCPU側に届いた画素をそのまま取り込み、ガウシアンピラミッドを作ります.
+         テクスチャの読み戻しはしません. ピラミッドはフレームごとにここで1回だけ作ります.
+         次のSolveを新しいフレームとして扱い、前のフレームの解から初期値を予測します.
+         顔の範囲の切り出し(SetFaceRegionResolution)を使う場合は、予測した姿勢で投影したメッシュの範囲を
+         作業解像度に切り出した画像からピラミッドを作ります.
+         @param inputPixels 入力フレームの画素
+         @return 取り込みの成否
+         */
+        bool    Update(const ofPixels& inputPixels);
+        
+        /**
+         @brief 写真的整合性の項の画素の間引き設定
+         
+         反復ごとに可視画素から三角形で層別してnumSamples個を選び、残差をその画素だけで計算します.
+         残差は 可視画素数 / numSamples で重み付けするので、エネルギーの大きさは間引かない場合と揃います.
+         @param numSamples  1反復あたりの画素数(0以下の場合は全ての可視画素を使う)
+         @param seed        乱数のシード
+         */
+        void    SetPixelSampling(int numSamples, unsigned int seed = 0);
+        
+        /**
+         @brief 粗から密への反復スケジュールのセット
+         
+         iterationsPerLevel[level]がそのレベルで回す反復数で、最も粗いレベルから順に反復します.
+         例えば{2, 2, 4}なら1/4解像度で4回、1/2解像度で2回、元の解像度で2回です.
+         次のUpdateからこのレベル数でピラミッドを作ります.
+         @param iterationsPerLevel  レベルごとの反復数(空の場合は元の解像度だけ)
+         @return セットの成否
+         */
+        bool    SetPyramidSchedule(const std::vector<int>& iterationsPerLevel);
+        
+        /**
+         @brief 反復回数に対応するピラミッドのレベルの取得
+         @param iteration   フレーム内の反復回数(0から)
+         @return レベル(スケジュールを使い切った後は0)
+         */
+        int     GetPyramidLevelForIteration(int iteration) const;
+        
+        //! エネルギーを計算するピラミッドのレベルのセット
+        inline void SetPyramidLevel(int level)
+        {
+            m_PyramidLevel  = level;
+        }
+        
+        inline int  GetPyramidLevel() const
+        {
+            return m_PyramidLevel;
+        }
+        
+        /**
+         @brief 指定レベルの解像度の取得
+         
+         Solveの中の合成画像はこのレベルの解像度で描画します. 顔の範囲を切り出している場合は作業解像度を基準にした解像度です.
+         @param level   レベル
+         @param width   出力の幅
+         @param height  出力の高さ
+         @return 入力フレームが届いているかどうか
+         */
+        bool    GetPyramidLevelSize(int level, int& width, int& height) const;
+        
+        /**
+         @brief 顔の範囲の切り出しのセット
+         
+         フレームごとに、投影したメッシュの外接矩形に余白を付けた範囲を入力フレームから切り出し、
+         width × heightに拡大縮小してから描画とエネルギーの計算をします(FaceCropper).
+         描画、残差、ヤコビアンの画素数は入力フレームの解像度によらなくなります.
+         ランドマークの観測はこれまで通り入力フレームの画素座標で渡してください.
+         顔の線形モデルが無い場合や、顔がカメラの後ろにある場合はフレーム全体を使います.
+         @param width   作業画像の幅(0以下の場合は切り出さずにフレーム全体を使う)
+         @param height  作業画像の高さ
+         @param margin  外接矩形の長辺に対する余白の割合(片側)
+         @return セットの成否
+         */
+        bool    SetFaceRegionResolution(int width, int height, float margin = 0.2f);
+        
+        //! 現在のフレームで使っている入力フレームの範囲(切り出さない場合はフレーム全体)
+        inline const FaceRegion&    GetFaceRegion() const
+        {
+            return m_FaceRegion;
+        }
+        
+        /**
+         @brief 顔の線形モデルのセット
+         
+         ランドマークと画素ごとのエネルギーで頂点と基底の行を引くために使います.
+         FacialModel::CreateMorphableBasisで作ったものを渡してください.
+         @param pBasis  顔の線形モデル
+         @return セットの成否
+         */
+        bool    SetMorphableBasis(const MorphableBasisPtr& pBasis);
+        
+        /**
+         @brief ランドマークに対応する頂点番号のセット
+         
+         対応する頂点の基底の行をここで集めておきます. SetMorphableBasisの後に呼んでください.
+         @param vertexIndices   頂点番号(LandmarkEnergy::LoadVertexIndicesで読み込めます)
+         @return セットの成否
+         */
+        bool    SetLandmarkVertices(const std::vector<int>& vertexIndices);
+        
+        /**
+         @brief ランドマークのサイドカーファイルの読み込み
+         
+         1行1フレームのランドマークの観測を読み込みます. 書式はLandmarkTrackを参照してください.
+         @param path    ファイルパス
+         @return 読み込みの成否
+         */
+        bool    LoadLandmarkTrack(const std::string& path);
+        
+        /**
+         @brief 読み込んだランドマークの観測から現在のフレームを選ぶ
+         @param frame   フレーム番号
+         @return 選択の成否
+         */
+        bool    SetLandmarkFrame(int frame);
+        
+        /**
+         @brief メモリ上のランドマークの観測のセット
+         @param pPoints         入力フレームの画素座標(x, y)の列
+         @param pConfidences    信頼度の列(nullptrの場合は全て1)
+         @return セットの成否
+         */
+        bool    SetLandmarkObservations(const float* pPoints, const float* pConfidences);
+        
+        /**
+         @brief 1フレーム分の反復の最大数のセット
+         
+         ピラミッドのスケジュールがセットされている場合はスケジュールの反復数の合計を使います.
+         @param iterations  反復数
+         */
+        inline void SetMaxIterations(int iterations)
+        {
+            m_MaxIterations = std::max(iterations, 0);
+        }
+        
+        /**
+         @brief 反復を打ち切るコストの相対減少量のセット
+         
+         同じピラミッドのレベルで、受け入れたステップのコストの相対減少量 |cost_k - cost_k+1| / cost_k が
+         これ以下になったら、そのレベルの残りの反復を飛ばします(KSSolveOptions::functionToleranceと同じ判定).
+         画素を間引いている場合はコストが反復ごとにばらつくので、この判定はしません.
+         @param tolerance   相対減少量(0以下の場合は打ち切らない)
+         */
+        inline void SetFunctionTolerance(float tolerance)
+        {
+            m_FunctionTolerance = tolerance;
+        }
+        
+        /**
+         @brief 追跡の品質のしきい値のセット
+         
+         Solveの解が満たさない場合は、ランドマークだけで顔の姿勢を初期化し直してもう一度解きます.
+         @param thresholds  しきい値
+         */
+        inline void SetQualityThresholds(const TrackingQualityThresholds& thresholds)
+        {
+            m_QualityThresholds = thresholds;
+        }
+        
+        /**
+         @brief ランドマークによる初期化し直しの反復数のセット
+         @param iterations  反復数(0の場合は初期化し直さない)
+         */
+        inline void SetReinitializationIterations(int iterations)
+        {
+            m_ReinitializationIterations = std::max(iterations, 0);
+        }
+        
+        //! 最後のSolveの解の追跡の品質
+        inline const TrackingQuality&   GetTrackingQuality() const
+        {
+            return m_TrackingQuality;
+        }
+        
+        /**
+         @brief 固定するパラメータブロックのセット
+         
+         固定したパラメータの列は正規方程式から除きます. 初期値はカメラ(位置、注視点、画角、アスペクト比)です.
+         個人性のキャリブレーション中とその後は、これに加えてα、β、画角、アスペクト比を固定します.
+         @param blocks  固定するパラメータブロックのリスト
+         */
+        void    SetConstantParameterBlocks(const std::vector<Kosakasakas::KSParameterBlock>& blocks);
+        
+        /**
+         @brief フレーム間の予測の速度の減衰の係数のセット
+         @param damping 0(前のフレームの解から始める)から1(等速度で予測する)
+         */
+        inline void SetVelocityDamping(float damping)
+        {
+            m_TrackerState.SetVelocityDamping(damping);
+        }
+        
+        /**
+         @brief 追跡の状態のリセット
+         
+         前のフレームの解と分解を捨てます. シーンが切り替わった場合や追跡を見失った場合に呼んでください.
+         次のSolveは現在のパラメータから減衰の初期値で始めます.
+         */
+        inline void ResetTracking()
+        {
+            m_TrackerState.Reset();
+        }
+        
+        /**
+         @brief 個人性のキャリブレーションの開始
+         
+         追跡したフレームから顔の向きがばらけたnumKeyframes枚をキーフレームとして集め、集まったら
+         別スレッドで形状α、アルベドβ、画角、アスペクト比をキーフレーム全体でまとめて解きます(IdentityCalibrator).
+         その間もこれらのパラメータは固定し、現在の値(平均顔なら0)のまま追跡を続けます.
+         解き終わると次のSolveの最初に結果をパラメータに書き込み、以降も固定したままにします.
+         SetMorphableBasisの後に呼んでください.
+         @param numKeyframes    キーフレーム数
+         @param minPoseSpread   キーフレームどうしの顔の回転の差の下限(度)
+         @param pyramidLevel    キーフレームとして保持する入力画像のピラミッドのレベル
+         @return 開始の成否
+         */
+        bool    StartIdentityCalibration(int numKeyframes, float minPoseSpread, int pyramidLevel = 1);
+        
+        //! 個人性のキャリブレーションを打ち切り、α、β、画角、アスペクト比の固定を解除する
+        void    StopIdentityCalibration();
+        
+        inline CalibrationStatus    GetCalibrationStatus() const
+        {
+            return m_IdentityCalibrator.GetStatus();
+        }
+        
+        /**
+         @brief 最適化の実行
+         
+         反復ごとにCPU側のラスタライザで合成画像を描画し、写真的整合性、特徴点整合、統計的正則化の
+         正規方程式をまとめてレーベンバーグ・マーカート法の1ステップを解きます.
+         写真的整合性の項のヤコビアンは描画した三角形番号と重心座標から解析的に作ります(PhotometricJacobian).
+         コストが前の反復より増えた場合はステップを捨てて減衰を強めます.
+         画素を間引いている場合はコストが反復ごとにばらつくので、この判定はしません.
+         新しいフレームでは、前のフレームの解から予測した姿勢と表情、前のフレームの減衰の係数から始めます.
+         レベルごとの最初の反復は、前に解いた同じレベルの係数行列の分解を使い、右辺だけを作り直して解きます.
+         そのステップでコストが増えた場合は、ステップ前の点で線形化し直します.
+         コストが下げ止まったレベルは残りの反復を飛ばし(SetFunctionTolerance)、最後の解で追跡の品質を計算します.
+         品質がしきい値(SetQualityThresholds)を満たさない場合は、ランドマークの観測があれば
+         顔の姿勢をランドマークだけで解き直し、追跡の状態を捨ててからもう一度解きます.
+         信頼できないフレームはキーフレームの候補にしません.
+         @return 最適化の成否(顔の線形モデルか入力フレームが無い場合などは失敗)
+         */
         bool    Solve();
         
     private:
+        /**
+         @brief 顔の範囲を切り出した画像への投影のセット
+         @param params      パラメータ
+         @param width       画像の幅
+         @param height      画像の高さ
+         @param projection  出力の投影
+         @return セットの成否
+         */
+        bool    SetRegionProjection(const FacehackParams::ParamVec& params,
+                                    int width,
+                                    int height,
+                                    FaceProjection& projection) const;
+        
+        /**
+         @brief 1回分の反復
+         
+         最後の解が最後に受け入れた解よりコストが大きい場合は、受け入れた解に戻します.
+         @param params          パラメータ(初期値と出力の解)
+         @param numIterations   反復数の上限
+         @param damping         減衰の係数(初期値と出力の最後の値)
+         @param quality         出力の品質(isReinitializedとisReliable以外)
+         @return 最適化の成否
+         */
+        bool    Optimize(FacehackParams::ParamVec& params,
+                         int numIterations,
+                         double& damping,
+                         TrackingQuality& quality);
+        
+        /**
+         @brief 現在のレベルの最後の反復の次の反復番号
+         @param iteration       反復番号
+         @param numIterations   反復数の上限
+         @return 次のレベルの最初の反復番号
+         */
+        int     GetLevelEndIteration(int iteration, int numIterations) const;
+        
+        /**
+         @brief コストと品質の計算
+         
+         合成画像を描画し、ヤコビアンは作らずにコスト、可視画素の割合、ランドマークの再投影誤差を計算します.
+         @param params  パラメータ
+         @param quality 出力の品質(cost、photoCost、landmarkError、visibleRatio)
+         @return 計算の成否
+         */
+        bool    Evaluate(const FacehackParams::ParamVec& params, TrackingQuality& quality);
+        
+        /**
+         @brief 最後に作った縮小した係数行列の条件数の推定
+         
+         パラメータの単位の違いを除くため対角でスケーリングし、残差の無い列は除きます.
+         クォータニオンの大きさの方向は投影に効かないので、その方向の曲率を足してから測ります.
+         @param params  線形化したパラメータ
+         @return 条件数の推定(分解できない場合は無限大)
+         */
+        float   EstimateConditionNumber(const FacehackParams::ParamVec& params);
+        
+        /**
+         @brief ランドマークだけで顔の姿勢を解き直す
+         
+         形状、表情、カメラを固定し、回転と平行移動だけをFacehackParams::PoseOptimizerで解きます.
+         @param params  パラメータ(初期値と出力)
+         @return 解き直したかどうか(観測が無い場合や、姿勢を固定している場合は失敗)
+         */
+        bool    ReinitializeFromLandmarks(FacehackParams::ParamVec& params);
+        
+        //! 利用者が指定したブロックとキャリブレーションのブロックを合わせて固定する
+        void    UpdateConstantBlocks();
+        
+        /**
+         @brief 解き終わった個人性のキャリブレーションの結果の反映
+         @param params  パラメータ(共有パラメータを上書き)
+         */
+        void    ApplyIdentityCalibration(FacehackParams::ParamVec& params);
+        
+        /**
+         @brief 追跡したフレームをキーフレームの候補として渡し、集まったらキャリブレーションを始める
+         @param params  追跡したパラメータ
+         */
+        void    UpdateIdentityCalibration(const FacehackParams::ParamVec& params);
+        
         float   GetPhotoConsistency();
         float   GetFeatureAlignment();
         float   GetStatisticalRegularization();
         
+        //! 直前の写真的整合性の計算で使った可視画素数
+        int     GetNumPhotoVisiblePixels() const;
+        
+        /**
+         @brief 現在のパラメータでの線形化
+         
+         合成画像を描画し、全ての項の残差とヤコビアンから正規方程式 A = J^tJ、b = J^ty を作ります.
+         固定したパラメータの行と列を除いた縮小した正規方程式もここで作ります.
+         @param params      パラメータ
+         @param withHessian falseの場合は右辺bだけを作る(係数行列は前の値のまま)
+         @param cost        出力のコスト
+         @return 線形化の成否
+         */
+        bool    Linearize(const FacehackParams::ParamVec& params, bool withHessian, float& cost);
+        
+        /**
+         @brief 減衰を付けた縮小した正規方程式を分解して解き、パラメータを更新
+         
+         分解は追跡の状態に現在のレベルの分解として残します.
+         @param base    線形化したパラメータ
+         @param damping 減衰の係数
+         @param params  出力のパラメータ
+         @return 求解の成否
+         */
+        bool    ApplyStep(const FacehackParams::ParamVec& base,
+                          double damping,
+                          FacehackParams::ParamVec& params);
+        
+        /**
+         @brief 追跡の状態に残した現在のレベルの分解で解き、パラメータを更新
+         @param base    線形化したパラメータ
+         @param params  出力のパラメータ
+         @return 求解の成否(分解が無い場合は失敗)
+         */
+        bool    ApplyCachedStep(const FacehackParams::ParamVec& base,
+                                FacehackParams::ParamVec& params);
+        
+        /**
+         @brief 縮小した未知数のステップをパラメータに足す
+         @param base    線形化したパラメータ
+         @param step    ステップ(固定していないパラメータの数)
+         @param params  出力のパラメータ
+         */
+        void    AddStep(const FacehackParams::ParamVec& base,
+                        const Kosakasakas::KSVectorXd& step,
+                        FacehackParams::ParamVec& params) const;
+    
     private:
         const float W_col   = 1.0f;
         const float W_lan   = 10.0f;
@@ -48,6 +445,110 @@ namespace Facehack {
         AlphaCoeffArray m_AlphaValiance;
         BetaCoeffArray  m_BetaValiance;
         DeltaCoeffArray m_DeltaValiance;
+        
+        //! CPU側の入力画像のガウシアンピラミッド
+        ImagePyramid        m_InputPyramid;
+        //! レベルごとの反復数
+        std::vector<int>    m_PyramidSchedule;
+        //! エネルギーを計算するレベル
+        int                 m_PyramidLevel;
+        //! CPU側の合成画像
+        FaceImage           m_SynthesizedImage;
+        //! 写真的整合性のエネルギー
+        PhotometricEnergy   m_PhotoEnergy;
+        //! 写真的整合性の項の画素の間引き
+        PixelSampler        m_PixelSampler;
+        //! 写真的整合性の残差ベクトル
+        Kosakasakas::KSVectorXf m_PhotoResidual;
+        
+        //! 顔の線形モデル
+        MorphableBasisPtr   m_pBasis;
+        //! ランドマークのエネルギー
+        LandmarkEnergy      m_LandmarkEnergy;
+        //! ランドマークの観測列
+        LandmarkTrack       m_LandmarkTrack;
+        //! ランドマーク用の投影(入力フレームの解像度)
+        FaceProjection      m_LandmarkProjection;
+        //! ランドマークの残差ベクトル
+        Kosakasakas::KSVectorXf m_LandmarkResidual;
+        //! ランドマークのヤコビアン
+        Kosakasakas::KSMatrixXf m_LandmarkJacobian;
+        
+        //! 係数の統計的正則化(正規方程式の対角に足し込む)
+        StatisticalPrior    m_StatisticalPrior;
+        
+        //! 1フレーム分の反復の最大数
+        int                 m_MaxIterations;
+        //! CPU側のラスタライザ
+        FaceRasterizer      m_Rasterizer;
+        //! 写真的整合性の項の投影(ピラミッドのレベルの解像度)
+        FaceProjection      m_Projection;
+        //! 写真的整合性の項の解析的なヤコビアン
+        PhotometricJacobian m_PhotoJacobian;
+        //! ランドマークの正規方程式の累積
+        Kosakasakas::KSNormalEquationAccumulator    m_Accumulator;
+        //! 固定するパラメータ
+        Kosakasakas::KSParameterMask    m_ParamMask;
+        //! 全パラメータの正規方程式の係数行列
+        Kosakasakas::KSMatrixXd m_NormalA;
+        //! 全パラメータの正規方程式の右辺
+        Kosakasakas::KSVectorXd m_NormalB;
+        //! 固定したパラメータを除いた係数行列
+        Kosakasakas::KSMatrixXd m_ReducedA;
+        //! 固定したパラメータを除いた右辺
+        Kosakasakas::KSVectorXd m_ReducedB;
+        //! ランドマークの係数行列
+        Kosakasakas::KSMatrixXd m_LandmarkA;
+        //! ランドマークの右辺
+        Kosakasakas::KSVectorXd m_LandmarkB;
+        //! 減衰を付けた係数行列
+        Kosakasakas::KSMatrixXd m_DampedA;
+        //! 縮小した正規方程式のステップ
+        Kosakasakas::KSVectorXd m_Step;
+        
+        //! フレームをまたいで引き継ぐ追跡の状態
+        TrackerState        m_TrackerState;
+        //! 入力フレームが更新されてからまだ解いていないかどうか
+        bool                m_IsNewFrame;
+        
+        //! 利用者が指定した固定するパラメータブロック
+        std::vector<Kosakasakas::KSParameterBlock>  m_ConstantBlocks;
+        //! ランドマークに対応する頂点番号
+        std::vector<int>    m_LandmarkVertices;
+        //! 個人性のキャリブレーション
+        IdentityCalibrator  m_IdentityCalibrator;
+        //! 個人性のキャリブレーションを使っているかどうか
+        bool                m_IsCalibrationEnabled;
+        //! キャリブレーションの結果を反映したかどうか
+        bool                m_IsIdentityCalibrated;
+        //! キーフレームとして保持するピラミッドのレベル
+        int                 m_CalibrationLevel;
+        
+        //! 顔の範囲の切り出し
+        FaceCropper         m_FaceCropper;
+        //! 顔の範囲を切り出すかどうか
+        bool                m_IsFaceRegionEnabled;
+        //! 現在のフレームで使っている入力フレームの範囲
+        FaceRegion          m_FaceRegion;
+        //! 切り出した作業画像
+        FaceImage           m_RegionImage;
+        //! 入力フレームの幅
+        int                 m_FrameWidth;
+        //! 入力フレームの高さ
+        int                 m_FrameHeight;
+        
+        //! 反復を打ち切るコストの相対減少量
+        float               m_FunctionTolerance;
+        //! 追跡の品質のしきい値
+        TrackingQualityThresholds   m_QualityThresholds;
+        //! 最後のSolveの解の追跡の品質
+        TrackingQuality     m_TrackingQuality;
+        //! ランドマークによる初期化し直しの反復数
+        int                 m_ReinitializationIterations;
+        //! ランドマークによる姿勢の残差
+        LandmarkPoseResidual        m_PoseResidual;
+        //! ランドマークによる姿勢の最適化
+        FacehackParams::PoseOptimizer   m_PoseOptimizer;
     };
 }
 
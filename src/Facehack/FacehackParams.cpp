@@ -185,3 +185,29 @@ const float* const  FacehackParams::GetFacialTransform() const
     return (m_pParams.data() + FACE_TRANS);
 }
 
+std::vector<KSParameterBlock>   FacehackParams::GetTrackingConstantBlocks()
+{
+    std::vector<KSParameterBlock> blocks;
+    blocks.push_back({CAM_POS, GAMMA_R - CAM_POS});
+    blocks.push_back({ALPHA, DELTA - ALPHA});
+    return blocks;
+}
+
+FaceParamLayout FacehackParams::GetLayout()
+{
+    FaceParamLayout layout;
+    layout.camPos       = CAM_POS;
+    layout.camLookAt    = CAM_LOOKAT;
+    layout.camFov       = CAM_FOV;
+    layout.camAspect    = CAM_ASPECT;
+    layout.gammaR       = GAMMA_R;
+    layout.gammaG       = GAMMA_G;
+    layout.gammaB       = GAMMA_B;
+    layout.alpha        = ALPHA;
+    layout.beta         = BETA;
+    layout.delta        = DELTA;
+    layout.faceQuat     = FACE_QUAT;
+    layout.faceTrans    = FACE_TRANS;
+    layout.total        = TOTAL_NUM;
+    return layout;
+}
@@ -13,6 +13,7 @@
 #include "KSMath.h"
 #include "FacialModel.hpp"
 #include "IlluminationModel.hpp"
+#include "FaceParamLayout.hpp"
 
 namespace Facehack {
     
@@ -89,11 +90,39 @@ namespace Facehack {
         };
         typedef Eigen::Matrix<float, TOTAL_NUM, 1> ParamVec;
         
+        //! 顔の姿勢(クォータニオン+平行移動)だけを最適化するオプティマイザ
+        typedef Kosakasakas::KSFixedOptimizer<TOTAL_NUM - FACE_QUAT>    PoseOptimizer;
+        //! 照明(RGBの球面調和係数)だけを最適化するオプティマイザ
+        typedef Kosakasakas::KSFixedOptimizer<ALPHA - GAMMA_R>          IlluminationOptimizer;
+        
+        /**
+         @brief フレームごとのトラッキングで固定するパラメータブロックの取得
+         
+         カメラ、α(形状)、β(アルベド)を固定し、δ(表情)、顔の姿勢、γ(照明)だけを最適化対象に残します.
+         KSDenseOptimizer::SetConstantParameterBlocksなどに渡して使います.
+         @return 固定するパラメータブロックのリスト
+         */
+        static std::vector<Kosakasakas::KSParameterBlock>   GetTrackingConstantBlocks();
+        
+        /**
+         @brief パラメータ配列のレイアウトの取得
+         
+         DataLayoutと同じ配置を、openFrameworksに依存しないエネルギー計算クラスに渡すための形で返します.
+         @return レイアウト
+         */
+        static FaceParamLayout  GetLayout();
+        
         const ParamVec&  GetParams() const
         {
             return m_pParams;
         }
         
+        //! パラメータ配列のセット(最適化の結果の書き戻し用)
+        void    SetParams(const ParamVec& params)
+        {
+            m_pParams   = params;
+        }
+    
     private:
         //! パラメータ配列
         //Kosakasakas::KSVectorXf  m_pParams;
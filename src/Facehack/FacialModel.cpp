@@ -109,6 +109,41 @@ void    FacialModel::Finalize()
 {
 }
 
+bool    FacialModel::CreateMorphableBasis(MorphableBasis& basis) const
+{
+    if (!m_pBaselModel)
+    {
+        ofLog(OF_LOG_ERROR, "初期化されていません.");
+        return false;
+    }
+    
+    KSVectorXf meanShape, meanAlbedo;
+    KSMatrixXf shapeBasis, albedoBasis;
+    std::vector<int> indices;
+    if (!m_pBaselModel->GetShapeModel(meanShape, shapeBasis)
+        || !m_pBaselModel->GetColorModel(meanAlbedo, albedoBasis)
+        || !m_pBaselModel->GetTriangles(indices))
+    {
+        ofLog(OF_LOG_ERROR, "バーセルモデルの線形モデルの取得に失敗しました.");
+        return false;
+    }
+    
+    MorphableBasis::TriangleArray triangles = Map<const MorphableBasis::TriangleArray>(indices.data(), 3, indices.size() / 3);
+    if (!basis.Initialize(meanShape,
+                          shapeBasis,
+                          meanAlbedo,
+                          albedoBasis,
+                          triangles,
+                          ALPHA_COEFF_NUM,
+                          BETA_COEFF_NUM,
+                          DELTA_COEFF_NUM))
+    {
+        ofLog(OF_LOG_ERROR, "顔の線形モデルの作成に失敗しました.");
+        return false;
+    }
+    return true;
+}
+
 void    FacialModel::Update(DeltaCoeffArray& deltaCoeffs,
                             float*           rotation,
                             float*           transform)
@@ -13,6 +13,7 @@
 #include <array>
 #include "KSMath.h"
 #include "ofKsBaselFaceModel.hpp"
+#include "MorphableBasis.hpp"
 
 namespace Facehack {
     
@@ -45,6 +46,16 @@ namespace Facehack {
                        float*           rotation,
                        float*           transform);
         
+        /**
+         @brief 顔の線形モデルの作成
+         
+         バーセルモデルの平均と基底、三角形をエネルギー計算用のMorphableBasisに書き出します.
+         形状とアルベドの基底はα、βの係数の数の列だけを使います.
+         @param basis   出力の線形モデル
+         @return 作成の成否
+         */
+        bool    CreateMorphableBasis(MorphableBasis& basis) const;
+        
         inline const ofMesh&    GetMesh() const
         {
             return m_pBaselModel->GetMesh();
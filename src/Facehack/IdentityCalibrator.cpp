@@ -0,0 +1,496 @@
+//
+//  IdentityCalibrator.cpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/18.
+//
+//
+
+#include "IdentityCalibrator.hpp"
+#include <eigen3/Eigen/Cholesky>
+#include <eigen3/Eigen/Geometry>
+#include <cmath>
+#include <limits>
+
+using namespace Kosakasakas;
+using namespace Facehack;
+using namespace Eigen;
+
+namespace
+{
+    //! 減衰の係数の初期値
+    const double INITIAL_DAMPING    = 1.0e-3;
+    //! 減衰の係数の上限
+    const double MAX_DAMPING        = 1.0e+7;
+}
+
+IdentityCalibrator::IdentityCalibrator()
+: m_Layout()
+, m_PhotoWeight(1.0f)
+, m_LandmarkWeight(1.0f)
+, m_NumKeyframes(4)
+, m_MinPoseSpread(10.0f)
+, m_MaxIterations(10)
+, m_InitialCost(0.0f)
+, m_FinalCost(0.0f)
+, m_Status(CALIBRATION_IDLE)
+, m_Cancel(false)
+{}
+
+IdentityCalibrator::~IdentityCalibrator()
+{
+    // 動いているスレッドを残したまま破棄しない
+    Join();
+}
+
+bool    IdentityCalibrator::Initialize(const MorphableBasisPtr& pBasis,
+                                       const FaceParamLayout& layout,
+                                       const float* pAlphaVariance,
+                                       const float* pBetaVariance,
+                                       const float* pDeltaVariance,
+                                       float photoWeight,
+                                       float landmarkWeight,
+                                       float priorWeight)
+{
+    Join();
+    if (!pBasis || pBasis->GetNumVertices() == 0)
+    {
+        return false;
+    }
+    const int numAlpha  = static_cast<int>(pBasis->GetShapeBasis().cols());
+    const int numBeta   = static_cast<int>(pBasis->GetAlbedoBasis().cols());
+    const int numDelta  = static_cast<int>(pBasis->GetExpressionBasis().cols());
+    if (!m_SharedPrior.Initialize(layout, pAlphaVariance, numAlpha, pBetaVariance, numBeta, nullptr, 0, priorWeight)
+        || !m_FramePrior.Initialize(layout, nullptr, 0, nullptr, 0, pDeltaVariance, numDelta, priorWeight)
+        || !m_PhotoEnergy.Initialize(PHOTOMETRIC_L21)
+        || !m_PhotoJacobian.Initialize()
+        || !m_Rasterizer.Initialize())
+    {
+        return false;
+    }
+    m_pBasis            = pBasis;
+    m_Layout            = layout;
+    m_PhotoWeight       = photoWeight;
+    m_LandmarkWeight    = landmarkWeight;
+    
+    // 共有ブロックとフレームごとのブロック(カメラの位置と注視点はどちらにも含めない)
+    m_SharedBlocks.clear();
+    m_SharedBlocks.push_back({layout.alpha, numAlpha});
+    m_SharedBlocks.push_back({layout.beta, numBeta});
+    m_SharedBlocks.push_back({layout.camFov, 1});
+    m_SharedBlocks.push_back({layout.camAspect, 1});
+    m_SharedIndices.clear();
+    for (const KSParameterBlock& block : m_SharedBlocks)
+    {
+        for (int i=0; i<block.size; ++i)
+        {
+            m_SharedIndices.push_back(block.offset + i);
+        }
+    }
+    std::vector<KSParameterBlock> frameBlocks;
+    frameBlocks.push_back({layout.faceQuat, 4});
+    frameBlocks.push_back({layout.faceTrans, 3});
+    frameBlocks.push_back({layout.delta, numDelta});
+    frameBlocks.push_back({layout.gammaR, SH_BASIS_NUM});
+    frameBlocks.push_back({layout.gammaG, SH_BASIS_NUM});
+    frameBlocks.push_back({layout.gammaB, SH_BASIS_NUM});
+    m_FrameIndices.clear();
+    for (const KSParameterBlock& block : frameBlocks)
+    {
+        for (int i=0; i<block.size; ++i)
+        {
+            m_FrameIndices.push_back(block.offset + i);
+        }
+    }
+    
+    Reset();
+    return true;
+}
+
+void    IdentityCalibrator::Finalize()
+{
+    Join();
+    m_Keyframes.clear();
+    m_Params.clear();
+    m_CrossA.clear();
+    m_FrameA.clear();
+    m_FrameB.clear();
+    m_PhotoEnergy.Finalize();
+    m_PhotoJacobian.Finalize();
+    m_Rasterizer.Finalize();
+    m_LandmarkEnergy.Finalize();
+    m_SharedPrior.Finalize();
+    m_FramePrior.Finalize();
+    m_SynthesizedImage.Finalize();
+    m_pBasis    = nullptr;
+    m_Status    = CALIBRATION_IDLE;
+}
+
+bool    IdentityCalibrator::SetLandmarkVertices(const std::vector<int>& vertexIndices)
+{
+    if (!m_pBasis || GetStatus() == CALIBRATION_RUNNING)
+    {
+        return false;
+    }
+    return m_LandmarkEnergy.Initialize(*m_pBasis, vertexIndices);
+}
+
+void    IdentityCalibrator::SetKeyframeSelection(int numKeyframes, float minPoseSpread)
+{
+    m_NumKeyframes  = std::max(numKeyframes, 1);
+    m_MinPoseSpread = std::max(minPoseSpread, 0.0f);
+}
+
+void    IdentityCalibrator::Reset()
+{
+    Join();
+    m_Keyframes.clear();
+    m_Params.clear();
+    m_Result.resize(0);
+    m_InitialCost   = 0.0f;
+    m_FinalCost     = 0.0f;
+    m_Status        = m_pBasis ? CALIBRATION_COLLECTING : CALIBRATION_IDLE;
+}
+
+bool    IdentityCalibrator::AddCandidate(const FaceImage& image,
+                                         const FaceRegion& region,
+                                         int frameWidth,
+                                         int frameHeight,
+                                         const float* pParams,
+                                         const KSVectorXf& landmarkPoints,
+                                         const KSVectorXf& landmarkConfidences)
+{
+    if (GetStatus() != CALIBRATION_COLLECTING
+        || static_cast<int>(m_Keyframes.size()) >= m_NumKeyframes
+        || image.GetNumPixels() == 0)
+    {
+        return false;
+    }
+    
+    // 既に選んだ全てのキーフレームと十分に向きが違う場合だけ採用する
+    for (const Keyframe& keyframe : m_Keyframes)
+    {
+        if (GetRotationDistance(keyframe.params.data(), pParams) < m_MinPoseSpread)
+        {
+            return false;
+        }
+    }
+    
+    Keyframe keyframe;
+    keyframe.image          = image;
+    keyframe.params         = Map<const KSVectorXf>(pParams, m_Layout.total);
+    keyframe.region         = region;
+    keyframe.frameWidth     = frameWidth;
+    keyframe.frameHeight    = frameHeight;
+    if (landmarkPoints.size() == 2 * m_LandmarkEnergy.GetNumLandmarks()
+        && landmarkConfidences.size() == m_LandmarkEnergy.GetNumLandmarks())
+    {
+        keyframe.landmarkPoints         = landmarkPoints;
+        keyframe.landmarkConfidences    = landmarkConfidences;
+    }
+    m_Keyframes.push_back(keyframe);
+    return true;
+}
+
+bool    IdentityCalibrator::Start()
+{
+    if (!IsReady())
+    {
+        return false;
+    }
+    Join();
+    m_Status    = CALIBRATION_RUNNING;
+    m_Thread    = std::thread([this]{ Run(); });
+    return true;
+}
+
+bool    IdentityCalibrator::Run()
+{
+    m_Status    = CALIBRATION_RUNNING;
+    const int numFrames = static_cast<int>(m_Keyframes.size());
+    if (numFrames == 0)
+    {
+        m_Status    = CALIBRATION_FAILED;
+        return false;
+    }
+    
+    // 共有パラメータの初期値は最初のキーフレームのもの
+    m_Params.resize(numFrames);
+    for (int f=0; f<numFrames; ++f)
+    {
+        m_Params[f] = m_Keyframes[f].params;
+        for (int index : m_SharedIndices)
+        {
+            m_Params[f](index)  = m_Keyframes[0].params(index);
+        }
+    }
+    
+    float cost  = 0.0f;
+    if (!Linearize(cost))
+    {
+        m_Status    = CALIBRATION_FAILED;
+        return false;
+    }
+    m_InitialCost       = cost;
+    float acceptedCost  = cost;
+    double damping      = INITIAL_DAMPING;
+    std::vector<KSVectorXf> accepted    = m_Params;
+    std::vector<KSVectorXf> candidate;
+    for (int iteration=0; iteration<m_MaxIterations && !m_Cancel; ++iteration)
+    {
+        // ステップが受け入れられるまで減衰を強めて解き直す
+        bool isAccepted = false;
+        while (!isAccepted && damping <= MAX_DAMPING && !m_Cancel)
+        {
+            if (!SolveStep(damping, candidate))
+            {
+                damping *= 10.0;
+                continue;
+            }
+            m_Params.swap(candidate);
+            if (Linearize(cost) && cost <= acceptedCost)
+            {
+                accepted        = m_Params;
+                acceptedCost    = cost;
+                damping         = std::max(damping * 0.1, 1.0e-7);
+                isAccepted      = true;
+            }
+            else
+            {
+                // 受け入れた点の正規方程式に戻す
+                m_Params    = accepted;
+                if (!Linearize(cost))
+                {
+                    m_Status    = CALIBRATION_FAILED;
+                    return false;
+                }
+                damping *= 10.0;
+            }
+        }
+        if (!isAccepted)
+        {
+            break;
+        }
+    }
+    if (m_Cancel)
+    {
+        m_Status    = CALIBRATION_FAILED;
+        return false;
+    }
+    
+    m_Params    = accepted;
+    m_FinalCost = acceptedCost;
+    m_Result    = accepted[0];
+    m_Status    = CALIBRATION_FINISHED;
+    return true;
+}
+
+bool    IdentityCalibrator::GetResult(float* pParams) const
+{
+    if (GetStatus() != CALIBRATION_FINISHED)
+    {
+        return false;
+    }
+    for (int index : m_SharedIndices)
+    {
+        pParams[index]  = m_Result(index);
+    }
+    return true;
+}
+
+bool    IdentityCalibrator::Linearize(float& cost)
+{
+    const int numFrames = static_cast<int>(m_Keyframes.size());
+    const int numShared = static_cast<int>(m_SharedIndices.size());
+    const int numLocal  = static_cast<int>(m_FrameIndices.size());
+    m_SharedA.setZero(numShared, numShared);
+    m_SharedB.setZero(numShared);
+    m_CrossA.resize(numFrames);
+    m_FrameA.resize(numFrames);
+    m_FrameB.resize(numFrames);
+    
+    cost    = 0.0f;
+    for (int f=0; f<numFrames; ++f)
+    {
+        float frameCost = 0.0f;
+        if (!LinearizeFrame(m_Keyframes[f], m_Params[f], frameCost))
+        {
+            return false;
+        }
+        cost    += frameCost;
+        
+        // 共有ブロックは全フレームで足し、フレームごとのブロックは分けて持つ
+        KSMatrixXd& cross   = m_CrossA[f];
+        KSMatrixXd& frameA  = m_FrameA[f];
+        KSVectorXd& frameB  = m_FrameB[f];
+        cross.resize(numShared, numLocal);
+        frameA.resize(numLocal, numLocal);
+        frameB.resize(numLocal);
+        for (int j=0; j<numShared; ++j)
+        {
+            m_SharedB(j)    += m_NormalB(m_SharedIndices[j]);
+            for (int i=0; i<numShared; ++i)
+            {
+                m_SharedA(i, j) += m_NormalA(m_SharedIndices[i], m_SharedIndices[j]);
+            }
+        }
+        for (int j=0; j<numLocal; ++j)
+        {
+            frameB(j)   = m_NormalB(m_FrameIndices[j]);
+            for (int i=0; i<numShared; ++i)
+            {
+                cross(i, j) = m_NormalA(m_SharedIndices[i], m_FrameIndices[j]);
+            }
+            for (int i=0; i<numLocal; ++i)
+            {
+                frameA(i, j)    = m_NormalA(m_FrameIndices[i], m_FrameIndices[j]);
+            }
+        }
+    }
+    
+    // αとβの正規化は共有ブロックに1回だけかける
+    cost    += static_cast<float>(m_SharedPrior.Evaluate(m_Params[0].data()));
+    m_SharedPrior.Accumulate(m_Params[0].data(), m_SharedIndices, m_SharedA, m_SharedB);
+    return std::isfinite(cost);
+}
+
+bool    IdentityCalibrator::LinearizeFrame(const Keyframe& frame,
+                                           const KSVectorXf& params,
+                                           float& cost)
+{
+    const float* pParams    = params.data();
+    const FaceImage& input  = frame.image;
+    if (!m_Projection.Set(pParams, m_Layout, frame.frameWidth, frame.frameHeight)
+        || !m_Projection.SetRegion(frame.region, input.GetWidth(), input.GetHeight())
+        || !m_Rasterizer.Render(*m_pBasis, pParams, m_Layout, m_Projection, m_SynthesizedImage))
+    {
+        return false;
+    }
+    m_NormalA.setZero(m_Layout.total, m_Layout.total);
+    m_NormalB.setZero(m_Layout.total);
+    
+    // 写真的整合性(可視画素数で正規化)
+    cost    = 0.0f;
+    const double energy     = m_PhotoEnergy.Evaluate(input, m_SynthesizedImage, m_PhotoResidual);
+    const int numVisible    = m_PhotoEnergy.GetNumVisiblePixels();
+    if (energy >= 0.0 && numVisible > 0)
+    {
+        cost    += m_PhotoWeight * static_cast<float>(energy / numVisible);
+        if (m_PhotoJacobian.Setup(m_Rasterizer, *m_pBasis, m_Projection, input, m_SynthesizedImage, pParams, m_Layout))
+        {
+            m_PhotoJacobian.Accumulate(m_PhotoEnergy.GetPixelIndices(),
+                                       m_PhotoEnergy.GetResidualScales(),
+                                       m_PhotoResidual,
+                                       m_PhotoWeight / static_cast<double>(numVisible),
+                                       m_NormalA,
+                                       m_NormalB);
+        }
+    }
+    
+    // 特徴点整合(信頼度の和で正規化)
+    if (frame.landmarkPoints.size() > 0
+        && m_LandmarkEnergy.SetObservations(frame.landmarkPoints.data(), frame.landmarkConfidences.data())
+        && m_LandmarkEnergy.GetTotalConfidence() > 0.0f
+        && m_LandmarkProjection.Set(pParams, m_Layout, frame.frameWidth, frame.frameHeight))
+    {
+        const double landmarkEnergy = m_LandmarkEnergy.Evaluate(m_LandmarkProjection,
+                                                                pParams,
+                                                                m_Layout,
+                                                                m_LandmarkResidual,
+                                                                m_LandmarkJacobian);
+        const double weight = m_LandmarkWeight / static_cast<double>(m_LandmarkEnergy.GetTotalConfidence());
+        cost    += static_cast<float>(weight * landmarkEnergy);
+        m_Accumulator.Accumulate(m_LandmarkA, m_LandmarkB, m_LandmarkJacobian, m_LandmarkResidual);
+        m_NormalA.noalias() += weight * m_LandmarkA;
+        m_NormalB.noalias() += weight * m_LandmarkB;
+    }
+    
+    // 表情の正則化はフレームごと
+    cost    += static_cast<float>(m_FramePrior.Evaluate(pParams));
+    m_FramePrior.Accumulate(pParams, m_NormalA, m_NormalB);
+    return true;
+}
+
+bool    IdentityCalibrator::SolveStep(double damping, std::vector<KSVectorXf>& params) const
+{
+    typedef LDLT<KSMatrixXd>    Solver;
+    const int numFrames = static_cast<int>(m_Keyframes.size());
+    
+    // S = U - Σ W_k V_k^-1 W_k^t、右辺 = -g_s + Σ W_k V_k^-1 g_k
+    KSMatrixXd S    = m_SharedA;
+    S.diagonal().array()    += damping * (S.diagonal().array() + 1.0e-9);
+    KSVectorXd rhs  = -m_SharedB;
+    std::vector<KSMatrixXd> vinvWt(numFrames);
+    std::vector<KSVectorXd> vinvG(numFrames);
+    for (int f=0; f<numFrames; ++f)
+    {
+        KSMatrixXd V    = m_FrameA[f];
+        V.diagonal().array()    += damping * (V.diagonal().array() + 1.0e-9);
+        const Solver ldlt(V);
+        if (ldlt.info() != Success)
+        {
+            return false;
+        }
+        vinvWt[f]   = ldlt.solve(m_CrossA[f].transpose());
+        vinvG[f]    = ldlt.solve(m_FrameB[f]);
+        S.noalias()     -= m_CrossA[f] * vinvWt[f];
+        rhs.noalias()   += m_CrossA[f] * vinvG[f];
+    }
+    const Solver ldlt(S);
+    if (ldlt.info() != Success)
+    {
+        return false;
+    }
+    const KSVectorXd sharedStep = ldlt.solve(rhs);
+    if (!sharedStep.allFinite())
+    {
+        return false;
+    }
+    
+    // フレームごとのステップを戻す: V_k dx_k = -g_k - W_k^t ds
+    params  = m_Params;
+    for (int f=0; f<numFrames; ++f)
+    {
+        const KSVectorXd frameStep  = -vinvG[f] - vinvWt[f] * sharedStep;
+        if (!frameStep.allFinite())
+        {
+            return false;
+        }
+        KSVectorXf& p   = params[f];
+        for (int k=0, n=static_cast<int>(m_SharedIndices.size()); k<n; ++k)
+        {
+            p(m_SharedIndices[k])   += static_cast<float>(sharedStep(k));
+        }
+        for (int k=0, n=static_cast<int>(m_FrameIndices.size()); k<n; ++k)
+        {
+            p(m_FrameIndices[k])    += static_cast<float>(frameStep(k));
+        }
+        const float norm    = p.segment<4>(m_Layout.faceQuat).norm();
+        if (norm > 0.0f)
+        {
+            p.segment<4>(m_Layout.faceQuat) /= norm;
+        }
+    }
+    return true;
+}
+
+float   IdentityCalibrator::GetRotationDistance(const float* pParamsA, const float* pParamsB) const
+{
+    const Quaternionf a(Map<const Vector4f>(pParamsA + m_Layout.faceQuat));
+    const Quaternionf b(Map<const Vector4f>(pParamsB + m_Layout.faceQuat));
+    if (a.norm() <= 0.0f || b.norm() <= 0.0f)
+    {
+        return 0.0f;
+    }
+    return a.normalized().angularDistance(b.normalized()) * 180.0f / static_cast<float>(M_PI);
+}
+
+void    IdentityCalibrator::Join()
+{
+    if (m_Thread.joinable())
+    {
+        m_Cancel    = true;
+        m_Thread.join();
+    }
+    m_Cancel    = false;
+}
@@ -0,0 +1,329 @@
+//
+//  IdentityCalibrator.hpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/18.
+//
+//
+
+#ifndef IdentityCalibrator_hpp
+#define IdentityCalibrator_hpp
+
+#include "KSMath.h"
+#include "KSParameterMask.h"
+#include "KSNormalEquationAccumulator.h"
+#include "FaceImage.hpp"
+#include "FaceProjection.hpp"
+#include "FaceRasterizer.hpp"
+#include "MorphableBasis.hpp"
+#include "PhotometricEnergy.hpp"
+#include "PhotometricJacobian.hpp"
+#include "LandmarkEnergy.hpp"
+#include "StatisticalPrior.hpp"
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace Facehack {
+    
+    //! 個人性のキャリブレーションの状態
+    enum CalibrationStatus
+    {
+        //! 初期化前
+        CALIBRATION_IDLE,
+        //! キーフレームを集めている
+        CALIBRATION_COLLECTING,
+        //! バックグラウンドで解いている
+        CALIBRATION_RUNNING,
+        //! 解き終わった(GetResultで結果を取れる)
+        CALIBRATION_FINISHED,
+        //! 解けなかった
+        CALIBRATION_FAILED
+    };
+    
+    /**
+     @brief キーフレームによる個人性のキャリブレーション
+     
+     形状α、アルベドβ、画角とアスペクト比はセッションの間変わらないので、
+     顔の向きがばらけたK枚のキーフレームで、これらの共有パラメータとフレームごとのパラメータ
+     (回転、平行移動、表情δ、照明γ)をまとめて解きます.
+     キーフレームは、既に選んだ全てのキーフレームとの回転の差がしきい値以上の候補だけを採用します.
+     レーベンバーグ・マーカート法の各反復でフレームごとに正規方程式を作り、
+     フレームごとのブロックを消去したシューア補行列で共有ブロックを解いてからフレームごとのステップを戻します
+     (KSSchurComplementSolverと同じ分解を、ヤコビアンではなく正規方程式のブロックで行います).
+     αとβの統計的正則化は共有ブロックに1回だけ、δの正則化はフレームごとにかけます.
+     Startで別スレッドを起動して解くので、その間も追跡は共有パラメータを固定したまま続けられます.
+     解いている間はキーフレームを追加できません.
+     */
+    class IdentityCalibrator
+    {
+    public:
+        IdentityCalibrator();
+        virtual ~IdentityCalibrator();
+        
+        /**
+         @brief 初期化
+         @param pBasis          顔の線形モデル
+         @param layout          パラメータ配列のレイアウト
+         @param pAlphaVariance  形状の係数の分散
+         @param pBetaVariance   アルベドの係数の分散
+         @param pDeltaVariance  表情の係数の分散
+         @param photoWeight     写真的整合性の項の重み
+         @param landmarkWeight  特徴点整合の項の重み
+         @param priorWeight     統計的正則化の項の重み
+         @return 初期化の成否
+         */
+        bool    Initialize(const MorphableBasisPtr& pBasis,
+                           const FaceParamLayout& layout,
+                           const float* pAlphaVariance,
+                           const float* pBetaVariance,
+                           const float* pDeltaVariance,
+                           float photoWeight,
+                           float landmarkWeight,
+                           float priorWeight);
+        
+        //! 解いている途中の場合は打ち切ってスレッドの終了を待つ
+        void    Finalize();
+        
+        /**
+         @brief ランドマークに対応する頂点番号のセット
+         @param vertexIndices   頂点番号
+         @return セットの成否
+         */
+        bool    SetLandmarkVertices(const std::vector<int>& vertexIndices);
+        
+        /**
+         @brief キーフレームの選び方のセット
+         @param numKeyframes        キーフレーム数K
+         @param minPoseSpread       キーフレームどうしの回転の差の下限(度)
+         */
+        void    SetKeyframeSelection(int numKeyframes, float minPoseSpread);
+        
+        //! 反復数のセット
+        inline void SetMaxIterations(int iterations)
+        {
+            m_MaxIterations = std::max(iterations, 1);
+        }
+        
+        /**
+         @brief 集めたキーフレームと結果を捨てて、キーフレームを集め直す
+         
+         解いている途中の場合は打ち切ります.
+         */
+        void    Reset();
+        
+        /**
+         @brief キーフレームの候補の追加
+         @param image           入力フレームのregionを切り出した画像
+         @param region          画像に対応する入力フレームの範囲
+         @param frameWidth      入力フレームの幅
+         @param frameHeight     入力フレームの高さ
+         @param pParams         このフレームで追跡したパラメータ配列
+         @param landmarkPoints  ランドマークの観測(入力フレームの画素座標、空の場合はランドマークを使わない)
+         @param landmarkConfidences ランドマークの信頼度
+         @return キーフレームとして採用したかどうか
+         */
+        bool    AddCandidate(const FaceImage& image,
+                             const FaceRegion& region,
+                             int frameWidth,
+                             int frameHeight,
+                             const float* pParams,
+                             const Kosakasakas::KSVectorXf& landmarkPoints,
+                             const Kosakasakas::KSVectorXf& landmarkConfidences);
+        
+        //! キーフレームがK枚集まったかどうか
+        inline bool IsReady() const
+        {
+            return GetStatus() == CALIBRATION_COLLECTING
+                && static_cast<int>(m_Keyframes.size()) >= m_NumKeyframes;
+        }
+        
+        inline int  GetNumKeyframes() const
+        {
+            return static_cast<int>(m_Keyframes.size());
+        }
+        
+        inline CalibrationStatus    GetStatus() const
+        {
+            return static_cast<CalibrationStatus>(m_Status.load());
+        }
+        
+        /**
+         @brief 別スレッドでの求解の開始
+         @return 開始の成否(キーフレームが集まっていない場合は失敗)
+         */
+        bool    Start();
+        
+        /**
+         @brief 呼び出したスレッドでの求解
+         
+         Startから起動したスレッドもこれを呼びます.
+         @return 求解の成否
+         */
+        bool    Run();
+        
+        /**
+         @brief 共有パラメータの取得
+         
+         解き終わっている場合だけ、パラメータ配列の共有ブロックを結果で上書きします.
+         @param pParams パラメータ配列
+         @return 上書きしたかどうか
+         */
+        bool    GetResult(float* pParams) const;
+        
+        //! 共有パラメータのブロック(α、β、画角とアスペクト比)
+        inline const std::vector<Kosakasakas::KSParameterBlock>&    GetSharedBlocks() const
+        {
+            return m_SharedBlocks;
+        }
+        
+        //! 最後に解いたときのコスト(反復前, 反復後)
+        inline void GetCost(float& initialCost, float& finalCost) const
+        {
+            initialCost = m_InitialCost;
+            finalCost   = m_FinalCost;
+        }
+    
+    private:
+        //! キーフレーム
+        struct Keyframe
+        {
+            //! 入力フレームから切り出した画像
+            FaceImage   image;
+            //! 画像に対応する入力フレームの範囲
+            FaceRegion  region;
+            //! パラメータ配列
+            Kosakasakas::KSVectorXf params;
+            //! ランドマークの観測
+            Kosakasakas::KSVectorXf landmarkPoints;
+            //! ランドマークの信頼度
+            Kosakasakas::KSVectorXf landmarkConfidences;
+            //! 入力フレームの幅
+            int frameWidth;
+            //! 入力フレームの高さ
+            int frameHeight;
+        };
+        
+        /**
+         @brief 全てのキーフレームでの線形化
+         
+         フレームごとの正規方程式を共有ブロックとフレームごとのブロックに分けて保持します.
+         @param cost    出力のコスト
+         @return 線形化の成否
+         */
+        bool    Linearize(float& cost);
+        
+        /**
+         @brief 1フレーム分の線形化
+         @param frame   キーフレーム
+         @param params  パラメータ配列
+         @param cost    出力のコスト
+         @return 線形化の成否
+         */
+        bool    LinearizeFrame(const Keyframe& frame,
+                               const Kosakasakas::KSVectorXf& params,
+                               float& cost);
+        
+        /**
+         @brief 減衰を付けたシューア補行列で解き、ステップを足したパラメータを作る
+         @param damping 減衰の係数
+         @param params  出力のキーフレームごとのパラメータ配列
+         @return 求解の成否
+         */
+        bool    SolveStep(double damping, std::vector<Kosakasakas::KSVectorXf>& params) const;
+        
+        //! 2つのパラメータ配列の顔の回転の差(度)
+        float   GetRotationDistance(const float* pParamsA, const float* pParamsB) const;
+        
+        //! スレッドの終了を待つ
+        void    Join();
+    
+    private:
+        //! 顔の線形モデル
+        MorphableBasisPtr   m_pBasis;
+        //! パラメータ配列のレイアウト
+        FaceParamLayout     m_Layout;
+        //! 写真的整合性の項の重み
+        float   m_PhotoWeight;
+        //! 特徴点整合の項の重み
+        float   m_LandmarkWeight;
+        //! キーフレーム数
+        int     m_NumKeyframes;
+        //! キーフレームどうしの回転の差の下限(度)
+        float   m_MinPoseSpread;
+        //! 反復数
+        int     m_MaxIterations;
+        
+        //! 共有パラメータのブロック
+        std::vector<Kosakasakas::KSParameterBlock>  m_SharedBlocks;
+        //! 共有パラメータの番号
+        std::vector<int>    m_SharedIndices;
+        //! フレームごとのパラメータの番号
+        std::vector<int>    m_FrameIndices;
+        //! 集めたキーフレーム
+        std::vector<Keyframe>   m_Keyframes;
+        //! キーフレームごとのパラメータ配列
+        std::vector<Kosakasakas::KSVectorXf>    m_Params;
+        //! 結果のパラメータ配列
+        Kosakasakas::KSVectorXf m_Result;
+        
+        //! 共有ブロックの係数行列(全フレームの和)
+        Kosakasakas::KSMatrixXd m_SharedA;
+        //! 共有ブロックの右辺
+        Kosakasakas::KSVectorXd m_SharedB;
+        //! フレームごとの共有ブロックとフレームブロックの間の係数行列
+        std::vector<Kosakasakas::KSMatrixXd>    m_CrossA;
+        //! フレームごとのフレームブロックの係数行列
+        std::vector<Kosakasakas::KSMatrixXd>    m_FrameA;
+        //! フレームごとのフレームブロックの右辺
+        std::vector<Kosakasakas::KSVectorXd>    m_FrameB;
+        //! 1フレーム分の正規方程式の係数行列
+        Kosakasakas::KSMatrixXd m_NormalA;
+        //! 1フレーム分の正規方程式の右辺
+        Kosakasakas::KSVectorXd m_NormalB;
+        
+        //! ラスタライザ
+        FaceRasterizer      m_Rasterizer;
+        //! 投影
+        FaceProjection      m_Projection;
+        //! 合成画像
+        FaceImage           m_SynthesizedImage;
+        //! 写真的整合性のエネルギー
+        PhotometricEnergy   m_PhotoEnergy;
+        //! 写真的整合性のヤコビアン
+        PhotometricJacobian m_PhotoJacobian;
+        //! 写真的整合性の残差
+        Kosakasakas::KSVectorXf m_PhotoResidual;
+        //! ランドマークのエネルギー
+        LandmarkEnergy      m_LandmarkEnergy;
+        //! ランドマーク用の投影
+        FaceProjection      m_LandmarkProjection;
+        //! ランドマークの残差
+        Kosakasakas::KSVectorXf m_LandmarkResidual;
+        //! ランドマークのヤコビアン
+        Kosakasakas::KSMatrixXf m_LandmarkJacobian;
+        //! ランドマークの正規方程式の累積
+        Kosakasakas::KSNormalEquationAccumulator    m_Accumulator;
+        //! ランドマークの係数行列
+        Kosakasakas::KSMatrixXd m_LandmarkA;
+        //! ランドマークの右辺
+        Kosakasakas::KSVectorXd m_LandmarkB;
+        //! 共有ブロックの統計的正則化(α、β)
+        StatisticalPrior    m_SharedPrior;
+        //! フレームごとの統計的正則化(δ)
+        StatisticalPrior    m_FramePrior;
+        
+        //! 反復前のコスト
+        float   m_InitialCost;
+        //! 反復後のコスト
+        float   m_FinalCost;
+        //! 求解のスレッド
+        std::thread         m_Thread;
+        //! 状態(CalibrationStatus)
+        std::atomic<int>    m_Status;
+        //! 打ち切りの要求
+        std::atomic<bool>   m_Cancel;
+    };
+}
+
+#endif /* IdentityCalibrator_hpp */
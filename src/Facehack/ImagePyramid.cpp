@@ -0,0 +1,207 @@
+//
+//  ImagePyramid.cpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/18.
+//
+//
+
+#include "ImagePyramid.hpp"
+#include "KSThreadPool.h"
+#include <algorithm>
+
+using namespace Kosakasakas;
+using namespace Facehack;
+using namespace Eigen;
+
+namespace
+{
+    //! 2列おきに列を取り出すMap
+    typedef Map<const FaceImage::ColorArray, 0, OuterStride<> > StridedColor;
+    //! 2要素おきに要素を取り出すMap
+    typedef Map<const FaceImage::MaskArray, 0, InnerStride<2> > StridedMask;
+    
+    //! 二項フィルタの係数
+    const float kWeights[5] = {1.0f / 16.0f, 4.0f / 16.0f, 6.0f / 16.0f, 4.0f / 16.0f, 1.0f / 16.0f};
+    
+    //! 近傍が全て有効とみなすマスクの閾値
+    const float kMaskThreshold  = 1.0f - 1.0e-4f;
+}
+
+ImagePyramid::ImagePyramid()
+: m_NumLevels(1)
+{}
+
+ImagePyramid::~ImagePyramid()
+{}
+
+bool    ImagePyramid::Initialize(int numLevels)
+{
+    if (numLevels < 1)
+    {
+        return false;
+    }
+    m_NumLevels = numLevels;
+    m_Levels.clear();
+    return true;
+}
+
+void    ImagePyramid::Finalize()
+{
+    m_Levels.clear();
+    m_RowColor.resize(3, 0);
+    m_RowMask.resize(1, 0);
+}
+
+bool    ImagePyramid::Build(const FaceImage& image)
+{
+    if (image.GetNumPixels() == 0)
+    {
+        return false;
+    }
+    
+    if (m_Levels.empty())
+    {
+        m_Levels.resize(1);
+    }
+    m_Levels[0] = image;
+    BuildLevels();
+    return true;
+}
+
+bool    ImagePyramid::Build(const unsigned char* pPixels,
+                            int width,
+                            int height,
+                            int numChannels)
+{
+    if (m_Levels.empty())
+    {
+        m_Levels.resize(1);
+    }
+    if (!m_Levels[0].SetPixels(pPixels, width, height, numChannels))
+    {
+        m_Levels.clear();
+        return false;
+    }
+    BuildLevels();
+    return true;
+}
+
+void    ImagePyramid::BuildLevels()
+{
+    // 上のレベルの画像は確保済みなら使い回す
+    m_Levels.resize(m_NumLevels);
+    for (int level=1; level<m_NumLevels; ++level)
+    {
+        const FaceImage& src    = m_Levels[level - 1];
+        if (src.GetWidth() < 2 && src.GetHeight() < 2)
+        {
+            m_Levels.resize(level);
+            break;
+        }
+        Downsample(src, m_Levels[level]);
+    }
+}
+
+void    ImagePyramid::GetLevelSize(int level, int& width, int& height)
+{
+    for (int i=0; i<level; ++i)
+    {
+        width   = (width + 1) / 2;
+        height  = (height + 1) / 2;
+    }
+}
+
+void    ImagePyramid::Downsample(const FaceImage& src, FaceImage& dst)
+{
+    const int srcWidth  = src.GetWidth();
+    const int srcHeight = src.GetHeight();
+    int dstWidth        = srcWidth;
+    int dstHeight       = srcHeight;
+    GetLevelSize(1, dstWidth, dstHeight);
+    if (dst.GetWidth() != dstWidth || dst.GetHeight() != dstHeight)
+    {
+        dst.Initialize(dstWidth, dstHeight);
+    }
+    
+    const FaceImage::ColorArray& srcColor   = src.GetColor();
+    const FaceImage::MaskArray& srcMask     = src.GetMask();
+    FaceImage::ColorArray& dstColor         = dst.GetColor();
+    FaceImage::MaskArray& dstMask           = dst.GetMask();
+    m_RowColor.resize(3, srcWidth * dstHeight);
+    m_RowMask.resize(1, srcWidth * dstHeight);
+    
+    KSThreadPool& pool  = KSThreadPool::GetDefault();
+    const int grain     = std::max(1, dstHeight / (4 * pool.GetNumWorkers()));
+    
+    // 縦方向: 5行の重み付き和を行ブロックで計算する
+    pool.ParallelFor(0, dstHeight, grain, [&](int begin, int end, int /*worker*/)
+    {
+        for (int y=begin; y<end; ++y)
+        {
+            int rows[5];
+            for (int k=0; k<5; ++k)
+            {
+                rows[k] = std::min(std::max(2 * y + k - 2, 0), srcHeight - 1) * srcWidth;
+            }
+            m_RowColor.middleCols(y * srcWidth, srcWidth)
+                = kWeights[0] * srcColor.middleCols(rows[0], srcWidth)
+                + kWeights[1] * srcColor.middleCols(rows[1], srcWidth)
+                + kWeights[2] * srcColor.middleCols(rows[2], srcWidth)
+                + kWeights[3] * srcColor.middleCols(rows[3], srcWidth)
+                + kWeights[4] * srcColor.middleCols(rows[4], srcWidth);
+            m_RowMask.segment(y * srcWidth, srcWidth)
+                = kWeights[0] * srcMask.segment(rows[0], srcWidth)
+                + kWeights[1] * srcMask.segment(rows[1], srcWidth)
+                + kWeights[2] * srcMask.segment(rows[2], srcWidth)
+                + kWeights[3] * srcMask.segment(rows[3], srcWidth)
+                + kWeights[4] * srcMask.segment(rows[4], srcWidth);
+        }
+    });
+    
+    // 横方向: 内側の列は2列おきのMapで、端の列は折り返しで計算する
+    const int innerBegin    = 1;
+    const int innerEnd      = std::max(innerBegin, (srcWidth - 1) / 2);
+    const int numInner      = innerEnd - innerBegin;
+    pool.ParallelFor(0, dstHeight, grain, [&](int begin, int end, int /*worker*/)
+    {
+        for (int y=begin; y<end; ++y)
+        {
+            const float* pColor = m_RowColor.data() + 3 * y * srcWidth;
+            const float* pMask  = m_RowMask.data() + y * srcWidth;
+            const int dstOffset = y * dstWidth;
+            if (numInner > 0)
+            {
+                FaceImage::ColorArray::ColsBlockXpr color   = dstColor.middleCols(dstOffset + innerBegin, numInner);
+                color.setZero();
+                FaceImage::MaskArray::SegmentReturnType mask    = dstMask.segment(dstOffset + innerBegin, numInner);
+                mask.setZero();
+                for (int k=0; k<5; ++k)
+                {
+                    const int x0    = 2 * innerBegin + k - 2;
+                    color   += kWeights[k] * StridedColor(pColor + 3 * x0, 3, numInner, OuterStride<>(6));
+                    mask    += kWeights[k] * StridedMask(pMask + x0, 1, numInner);
+                }
+            }
+            for (int x=0; x<dstWidth; ++x)
+            {
+                if (x >= innerBegin && x < innerEnd)
+                {
+                    continue;
+                }
+                Array3f color   = Array3f::Zero();
+                float mask      = 0.0f;
+                for (int k=0; k<5; ++k)
+                {
+                    const int xs    = std::min(std::max(2 * x + k - 2, 0), srcWidth - 1);
+                    color   += kWeights[k] * Map<const Array3f>(pColor + 3 * xs);
+                    mask    += kWeights[k] * pMask[xs];
+                }
+                dstColor.col(dstOffset + x) = color;
+                dstMask(dstOffset + x)      = mask;
+            }
+            FaceImage::MaskArray::SegmentReturnType mask    = dstMask.segment(dstOffset, dstWidth);
+            mask    = (mask >= kMaskThreshold).cast<float>();
+        }
+    });
+}
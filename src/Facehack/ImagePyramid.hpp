@@ -0,0 +1,109 @@
+//
+//  ImagePyramid.hpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/18.
+//
+//
+
+#ifndef ImagePyramid_hpp
+#define ImagePyramid_hpp
+
+#include "FaceImage.hpp"
+#include <vector>
+
+namespace Facehack {
+    
+    /**
+     @brief ガウシアンピラミッド
+     
+     入力フレームを[1 4 6 4 1]/16の分離可能なぼかしと1/2の間引きで縮小した画像列を作ります.
+     レベル0が元の解像度で、レベルが1つ上がるごとに幅と高さが半分(切り上げ)になります.
+     縦方向は行ごとのブロック演算、横方向は2列おきのストライド付きMapで計算し、行をスレッドプールで分担します.
+     マスクも同じようにぼかし、近傍が全て有効な画素だけを有効とします.
+     フレームごとに1回Buildを呼び、反復中は同じピラミッドを使い回してください.
+     */
+    class ImagePyramid
+    {
+    public:
+        ImagePyramid();
+        virtual ~ImagePyramid();
+        
+        /**
+         @brief 初期化
+         @param numLevels   レベル数(1以上)
+         @return 初期化の成否
+         */
+        bool    Initialize(int numLevels);
+        void    Finalize();
+        
+        /**
+         @brief ピラミッドの構築
+         
+         1×1まで縮小したら、それより上のレベルは作りません.
+         @param image   レベル0の画像
+         @return 構築の成否
+         */
+        bool    Build(const FaceImage& image);
+        
+        /**
+         @brief 8bit画素からのピラミッドの構築
+         
+         FaceImage::SetPixelsでレベル0に直接取り込むので、フレームのコピーは作りません.
+         @param pPixels     画素列(行優先、チャンネルはRGB(A)の順)
+         @param width       幅
+         @param height      高さ
+         @param numChannels チャンネル数(3か4)
+         @return 構築の成否
+         */
+        bool    Build(const unsigned char* pPixels,
+                      int width,
+                      int height,
+                      int numChannels);
+        
+        //! 構築済みのレベル数
+        inline int  GetNumLevels() const
+        {
+            return static_cast<int>(m_Levels.size());
+        }
+        
+        //! 指定レベルの画像
+        inline const FaceImage& GetLevel(int level) const
+        {
+            return m_Levels[level];
+        }
+        
+        /**
+         @brief 指定レベルの解像度の計算
+         
+         Buildの前でも使えるよう、元の解像度から計算します.
+         @param level   レベル
+         @param width   元の幅. 出力の幅
+         @param height  元の高さ. 出力の高さ
+         */
+        static void GetLevelSize(int level, int& width, int& height);
+    
+    private:
+        //! レベル0から上のレベルを作る
+        void    BuildLevels();
+        
+        /**
+         @brief 1レベル分の縮小
+         @param src 縮小元
+         @param dst 縮小先
+         */
+        void    Downsample(const FaceImage& src, FaceImage& dst);
+    
+    private:
+        //! 作るレベル数
+        int                     m_NumLevels;
+        //! 各レベルの画像
+        std::vector<FaceImage>  m_Levels;
+        //! 縦方向にだけ縮小した作業画像
+        FaceImage::ColorArray   m_RowColor;
+        //! 縦方向にだけ縮小した作業マスク
+        FaceImage::MaskArray    m_RowMask;
+    };
+}
+
+#endif /* ImagePyramid_hpp */
@@ -0,0 +1,365 @@
+//
+//  LandmarkEnergy.cpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/18.
+//
+//
+
+#include "LandmarkEnergy.hpp"
+#include <cmath>
+#include <fstream>
+#include <sstream>
+
+using namespace Kosakasakas;
+using namespace Facehack;
+using namespace Eigen;
+
+LandmarkTrack::LandmarkTrack()
+: m_NumLandmarks(0)
+{}
+
+LandmarkTrack::~LandmarkTrack()
+{}
+
+bool    LandmarkTrack::Load(const std::string& path, int numLandmarks)
+{
+    std::ifstream file(path.c_str());
+    if (!file || numLandmarks <= 0)
+    {
+        return false;
+    }
+    
+    Finalize();
+    m_NumLandmarks  = numLandmarks;
+    std::string line;
+    std::vector<float> values;
+    while (std::getline(file, line))
+    {
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+        values.clear();
+        std::istringstream stream(line);
+        float value;
+        while (stream >> value)
+        {
+            values.push_back(value);
+        }
+        if (values.empty())
+        {
+            continue;
+        }
+        
+        // 1ランドマークあたり2個(x y)か3個(x y 信頼度)
+        const int stride    = static_cast<int>(values.size()) / numLandmarks;
+        if ((stride != 2 && stride != 3) || static_cast<int>(values.size()) != stride * numLandmarks)
+        {
+            Finalize();
+            return false;
+        }
+        for (int k=0; k<numLandmarks; ++k)
+        {
+            const float x   = values[stride * k];
+            const float y   = values[stride * k + 1];
+            const float c   = (stride == 3) ? values[stride * k + 2] : 1.0f;
+            const bool valid    = (x >= 0.0f && y >= 0.0f);
+            m_Points.push_back(x);
+            m_Points.push_back(y);
+            m_Confidences.push_back(valid ? std::max(c, 0.0f) : 0.0f);
+        }
+    }
+    return true;
+}
+
+bool    LandmarkTrack::AddFrame(const float* pPoints,
+                                const float* pConfidences,
+                                int numLandmarks)
+{
+    if (!pPoints || numLandmarks <= 0 || (m_NumLandmarks > 0 && numLandmarks != m_NumLandmarks))
+    {
+        return false;
+    }
+    m_NumLandmarks  = numLandmarks;
+    for (int k=0; k<numLandmarks; ++k)
+    {
+        const bool valid    = (pPoints[2 * k] >= 0.0f && pPoints[2 * k + 1] >= 0.0f);
+        m_Points.push_back(pPoints[2 * k]);
+        m_Points.push_back(pPoints[2 * k + 1]);
+        m_Confidences.push_back(valid ? (pConfidences ? std::max(pConfidences[k], 0.0f) : 1.0f) : 0.0f);
+    }
+    return true;
+}
+
+void    LandmarkTrack::Finalize()
+{
+    m_NumLandmarks  = 0;
+    m_Points.clear();
+    m_Confidences.clear();
+}
+
+LandmarkEnergy::LandmarkEnergy()
+{}
+
+LandmarkEnergy::~LandmarkEnergy()
+{}
+
+bool    LandmarkEnergy::Initialize(const MorphableBasis& basis,
+                                   const std::vector<int>& vertexIndices)
+{
+    const int numVertices   = basis.GetNumVertices();
+    const int num           = static_cast<int>(vertexIndices.size());
+    for (int index : vertexIndices)
+    {
+        if (index < 0 || index >= numVertices)
+        {
+            return false;
+        }
+    }
+    
+    // ランドマークの頂点の行だけを集める
+    m_VertexIndices = vertexIndices;
+    m_MeanShape.resize(3 * num);
+    m_ShapeBasis.resize(3 * num, basis.GetShapeBasis().cols());
+    m_ExprBasis.resize(3 * num, basis.GetExpressionBasis().cols());
+    for (int k=0; k<num; ++k)
+    {
+        const int row   = 3 * vertexIndices[k];
+        m_MeanShape.segment<3>(3 * k)   = basis.GetMeanShape().segment<3>(row);
+        m_ShapeBasis.middleRows<3>(3 * k)   = basis.GetShapeBasis().middleRows<3>(row);
+        m_ExprBasis.middleRows<3>(3 * k)    = basis.GetExpressionBasis().middleRows<3>(row);
+    }
+    m_Points.setZero(2 * num);
+    m_Confidences.setZero(num);
+    return true;
+}
+
+void    LandmarkEnergy::Finalize()
+{
+    m_VertexIndices.clear();
+    m_MeanShape.resize(0);
+    m_ShapeBasis.resize(0, 0);
+    m_ExprBasis.resize(0, 0);
+    m_Points.resize(0);
+    m_Confidences.resize(0);
+}
+
+bool    LandmarkEnergy::LoadVertexIndices(const std::string& path, std::vector<int>& indices)
+{
+    std::ifstream file(path.c_str());
+    if (!file)
+    {
+        return false;
+    }
+    indices.clear();
+    std::string line;
+    while (std::getline(file, line))
+    {
+        const std::string::size_type comment    = line.find('#');
+        std::istringstream stream(line.substr(0, comment));
+        int index;
+        while (stream >> index)
+        {
+            indices.push_back(index);
+        }
+        if (!stream.eof())
+        {
+            return false;
+        }
+    }
+    return !indices.empty();
+}
+
+bool    LandmarkEnergy::SetObservations(const float* pPoints, const float* pConfidences)
+{
+    if (!pPoints)
+    {
+        return false;
+    }
+    const int num   = GetNumLandmarks();
+    m_Points        = Map<const KSVectorXf>(pPoints, 2 * num);
+    if (pConfidences)
+    {
+        m_Confidences   = Map<const KSVectorXf>(pConfidences, num).cwiseMax(0.0f);
+    }
+    else
+    {
+        m_Confidences.setOnes(num);
+    }
+    return true;
+}
+
+double  LandmarkEnergy::Evaluate(const FaceProjection& projection,
+                                 const float* pParams,
+                                 const FaceParamLayout& layout,
+                                 KSVectorXf& residual) const
+{
+    const int num   = GetNumLandmarks();
+    residual.setZero(2 * num);
+    double energy   = 0.0;
+    for (int k=0; k<num; ++k)
+    {
+        Vector2f uv;
+        if (m_Confidences(k) <= 0.0f || !projection.Project(Vertex(k, pParams, layout), uv))
+        {
+            continue;
+        }
+        residual.segment<2>(2 * k)  = std::sqrt(m_Confidences(k)) * (uv - m_Points.segment<2>(2 * k));
+        energy  += residual.segment<2>(2 * k).squaredNorm();
+    }
+    return energy;
+}
+
+double  LandmarkEnergy::Evaluate(const FaceProjection& projection,
+                                 const float* pParams,
+                                 const FaceParamLayout& layout,
+                                 KSVectorXf& residual,
+                                 KSMatrixXf& jacobian) const
+{
+    const int num   = GetNumLandmarks();
+    residual.setZero(2 * num);
+    jacobian.setZero(2 * num, layout.total);
+    double energy   = 0.0;
+    for (int k=0; k<num; ++k)
+    {
+        Vector2f uv;
+        FaceProjection::PointJacobian dPoint, dTrans;
+        FaceProjection::QuatJacobian dQuat;
+        if (m_Confidences(k) <= 0.0f
+            || !projection.ProjectWithJacobian(Vertex(k, pParams, layout), uv, dPoint, dQuat, dTrans))
+        {
+            continue;
+        }
+        const float weight  = std::sqrt(m_Confidences(k));
+        residual.segment<2>(2 * k)  = weight * (uv - m_Points.segment<2>(2 * k));
+        energy  += residual.segment<2>(2 * k).squaredNorm();
+        
+        // 頂点は基底の行の線形結合なので、係数の微分は 投影の微分 × 基底の行
+        const Matrix<float, 2, 3> dWeighted = weight * dPoint;
+        jacobian.block(2 * k, layout.alpha, 2, m_ShapeBasis.cols()).noalias()
+            = dWeighted * m_ShapeBasis.middleRows<3>(3 * k);
+        jacobian.block(2 * k, layout.delta, 2, m_ExprBasis.cols()).noalias()
+            = dWeighted * m_ExprBasis.middleRows<3>(3 * k);
+        jacobian.block<2, 4>(2 * k, layout.faceQuat)    = weight * dQuat;
+        jacobian.block<2, 3>(2 * k, layout.faceTrans)   = weight * dTrans;
+        const FaceProjection::IntrinsicsJacobian dIntrinsics    = weight * projection.GetIntrinsicsJacobian(uv);
+        jacobian.col(layout.camFov).segment<2>(2 * k)       = dIntrinsics.col(0);
+        jacobian.col(layout.camAspect).segment<2>(2 * k)    = dIntrinsics.col(1);
+    }
+    return energy;
+}
+
+Vector3f    LandmarkEnergy::Vertex(int k,
+                                   const float* pParams,
+                                   const FaceParamLayout& layout) const
+{
+    Vector3f v  = m_MeanShape.segment<3>(3 * k);
+    v.noalias() += m_ShapeBasis.middleRows<3>(3 * k) * Map<const KSVectorXf>(pParams + layout.alpha, m_ShapeBasis.cols());
+    v.noalias() += m_ExprBasis.middleRows<3>(3 * k) * Map<const KSVectorXf>(pParams + layout.delta, m_ExprBasis.cols());
+    return v;
+}
+
+void    LandmarkEnergy::ComputeVertices(const float* pParams,
+                                        const FaceParamLayout& layout,
+                                        KSVectorXf& vertices) const
+{
+    const int num   = GetNumLandmarks();
+    vertices.resize(3 * num);
+    for (int k=0; k<num; ++k)
+    {
+        vertices.segment<3>(3 * k)  = Vertex(k, pParams, layout);
+    }
+}
+
+LandmarkPoseResidual::LandmarkPoseResidual()
+: m_Layout()
+, m_Width(0)
+, m_Height(0)
+, m_IsProjectionValid(false)
+{
+    m_Pose.setZero();
+}
+
+LandmarkPoseResidual::~LandmarkPoseResidual()
+{}
+
+bool    LandmarkPoseResidual::Setup(const LandmarkEnergy& energy,
+                                    const float* pParams,
+                                    const FaceParamLayout& layout,
+                                    int width,
+                                    int height)
+{
+    if (energy.GetNumLandmarks() == 0 || energy.GetTotalConfidence() <= 0.0f
+        || layout.total <= 0 || width <= 0 || height <= 0)
+    {
+        return false;
+    }
+    m_Layout    = layout;
+    m_Width     = width;
+    m_Height    = height;
+    energy.ComputeVertices(pParams, layout, m_Vertices);
+    m_Points    = energy.GetPoints();
+    m_Weights   = energy.GetConfidences().cwiseSqrt();
+    m_Params    = Map<const KSVectorXf>(pParams, layout.total);
+    m_IsProjectionValid = false;
+    return true;
+}
+
+void    LandmarkPoseResidual::GetPose(const float* pParams, PoseVector& pose) const
+{
+    pose.head<4>()  = Map<const Vector4f>(pParams + m_Layout.faceQuat);
+    pose.tail<3>()  = Map<const Vector3f>(pParams + m_Layout.faceTrans);
+}
+
+void    LandmarkPoseResidual::SetPose(const PoseVector& pose, float* pParams) const
+{
+    const float norm    = pose.head<4>().norm();
+    Map<Vector4f>(pParams + m_Layout.faceQuat)  = (norm > 0.0f) ? Vector4f(pose.head<4>() / norm) : Vector4f(pose.head<4>());
+    Map<Vector3f>(pParams + m_Layout.faceTrans) = pose.tail<3>();
+}
+
+bool    LandmarkPoseResidual::operator()(const PoseVector& pose, int i, float& r, JacobianRow* pJacobianRow) const
+{
+    if (!UpdateProjection(pose))
+    {
+        return false;
+    }
+    const int k = i / 2;
+    const int c = i % 2;
+    r   = 0.0f;
+    if (pJacobianRow)
+    {
+        pJacobianRow->setZero();
+    }
+    
+    // 信頼度0の観測とカメラの後ろに回った頂点は残差もヤコビアンも0にする
+    Vector2f uv;
+    FaceProjection::PointJacobian dPoint, dTrans;
+    FaceProjection::QuatJacobian dQuat;
+    if (m_Weights(k) <= 0.0f
+        || !m_Projection.ProjectWithJacobian(m_Vertices.segment<3>(3 * k), uv, dPoint, dQuat, dTrans))
+    {
+        return true;
+    }
+    r   = m_Weights(k) * (uv(c) - m_Points(2 * k + c));
+    if (pJacobianRow)
+    {
+        pJacobianRow->head<4>() = m_Weights(k) * dQuat.row(c);
+        pJacobianRow->tail<3>() = m_Weights(k) * dTrans.row(c);
+    }
+    return true;
+}
+
+bool    LandmarkPoseResidual::UpdateProjection(const PoseVector& pose) const
+{
+    if (m_IsProjectionValid && pose == m_Pose)
+    {
+        return true;
+    }
+    m_Params.segment<4>(m_Layout.faceQuat)  = pose.head<4>();
+    m_Params.segment<3>(m_Layout.faceTrans) = pose.tail<3>();
+    m_IsProjectionValid = m_Projection.Set(m_Params.data(), m_Layout, m_Width, m_Height);
+    m_Pose              = pose;
+    return m_IsProjectionValid;
+}
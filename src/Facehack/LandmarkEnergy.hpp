@@ -0,0 +1,303 @@
+//
+//  LandmarkEnergy.hpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/18.
+//
+//
+
+#ifndef LandmarkEnergy_hpp
+#define LandmarkEnergy_hpp
+
+#include "KSMath.h"
+#include "MorphableBasis.hpp"
+#include "FaceProjection.hpp"
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace Facehack {
+    
+    /**
+     @brief 2Dランドマークの観測列
+     
+     フレームごとのランドマークの画素座標と信頼度を保持します.
+     サイドカーファイルは1行1フレームのテキストで、ランドマークごとに「x y」か「x y 信頼度」を空白区切りで並べます.
+     '#'で始まる行と空行は読み飛ばします. 座標が負のランドマークは未検出として信頼度0で扱います.
+     */
+    class LandmarkTrack
+    {
+    public:
+        LandmarkTrack();
+        virtual ~LandmarkTrack();
+        
+        /**
+         @brief サイドカーファイルの読み込み
+         @param path            ファイルパス
+         @param numLandmarks    1フレームあたりのランドマーク数
+         @return 読み込みの成否(数値の個数が合わない行があれば失敗)
+         */
+        bool    Load(const std::string& path, int numLandmarks);
+        
+        /**
+         @brief メモリ上のフレームの追加
+         @param pPoints         画素座標(x, y)の列
+         @param pConfidences    信頼度の列(nullptrの場合は全て1)
+         @param numLandmarks    ランドマーク数
+         @return 追加の成否
+         */
+        bool    AddFrame(const float* pPoints,
+                         const float* pConfidences,
+                         int numLandmarks);
+        
+        void    Finalize();
+        
+        inline int  GetNumFrames() const
+        {
+            return static_cast<int>(m_Confidences.size()) / std::max(m_NumLandmarks, 1);
+        }
+        
+        inline int  GetNumLandmarks() const
+        {
+            return m_NumLandmarks;
+        }
+        
+        //! 指定フレームの画素座標(x, y)の列
+        inline const float* GetPoints(int frame) const
+        {
+            return m_Points.data() + 2 * m_NumLandmarks * frame;
+        }
+        
+        //! 指定フレームの信頼度の列
+        inline const float* GetConfidences(int frame) const
+        {
+            return m_Confidences.data() + m_NumLandmarks * frame;
+        }
+    
+    private:
+        //! ランドマーク数
+        int                 m_NumLandmarks;
+        //! 全フレームの画素座標
+        std::vector<float>  m_Points;
+        //! 全フレームの信頼度
+        std::vector<float>  m_Confidences;
+    };
+    
+    /**
+     @brief ランドマークの特徴点整合(Feature Alignment)のエネルギー計算クラス
+     
+     ランドマークに対応する頂点の平均と基底の行だけを初期化時に集めておき、
+     反復ごとにはその行だけから頂点を作って投影します. ラスタライズは不要です.
+     残差は 投影した画素座標 - 観測した画素座標 に信頼度の平方根を掛けたもので、ランドマークごとに2要素です.
+     ヤコビアンはα、δ、顔の姿勢、垂直画角、アスペクト比の列だけに解析的に書き込みます(他の列は0).
+     カメラの後ろに回ったランドマークは、その評価では残差もヤコビアンも0にします.
+     */
+    class LandmarkEnergy
+    {
+    public:
+        LandmarkEnergy();
+        virtual ~LandmarkEnergy();
+        
+        /**
+         @brief 初期化
+         @param basis           顔の線形モデル
+         @param vertexIndices   ランドマークに対応する頂点番号
+         @return 初期化の成否
+         */
+        bool    Initialize(const MorphableBasis& basis,
+                           const std::vector<int>& vertexIndices);
+        void    Finalize();
+        
+        /**
+         @brief 頂点番号ファイルの読み込み
+         
+         空白か改行区切りの頂点番号を読み込みます. '#'から行末まではコメントです.
+         @param path    ファイルパス
+         @param indices 出力の頂点番号
+         @return 読み込みの成否
+         */
+        static bool LoadVertexIndices(const std::string& path, std::vector<int>& indices);
+        
+        /**
+         @brief 観測のセット
+         @param pPoints         画素座標(x, y)の列
+         @param pConfidences    信頼度の列(nullptrの場合は全て1)
+         @return セットの成否
+         */
+        bool    SetObservations(const float* pPoints, const float* pConfidences);
+        
+        /**
+         @brief エネルギーと残差の計算
+         @param projection  投影(観測と同じ解像度でセットしておくこと)
+         @param pParams     パラメータ配列
+         @param layout      パラメータ配列のレイアウト
+         @param residual    出力の残差(2 × ランドマーク数)
+         @return エネルギー(信頼度で重み付けした二乗誤差の和)
+         */
+        double  Evaluate(const FaceProjection& projection,
+                         const float* pParams,
+                         const FaceParamLayout& layout,
+                         Kosakasakas::KSVectorXf& residual) const;
+        
+        /**
+         @brief エネルギー、残差、ヤコビアンの計算
+         @param projection  投影
+         @param pParams     パラメータ配列
+         @param layout      パラメータ配列のレイアウト
+         @param residual    出力の残差(2 × ランドマーク数)
+         @param jacobian    出力のヤコビアン(2 × ランドマーク数, layout.total)
+         @return エネルギー
+         */
+        double  Evaluate(const FaceProjection& projection,
+                         const float* pParams,
+                         const FaceParamLayout& layout,
+                         Kosakasakas::KSVectorXf& residual,
+                         Kosakasakas::KSMatrixXf& jacobian) const;
+        
+        inline int  GetNumLandmarks() const
+        {
+            return static_cast<int>(m_VertexIndices.size());
+        }
+        
+        //! 信頼度の和(エネルギーの正規化用)
+        inline float    GetTotalConfidence() const
+        {
+            return m_Confidences.sum();
+        }
+        
+        //! 観測した画素座標(x, y)の列
+        inline const Kosakasakas::KSVectorXf&   GetPoints() const
+        {
+            return m_Points;
+        }
+        
+        //! 観測の信頼度の列
+        inline const Kosakasakas::KSVectorXf&   GetConfidences() const
+        {
+            return m_Confidences;
+        }
+        
+        /**
+         @brief ランドマークの頂点座標の計算
+         @param pParams     パラメータ配列
+         @param layout      パラメータ配列のレイアウト
+         @param vertices    出力のモデル座標の頂点(3 × ランドマーク数)
+         */
+        void    ComputeVertices(const float* pParams,
+                                const FaceParamLayout& layout,
+                                Kosakasakas::KSVectorXf& vertices) const;
+    
+    private:
+        /**
+         @brief ランドマークの頂点座標の計算
+         @param k       ランドマーク番号
+         @param pParams パラメータ配列
+         @param layout  パラメータ配列のレイアウト
+         @return モデル座標の頂点
+         */
+        Eigen::Vector3f Vertex(int k,
+                               const float* pParams,
+                               const FaceParamLayout& layout) const;
+    
+    private:
+        //! ランドマークの頂点番号
+        std::vector<int>        m_VertexIndices;
+        //! ランドマークの頂点の平均形状(3 × ランドマーク数)
+        Kosakasakas::KSVectorXf m_MeanShape;
+        //! ランドマークの頂点の形状の基底
+        Kosakasakas::KSMatrixXf m_ShapeBasis;
+        //! ランドマークの頂点の表情の基底
+        Kosakasakas::KSMatrixXf m_ExprBasis;
+        //! 観測した画素座標
+        Kosakasakas::KSVectorXf m_Points;
+        //! 信頼度
+        Kosakasakas::KSVectorXf m_Confidences;
+    };
+    
+    /**
+     @brief ランドマークだけで顔の姿勢を解くための残差ファンクタ
+     
+     KSFixedOptimizer(FacehackParams::PoseOptimizer)に渡します. 未知数は回転のクォータニオン(x, y, z, w)と
+     平行移動を並べた7要素で、形状、表情、カメラはSetupで渡したパラメータ配列の値に固定します.
+     ランドマークの頂点はSetupで1回だけ作っておき、残差の評価では投影だけをします.
+     i番目の残差はランドマークi / 2の画素座標のx(偶数)かy(奇数)の 投影 - 観測 に信頼度の平方根を掛けたものです.
+     クォータニオンの大きさの方向は残差に効かないので、J^tJはその方向に退化します
+     (KSFixedOptimizerのLDLTはその方向のステップを0にします).
+     */
+    class LandmarkPoseResidual
+    {
+    public:
+        //! 未知数(クォータニオン、平行移動)
+        typedef Eigen::Matrix<float, 7, 1>  PoseVector;
+        //! ヤコビアンの行
+        typedef Eigen::Matrix<float, 1, 7>  JacobianRow;
+        
+        LandmarkPoseResidual();
+        virtual ~LandmarkPoseResidual();
+        
+        /**
+         @brief 観測と固定するパラメータのセット
+         @param energy  観測をセットしたランドマークのエネルギー
+         @param pParams パラメータ配列
+         @param layout  パラメータ配列のレイアウト
+         @param width   観測の画像の幅
+         @param height  観測の画像の高さ
+         @return セットの成否(信頼度が正の観測が無い場合は失敗)
+         */
+        bool    Setup(const LandmarkEnergy& energy,
+                      const float* pParams,
+                      const FaceParamLayout& layout,
+                      int width,
+                      int height);
+        
+        inline int  GetNumResiduals() const
+        {
+            return 2 * static_cast<int>(m_Weights.size());
+        }
+        
+        //! パラメータ配列から未知数を取り出す
+        void    GetPose(const float* pParams, PoseVector& pose) const;
+        
+        //! 未知数をパラメータ配列に書き戻す(クォータニオンは正規化する)
+        void    SetPose(const PoseVector& pose, float* pParams) const;
+        
+        /**
+         @brief 残差とヤコビアンの行の計算
+         @param pose            未知数
+         @param i               残差の番号
+         @param r               出力の残差
+         @param pJacobianRow    出力のヤコビアンの行(nullptrの場合は残差のみ)
+         @return 計算の成否
+         */
+        bool    operator()(const PoseVector& pose, int i, float& r, JacobianRow* pJacobianRow) const;
+    
+    private:
+        //! 姿勢が変わった場合だけ投影をセットし直す
+        bool    UpdateProjection(const PoseVector& pose) const;
+    
+    private:
+        //! パラメータ配列のレイアウト
+        FaceParamLayout m_Layout;
+        //! 観測の画像の幅
+        int     m_Width;
+        //! 観測の画像の高さ
+        int     m_Height;
+        //! ランドマークの頂点(モデル座標)
+        Kosakasakas::KSVectorXf m_Vertices;
+        //! 観測した画素座標
+        Kosakasakas::KSVectorXf m_Points;
+        //! 信頼度の平方根
+        Kosakasakas::KSVectorXf m_Weights;
+        
+        //! 投影用のパラメータ配列(評価中の姿勢を書き込む)
+        mutable Kosakasakas::KSVectorXf m_Params;
+        //! 評価中の姿勢の投影
+        mutable FaceProjection  m_Projection;
+        //! 投影をセットした姿勢
+        mutable PoseVector      m_Pose;
+        //! 投影をセットしたかどうか
+        mutable bool            m_IsProjectionValid;
+    };
+}
+
+#endif /* LandmarkEnergy_hpp */
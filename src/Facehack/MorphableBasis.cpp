@@ -0,0 +1,96 @@
+//
+//  MorphableBasis.cpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/18.
+//
+//
+
+#include "MorphableBasis.hpp"
+#include <algorithm>
+
+using namespace Kosakasakas;
+using namespace Facehack;
+using namespace Eigen;
+
+MorphableBasis::MorphableBasis()
+{}
+
+MorphableBasis::~MorphableBasis()
+{}
+
+bool    MorphableBasis::Initialize(const KSVectorXf& meanShape,
+                                   const KSMatrixXf& shapeBasis,
+                                   const KSVectorXf& meanAlbedo,
+                                   const KSMatrixXf& albedoBasis,
+                                   const TriangleArray& triangles,
+                                   int numShapeCoeffs,
+                                   int numAlbedoCoeffs,
+                                   int numExprCoeffs)
+{
+    const int rows  = static_cast<int>(meanShape.size());
+    if (rows == 0 || rows % 3 != 0
+        || shapeBasis.rows() != rows
+        || meanAlbedo.size() != rows
+        || albedoBasis.rows() != rows)
+    {
+        return false;
+    }
+    if (triangles.size() > 0 && (triangles.minCoeff() < 0 || triangles.maxCoeff() >= rows / 3))
+    {
+        return false;
+    }
+    
+    m_MeanShape     = meanShape;
+    m_MeanAlbedo    = meanAlbedo;
+    m_Triangles     = triangles;
+    ResizeColumns(shapeBasis, numShapeCoeffs, m_ShapeBasis);
+    ResizeColumns(albedoBasis, numAlbedoCoeffs, m_AlbedoBasis);
+    m_ExprBasis.setZero(rows, numExprCoeffs);
+    return true;
+}
+
+void    MorphableBasis::Finalize()
+{
+    m_MeanShape.resize(0);
+    m_ShapeBasis.resize(0, 0);
+    m_ExprBasis.resize(0, 0);
+    m_MeanAlbedo.resize(0);
+    m_AlbedoBasis.resize(0, 0);
+    m_Triangles.resize(3, 0);
+}
+
+bool    MorphableBasis::SetExpressionBasis(const KSMatrixXf& exprBasis)
+{
+    if (exprBasis.rows() != m_MeanShape.size())
+    {
+        return false;
+    }
+    ResizeColumns(exprBasis, static_cast<int>(m_ExprBasis.cols()), m_ExprBasis);
+    return true;
+}
+
+void    MorphableBasis::ComputeShape(const float* pAlpha,
+                                     const float* pDelta,
+                                     KSVectorXf& vertices) const
+{
+    vertices    = m_MeanShape;
+    vertices.noalias()  += m_ShapeBasis * Map<const KSVectorXf>(pAlpha, m_ShapeBasis.cols());
+    vertices.noalias()  += m_ExprBasis * Map<const KSVectorXf>(pDelta, m_ExprBasis.cols());
+}
+
+void    MorphableBasis::ComputeAlbedo(const float* pBeta,
+                                      KSVectorXf& albedo) const
+{
+    albedo  = m_MeanAlbedo;
+    albedo.noalias()    += m_AlbedoBasis * Map<const KSVectorXf>(pBeta, m_AlbedoBasis.cols());
+}
+
+void    MorphableBasis::ResizeColumns(const KSMatrixXf& src,
+                                      int numCols,
+                                      KSMatrixXf& dst)
+{
+    const int numCopy   = std::min(numCols, static_cast<int>(src.cols()));
+    dst.setZero(src.rows(), numCols);
+    dst.leftCols(numCopy)   = src.leftCols(numCopy);
+}
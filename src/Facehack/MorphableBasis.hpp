@@ -0,0 +1,149 @@
+//
+//  MorphableBasis.hpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/18.
+//
+//
+
+#ifndef MorphableBasis_hpp
+#define MorphableBasis_hpp
+
+#include "KSMath.h"
+#include <memory>
+
+namespace Facehack {
+    
+    /**
+     @brief 顔の線形モデル(形状・表情・アルベド)
+     
+     頂点座標とアルベドを 平均 + 基底 × 係数 で表す線形モデルを、インデックス付きの頂点配列として保持します.
+     頂点iの成分は3i, 3i+1, 3i+2行目です. 基底は主成分に標準偏差を掛けたもので、係数は標準偏差単位です.
+     表情の基底はBasel Face Modelに含まれないので、SetExpressionBasisで与えるまでは全て0です.
+     エネルギー計算でテクスチャやofMeshを経由せずに頂点と基底の行を直接引くためのクラスです.
+     */
+    class MorphableBasis
+    {
+    public:
+        //! 三角形の頂点番号(3 × 三角形数)
+        typedef Eigen::Matrix<int, 3, Eigen::Dynamic>   TriangleArray;
+        
+        MorphableBasis();
+        virtual ~MorphableBasis();
+        
+        /**
+         @brief 初期化
+         
+         基底の列数が係数の数より多い場合は先頭の列だけを使い、少ない場合は0の列で埋めます.
+         @param meanShape       平均形状(3 × 頂点数)
+         @param shapeBasis      形状の基底
+         @param meanAlbedo      平均アルベド(3 × 頂点数, [0, 1])
+         @param albedoBasis     アルベドの基底
+         @param triangles       三角形の頂点番号
+         @param numShapeCoeffs  形状の係数の数
+         @param numAlbedoCoeffs アルベドの係数の数
+         @param numExprCoeffs   表情の係数の数
+         @return 初期化の成否
+         */
+        bool    Initialize(const Kosakasakas::KSVectorXf& meanShape,
+                           const Kosakasakas::KSMatrixXf& shapeBasis,
+                           const Kosakasakas::KSVectorXf& meanAlbedo,
+                           const Kosakasakas::KSMatrixXf& albedoBasis,
+                           const TriangleArray& triangles,
+                           int numShapeCoeffs,
+                           int numAlbedoCoeffs,
+                           int numExprCoeffs);
+        void    Finalize();
+        
+        /**
+         @brief 表情の基底のセット
+         
+         列数が係数の数と違う場合の扱いはInitializeと同じです.
+         @param exprBasis   表情の基底(3 × 頂点数行)
+         @return セットの成否
+         */
+        bool    SetExpressionBasis(const Kosakasakas::KSMatrixXf& exprBasis);
+        
+        /**
+         @brief 頂点座標の計算
+         @param pAlpha      形状の係数
+         @param pDelta      表情の係数
+         @param vertices    出力の頂点座標(3 × 頂点数)
+         */
+        void    ComputeShape(const float* pAlpha,
+                             const float* pDelta,
+                             Kosakasakas::KSVectorXf& vertices) const;
+        
+        /**
+         @brief アルベドの計算
+         @param pBeta   アルベドの係数
+         @param albedo  出力のアルベド(3 × 頂点数)
+         */
+        void    ComputeAlbedo(const float* pBeta,
+                              Kosakasakas::KSVectorXf& albedo) const;
+        
+        inline int  GetNumVertices() const
+        {
+            return static_cast<int>(m_MeanShape.size() / 3);
+        }
+        
+        inline int  GetNumTriangles() const
+        {
+            return static_cast<int>(m_Triangles.cols());
+        }
+        
+        inline const TriangleArray& GetTriangles() const
+        {
+            return m_Triangles;
+        }
+        
+        inline const Kosakasakas::KSVectorXf&   GetMeanShape() const
+        {
+            return m_MeanShape;
+        }
+        
+        inline const Kosakasakas::KSMatrixXf&   GetShapeBasis() const
+        {
+            return m_ShapeBasis;
+        }
+        
+        inline const Kosakasakas::KSMatrixXf&   GetExpressionBasis() const
+        {
+            return m_ExprBasis;
+        }
+        
+        inline const Kosakasakas::KSVectorXf&   GetMeanAlbedo() const
+        {
+            return m_MeanAlbedo;
+        }
+        
+        inline const Kosakasakas::KSMatrixXf&   GetAlbedoBasis() const
+        {
+            return m_AlbedoBasis;
+        }
+    
+    private:
+        //! 列数を揃えた基底のコピー
+        static void ResizeColumns(const Kosakasakas::KSMatrixXf& src,
+                                  int numCols,
+                                  Kosakasakas::KSMatrixXf& dst);
+    
+    private:
+        //! 平均形状
+        Kosakasakas::KSVectorXf m_MeanShape;
+        //! 形状の基底
+        Kosakasakas::KSMatrixXf m_ShapeBasis;
+        //! 表情の基底
+        Kosakasakas::KSMatrixXf m_ExprBasis;
+        //! 平均アルベド
+        Kosakasakas::KSVectorXf m_MeanAlbedo;
+        //! アルベドの基底
+        Kosakasakas::KSMatrixXf m_AlbedoBasis;
+        //! 三角形
+        TriangleArray           m_Triangles;
+    };
+    
+    typedef std::shared_ptr<MorphableBasis> MorphableBasisPtr;
+}
+
+#endif /* MorphableBasis_hpp */
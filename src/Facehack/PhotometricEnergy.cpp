@@ -0,0 +1,238 @@
+//
+//  PhotometricEnergy.cpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/17.
+//
+//
+
+#include "PhotometricEnergy.hpp"
+#include "KSThreadPool.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace Kosakasakas;
+using namespace Facehack;
+using namespace Eigen;
+
+PhotometricEnergy::PhotometricEnergy()
+: m_NormType(PHOTOMETRIC_L21)
+, m_Epsilon(1.0f / 255.0f)
+, m_NumVisible(0)
+{}
+
+PhotometricEnergy::~PhotometricEnergy()
+{}
+
+bool    PhotometricEnergy::Initialize(PhotometricNormType normType)
+{
+    m_NormType      = normType;
+    m_NumVisible    = 0;
+    m_PixelIndices.clear();
+    return true;
+}
+
+void    PhotometricEnergy::Finalize()
+{
+    m_Scratch.resize(3, 0);
+    m_ScaleScratch.resize(1, 0);
+    m_Visible.resize(1, 0);
+    m_ResidualScales.resize(0);
+    m_RowCounts.clear();
+    m_WorkerEnergy.clear();
+    m_PixelIndices.clear();
+    m_NumVisible    = 0;
+}
+
+double  PhotometricEnergy::Evaluate(const FaceImage& input,
+                                    const FaceImage& synthesized)
+{
+    return EvaluateRows(input, synthesized, false);
+}
+
+double  PhotometricEnergy::Evaluate(const FaceImage& input,
+                                    const FaceImage& synthesized,
+                                    KSVectorXf& residual)
+{
+    const double energy = EvaluateRows(input, synthesized, true);
+    if (energy < 0.0)
+    {
+        return energy;
+    }
+    
+    // 行ごとの書き込み先を決める
+    const int width     = synthesized.GetWidth();
+    const int height    = synthesized.GetHeight();
+    std::vector<int> rowOffsets(height + 1, 0);
+    for (int y=0; y<height; ++y)
+    {
+        rowOffsets[y + 1]   = rowOffsets[y] + m_RowCounts[y];
+    }
+    
+    // 可視画素だけを詰めて並べる
+    residual.resize(3 * m_NumVisible);
+    m_PixelIndices.resize(m_NumVisible);
+    m_ResidualScales.resize(m_NumVisible);
+    KSThreadPool& pool  = KSThreadPool::GetDefault();
+    const int grain     = std::max(1, height / (4 * pool.GetNumWorkers()));
+    pool.ParallelFor(0, height, grain, [&](int begin, int end, int /*worker*/)
+    {
+        for (int y=begin; y<end; ++y)
+        {
+            int dst = rowOffsets[y];
+            for (int x=0, i=y*width; x<width; ++x, ++i)
+            {
+                if (m_Visible(i) > 0.0f)
+                {
+                    residual.segment<3>(3 * dst)    = m_Scratch.col(i).matrix();
+                    m_PixelIndices[dst]             = i;
+                    m_ResidualScales(dst)           = m_ScaleScratch(i);
+                    ++dst;
+                }
+            }
+        }
+    });
+    return energy;
+}
+
+double  PhotometricEnergy::Evaluate(const FaceImage& input,
+                                    const FaceImage& synthesized,
+                                    const std::vector<int>& samples,
+                                    float weight,
+                                    KSVectorXf& residual)
+{
+    if (synthesized.GetNumPixels() != input.GetNumPixels())
+    {
+        return -1.0;
+    }
+    
+    const int num   = static_cast<int>(samples.size());
+    residual.resize(3 * num);
+    m_ResidualScales.resize(num);
+    m_PixelIndices  = samples;
+    m_NumVisible    = num;
+    
+    KSThreadPool& pool  = KSThreadPool::GetDefault();
+    m_WorkerEnergy.assign(pool.GetNumWorkers(), 0.0);
+    
+    const FaceImage::ColorArray& inColor    = input.GetColor();
+    const FaceImage::ColorArray& synColor   = synthesized.GetColor();
+    const bool  isL21       = (m_NormType == PHOTOMETRIC_L21);
+    const float epsilon     = m_Epsilon;
+    const float sqrtWeight  = std::sqrt(weight);
+    
+    const int grain = std::max(256, num / (4 * pool.GetNumWorkers()));
+    pool.ParallelFor(0, num, grain, [&](int begin, int end, int worker)
+    {
+        double energy   = 0.0;
+        for (int k=begin; k<end; ++k)
+        {
+            const int i = samples[k];
+            Vector3f diff   = (synColor.col(i) - inColor.col(i)).matrix();
+            float norm      = diff.squaredNorm();
+            float scale     = sqrtWeight;
+            if (isL21)
+            {
+                norm    = std::sqrt(norm);
+                scale   /= std::sqrt(std::max(norm, epsilon));
+            }
+            energy  += static_cast<double>(norm);
+            residual.segment<3>(3 * k)  = scale * diff;
+            m_ResidualScales(k)         = scale;
+        }
+        m_WorkerEnergy[worker]  += energy;
+    });
+    
+    double energy   = 0.0;
+    for (double e : m_WorkerEnergy)
+    {
+        energy  += e;
+    }
+    return weight * energy;
+}
+
+double  PhotometricEnergy::EvaluateRows(const FaceImage& input,
+                                        const FaceImage& synthesized,
+                                        bool storeResidual)
+{
+    const int width     = synthesized.GetWidth();
+    const int height    = synthesized.GetHeight();
+    if (width != input.GetWidth() || height != input.GetHeight())
+    {
+        return -1.0;
+    }
+    
+    KSThreadPool& pool  = KSThreadPool::GetDefault();
+    m_RowCounts.assign(height, 0);
+    m_WorkerEnergy.assign(pool.GetNumWorkers(), 0.0);
+    if (storeResidual)
+    {
+        m_Scratch.resize(3, width * height);
+        m_ScaleScratch.resize(1, width * height);
+        m_Visible.resize(1, width * height);
+    }
+    
+    const FaceImage::ColorArray& inColor    = input.GetColor();
+    const FaceImage::ColorArray& synColor   = synthesized.GetColor();
+    const FaceImage::MaskArray& inMask      = input.GetMask();
+    const FaceImage::MaskArray& synMask     = synthesized.GetMask();
+    const bool  isL21   = (m_NormType == PHOTOMETRIC_L21);
+    const float epsilon = m_Epsilon;
+    
+    const int grain = std::max(1, height / (4 * pool.GetNumWorkers()));
+    pool.ParallelFor(0, height, grain, [&](int begin, int end, int worker)
+    {
+        // 行単位の作業領域(幅が同じなので確保は初回だけ)
+        FaceImage::ColorArray   diff(3, width);
+        FaceImage::MaskArray    visible(1, width);
+        FaceImage::MaskArray    norm(1, width);
+        double energy   = 0.0;
+        for (int y=begin; y<end; ++y)
+        {
+            const int offset    = y * width;
+            diff    = synColor.middleCols(offset, width) - inColor.middleCols(offset, width);
+            visible = synMask.segment(offset, width) * inMask.segment(offset, width);
+            norm    = diff.square().colwise().sum();
+            if (isL21)
+            {
+                norm    = norm.sqrt();
+            }
+            energy          += static_cast<double>((norm * visible).sum());
+            m_RowCounts[y]  = static_cast<int>((visible > 0.0f).count());
+            
+            if (storeResidual)
+            {
+                if (isL21)
+                {
+                    // |r~|^2 = |r|^2 / max(|r|, ε) ≒ |r| になるよう重み付けする
+                    m_ScaleScratch.segment(offset, width)   = norm.max(epsilon).rsqrt();
+                    diff.rowwise()  *= m_ScaleScratch.segment(offset, width);
+                }
+                else
+                {
+                    m_ScaleScratch.segment(offset, width).setOnes();
+                }
+                m_Scratch.middleCols(offset, width) = diff;
+                m_Visible.segment(offset, width)    = visible;
+            }
+        }
+        m_WorkerEnergy[worker]  += energy;
+    });
+    
+    m_NumVisible    = 0;
+    for (int y=0; y<height; ++y)
+    {
+        m_NumVisible    += m_RowCounts[y];
+    }
+    if (!storeResidual)
+    {
+        m_PixelIndices.clear();
+    }
+    
+    double energy   = 0.0;
+    for (double e : m_WorkerEnergy)
+    {
+        energy  += e;
+    }
+    return energy;
+}
@@ -0,0 +1,167 @@
+//
+//  PhotometricEnergy.hpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/17.
+//
+//
+
+#ifndef PhotometricEnergy_hpp
+#define PhotometricEnergy_hpp
+
+#include "KSMath.h"
+#include "FaceImage.hpp"
+#include <vector>
+
+namespace Facehack {
+    
+    //! 色残差のノルムの種類
+    enum PhotometricNormType
+    {
+        //! 画素ごとの二乗ノルムの和
+        PHOTOMETRIC_L2,
+        //! 画素ごとのノルムの和(外れ値に強い)
+        PHOTOMETRIC_L21
+    };
+    
+    /**
+     @brief 写真的整合性(Photo-Consistency)のエネルギー計算クラス
+     
+     CPU側の入力画像と合成画像から、顔が描画された画素だけの色残差を計算します.
+     行ごとに3 × 幅のブロックでまとめて計算し、行をスレッドプールで分担します.
+     残差ベクトルは可視画素ごとにRGBの3要素を詰めて並べ、どの画素の残差かはGetPixelIndicesで引けます.
+     L2,1ノルムの場合、残差は r / sqrt(max(|r|, ε)) に重み付けして返すので、
+     残差の二乗和がそのままエネルギーになり、ガウス-ニュートン法の1反復がIRLSの1反復になります.
+     */
+    class PhotometricEnergy
+    {
+    public:
+        PhotometricEnergy();
+        virtual ~PhotometricEnergy();
+        
+        bool    Initialize(PhotometricNormType normType = PHOTOMETRIC_L21);
+        void    Finalize();
+        
+        inline void SetNormType(PhotometricNormType normType)
+        {
+            m_NormType  = normType;
+        }
+        
+        inline PhotometricNormType  GetNormType() const
+        {
+            return m_NormType;
+        }
+        
+        /**
+         @brief L2,1ノルムの重みの下限のセット
+         
+         残差がほぼ0の画素の重みが発散しないように、ノルムをこの値で下から抑えます. デフォルトは1/255です.
+         @param epsilon 下限
+         */
+        inline void SetEpsilon(float epsilon)
+        {
+            m_Epsilon   = epsilon;
+        }
+        
+        /**
+         @brief エネルギーの計算
+         
+         入力画像と合成画像のマスクの積が1の画素について、色残差のノルムの和を返します.
+         @param input       入力画像
+         @param synthesized 合成画像
+         @return エネルギー(画素数で正規化しない和). サイズが違う場合は負の値
+         */
+        double  Evaluate(const FaceImage& input,
+                         const FaceImage& synthesized);
+        
+        /**
+         @brief エネルギーと残差ベクトルの計算
+         @param input       入力画像
+         @param synthesized 合成画像
+         @param residual    出力の残差ベクトル(3 × 可視画素数)
+         @return エネルギー. サイズが違う場合は負の値
+         */
+        double  Evaluate(const FaceImage& input,
+                         const FaceImage& synthesized,
+                         Kosakasakas::KSVectorXf& residual);
+        
+        /**
+         @brief 選んだ画素だけのエネルギーと残差ベクトルの計算
+         
+         PixelSamplerで選んだ画素の残差に重みを掛けて計算します.
+         重みが 可視画素数 / 選択数 なら、戻り値と残差の二乗和は全画素のエネルギーの推定値になります.
+         @param input       入力画像
+         @param synthesized 合成画像
+         @param samples     画素番号(可視画素であること)
+         @param weight      エネルギーの重み(残差にはその平方根を掛けます)
+         @param residual    出力の残差ベクトル(3 × 画素数)
+         @return エネルギー. サイズが違う場合は負の値
+         */
+        double  Evaluate(const FaceImage& input,
+                         const FaceImage& synthesized,
+                         const std::vector<int>& samples,
+                         float weight,
+                         Kosakasakas::KSVectorXf& residual);
+        
+        //! 直前の計算で残差を求めた可視画素数
+        inline int  GetNumVisiblePixels() const
+        {
+            return m_NumVisible;
+        }
+        
+        //! 直前に残差を計算した可視画素の画素番号(残差の3要素ごとに1つ)
+        inline const std::vector<int>&  GetPixelIndices() const
+        {
+            return m_PixelIndices;
+        }
+        
+        /**
+         @brief 直前に残差を計算した可視画素ごとの残差の倍率
+         
+         残差は 倍率 × (合成画像 - 入力画像) です. 倍率にはIRLSの重みと間引きの重みが含まれるので、
+         ヤコビアンの行にも同じ倍率を掛けてください.
+         */
+        inline const Kosakasakas::KSVectorXf&   GetResidualScales() const
+        {
+            return m_ResidualScales;
+        }
+    
+    private:
+        /**
+         @brief 行ごとの残差の計算
+         
+         行ごとの可視画素数とワーカーごとのエネルギーを集計します.
+         @param input           入力画像
+         @param synthesized     合成画像
+         @param storeResidual   重み付けした残差、倍率、可視マスクをm_Scratch、m_ScaleScratch、m_Visibleに書き込むかどうか
+         @return エネルギー
+         */
+        double  EvaluateRows(const FaceImage& input,
+                             const FaceImage& synthesized,
+                             bool storeResidual);
+    
+    private:
+        //! ノルムの種類
+        PhotometricNormType m_NormType;
+        //! L2,1ノルムの重みの下限
+        float               m_Epsilon;
+        //! 全画素分の重み付き残差(3 × 画素数)
+        FaceImage::ColorArray   m_Scratch;
+        //! 全画素分の残差の倍率
+        FaceImage::MaskArray    m_ScaleScratch;
+        //! 全画素分の可視マスク
+        FaceImage::MaskArray    m_Visible;
+        //! 行ごとの可視画素数
+        std::vector<int>    m_RowCounts;
+        //! 可視画素数
+        int                 m_NumVisible;
+        //! ワーカーごとのエネルギー
+        std::vector<double> m_WorkerEnergy;
+        //! 可視画素の画素番号
+        std::vector<int>    m_PixelIndices;
+        //! 可視画素ごとの残差の倍率
+        Kosakasakas::KSVectorXf m_ResidualScales;
+    };
+}
+
+#endif /* PhotometricEnergy_hpp */
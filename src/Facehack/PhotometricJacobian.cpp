@@ -0,0 +1,265 @@
+//
+//  PhotometricJacobian.cpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/18.
+//
+//
+
+#include "PhotometricJacobian.hpp"
+#include "KSThreadPool.h"
+#include <algorithm>
+
+using namespace Kosakasakas;
+using namespace Facehack;
+using namespace Eigen;
+
+PhotometricJacobian::PhotometricJacobian()
+: m_PixelChunk(64)
+, m_pRasterizer(nullptr)
+, m_pBasis(nullptr)
+, m_pProjection(nullptr)
+, m_pInput(nullptr)
+, m_pSynthesized(nullptr)
+, m_Layout()
+, m_Gamma(Matrix<float, 3, SH_BASIS_NUM>::Zero())
+{}
+
+PhotometricJacobian::~PhotometricJacobian()
+{}
+
+bool    PhotometricJacobian::Initialize()
+{
+    return true;
+}
+
+void    PhotometricJacobian::Finalize()
+{
+    m_pRasterizer   = nullptr;
+    m_pBasis        = nullptr;
+    m_pProjection   = nullptr;
+    m_pInput        = nullptr;
+    m_pSynthesized  = nullptr;
+    m_ChunkJ.clear();
+    m_ChunkJd.clear();
+    m_PartialA.clear();
+    m_PartialB.clear();
+}
+
+bool    PhotometricJacobian::Setup(const FaceRasterizer& rasterizer,
+                                   const MorphableBasis& basis,
+                                   const FaceProjection& projection,
+                                   const FaceImage& input,
+                                   const FaceImage& synthesized,
+                                   const float* pParams,
+                                   const FaceParamLayout& layout)
+{
+    if (input.GetWidth() != synthesized.GetWidth()
+        || input.GetHeight() != synthesized.GetHeight()
+        || rasterizer.GetVertices().cols() != basis.GetNumVertices())
+    {
+        return false;
+    }
+    m_pRasterizer   = &rasterizer;
+    m_pBasis        = &basis;
+    m_pProjection   = &projection;
+    m_pInput        = &input;
+    m_pSynthesized  = &synthesized;
+    m_Layout        = layout;
+    typedef Map<const Matrix<float, 1, SH_BASIS_NUM> > GammaMap;
+    m_Gamma.row(0)  = GammaMap(pParams + layout.gammaR);
+    m_Gamma.row(1)  = GammaMap(pParams + layout.gammaG);
+    m_Gamma.row(2)  = GammaMap(pParams + layout.gammaB);
+    return true;
+}
+
+void    PhotometricJacobian::Compute(const std::vector<int>& pixelIndices,
+                                     const KSVectorXf& scales,
+                                     KSMatrixXf& jacobian)
+{
+    const int num   = static_cast<int>(pixelIndices.size());
+    jacobian.resize(3 * num, m_Layout.total);
+    
+    KSThreadPool& pool  = KSThreadPool::GetDefault();
+    pool.ParallelFor(0, num, m_PixelChunk, [&](int begin, int end, int /*worker*/)
+    {
+        for (int k=begin; k<end; ++k)
+        {
+            ComputePixel(pixelIndices[k], scales(k), jacobian.middleRows<3>(3 * k));
+        }
+    });
+}
+
+void    PhotometricJacobian::Accumulate(const std::vector<int>& pixelIndices,
+                                        const KSVectorXf& scales,
+                                        const KSVectorXf& residual,
+                                        double weight,
+                                        KSMatrixXd& A,
+                                        KSVectorXd& b)
+{
+    const int num   = static_cast<int>(pixelIndices.size());
+    const int cols  = m_Layout.total;
+    KSThreadPool& pool      = KSThreadPool::GetDefault();
+    const int numWorkers    = pool.GetNumWorkers();
+    
+    m_ChunkJ.resize(numWorkers);
+    m_ChunkJd.resize(numWorkers);
+    m_PartialA.resize(numWorkers);
+    m_PartialB.resize(numWorkers);
+    for (int i=0; i<numWorkers; ++i)
+    {
+        m_PartialA[i].setZero(cols, cols);
+        m_PartialB[i].setZero(cols);
+    }
+    
+    pool.ParallelFor(0, num, m_PixelChunk, [&](int begin, int end, int worker)
+    {
+        // チャンク分のヤコビアンだけを作り、doubleに変換して累積する
+        const int count = end - begin;
+        KSMatrixXf& jf  = m_ChunkJ[worker];
+        jf.resize(3 * count, cols);
+        for (int k=0; k<count; ++k)
+        {
+            ComputePixel(pixelIndices[begin + k], scales(begin + k), jf.middleRows<3>(3 * k));
+        }
+        KSMatrixXd& jd  = m_ChunkJd[worker];
+        jd              = jf.cast<double>();
+        m_PartialA[worker].selfadjointView<Lower>().rankUpdate(jd.transpose());
+        m_PartialB[worker].noalias()    += jd.transpose() * residual.segment(3 * begin, 3 * count).cast<double>();
+    });
+    
+    for (int i=1; i<numWorkers; ++i)
+    {
+        m_PartialA[0].triangularView<Lower>()   += m_PartialA[i];
+        m_PartialB[0]   += m_PartialB[i];
+    }
+    m_PartialA[0].triangularView<StrictlyUpper>()   = m_PartialA[0].transpose().eval();
+    A.noalias() += weight * m_PartialA[0];
+    b.noalias() += weight * m_PartialB[0];
+}
+
+void    PhotometricJacobian::AccumulateGradient(const std::vector<int>& pixelIndices,
+                                                const KSVectorXf& scales,
+                                                const KSVectorXf& residual,
+                                                double weight,
+                                                KSVectorXd& b)
+{
+    const int num   = static_cast<int>(pixelIndices.size());
+    const int cols  = m_Layout.total;
+    KSThreadPool& pool      = KSThreadPool::GetDefault();
+    const int numWorkers    = pool.GetNumWorkers();
+    
+    m_ChunkJ.resize(numWorkers);
+    m_PartialB.resize(numWorkers);
+    for (int i=0; i<numWorkers; ++i)
+    {
+        m_PartialB[i].setZero(cols);
+    }
+    
+    pool.ParallelFor(0, num, m_PixelChunk, [&](int begin, int end, int worker)
+    {
+        const int count = end - begin;
+        KSMatrixXf& jf  = m_ChunkJ[worker];
+        jf.resize(3 * count, cols);
+        for (int k=0; k<count; ++k)
+        {
+            ComputePixel(pixelIndices[begin + k], scales(begin + k), jf.middleRows<3>(3 * k));
+        }
+        m_PartialB[worker].noalias()    += (jf.transpose() * residual.segment(3 * begin, 3 * count)).cast<double>();
+    });
+    
+    for (int i=1; i<numWorkers; ++i)
+    {
+        m_PartialB[0]   += m_PartialB[i];
+    }
+    b.noalias() += weight * m_PartialB[0];
+}
+
+void    PhotometricJacobian::ComputePixel(int pixel, float scale, PixelRows rows) const
+{
+    rows.setZero();
+    const int t = m_pSynthesized->GetTriangleIds()(pixel);
+    if (t < 0)
+    {
+        return;
+    }
+    const Vector3f bary = m_pSynthesized->GetBarycentrics().col(pixel).matrix();
+    const Vector3i tri  = m_pBasis->GetTriangles().col(t);
+    const FaceRasterizer::VertexArray& vertices = m_pRasterizer->GetVertices();
+    const Vector3f point    = bary(0) * vertices.col(tri(0))
+                            + bary(1) * vertices.col(tri(1))
+                            + bary(2) * vertices.col(tri(2));
+    
+    Vector2f uv;
+    FaceProjection::PointJacobian dPoint, dTrans;
+    FaceProjection::QuatJacobian dQuat;
+    if (!m_pProjection->ProjectWithJacobian(point, uv, dPoint, dQuat, dTrans))
+    {
+        return;
+    }
+    
+    // 面上の点が動くと、その点に対応する入力画像の色が変わる
+    const int width = m_pInput->GetWidth();
+    const Matrix<float, 3, 2> gradient  = -scale * InputGradient(pixel % width, pixel / width);
+    const Matrix3f dGeometry            = gradient * dPoint;
+    
+    const KSMatrixXf& shapeBasis    = m_pBasis->GetShapeBasis();
+    const KSMatrixXf& exprBasis     = m_pBasis->GetExpressionBasis();
+    const KSMatrixXf& albedoBasis   = m_pBasis->GetAlbedoBasis();
+    const int numAlpha  = static_cast<int>(shapeBasis.cols());
+    const int numDelta  = static_cast<int>(exprBasis.cols());
+    const int numBeta   = static_cast<int>(albedoBasis.cols());
+    const FaceRasterizer::VertexArray& albedo   = m_pRasterizer->GetAlbedo();
+    const FaceRasterizer::VertexArray& shading  = m_pRasterizer->GetShading();
+    const FaceRasterizer::VertexArray& normals  = m_pRasterizer->GetNormals();
+    const FaceRasterizer::VertexArray& cameraNormals    = m_pRasterizer->GetCameraNormals();
+    const FaceRasterizer::SHBasisArray& shBasis         = m_pRasterizer->GetSHBasis();
+    const Matrix3f& cameraRotation  = m_pProjection->GetCameraRotation();
+    
+    Matrix<float, 3, 4> dShadingQuat    = Matrix<float, 3, 4>::Zero();
+    SphericalHarmonics::BasisJacobian dh;
+    for (int k=0; k<3; ++k)
+    {
+        const int row       = 3 * tri(k);
+        const float b       = bary(k);
+        const Matrix3f dk   = b * dGeometry;
+        rows.middleCols(m_Layout.alpha, numAlpha).noalias()    += dk * shapeBasis.middleRows<3>(row);
+        rows.middleCols(m_Layout.delta, numDelta).noalias()    += dk * exprBasis.middleRows<3>(row);
+        
+        // 色 = アルベド × (γ・H(n))
+        const Vector3f weightedShading  = scale * b * shading.col(tri(k));
+        const Vector3f weightedAlbedo   = scale * b * albedo.col(tri(k));
+        rows.middleCols(m_Layout.beta, numBeta).noalias()  += weightedShading.asDiagonal() * albedoBasis.middleRows<3>(row);
+        rows.block<1, SH_BASIS_NUM>(0, m_Layout.gammaR)    += weightedAlbedo(0) * shBasis.col(tri(k)).transpose();
+        rows.block<1, SH_BASIS_NUM>(1, m_Layout.gammaG)    += weightedAlbedo(1) * shBasis.col(tri(k)).transpose();
+        rows.block<1, SH_BASIS_NUM>(2, m_Layout.gammaB)    += weightedAlbedo(2) * shBasis.col(tri(k)).transpose();
+        
+        // 回転でカメラ座標の法線が変わることによる陰影の変化
+        SphericalHarmonics::EvaluateJacobian(cameraNormals.col(tri(k)), dh);
+        const Matrix<float, 3, 4> dNormal   = cameraRotation * m_pProjection->RotationJacobian(normals.col(tri(k)));
+        dShadingQuat.noalias()  += weightedAlbedo.asDiagonal() * (m_Gamma * dh) * dNormal;
+    }
+    
+    rows.block<3, 4>(0, m_Layout.faceQuat)  = gradient * dQuat + dShadingQuat;
+    rows.block<3, 3>(0, m_Layout.faceTrans) = gradient * dTrans;
+    const Matrix<float, 3, 2> dIntrinsics   = gradient * m_pProjection->GetIntrinsicsJacobian(uv);
+    rows.col(m_Layout.camFov)       = dIntrinsics.col(0);
+    rows.col(m_Layout.camAspect)    = dIntrinsics.col(1);
+}
+
+Matrix<float, 3, 2> PhotometricJacobian::InputGradient(int x, int y) const
+{
+    const int width     = m_pInput->GetWidth();
+    const int height    = m_pInput->GetHeight();
+    const FaceImage::ColorArray& color  = m_pInput->GetColor();
+    
+    // 端では片側差分にする
+    const int x0    = std::max(x - 1, 0);
+    const int x1    = std::min(x + 1, width - 1);
+    const int y0    = std::max(y - 1, 0);
+    const int y1    = std::min(y + 1, height - 1);
+    Matrix<float, 3, 2> gradient;
+    gradient.col(0) = (color.col(y * width + x1) - color.col(y * width + x0)).matrix() / static_cast<float>(std::max(x1 - x0, 1));
+    gradient.col(1) = (color.col(y1 * width + x) - color.col(y0 * width + x)).matrix() / static_cast<float>(std::max(y1 - y0, 1));
+    return gradient;
+}
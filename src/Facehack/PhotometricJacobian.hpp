@@ -0,0 +1,162 @@
+//
+//  PhotometricJacobian.hpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/18.
+//
+//
+
+#ifndef PhotometricJacobian_hpp
+#define PhotometricJacobian_hpp
+
+#include "KSMath.h"
+#include "FaceImage.hpp"
+#include "FaceProjection.hpp"
+#include "FaceRasterizer.hpp"
+#include "MorphableBasis.hpp"
+#include <vector>
+
+namespace Facehack {
+    
+    /**
+     @brief 写真的整合性の項の画素ごとの解析的なヤコビアン
+     
+     FaceRasterizerが書き込んだ三角形番号と重心座標から、画素の残差 r = 合成画像の色 - 入力画像の色 の
+     パラメータに関する微分を組み立てます. 重心座標は固定して、画素に描画された面上の点を追いかけます.
+     - アルベドβ、照明γ: 頂点の色 アルベド × 陰影 の微分を重心座標で補間します.
+     - 形状α、表情δ、平行移動、画角: 面上の点が画像上で動くので、入力画像の勾配 × 投影の微分 × 頂点の基底 です.
+     - 回転: 上の項に、カメラ座標の法線が回ることによる陰影の微分を加えます.
+     法線のα、δに関する微分は省略します(陰影への寄与は入力画像の勾配の項より十分小さいため).
+     カメラ位置と注視点の列は0です.
+     画素をチャンクに分けてスレッドプールで並列に計算し、1画素の3行はEigenの固定サイズの演算でまとめて計算します.
+     */
+    class PhotometricJacobian
+    {
+    public:
+        PhotometricJacobian();
+        virtual ~PhotometricJacobian();
+        
+        bool    Initialize();
+        void    Finalize();
+        
+        //! 1チャンクあたりの画素数のセット
+        inline void SetPixelChunk(int pixelChunk)
+        {
+            m_PixelChunk    = std::max(pixelChunk, 1);
+        }
+        
+        /**
+         @brief 線形化する点のセット
+         
+         引数は計算が終わるまで保持しておいてください.
+         @param rasterizer  合成画像を描画したラスタライザ
+         @param basis       顔の線形モデル
+         @param projection  描画に使った投影
+         @param input       入力画像(合成画像と同じ解像度)
+         @param synthesized 合成画像
+         @param pParams     パラメータ配列
+         @param layout      パラメータ配列のレイアウト
+         @return セットの成否
+         */
+        bool    Setup(const FaceRasterizer& rasterizer,
+                      const MorphableBasis& basis,
+                      const FaceProjection& projection,
+                      const FaceImage& input,
+                      const FaceImage& synthesized,
+                      const float* pParams,
+                      const FaceParamLayout& layout);
+        
+        /**
+         @brief ヤコビアンの計算
+         @param pixelIndices    画素番号(PhotometricEnergy::GetPixelIndices)
+         @param scales          画素ごとの残差の倍率(PhotometricEnergy::GetResidualScales)
+         @param jacobian        出力のヤコビアン(3 × 画素数, layout.total)
+         */
+        void    Compute(const std::vector<int>& pixelIndices,
+                        const Kosakasakas::KSVectorXf& scales,
+                        Kosakasakas::KSMatrixXf& jacobian);
+        
+        /**
+         @brief 正規方程式への足し込み
+         
+         ヤコビアン全体は作らず、チャンクごとに作ったヤコビアンからA += weight × J^tJ、b += weight × J^tyをdoubleで累積します.
+         @param pixelIndices    画素番号
+         @param scales          画素ごとの残差の倍率
+         @param residual        残差ベクトル(PhotometricEnergy::Evaluateの出力)
+         @param weight          項の重み
+         @param A               係数行列(layout.total × layout.total)
+         @param b               右辺ベクトル(layout.total)
+         */
+        void    Accumulate(const std::vector<int>& pixelIndices,
+                           const Kosakasakas::KSVectorXf& scales,
+                           const Kosakasakas::KSVectorXf& residual,
+                           double weight,
+                           Kosakasakas::KSMatrixXd& A,
+                           Kosakasakas::KSVectorXd& b);
+    
+        /**
+         @brief 右辺だけの足し込み
+         
+         J^tJを作らず b += weight × J^ty だけを累積します. 係数行列の分解を使い回す反復で使います.
+         画素ごとのヤコビアンの計算は同じですが、パラメータ数の2乗に比例するランク更新をしません.
+         @param pixelIndices    画素番号
+         @param scales          画素ごとの残差の倍率
+         @param residual        残差ベクトル
+         @param weight          項の重み
+         @param b               右辺ベクトル(layout.total)
+         */
+        void    AccumulateGradient(const std::vector<int>& pixelIndices,
+                                   const Kosakasakas::KSVectorXf& scales,
+                                   const Kosakasakas::KSVectorXf& residual,
+                                   double weight,
+                                   Kosakasakas::KSVectorXd& b);
+    
+    private:
+        //! 1画素分のヤコビアンの行
+        typedef Eigen::Block<Kosakasakas::KSMatrixXf, 3, Eigen::Dynamic, false>   PixelRows;
+        
+        /**
+         @brief 1画素分のヤコビアンの計算
+         @param pixel   画素番号
+         @param scale   残差の倍率
+         @param rows    出力の3行
+         */
+        void    ComputePixel(int pixel, float scale, PixelRows rows) const;
+        
+        /**
+         @brief 入力画像の勾配(中心差分)
+         @param x   画素のx
+         @param y   画素のy
+         @return RGBの画素座標に関する微分(3 × 2)
+         */
+        Eigen::Matrix<float, 3, 2>  InputGradient(int x, int y) const;
+    
+    private:
+        //! 1チャンクあたりの画素数
+        int     m_PixelChunk;
+        //! ラスタライザ
+        const FaceRasterizer*   m_pRasterizer;
+        //! 顔の線形モデル
+        const MorphableBasis*   m_pBasis;
+        //! 投影
+        const FaceProjection*   m_pProjection;
+        //! 入力画像
+        const FaceImage*        m_pInput;
+        //! 合成画像
+        const FaceImage*        m_pSynthesized;
+        //! パラメータ配列のレイアウト
+        FaceParamLayout         m_Layout;
+        //! RGBの照明の係数(3 × SH_BASIS_NUM)
+        Eigen::Matrix<float, 3, SH_BASIS_NUM>   m_Gamma;
+        //! ワーカーごとのチャンクのヤコビアン
+        std::vector<Kosakasakas::KSMatrixXf>    m_ChunkJ;
+        //! ワーカーごとのdoubleに変換したチャンクのヤコビアン
+        std::vector<Kosakasakas::KSMatrixXd>    m_ChunkJd;
+        //! ワーカーごとのJ^tJの部分和
+        std::vector<Kosakasakas::KSMatrixXd>    m_PartialA;
+        //! ワーカーごとのJ^tyの部分和
+        std::vector<Kosakasakas::KSVectorXd>    m_PartialB;
+    };
+}
+
+#endif /* PhotometricJacobian_hpp */
@@ -0,0 +1,117 @@
+//
+//  PixelSampler.cpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/17.
+//
+//
+
+#include "PixelSampler.hpp"
+#include <algorithm>
+
+using namespace Facehack;
+
+PixelSampler::PixelSampler()
+: m_NumSamples(0)
+, m_Random(0)
+, m_Weight(1.0f)
+{}
+
+PixelSampler::~PixelSampler()
+{}
+
+bool    PixelSampler::Initialize(int numSamples, unsigned int seed)
+{
+    m_NumSamples    = numSamples;
+    SetSeed(seed);
+    return true;
+}
+
+void    PixelSampler::Finalize()
+{
+    m_Candidates.clear();
+    m_TriangleCounts.clear();
+    m_Samples.clear();
+}
+
+void    PixelSampler::SetSeed(unsigned int seed)
+{
+    m_Random.seed(seed);
+}
+
+bool    PixelSampler::Sample(const FaceImage& input, const FaceImage& synthesized)
+{
+    const int num   = synthesized.GetNumPixels();
+    if (num != input.GetNumPixels())
+    {
+        return false;
+    }
+    
+    const FaceImage::MaskArray& inMask      = input.GetMask();
+    const FaceImage::MaskArray& synMask     = synthesized.GetMask();
+    const FaceImage::IndexArray& triangles  = synthesized.GetTriangleIds();
+    const bool hasTriangles = (triangles.size() == num && num > 0 && triangles.maxCoeff() >= 0);
+    
+    // 可視画素を三角形番号の順に並べる(三角形番号が無い場合は走査順のまま)
+    m_Candidates.clear();
+    if (hasTriangles)
+    {
+        m_TriangleCounts.assign(triangles.maxCoeff() + 2, 0);
+        for (int i=0; i<num; ++i)
+        {
+            if (synMask(i) > 0.0f && inMask(i) > 0.0f)
+            {
+                ++m_TriangleCounts[triangles(i) + 1];
+            }
+        }
+        int total   = 0;
+        for (auto& count : m_TriangleCounts)
+        {
+            const int c = count;
+            count   = total;
+            total   += c;
+        }
+        m_Candidates.resize(total);
+        for (int i=0; i<num; ++i)
+        {
+            if (synMask(i) > 0.0f && inMask(i) > 0.0f)
+            {
+                m_Candidates[m_TriangleCounts[triangles(i) + 1]++] = i;
+            }
+        }
+    }
+    else
+    {
+        for (int i=0; i<num; ++i)
+        {
+            if (synMask(i) > 0.0f && inMask(i) > 0.0f)
+            {
+                m_Candidates.push_back(i);
+            }
+        }
+    }
+    
+    // 間引かない場合は全ての可視画素を使う
+    const int numCandidates = static_cast<int>(m_Candidates.size());
+    if (m_NumSamples <= 0 || numCandidates <= m_NumSamples)
+    {
+        m_Samples   = m_Candidates;
+        m_Weight    = 1.0f;
+        return true;
+    }
+    
+    // 等間隔の区間ごとに1画素を選ぶ
+    const double stride = static_cast<double>(numCandidates) / m_NumSamples;
+    std::uniform_real_distribution<double> jitter(0.0, 1.0);
+    m_Samples.resize(m_NumSamples);
+    for (int j=0; j<m_NumSamples; ++j)
+    {
+        const int k = std::min(static_cast<int>((j + jitter(m_Random)) * stride), numCandidates - 1);
+        m_Samples[j]    = m_Candidates[k];
+    }
+    
+    // 残差のメモリアクセスが連続するよう走査順に戻す
+    std::sort(m_Samples.begin(), m_Samples.end());
+    m_Weight    = static_cast<float>(stride);
+    return true;
+}
@@ -0,0 +1,101 @@
+//
+//  PixelSampler.hpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/17.
+//
+//
+
+#ifndef PixelSampler_hpp
+#define PixelSampler_hpp
+
+#include "FaceImage.hpp"
+#include <random>
+#include <vector>
+
+namespace Facehack {
+    
+    /**
+     @brief 写真的整合性の項で使う画素の確率的な間引きクラス
+     
+     反復ごとに可視画素から指定数の画素を選び、残差とヤコビアンの計算をその画素だけに絞ります.
+     可視画素を三角形番号の順に並べ、等間隔の区間ごとに1画素をランダムに選ぶ(ジッター付き系統抽出)ので、
+     各三角形からはその面積に比例した数の画素が選ばれます.
+     選ばれた画素の残差に 可視画素数 / 選択数 の重みを掛けると、エネルギーは全画素の和の不偏推定になります.
+     乱数はシードから決まるので、同じシード・同じ入力なら同じ画素列になります.
+     */
+    class PixelSampler
+    {
+    public:
+        PixelSampler();
+        virtual ~PixelSampler();
+        
+        /**
+         @brief 初期化
+         @param numSamples  1回に選ぶ画素数(0以下の場合は間引かない)
+         @param seed        乱数のシード
+         @return 初期化の成否
+         */
+        bool    Initialize(int numSamples, unsigned int seed = 0);
+        void    Finalize();
+        
+        inline void SetNumSamples(int numSamples)
+        {
+            m_NumSamples    = numSamples;
+        }
+        
+        inline int  GetNumSamples() const
+        {
+            return m_NumSamples;
+        }
+        
+        //! 乱数のシードのセット(乱数列は先頭からやり直します)
+        void    SetSeed(unsigned int seed);
+        
+        /**
+         @brief 画素の選択
+         
+         入力画像と合成画像のマスクの積が1の画素から選びます. 呼ぶたびに別の画素列になります.
+         合成画像に三角形番号が無い(全画素-1の)場合は走査順で層別します.
+         可視画素数が選択数以下の場合は全ての可視画素を重み1で選びます.
+         @param input       入力画像
+         @param synthesized 合成画像
+         @return 選択の成否(サイズが違う場合は失敗)
+         */
+        bool    Sample(const FaceImage& input, const FaceImage& synthesized);
+        
+        //! 選んだ画素の画素番号(走査順)
+        inline const std::vector<int>&  GetSamples() const
+        {
+            return m_Samples;
+        }
+        
+        //! 選んだ画素の残差の重み(可視画素数 / 選択数)
+        inline float    GetWeight() const
+        {
+            return m_Weight;
+        }
+        
+        //! 直前の選択での可視画素数
+        inline int  GetNumVisiblePixels() const
+        {
+            return static_cast<int>(m_Candidates.size());
+        }
+    
+    private:
+        //! 1回に選ぶ画素数
+        int                 m_NumSamples;
+        //! 乱数生成器
+        std::mt19937        m_Random;
+        //! 三角形番号順に並べた可視画素
+        std::vector<int>    m_Candidates;
+        //! 三角形ごとの可視画素数(計数ソート用)
+        std::vector<int>    m_TriangleCounts;
+        //! 選んだ画素
+        std::vector<int>    m_Samples;
+        //! 選んだ画素の重み
+        float               m_Weight;
+    };
+}
+
+#endif /* PixelSampler_hpp */
@@ -0,0 +1,44 @@
+//
+//  SphericalHarmonics.cpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/18.
+//
+//
+
+#include "SphericalHarmonics.hpp"
+
+using namespace Facehack;
+using namespace Eigen;
+
+void    SphericalHarmonics::Evaluate(const Vector3f& n, BasisVector& h)
+{
+    const float x   = n.x();
+    const float y   = n.y();
+    const float z   = n.z();
+    h << 1.0f,
+         y,
+         z,
+         x,
+         x * y,
+         y * z,
+         3.0f * z * z - 1.0f,
+         x * z,
+         x * x - y * y;
+}
+
+void    SphericalHarmonics::EvaluateJacobian(const Vector3f& n, BasisJacobian& dh)
+{
+    const float x   = n.x();
+    const float y   = n.y();
+    const float z   = n.z();
+    dh << 0.0f,         0.0f,           0.0f,
+          0.0f,         1.0f,           0.0f,
+          0.0f,         0.0f,           1.0f,
+          1.0f,         0.0f,           0.0f,
+          y,            x,              0.0f,
+          0.0f,         z,              y,
+          0.0f,         0.0f,           6.0f * z,
+          z,            0.0f,           x,
+          2.0f * x,     -2.0f * y,      0.0f;
+}
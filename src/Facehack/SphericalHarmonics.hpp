@@ -0,0 +1,50 @@
+//
+//  SphericalHarmonics.hpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/18.
+//
+//
+
+#ifndef SphericalHarmonics_hpp
+#define SphericalHarmonics_hpp
+
+#include "KSMath.h"
+
+namespace Facehack {
+    
+    //! 照明に使う球面調和関数の基底の数(2次まで)
+    const int SH_BASIS_NUM = 9;
+    
+    /**
+     @brief 球面調和関数による照明の基底
+     
+     単位法線nに対して、2次までの(正規化定数を係数に含めた)基底
+     1, y, z, x, xy, yz, 3z^2 - 1, xz, x^2 - y^2 を計算します.
+     チャンネルごとの照明は γ・H(n) で、γは各チャンネルの係数配列の先頭SH_BASIS_NUM個です.
+     */
+    class SphericalHarmonics
+    {
+    public:
+        //! 基底ベクトル
+        typedef Eigen::Matrix<float, SH_BASIS_NUM, 1>   BasisVector;
+        //! 基底の法線に関する微分
+        typedef Eigen::Matrix<float, SH_BASIS_NUM, 3>   BasisJacobian;
+        
+        /**
+         @brief 基底の計算
+         @param n   単位法線
+         @param h   出力の基底
+         */
+        static void Evaluate(const Eigen::Vector3f& n, BasisVector& h);
+        
+        /**
+         @brief 基底の法線に関する微分の計算
+         @param n   単位法線
+         @param dh  出力の微分
+         */
+        static void EvaluateJacobian(const Eigen::Vector3f& n, BasisJacobian& dh);
+    };
+}
+
+#endif /* SphericalHarmonics_hpp */
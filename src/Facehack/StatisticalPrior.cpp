@@ -0,0 +1,126 @@
+//
+//  StatisticalPrior.cpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/18.
+//
+//
+
+#include "StatisticalPrior.hpp"
+#include <cmath>
+
+using namespace Kosakasakas;
+using namespace Facehack;
+using namespace Eigen;
+
+StatisticalPrior::StatisticalPrior()
+{}
+
+StatisticalPrior::~StatisticalPrior()
+{}
+
+bool    StatisticalPrior::Initialize(const FaceParamLayout& layout,
+                                     const float* pAlphaVariance,
+                                     int numAlpha,
+                                     const float* pBetaVariance,
+                                     int numBeta,
+                                     const float* pDeltaVariance,
+                                     int numDelta,
+                                     float weight)
+{
+    if (weight < 0.0f)
+    {
+        return false;
+    }
+    m_Diagonal.setZero(layout.total);
+    if (!SetBlock(layout.alpha, pAlphaVariance, numAlpha, weight)
+        || !SetBlock(layout.beta, pBetaVariance, numBeta, weight)
+        || !SetBlock(layout.delta, pDeltaVariance, numDelta, weight))
+    {
+        Finalize();
+        return false;
+    }
+    return true;
+}
+
+void    StatisticalPrior::Finalize()
+{
+    m_Diagonal.resize(0);
+}
+
+double  StatisticalPrior::Evaluate(const float* pParams) const
+{
+    const int num   = static_cast<int>(m_Diagonal.size());
+    if (num == 0)
+    {
+        return 0.0;
+    }
+    const Map<const KSVectorXf> p(pParams, num);
+    return m_Diagonal.cast<double>().dot(p.cast<double>().cwiseAbs2());
+}
+
+void    StatisticalPrior::Accumulate(const float* pParams,
+                                     KSMatrixXd& A,
+                                     KSVectorXd& b) const
+{
+    const int num   = static_cast<int>(m_Diagonal.size());
+    if (num == 0)
+    {
+        return;
+    }
+    const Map<const KSVectorXf> p(pParams, num);
+    A.diagonal()    += m_Diagonal.cast<double>();
+    b               += m_Diagonal.cwiseProduct(p).cast<double>();
+}
+
+void    StatisticalPrior::AccumulateGradient(const float* pParams,
+                                             KSVectorXd& b) const
+{
+    const int num   = static_cast<int>(m_Diagonal.size());
+    if (num == 0)
+    {
+        return;
+    }
+    const Map<const KSVectorXf> p(pParams, num);
+    b   += m_Diagonal.cwiseProduct(p).cast<double>();
+}
+
+void    StatisticalPrior::Accumulate(const float* pParams,
+                                     const std::vector<int>& activeParams,
+                                     KSMatrixXd& A,
+                                     KSVectorXd& b) const
+{
+    if (m_Diagonal.size() == 0)
+    {
+        return;
+    }
+    const int num   = static_cast<int>(activeParams.size());
+    for (int k=0; k<num; ++k)
+    {
+        const int index = activeParams[k];
+        const double d  = m_Diagonal(index);
+        A(k, k)         += d;
+        b(k)            += d * pParams[index];
+    }
+}
+
+bool    StatisticalPrior::SetBlock(int offset, const float* pVariance, int num, float weight)
+{
+    if (num <= 0)
+    {
+        return true;
+    }
+    if (!pVariance || offset < 0 || offset + num > m_Diagonal.size())
+    {
+        return false;
+    }
+    for (int i=0; i<num; ++i)
+    {
+        if (!(pVariance[i] > 0.0f) || !std::isfinite(pVariance[i]))
+        {
+            return false;
+        }
+        m_Diagonal(offset + i)  = weight / pVariance[i];
+    }
+    return true;
+}
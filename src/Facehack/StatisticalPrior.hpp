@@ -0,0 +1,121 @@
+//
+//  StatisticalPrior.hpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/18.
+//
+//
+
+#ifndef StatisticalPrior_hpp
+#define StatisticalPrior_hpp
+
+#include "KSMath.h"
+#include "FaceParamLayout.hpp"
+#include <vector>
+
+namespace Facehack {
+    
+    /**
+     @brief 統計的正則化(Statistical Regularization)の計算クラス
+     
+     形状α、アルベドβ、表情δの係数に E = W_reg × Σ p_i^2 / σ_i^2 の事前分布をかけます.
+     この項のヤコビアンは対角なので、残差の行としてヤコビアンに積まず、
+     対角成分 d_i = W_reg / σ_i^2 をJ^tJの対角とJ^tyに直接足し込みます.
+     計算量はパラメータ数に比例し、画素数やランドマーク数には依存しません.
+     分散は係数と同じ単位で渡してください(標準偏差を掛けた基底の係数なら全て1です).
+     */
+    class StatisticalPrior
+    {
+    public:
+        StatisticalPrior();
+        virtual ~StatisticalPrior();
+        
+        /**
+         @brief 初期化
+         @param layout          パラメータ配列のレイアウト
+         @param pAlphaVariance  形状の係数の分散
+         @param numAlpha        形状の係数の数
+         @param pBetaVariance   アルベドの係数の分散
+         @param numBeta         アルベドの係数の数
+         @param pDeltaVariance  表情の係数の分散
+         @param numDelta        表情の係数の数
+         @param weight          項の重みW_reg
+         @return 初期化の成否(分散が正でない場合は失敗)
+         */
+        bool    Initialize(const FaceParamLayout& layout,
+                           const float* pAlphaVariance,
+                           int numAlpha,
+                           const float* pBetaVariance,
+                           int numBeta,
+                           const float* pDeltaVariance,
+                           int numDelta,
+                           float weight);
+        void    Finalize();
+        
+        /**
+         @brief エネルギーの計算
+         @param pParams パラメータ配列
+         @return エネルギー(重みを含む)
+         */
+        double  Evaluate(const float* pParams) const;
+        
+        /**
+         @brief 正規方程式への足し込み
+         
+         A = J^tJ、b = J^tyの形の正規方程式に、A_ii += d_i、b_i += d_i × p_i を足し込みます.
+         @param pParams パラメータ配列
+         @param A       係数行列(パラメータ数 × パラメータ数)
+         @param b       右辺ベクトル(パラメータ数)
+         */
+        void    Accumulate(const float* pParams,
+                           Kosakasakas::KSMatrixXd& A,
+                           Kosakasakas::KSVectorXd& b) const;
+        
+        /**
+         @brief 右辺だけの足し込み
+         
+         係数行列を作り直さない反復(前のフレームの分解を使う場合など)で、b_i += d_i × p_i だけを足し込みます.
+         @param pParams パラメータ配列
+         @param b       右辺ベクトル(パラメータ数)
+         */
+        void    AccumulateGradient(const float* pParams,
+                                   Kosakasakas::KSVectorXd& b) const;
+        
+        /**
+         @brief 一部のパラメータだけの正規方程式への足し込み
+         
+         固定するパラメータを除いた縮小した正規方程式に使います.
+         @param pParams         パラメータ配列
+         @param activeParams    正規方程式のk番目の未知数に対応するパラメータ番号
+         @param A               係数行列(未知数 × 未知数)
+         @param b               右辺ベクトル(未知数)
+         */
+        void    Accumulate(const float* pParams,
+                           const std::vector<int>& activeParams,
+                           Kosakasakas::KSMatrixXd& A,
+                           Kosakasakas::KSVectorXd& b) const;
+        
+        //! パラメータごとの対角成分d_i(正則化しないパラメータは0)
+        inline const Kosakasakas::KSVectorXf&   GetDiagonal() const
+        {
+            return m_Diagonal;
+        }
+    
+    private:
+        /**
+         @brief 1ブロック分の対角成分のセット
+         @param offset      パラメータ配列での先頭
+         @param pVariance   分散
+         @param num         係数の数
+         @param weight      項の重み
+         @return セットの成否
+         */
+        bool    SetBlock(int offset, const float* pVariance, int num, float weight);
+    
+    private:
+        //! パラメータごとの対角成分
+        Kosakasakas::KSVectorXf m_Diagonal;
+    };
+}
+
+#endif /* StatisticalPrior_hpp */
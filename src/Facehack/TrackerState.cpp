@@ -0,0 +1,153 @@
+//
+//  TrackerState.cpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/18.
+//
+//
+
+#include "TrackerState.hpp"
+#include <eigen3/Eigen/Geometry>
+
+using namespace Kosakasakas;
+using namespace Facehack;
+using namespace Eigen;
+
+TrackerState::TrackerState()
+: m_Layout()
+, m_NumDelta(0)
+, m_VelocityDamping(0.8f)
+, m_NumFrames(0)
+, m_Damping(0.0)
+{}
+
+TrackerState::~TrackerState()
+{}
+
+bool    TrackerState::Initialize(const FaceParamLayout& layout, int numDelta)
+{
+    if (layout.total <= 0 || numDelta < 0 || layout.delta + numDelta > layout.total)
+    {
+        return false;
+    }
+    m_Layout    = layout;
+    m_NumDelta  = numDelta;
+    Reset();
+    return true;
+}
+
+void    TrackerState::Finalize()
+{
+    Reset();
+    m_Previous.resize(0);
+    m_SecondPrevious.resize(0);
+}
+
+void    TrackerState::Reset()
+{
+    m_NumFrames = 0;
+    m_Damping   = 0.0;
+    ClearFactorizations();
+}
+
+bool    TrackerState::Predict(float* pParams) const
+{
+    if (m_NumFrames == 0)
+    {
+        return false;
+    }
+    const int quat  = m_Layout.faceQuat;
+    const int trans = m_Layout.faceTrans;
+    const int delta = m_Layout.delta;
+    Map<KSVectorXf> params(pParams, m_Layout.total);
+    params.segment<4>(quat)                 = m_Previous.segment<4>(quat);
+    params.segment<3>(trans)                = m_Previous.segment<3>(trans);
+    params.segment(delta, m_NumDelta)       = m_Previous.segment(delta, m_NumDelta);
+    if (m_NumFrames < 2 || m_VelocityDamping <= 0.0f)
+    {
+        return true;
+    }
+    
+    // 平行移動と表情は差分を足す
+    const float k   = m_VelocityDamping;
+    params.segment<3>(trans)            += k * (m_Previous.segment<3>(trans) - m_SecondPrevious.segment<3>(trans));
+    params.segment(delta, m_NumDelta)   += k * (m_Previous.segment(delta, m_NumDelta) - m_SecondPrevious.segment(delta, m_NumDelta));
+    
+    // 回転は相対回転を縮めて前のフレームの回転に掛ける(Eigenの係数の並びもx, y, z, w)
+    Quaternionf current(m_Previous.segment<4>(quat));
+    Quaternionf last(m_SecondPrevious.segment<4>(quat));
+    if (current.norm() <= 0.0f || last.norm() <= 0.0f)
+    {
+        return true;
+    }
+    current.normalize();
+    last.normalize();
+    const Quaternionf motion    = current * last.conjugate();
+    const Quaternionf predicted = (Quaternionf::Identity().slerp(k, motion) * current).normalized();
+    params.segment<4>(quat)     = predicted.coeffs();
+    return true;
+}
+
+void    TrackerState::Update(const float* pSolved, double damping, bool isNewFrame)
+{
+    const Map<const KSVectorXf> solved(pSolved, m_Layout.total);
+    if (isNewFrame || m_NumFrames == 0)
+    {
+        if (m_NumFrames > 0)
+        {
+            m_SecondPrevious.swap(m_Previous);
+        }
+        m_NumFrames = std::min(m_NumFrames + 1, 2);
+    }
+    m_Previous  = solved;
+    
+    // 回転は前のフレームと同じ半球に揃えておく(qと-qは同じ回転)
+    if (m_NumFrames > 1)
+    {
+        const int quat  = m_Layout.faceQuat;
+        if (m_Previous.segment<4>(quat).dot(m_SecondPrevious.segment<4>(quat)) < 0.0f)
+        {
+            m_Previous.segment<4>(quat) = -m_Previous.segment<4>(quat);
+        }
+    }
+    m_Damping   = damping;
+}
+
+bool    TrackerState::Factorize(int level, const KSMatrixXd& A)
+{
+    if (level < 0)
+    {
+        return false;
+    }
+    if (level >= static_cast<int>(m_Factorizations.size()))
+    {
+        m_Factorizations.resize(level + 1);
+        m_HasFactorization.resize(level + 1, 0);
+    }
+    m_Factorizations[level].compute(A);
+    m_HasFactorization[level]   = (m_Factorizations[level].info() == Success);
+    return m_HasFactorization[level] != 0;
+}
+
+bool    TrackerState::HasFactorization(int level, int size) const
+{
+    return level >= 0
+        && level < static_cast<int>(m_HasFactorization.size())
+        && m_HasFactorization[level]
+        && m_Factorizations[level].rows() == size;
+}
+
+bool    TrackerState::Solve(int level, const KSVectorXd& b, KSVectorXd& x) const
+{
+    if (!HasFactorization(level, static_cast<int>(b.size())))
+    {
+        return false;
+    }
+    x   = m_Factorizations[level].solve(b);
+    return x.allFinite();
+}
+
+void    TrackerState::ClearFactorizations()
+{
+    m_HasFactorization.assign(m_HasFactorization.size(), 0);
+}
@@ -0,0 +1,146 @@
+//
+//  TrackerState.hpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/18.
+//
+//
+
+#ifndef TrackerState_hpp
+#define TrackerState_hpp
+
+#include "KSMath.h"
+#include "FaceParamLayout.hpp"
+#include <eigen3/Eigen/Cholesky>
+#include <vector>
+
+namespace Facehack {
+    
+    /**
+     @brief フレームをまたいで引き継ぐ追跡の状態
+     
+     直前の2フレームの解から等速度モデルで次のフレームの初期値を予測します.
+     予測するのは顔の回転、平行移動、表情δで、それ以外のパラメータは現在の値(前のフレームの解)のままです.
+     速度には減衰の係数をかけて、止まった顔が行き過ぎないようにします.
+     回転は前のフレームからの相対回転を球面線形補間で縮めて次のフレームに適用します.
+     あわせて、最後に使ったレーベンバーグ・マーカート法の減衰の係数と、
+     ピラミッドのレベルごとに最後に分解した縮小した正規方程式の係数行列(LDLT分解)を保持します.
+     次のフレームの最初の反復では右辺だけを作り直し、この分解で解きます.
+     */
+    class TrackerState
+    {
+    public:
+        //! 係数行列の分解
+        typedef Eigen::LDLT<Kosakasakas::KSMatrixXd>    Factorization;
+        
+        TrackerState();
+        virtual ~TrackerState();
+        
+        /**
+         @brief 初期化
+         @param layout      パラメータ配列のレイアウト
+         @param numDelta    表情の係数の数
+         @return 初期化の成否
+         */
+        bool    Initialize(const FaceParamLayout& layout, int numDelta);
+        void    Finalize();
+        
+        //! 解の履歴と分解を捨てて、次のフレームを最初のフレームとして扱う
+        void    Reset();
+        
+        /**
+         @brief 速度の減衰の係数のセット
+         @param damping 0(予測しない、前のフレームの解のまま)から1(等速度)
+         */
+        inline void SetVelocityDamping(float damping)
+        {
+            m_VelocityDamping   = std::min(std::max(damping, 0.0f), 1.0f);
+        }
+        
+        inline float    GetVelocityDamping() const
+        {
+            return m_VelocityDamping;
+        }
+        
+        //! 記録したフレーム数
+        inline int  GetNumFrames() const
+        {
+            return m_NumFrames;
+        }
+        
+        /**
+         @brief 次のフレームの初期値の予測
+         
+         顔の回転、平行移動、表情δの位置だけを書き換えます.
+         解が2フレーム分無い場合は、記録がある範囲で前のフレームの解をそのまま使います.
+         @param pParams 現在のパラメータ配列(予測値で上書き)
+         @return 予測したかどうか(記録が無い場合はfalseで、配列は変えない)
+         */
+        bool    Predict(float* pParams) const;
+        
+        /**
+         @brief フレームの解の記録
+         @param pSolved     解いたパラメータ配列
+         @param damping     最後に使った減衰の係数
+         @param isNewFrame  新しいフレームの解かどうか(falseの場合は同じフレームの解を置き換える)
+         */
+        void    Update(const float* pSolved, double damping, bool isNewFrame);
+        
+        //! 最後に使った減衰の係数(記録が無い場合はdefaultDamping)
+        inline double   GetDamping(double defaultDamping) const
+        {
+            return (m_NumFrames > 0) ? m_Damping : defaultDamping;
+        }
+        
+        /**
+         @brief 減衰を付けた係数行列の分解と保持
+         @param level   ピラミッドのレベル
+         @param A       減衰を付けた縮小した係数行列
+         @return 分解の成否(失敗した場合はそのレベルの分解を捨てる)
+         */
+        bool    Factorize(int level, const Kosakasakas::KSMatrixXd& A);
+        
+        /**
+         @brief 保持している分解があるかどうか
+         @param level   ピラミッドのレベル
+         @param size    未知数の数
+         */
+        bool    HasFactorization(int level, int size) const;
+        
+        /**
+         @brief 保持している分解で解く
+         @param level   ピラミッドのレベル
+         @param b       右辺
+         @param x       出力の解
+         @return 求解の成否(分解が無いか、大きさが違う場合は失敗)
+         */
+        bool    Solve(int level,
+                      const Kosakasakas::KSVectorXd& b,
+                      Kosakasakas::KSVectorXd& x) const;
+        
+        //! 分解だけを捨てる(固定するパラメータやピラミッドの構成が変わった場合)
+        void    ClearFactorizations();
+    
+    private:
+        //! パラメータ配列のレイアウト
+        FaceParamLayout m_Layout;
+        //! 表情の係数の数
+        int     m_NumDelta;
+        //! 速度の減衰の係数
+        float   m_VelocityDamping;
+        //! 記録したフレーム数
+        int     m_NumFrames;
+        //! 前のフレームの解
+        Kosakasakas::KSVectorXf m_Previous;
+        //! 2つ前のフレームの解
+        Kosakasakas::KSVectorXf m_SecondPrevious;
+        //! 最後に使った減衰の係数
+        double  m_Damping;
+        //! レベルごとの分解
+        std::vector<Factorization>  m_Factorizations;
+        //! レベルごとの分解が使えるかどうか
+        std::vector<char>           m_HasFactorization;
+    };
+}
+
+#endif /* TrackerState_hpp */
@@ -0,0 +1,86 @@
+//
+//  TrackingQuality.hpp
+//  Facehack
+//
+//  Created by Takahiro Kosaka on 2016/07/18.
+//
+//
+
+#ifndef TrackingQuality_hpp
+#define TrackingQuality_hpp
+
+#include <limits>
+
+namespace Facehack {
+    
+    /**
+     @brief 1フレーム分の追跡の品質
+     
+     Solveの最後の解で計算します. 後段の処理はisReliableだけを見て悪いフレームを捨てられます.
+     */
+    struct TrackingQuality
+    {
+        TrackingQuality()
+        : cost(0.0f)
+        , photoCost(0.0f)
+        , landmarkError(0.0f)
+        , visibleRatio(0.0f)
+        , conditionNumber(0.0f)
+        , numIterations(0)
+        , isReinitialized(false)
+        , isReliable(false)
+        {}
+        
+        //! 全ての項を合わせたコスト
+        float   cost;
+        //! 写真的整合性のコスト(可視画素数で正規化)
+        float   photoCost;
+        //! ランドマークの再投影誤差の信頼度で重み付けした二乗平均平方根(入力フレームの画素、観測が無い場合は0)
+        float   landmarkError;
+        //! 描画した顔の画素のうち、入力フレームにも顔の画素がある割合
+        float   visibleRatio;
+        //! 最後に作った縮小したJ^tJを対角でスケーリングした行列の条件数の推定
+        float   conditionNumber;
+        //! 実行した反復数(ランドマークによる初期化し直しの後の反復も含む)
+        int     numIterations;
+        //! ランドマークだけで姿勢を初期化し直したかどうか
+        bool    isReinitialized;
+        //! 全てのしきい値を満たしたかどうか
+        bool    isReliable;
+    };
+    
+    /**
+     @brief 追跡の品質のしきい値
+     
+     どれか1つでも満たさないフレームは信頼できないとみなします.
+     */
+    struct TrackingQualityThresholds
+    {
+        TrackingQualityThresholds()
+        : maxPhotoCost(std::numeric_limits<float>::infinity())
+        , maxLandmarkError(std::numeric_limits<float>::infinity())
+        , minVisibleRatio(0.5f)
+        , maxConditionNumber(1.0e+8f)
+        {}
+        
+        //! 品質がしきい値を全て満たすかどうか
+        inline bool IsReliable(const TrackingQuality& quality) const
+        {
+            return quality.photoCost <= maxPhotoCost
+                && quality.landmarkError <= maxLandmarkError
+                && quality.visibleRatio >= minVisibleRatio
+                && quality.conditionNumber <= maxConditionNumber;
+        }
+        
+        //! 写真的整合性のコストの上限
+        float   maxPhotoCost;
+        //! ランドマークの再投影誤差の上限(入力フレームの画素)
+        float   maxLandmarkError;
+        //! 可視画素の割合の下限
+        float   minVisibleRatio;
+        //! 条件数の上限
+        float   maxConditionNumber;
+    };
+}
+
+#endif /* TrackingQuality_hpp */
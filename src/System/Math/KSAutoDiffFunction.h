@@ -0,0 +1,223 @@
+//
+//  KSAutoDiffFunction.h
+//
+//  自動微分によるヤコビアン計算クラス
+//
+//  Copyright (c) 2016年 Takahiro Kosaka. All rights reserved.
+//  Created by Takahiro Kosaka on 2016/07/15.
+//
+//  This Source Code Form is subject to the terms of the Mozilla
+//  Public License v. 2.0. If a copy of the MPL was not distributed
+//  with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef KSAutoDiffFunction_h
+#define KSAutoDiffFunction_h
+
+#include "KSTypeDef.h"
+#include "KSJet.h"
+#include "KSThreadPool.h"
+#include <eigen3/Eigen/StdVector>
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+namespace Kosakasakas {
+    
+    /**
+     @brief 自動微分によるヤコビアン計算クラス
+     
+     テンプレート化された残差ファンクタから、残差関数とヤコビアン関数(KSFunction)を生成します.
+     ファンクタは次の形式のメンバ関数テンプレートを持つ必要があります.
+        
+        template <typename T> bool operator()(const T* x, T* r) const;
+     
+     xはパラメータ、rは残差(GetNumResiduals個)の出力です. Tにはfloatか KSJet<float, ChunkSize> が渡されます.
+     ヤコビアンはパラメータをChunkSize列ずつのチャンクに分け、チャンクごとに1回ファンクタを評価して求めます.
+     チャンクはパラメータブロックを跨がないように区切るので、ブロックの境界でレーンが無駄になりません.
+     */
+    template <typename Functor, int ChunkSize = 8>
+    class KSAutoDiffFunction
+    {
+    public:
+        //! 二重数の型
+        typedef KSJet<float, ChunkSize> JetType;
+        
+        /**
+         @brief コンストラクタ
+         @param functor         残差ファンクタ
+         @param numResiduals    残差の要素数
+         */
+        KSAutoDiffFunction(const Functor& functor, int numResiduals)
+        : m_Functor(functor)
+        , m_NumResiduals(numResiduals)
+        , m_UseThreadPool(false)
+        {};
+        
+        //! デストラクタ
+        virtual ~KSAutoDiffFunction()
+        {};
+        
+        //! 残差の要素数の取得
+        inline int  GetNumResiduals() const
+        {
+            return m_NumResiduals;
+        }
+        
+        /**
+         @brief パラメータブロックのセット
+         
+         パラメータの要素数を先頭から順にブロックごとに指定します.
+         チャンクはブロックの境界で区切られます. 空の場合はパラメータ全体をひとつのブロックとして扱います.
+         @param blockSizes  パラメータブロックごとの要素数
+         */
+        inline void SetParameterBlocks(const std::vector<int>& blockSizes)
+        {
+            m_BlockSizes    = blockSizes;
+        }
+        
+        /**
+         @brief スレッドプールの使用
+         
+         有効にするとチャンクごとの評価を並列に行います. ファンクタはスレッドセーフである必要があります.
+         @param enable  スレッドプールを使うかどうか
+         */
+        inline void SetUseThreadPool(bool enable)
+        {
+            m_UseThreadPool = enable;
+        }
+        
+        /**
+         @brief 残差の評価
+         @param x   パラメータ
+         @return 残差
+         */
+        KSMatrixXf  EvaluateResidual(const KSMatrixXf& x) const
+        {
+            KSMatrixXf r(m_NumResiduals, 1);
+            if (!m_Functor(x.data(), r.data()))
+            {
+                r.setConstant(std::numeric_limits<float>::quiet_NaN());
+            }
+            return r;
+        }
+        
+        /**
+         @brief ヤコビアンの評価
+         @param x   パラメータ
+         @return 残差のヤコビアン
+         */
+        KSMatrixXf  EvaluateJacobian(const KSMatrixXf& x) const
+        {
+            const int numParams = static_cast<int>(x.size());
+            KSMatrixXf j(m_NumResiduals, numParams);
+            
+            std::vector<int> chunkOffsets;
+            MakeChunks(chunkOffsets, numParams);
+            const int numChunks = static_cast<int>(chunkOffsets.size()) - 1;
+            
+            auto evalChunks = [&](int begin, int end, int /*worker*/)
+            {
+                std::vector<JetType, Eigen::aligned_allocator<JetType> > xj(numParams);
+                std::vector<JetType, Eigen::aligned_allocator<JetType> > rj(m_NumResiduals);
+                for (int c = begin; c < end; ++c)
+                {
+                    const int offset    = chunkOffsets[c];
+                    const int size      = chunkOffsets[c + 1] - offset;
+                    
+                    // チャンク内のパラメータだけ微分の種を立てる
+                    for (int i = 0; i < numParams; ++i)
+                    {
+                        xj[i]   = JetType(x(i));
+                    }
+                    for (int k = 0; k < size; ++k)
+                    {
+                        xj[offset + k].v(k) = 1.0f;
+                    }
+                    
+                    if (!m_Functor(xj.data(), rj.data()))
+                    {
+                        j.middleCols(offset, size).setConstant(std::numeric_limits<float>::quiet_NaN());
+                        continue;
+                    }
+                    for (int i = 0; i < m_NumResiduals; ++i)
+                    {
+                        j.row(i).segment(offset, size)  = rj[i].v.head(size).transpose();
+                    }
+                }
+            };
+            
+            if (m_UseThreadPool)
+            {
+                KSThreadPool::GetDefault().ParallelFor(0, numChunks, 1, evalChunks);
+            }
+            else
+            {
+                evalChunks(0, numChunks, 0);
+            }
+            return j;
+        }
+        
+        //! 残差関数の取得
+        KSFunction  GetResidualFunction() const
+        {
+            KSAutoDiffFunction  self(*this);
+            return [self](const KSMatrixXf& x)->KSMatrixXf
+            {
+                return self.EvaluateResidual(x);
+            };
+        }
+        
+        //! ヤコビアン関数の取得
+        KSFunction  GetJacobianFunction() const
+        {
+            KSAutoDiffFunction  self(*this);
+            return [self](const KSMatrixXf& x)->KSMatrixXf
+            {
+                return self.EvaluateJacobian(x);
+            };
+        }
+    
+    private:
+        //! パラメータブロックに沿ったチャンクの区切りを作る
+        void    MakeChunks(std::vector<int>& offsets, int numParams) const
+        {
+            offsets.clear();
+            offsets.push_back(0);
+            
+            std::vector<int> blocks = m_BlockSizes;
+            int total   = 0;
+            for (int size : blocks)
+            {
+                total   += size;
+            }
+            if (total < numParams)
+            {
+                blocks.push_back(numParams - total);
+            }
+            
+            int offset  = 0;
+            for (int size : blocks)
+            {
+                size    = std::min(size, numParams - offset);
+                for (int k = 0; k < size; k += ChunkSize)
+                {
+                    offsets.push_back(offset + std::min(k + ChunkSize, size));
+                }
+                offset  += std::max(size, 0);
+            }
+        }
+    
+    private:
+        //! 残差ファンクタ
+        Functor             m_Functor;
+        //! 残差の要素数
+        int                 m_NumResiduals;
+        //! パラメータブロックごとの要素数
+        std::vector<int>    m_BlockSizes;
+        //! スレッドプールを使うかどうか
+        bool                m_UseThreadPool;
+    };
+
+} //namespace Kosakasakas {
+
+#endif /* KSAutoDiffFunction_h */
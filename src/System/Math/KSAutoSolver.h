@@ -0,0 +1,470 @@
+//
+//  KSAutoSolver.h
+//
+//  問題の形ごとにソルバを自動選択する正規方程式のソルバクラス
+//
+//  Copyright (c) 2016年 Takahiro Kosaka. All rights reserved.
+//  Created by Takahiro Kosaka on 2016/07/17.
+//
+//  This Source Code Form is subject to the terms of the Mozilla
+//  Public License v. 2.0. If a copy of the MPL was not distributed
+//  with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef KSAutoSolver_h
+#define KSAutoSolver_h
+
+#include "KSNormalEquationSolver.h"
+#include "KSCholeskyDecomposition.h"
+#include "KSConjugateGradient.h"
+#include "KSSolveOptions.h"
+#include "memory.h"
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace Kosakasakas {
+    
+    /**
+     @brief 問題の形ごとにソルバを自動選択する正規方程式のソルバ
+     
+     ヤコビアンの行数・列数・非ゼロ要素の割合(16段階)の組を問題の形とし、
+     形ごとに最初の数回の計算で全ての候補を実行して計測します.
+     候補は密行列のLL^t/LDL^t分解、スパース行列のLL^t/LDL^t分解、Jacobi/不完全コレスキー前処理の共役勾配法です.
+     密行列のヤコビアンはスパース行列に変換して、スパース行列のヤコビアンは小さい場合に密行列に変換して試します.
+     正規方程式の相対残差が閾値(または最も精度の良い候補の10倍)を超えた候補は除外し、
+     計測回数に達した時点で最短時間の候補を形ごとに記録して、以降はその候補だけを使います.
+     計測中も最速の候補の解を返すので、計測の回数だけ計算が遅くなる以外の違いはありません.
+     記録した候補が後で失敗した場合は、同じ計算の中で残りの候補を計測し直して解を返します.
+     */
+    class KSAutoSolver : public KSNormalEquationSolver
+    {
+    public:
+        //! コンストラクタ
+        KSAutoSolver()
+        : m_NumTrials(2)
+        , m_Tolerance(1.0e-3f)
+        , m_MaxDenseElements(1 << 22)
+        , m_LastCandidate(-1)
+        {};
+        
+        //! デストラクタ
+        virtual ~KSAutoSolver()
+        {};
+        
+        //! 初期化
+        inline bool Initialize()
+        {
+            m_Candidates.clear();
+            
+            auto pDenseLDLT     = std::make_shared<KSCholeskyDecomposition>();
+            auto pDenseLLT      = std::make_shared<KSCholeskyDecomposition>();
+            pDenseLLT->SetDenseFactorization(CholeskyType::CHOLESKY_LLT);
+            auto pSparseLLT     = std::make_shared<KSCholeskyDecomposition>();
+            auto pSparseLDLT    = std::make_shared<KSCholeskyDecomposition>();
+            pSparseLDLT->SetSparseFactorization(CholeskyType::CHOLESKY_LDLT);
+            auto pJacobiPCG     = std::make_shared<KSConjugateGradient>();
+            auto pCholeskyPCG   = std::make_shared<KSConjugateGradient>();
+            pCholeskyPCG->SetPreconditioner(PreconditionerType::INCOMPLETE_CHOLESKY);
+            
+            AddCandidate("DENSE_LDLT", pDenseLDLT, Storage::DENSE);
+            AddCandidate("DENSE_LLT", pDenseLLT, Storage::DENSE);
+            AddCandidate("SPARSE_LLT", pSparseLLT, Storage::SPARSE);
+            AddCandidate("SPARSE_LDLT", pSparseLDLT, Storage::SPARSE);
+            AddCandidate("PCG_JACOBI", pJacobiPCG, Storage::ANY);
+            AddCandidate("PCG_INCOMPLETE_CHOLESKY", pCholeskyPCG, Storage::ANY);
+            
+            ResetSelection();
+            return true;
+        };
+        
+        //! 終了処理
+        inline void Finalize()
+        {
+            m_Candidates.clear();
+            ResetSelection();
+        };
+        
+        /**
+         @brief 計算精度のセット
+         
+         全ての候補に反映し、記録した選択結果は破棄します.
+         @param precision   計算精度
+         */
+        inline void SetPrecision(PrecisionType precision)
+        {
+            m_Precision = precision;
+            for (auto& candidate : m_Candidates)
+            {
+                candidate.pSolver->SetPrecision(precision);
+            }
+            ResetSelection();
+        }
+        
+        /**
+         @brief 計測回数のセット
+         
+         問題の形ごとに全ての候補を実行する回数です. スパース行列の分解は1回目にシンボリック解析を含むので、
+         候補ごとの最短時間で比べます. デフォルトは2回です.
+         @param numTrials   計測回数
+         */
+        inline void SetNumTrials(int numTrials)
+        {
+            m_NumTrials = std::max(numTrials, 1);
+        }
+        
+        /**
+         @brief 精度の閾値のセット
+         
+         正規方程式の相対残差 |J^tJ・dx + J^t・r| / |J^t・r| がこの値と、最も精度の良い候補の10倍の
+         どちらよりも大きい候補は選びません. デフォルトは1.0e-3です.
+         @param tolerance   相対残差の閾値
+         */
+        inline void SetTolerance(float tolerance)
+        {
+            m_Tolerance = tolerance;
+        }
+        
+        /**
+         @brief 密行列に変換するヤコビアンの最大要素数のセット
+         
+         スパース行列のヤコビアンで密行列の分解を試すのは、行数×列数がこの値以下の場合だけです.
+         @param elements    最大要素数
+         */
+        inline void SetMaxDenseElements(int elements)
+        {
+            m_MaxDenseElements  = elements;
+        }
+        
+        //! 記録した選択結果の破棄(次の計算から計測をやり直します)
+        inline void ResetSelection()
+        {
+            m_Records.clear();
+            m_LastCandidate = -1;
+        }
+        
+        //! 候補の数
+        inline int  GetNumCandidates() const
+        {
+            return static_cast<int>(m_Candidates.size());
+        }
+        
+        //! 候補の名前
+        inline const std::string&   GetCandidateName(int candidate) const
+        {
+            return m_Candidates[candidate].name;
+        }
+        
+        //! 前回の計算で解を返した候補(計算していない場合は-1)
+        inline int  GetLastCandidate() const
+        {
+            return m_LastCandidate;
+        }
+        
+        /**
+         @brief 計算実行
+         
+         実際に計算を行う関数です.
+         問題の形に対して選んだソルバで正規方程式を解きます.
+         @param dst     出力パラメータ行列
+         @param y       残差関数
+         @param j       残差関数のヤコビアン
+         @param maxIterations   反復法の候補に渡す最大反復回数
+         @return 計算の成否
+         */
+        inline bool Solve(KSMatrixXf& dst, KSMatrixXf& y, KSMatrixXf& j, int maxIterations)
+        {
+            Signature signature;
+            signature.isSparse  = false;
+            signature.rows      = static_cast<int>(j.rows());
+            signature.cols      = static_cast<int>(j.cols());
+            signature.density   = GetDensityLevel((j.array() != 0.0f).count(), j.rows(), j.cols());
+            return SolveSelected(dst, y, j, maxIterations, signature);
+        };
+        
+        /**
+         @brief 計算実行
+         
+         実際に計算を行う関数です.
+         問題の形に対して選んだソルバで正規方程式を解きます.
+         @param dst     出力パラメータベクトル
+         @param y       残差ベクトル
+         @param j       残差関数のスパースヤコビアン
+         @param maxIterations   反復法の候補に渡す最大反復回数
+         @return 計算の成否
+         */
+        inline bool Solve(KSVectorXf& dst, KSVectorXf& y, KSMatrixSparsef& j, int maxIterations)
+        {
+            Signature signature;
+            signature.isSparse  = true;
+            signature.rows      = static_cast<int>(j.rows());
+            signature.cols      = static_cast<int>(j.cols());
+            signature.density   = GetDensityLevel(j.nonZeros(), j.rows(), j.cols());
+            return SolveSelected(dst, y, j, maxIterations, signature);
+        };
+    
+    private:
+        //! 候補が扱う行列の形式
+        enum class Storage
+        {
+            //! 密行列(スパース行列のヤコビアンは変換して渡す)
+            DENSE,
+            //! スパース行列(密行列のヤコビアンは変換して渡す)
+            SPARSE,
+            //! どちらもそのまま扱える
+            ANY
+        };
+        
+        //! 候補のソルバ
+        struct Candidate
+        {
+            //! 名前
+            std::string name;
+            //! ソルバ
+            std::shared_ptr<KSNormalEquationSolver> pSolver;
+            //! 扱う行列の形式
+            Storage     storage;
+        };
+        
+        //! 問題の形
+        struct Signature
+        {
+            //! スパース行列のヤコビアンかどうか
+            bool    isSparse;
+            //! 行数
+            int     rows;
+            //! 列数
+            int     cols;
+            //! 非ゼロ要素の割合(0〜16)
+            int     density;
+            
+            //! std::mapのキーとしての比較
+            inline bool operator<(const Signature& rhs) const
+            {
+                return std::tie(isSparse, rows, cols, density) < std::tie(rhs.isSparse, rhs.rows, rhs.cols, rhs.density);
+            }
+        };
+        
+        //! 問題の形ごとの計測結果
+        struct Record
+        {
+            //! 計測した回数
+            int     numTrials;
+            //! 候補ごとの最短時間[秒](除外した候補は負)
+            std::vector<double> bestTimes;
+            //! 選んだ候補(計測中は-1)
+            int     winner;
+        };
+        
+        //! 候補の追加
+        inline void AddCandidate(const std::string& name,
+                                 const std::shared_ptr<KSNormalEquationSolver>& pSolver,
+                                 Storage storage)
+        {
+            pSolver->SetPrecision(m_Precision);
+            Candidate candidate;
+            candidate.name      = name;
+            candidate.pSolver   = pSolver;
+            candidate.storage   = storage;
+            m_Candidates.push_back(candidate);
+        }
+        
+        //! 非ゼロ要素の割合を16段階に丸める
+        inline static int   GetDensityLevel(long nonZeros, long rows, long cols)
+        {
+            const double size   = static_cast<double>(rows) * static_cast<double>(cols);
+            return (size > 0.0) ? static_cast<int>(16.0 * static_cast<double>(nonZeros) / size) : 0;
+        }
+        
+        //! 候補による計算(密行列のヤコビアン)
+        inline bool Run(int candidate, KSMatrixXf& dst, KSMatrixXf& y, KSMatrixXf& j, int maxIterations)
+        {
+            const Candidate& c  = m_Candidates[candidate];
+            if (c.storage != Storage::SPARSE)
+            {
+                return c.pSolver->Solve(dst, y, j, maxIterations);
+            }
+            
+            KSMatrixSparsef js  = j.sparseView();
+            KSVectorXf d        = dst.col(0);
+            KSVectorXf r        = y.col(0);
+            if (!c.pSolver->Solve(d, r, js, maxIterations))
+            {
+                return false;
+            }
+            dst.col(0)  = d;
+            return true;
+        }
+        
+        //! 候補による計算(スパース行列のヤコビアン)
+        inline bool Run(int candidate, KSVectorXf& dst, KSVectorXf& y, KSMatrixSparsef& j, int maxIterations)
+        {
+            const Candidate& c  = m_Candidates[candidate];
+            if (c.storage != Storage::DENSE)
+            {
+                return c.pSolver->Solve(dst, y, j, maxIterations);
+            }
+            if (static_cast<double>(j.rows()) * static_cast<double>(j.cols()) > m_MaxDenseElements)
+            {
+                return false;
+            }
+            
+            KSMatrixXf jd   = KSMatrixXf(j);
+            KSMatrixXf d    = dst;
+            KSMatrixXf r    = y;
+            if (!c.pSolver->Solve(d, r, jd, maxIterations))
+            {
+                return false;
+            }
+            dst = d.col(0);
+            return true;
+        }
+        
+        //! 正規方程式の相対残差(密行列のヤコビアン)
+        inline static double    GetRelativeResidual(const KSMatrixXf& j, const KSMatrixXf& y, const KSMatrixXf& step)
+        {
+            const KSVectorXf g  = j.transpose() * y.col(0);
+            const KSVectorXf e  = j.transpose() * (j * step.col(0)) + g;
+            return e.norm() / std::max(g.norm(), std::numeric_limits<float>::min());
+        }
+        
+        //! 正規方程式の相対残差(スパース行列のヤコビアン)
+        inline static double    GetRelativeResidual(const KSMatrixSparsef& j, const KSVectorXf& y, const KSVectorXf& step)
+        {
+            const KSVectorXf g  = j.transpose() * y;
+            const KSVectorXf e  = j.transpose() * (j * step) + g;
+            return e.norm() / std::max(g.norm(), std::numeric_limits<float>::min());
+        }
+        
+        /**
+         @brief 選択した候補による計算
+         
+         計測中の場合は全ての候補を実行して時間と精度を記録し、最速の候補の解を返します.
+         選んだ候補が失敗した場合は、その候補を除いた計測をこの計算からやり直します.
+         @param dst             出力パラメータ
+         @param y               残差
+         @param j               ヤコビアン
+         @param maxIterations   反復法の候補に渡す最大反復回数
+         @param signature       問題の形
+         @return 計算の成否
+         */
+        template <typename ParamType, typename JacobianType>
+        bool    SolveSelected(ParamType& dst, ParamType& y, JacobianType& j, int maxIterations, const Signature& signature)
+        {
+            const int numCandidates = GetNumCandidates();
+            if (numCandidates == 0)
+            {
+                return false;
+            }
+            
+            Record& record  = m_Records[signature];
+            if (record.bestTimes.empty())
+            {
+                record.numTrials    = 0;
+                record.bestTimes.assign(numCandidates, 0.0);
+                record.winner       = -1;
+            }
+            
+            if (record.winner >= 0)
+            {
+                ParamType step  = ParamType::Zero(dst.rows(), dst.cols());
+                if (Run(record.winner, step, y, j, maxIterations) && step.allFinite())
+                {
+                    dst             += step;
+                    m_LastCandidate = record.winner;
+                    return true;
+                }
+                // 選んだ候補が失敗した場合は、その候補を除いてこの計算で計測し直す
+                const int failed    = record.winner;
+                record.numTrials    = 0;
+                record.bestTimes.assign(numCandidates, 0.0);
+                record.bestTimes[failed]    = -1.0;
+                record.winner       = -1;
+            }
+            
+            // 除外されていない全ての候補を同じ問題で実行する
+            std::vector<ParamType>  steps(numCandidates);
+            std::vector<double>     times(numCandidates, -1.0);
+            std::vector<double>     residuals(numCandidates, std::numeric_limits<double>::infinity());
+            double minResidual      = std::numeric_limits<double>::infinity();
+            for (int c=0; c<numCandidates; ++c)
+            {
+                if (record.bestTimes[c] < 0.0)
+                {
+                    continue;
+                }
+                steps[c]    = ParamType::Zero(dst.rows(), dst.cols());
+                KSSolveTimer timer;
+                const bool succeeded    = Run(c, steps[c], y, j, maxIterations);
+                const double elapsed    = timer.GetElapsedSeconds();
+                if (succeeded && steps[c].allFinite())
+                {
+                    times[c]        = elapsed;
+                    residuals[c]    = GetRelativeResidual(j, y, steps[c]);
+                    minResidual     = std::min(minResidual, residuals[c]);
+                }
+            }
+            
+            // 精度の足りない候補を除外し、残りの中で今回最速の候補の解を返す
+            const double threshold  = std::max(static_cast<double>(m_Tolerance), 10.0 * minResidual);
+            int fastest             = -1;
+            for (int c=0; c<numCandidates; ++c)
+            {
+                if (record.bestTimes[c] < 0.0)
+                {
+                    continue;
+                }
+                if (times[c] < 0.0 || !(residuals[c] <= threshold))
+                {
+                    record.bestTimes[c] = -1.0;
+                    continue;
+                }
+                record.bestTimes[c] = (record.numTrials == 0) ? times[c] : std::min(record.bestTimes[c], times[c]);
+                if (fastest < 0 || times[c] < times[fastest])
+                {
+                    fastest = c;
+                }
+            }
+            if (fastest < 0)
+            {
+                m_Records.erase(signature);
+                return false;
+            }
+            dst             += steps[fastest];
+            m_LastCandidate = fastest;
+            
+            if (++record.numTrials >= m_NumTrials)
+            {
+                int winner  = -1;
+                for (int c=0; c<numCandidates; ++c)
+                {
+                    if (record.bestTimes[c] >= 0.0 && (winner < 0 || record.bestTimes[c] < record.bestTimes[winner]))
+                    {
+                        winner  = c;
+                    }
+                }
+                record.winner   = winner;
+            }
+            return true;
+        }
+    
+    private:
+        //! 候補のソルバ
+        std::vector<Candidate>          m_Candidates;
+        //! 問題の形ごとの計測結果
+        std::map<Signature, Record>     m_Records;
+        //! 計測回数
+        int     m_NumTrials;
+        //! 正規方程式の相対残差の閾値
+        float   m_Tolerance;
+        //! 密行列に変換するヤコビアンの最大要素数
+        int     m_MaxDenseElements;
+        //! 前回の計算で解を返した候補
+        int     m_LastCandidate;
+    };
+
+} //namespace Kosakasakas {
+
+#endif /* KSAutoSolver_h */
@@ -0,0 +1,503 @@
+//
+//  KSBatchOptimizer.h
+//
+//  同じ構造の小さな非線形最小二乗問題をまとめて解く最適化計算クラス
+//
+//  Copyright (c) 2016年 Takahiro Kosaka. All rights reserved.
+//  Created by Takahiro Kosaka on 2016/07/15.
+//
+//  This Source Code Form is subject to the terms of the Mozilla
+//  Public License v. 2.0. If a copy of the MPL was not distributed
+//  with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef KSBatchOptimizer_h
+#define KSBatchOptimizer_h
+
+#include "KSTypeDef.h"
+#include "KSSolveOptions.h"
+#include "KSThreadPool.h"
+#include <eigen3/Eigen/StdVector>
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+namespace Kosakasakas {
+    
+    /**
+     @brief 同じ構造の小さな非線形最小二乗問題をまとめて解く最適化計算クラス
+     
+     パラメータ数Nが等しい独立した問題を多数まとめて、ガウス-ニュートン法で解きます.
+     問題をLanes個ずつのグループに分け、グループ内の問題のJ^tJを要素ごとにレーン方向へ並べて(SoA)持ち、
+     コレスキー分解と前進・後退代入をLanes個の問題について同時にSIMDで行います.
+     グループは共有のスレッドプールで並列に処理し、作業領域はワーカーごとに初期化時に一度だけ確保します.
+     
+     残差ファンクタは次の形式です. 複数のスレッドから同時に呼ばれるのでスレッドセーフにしてください.
+        
+        int  GetNumResiduals(int problem) const;
+        bool operator()(int problem, const ParamType& x, int i, float& r, JacobianRowType* pJacobianRow) const;
+     
+     problem番目の問題のi番目の残差をrに、そのヤコビアンの行をpJacobianRowに書き込みます.
+     */
+    template <int N, int Lanes = 8>
+    class KSBatchOptimizer
+    {
+    public:
+        //! パラメータベクトルの型
+        typedef Eigen::Matrix<float, N, 1>  ParamType;
+        //! ヤコビアンの行の型
+        typedef Eigen::Matrix<float, 1, N>  JacobianRowType;
+        //! パラメータベクトルの配列の型
+        typedef std::vector<ParamType, Eigen::aligned_allocator<ParamType> >    ParamArray;
+        //! レーン方向に並べた値の型
+        typedef Eigen::Array<float, Lanes, 1>   LaneArray;
+        //! レーンごとの真偽値の型
+        typedef Eigen::Array<bool, Lanes, 1>    LaneMask;
+        //! 1問題分のJ^tJの型(スタックに載る大きさなら固定長)
+        typedef typename std::conditional<(N * N * sizeof(float) <= EIGEN_STACK_ALLOCATION_LIMIT),
+                                          Eigen::Matrix<float, N, N>,
+                                          KSMatrixXf>::type NormalMatrixType;
+        
+        //! コンストラクタ
+        KSBatchOptimizer()
+        : m_IsInitialized(false)
+        {};
+        
+        //! デストラクタ
+        virtual ~KSBatchOptimizer()
+        {};
+        
+        /**
+         @brief 初期化
+         
+         問題ごとのパラメータの初期値をセットし、ワーカーごとの作業領域を確保します.
+         @param initParams  問題ごとのパラメータの初期値
+         @return 初期化の成否
+         */
+        bool    Initialize(const ParamArray& initParams)
+        {
+            m_Params    = initParams;
+            m_Summaries.assign(m_Params.size(), KSSolveSummary());
+            
+            const int numWorkers    = KSThreadPool::GetDefault().GetNumWorkers();
+            m_Workspaces.clear();
+            for (int i=0; i<numWorkers; ++i)
+            {
+                m_Workspaces.push_back(std::unique_ptr<Workspace>(new Workspace()));
+            }
+            m_IsInitialized = true;
+            return true;
+        }
+        
+        //! 終了処理
+        void    Finalize()
+        {
+            m_Workspaces.clear();
+            m_IsInitialized = false;
+        }
+        
+        //! 問題数の取得
+        inline int  GetNumProblems() const
+        {
+            return static_cast<int>(m_Params.size());
+        }
+        
+        //! パラメータベクトルの取得
+        inline const ParamType& GetParamVec(int problem) const
+        {
+            return m_Params[problem];
+        }
+        
+        //! パラメータベクトルのセット
+        inline void SetParamVec(int problem, const ParamType& param)
+        {
+            m_Params[problem]   = param;
+        }
+        
+        //! 前回のSolveの問題ごとの結果の取得
+        inline const std::vector<KSSolveSummary>&   GetSummaries() const
+        {
+            return m_Summaries;
+        }
+        
+        /**
+         @brief 全ての問題について最適化ステップを1回実行（ガウス-ニュートン法）
+         @param functor 残差ファンクタ
+         @return 全ての問題のステップが成功したかどうか(失敗した問題のパラメータは更新されません)
+         */
+        template <typename Functor>
+        bool    DoGaussNewtonStep(const Functor& functor)
+        {
+            if (!m_IsInitialized)
+            {
+                return false;
+            }
+            
+            std::vector<char> groupSucceeded(GetNumGroups(), 0);
+            KSThreadPool::GetDefault().ParallelFor(0, GetNumGroups(), 1, [&](int begin, int end, int worker)
+            {
+                Workspace& ws   = *m_Workspaces[worker];
+                for (int g=begin; g<end; ++g)
+                {
+                    LaneMask active = GetValidLanes(g);
+                    LaneMask ok     = Accumulate(functor, g, active, ws);
+                    FactorizeAndSolve(ws, ok);
+                    ApplyStep(g, ok, ws);
+                    groupSucceeded[g]   = ((ok == active).all()) ? 1 : 0;
+                }
+            });
+            return std::find(groupSucceeded.begin(), groupSucceeded.end(), 0) == groupSucceeded.end();
+        }
+        
+        /**
+         @brief 全ての問題について収束するまで最適化ステップを実行
+         
+         問題ごとに収束判定を行い、収束した問題はグループ内のレーンを止めて残りの問題だけを進めます.
+         options.useIRLSは使いません(重みが必要な場合はファンクタ側で掛けてください).
+         @param functor 残差ファンクタ
+         @param options 収束判定と計算予算の設定(計算時間の予算は全ての問題で共有します)
+         @return 問題ごとの最適化ループの結果
+         */
+        template <typename Functor>
+        const std::vector<KSSolveSummary>&  Solve(const Functor& functor, const KSSolveOptions& options)
+        {
+            m_Summaries.assign(m_Params.size(), KSSolveSummary());
+            if (!m_IsInitialized)
+            {
+                return m_Summaries;
+            }
+            
+            KSSolveTimer    timer;
+            KSThreadPool::GetDefault().ParallelFor(0, GetNumGroups(), 1, [&](int begin, int end, int worker)
+            {
+                for (int g=begin; g<end; ++g)
+                {
+                    SolveGroup(functor, options, g, timer, *m_Workspaces[worker]);
+                }
+            });
+            return m_Summaries;
+        }
+    
+    private:
+        //! ワーカーごとの作業領域
+        struct Workspace
+        {
+            Workspace()
+            : JtJ(N, N)
+            , A(N * (N + 1) / 2)
+            , b(N)
+            , prevParams(Lanes)
+            {};
+            
+            //! 1問題分のJ^tJ
+            NormalMatrixType    JtJ;
+            //! 1問題分のJ^tr
+            ParamType           Jtr;
+            //! レーン方向に並べたJ^tJの下三角(行ごとに詰めて格納)、分解後はコレスキー因子
+            std::vector<LaneArray, Eigen::aligned_allocator<LaneArray> >    A;
+            //! レーン方向に並べた-J^tr、求解後はステップ
+            std::vector<LaneArray, Eigen::aligned_allocator<LaneArray> >    b;
+            //! ステップ前のパラメータ
+            ParamArray          prevParams;
+            //! レーンごとのコスト
+            double              cost[Lanes];
+            //! レーンごとの勾配の最大絶対値
+            double              gradientNorm[Lanes];
+            
+            EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+        };
+        
+        //! グループ数
+        inline int  GetNumGroups() const
+        {
+            return (GetNumProblems() + Lanes - 1) / Lanes;
+        }
+        
+        //! グループ内で問題が割り当てられているレーン
+        inline LaneMask GetValidLanes(int group) const
+        {
+            LaneMask mask;
+            for (int l=0; l<Lanes; ++l)
+            {
+                mask(l) = (group * Lanes + l < GetNumProblems());
+            }
+            return mask;
+        }
+        
+        //! 詰めて格納した下三角の(i, j)要素の位置
+        static inline int   PackedIndex(int i, int j)
+        {
+            return i * (i + 1) / 2 + j;
+        }
+        
+        /**
+         @brief グループ内の問題の正規方程式をレーン方向に並べて累積
+         
+         有効でないレーンには単位行列を置くので、分解はレーンに関係なく同じ手順で進められます.
+         @param functor 残差ファンクタ
+         @param group   グループ
+         @param active  累積するレーン
+         @param ws      作業領域
+         @return 累積に成功したレーン
+         */
+        template <typename Functor>
+        LaneMask    Accumulate(const Functor& functor, int group, const LaneMask& active, Workspace& ws)
+        {
+            LaneMask ok = active;
+            float r;
+            JacobianRowType jrow;
+            for (int l=0; l<Lanes; ++l)
+            {
+                const int problem   = group * Lanes + l;
+                if (ok(l))
+                {
+                    ws.JtJ.setZero();
+                    ws.Jtr.setZero();
+                    double cost = 0.0;
+                    const ParamType& x  = m_Params[problem];
+                    for (int i=0, n=functor.GetNumResiduals(problem); i<n && ok(l); ++i)
+                    {
+                        if (!functor(problem, x, i, r, &jrow))
+                        {
+                            ok(l)   = false;
+                            break;
+                        }
+                        ws.JtJ.template selfadjointView<Eigen::Lower>().rankUpdate(jrow.transpose());
+                        ws.Jtr.noalias()    += jrow.transpose() * r;
+                        cost    += static_cast<double>(r) * r;
+                    }
+                    ws.cost[l]          = cost;
+                    ws.gradientNorm[l]  = ws.Jtr.cwiseAbs().maxCoeff();
+                }
+                
+                // レーンlに書き込む
+                for (int i=0; i<N; ++i)
+                {
+                    LaneArray* pRow = &ws.A[PackedIndex(i, 0)];
+                    for (int j=0; j<i; ++j)
+                    {
+                        pRow[j](l)  = ok(l) ? ws.JtJ(i, j) : 0.0f;
+                    }
+                    pRow[i](l)  = ok(l) ? ws.JtJ(i, i) : 1.0f;
+                    ws.b[i](l)  = ok(l) ? -ws.Jtr(i) : 0.0f;
+                }
+            }
+            return ok;
+        }
+        
+        /**
+         @brief レーン方向に並べた正規方程式のコレスキー分解と求解
+         
+         全ての演算がレーン方向の要素ごとの演算なので、Lanes個の問題を同時に解きます.
+         ピボットが正でないレーンはokから外し、そのレーンの結果は使いません.
+         @param ws  作業領域(ws.bに解が入ります)
+         @param ok  分解できたレーン
+         */
+        void    FactorizeAndSolve(Workspace& ws, LaneMask& ok) const
+        {
+            const LaneArray ones    = LaneArray::Ones();
+            
+            // A = L L^t (行ごとに連続した下三角をその場で分解)
+            for (int j=0; j<N; ++j)
+            {
+                LaneArray* pRowJ    = &ws.A[PackedIndex(j, 0)];
+                LaneArray d         = pRowJ[j];
+                for (int k=0; k<j; ++k)
+                {
+                    d   -= pRowJ[k].square();
+                }
+                const LaneMask positive = (d > 0.0f);
+                ok      = ok && positive;
+                pRowJ[j]    = positive.select(d, ones).sqrt();
+                const LaneArray inv = pRowJ[j].inverse();
+                
+                for (int i=j+1; i<N; ++i)
+                {
+                    LaneArray* pRowI    = &ws.A[PackedIndex(i, 0)];
+                    LaneArray s         = pRowI[j];
+                    for (int k=0; k<j; ++k)
+                    {
+                        s   -= pRowI[k] * pRowJ[k];
+                    }
+                    pRowI[j]    = s * inv;
+                }
+            }
+            
+            // L y = b
+            for (int i=0; i<N; ++i)
+            {
+                const LaneArray* pRowI  = &ws.A[PackedIndex(i, 0)];
+                LaneArray s             = ws.b[i];
+                for (int k=0; k<i; ++k)
+                {
+                    s   -= pRowI[k] * ws.b[k];
+                }
+                ws.b[i] = s / pRowI[i];
+            }
+            
+            // L^t x = y
+            for (int i=N-1; i>=0; --i)
+            {
+                LaneArray s = ws.b[i];
+                for (int k=i+1; k<N; ++k)
+                {
+                    s   -= ws.A[PackedIndex(k, i)] * ws.b[k];
+                }
+                ws.b[i] = s / ws.A[PackedIndex(i, i)];
+                // 有限値のときだけx-xが0になる
+                ok      = ok && ((ws.b[i] - ws.b[i]) == 0.0f);
+            }
+        }
+        
+        //! 分解できたレーンの問題にステップを加算
+        void    ApplyStep(int group, const LaneMask& ok, const Workspace& ws)
+        {
+            for (int l=0; l<Lanes; ++l)
+            {
+                if (!ok(l))
+                {
+                    continue;
+                }
+                ParamType& x    = m_Params[group * Lanes + l];
+                for (int i=0; i<N; ++i)
+                {
+                    x(i)    += ws.b[i](l);
+                }
+            }
+        }
+        
+        /**
+         @brief 1グループ分の最適化ループ
+         
+         KSFixedOptimizer::Solveと同じ判定をレーンごとに行います.
+         */
+        template <typename Functor>
+        void    SolveGroup(const Functor& functor,
+                           const KSSolveOptions& options,
+                           int group,
+                           const KSSolveTimer& timer,
+                           Workspace& ws)
+        {
+            KSSolveSummary* pSummaries  = &m_Summaries[group * Lanes];
+            const LaneMask valid        = GetValidLanes(group);
+            LaneMask active             = Accumulate(functor, group, valid, ws);
+            for (int l=0; l<Lanes; ++l)
+            {
+                if (active(l))
+                {
+                    pSummaries[l].initialCost   = ws.cost[l];
+                    pSummaries[l].finalCost     = ws.cost[l];
+                    pSummaries[l].termination   = SolveTerminationType::MAX_ITERATIONS;
+                }
+            }
+            
+            double lastStepTime = 0.0;
+            for (int it=0; it<options.maxIterations && active.any(); ++it)
+            {
+                const double stepStart  = timer.GetElapsedSeconds();
+                if (options.maxSolveTimeInSeconds > 0.0
+                    && stepStart + lastStepTime > options.maxSolveTimeInSeconds)
+                {
+                    for (int l=0; l<Lanes; ++l)
+                    {
+                        if (active(l))
+                        {
+                            pSummaries[l].termination   = SolveTerminationType::TIME_BUDGET;
+                        }
+                    }
+                    break;
+                }
+                
+                for (int l=0; l<Lanes; ++l)
+                {
+                    if (!active(l))
+                    {
+                        continue;
+                    }
+                    pSummaries[l].gradientNorm  = ws.gradientNorm[l];
+                    if (options.gradientTolerance > 0.0 && ws.gradientNorm[l] <= options.gradientTolerance)
+                    {
+                        pSummaries[l].termination   = SolveTerminationType::GRADIENT_CONVERGENCE;
+                        active(l)   = false;
+                    }
+                    else
+                    {
+                        ws.prevParams[l]    = m_Params[group * Lanes + l];
+                    }
+                }
+                
+                LaneMask ok = active;
+                FactorizeAndSolve(ws, ok);
+                ApplyStep(group, ok, ws);
+                for (int l=0; l<Lanes; ++l)
+                {
+                    if (active(l) && !ok(l))
+                    {
+                        pSummaries[l].termination   = SolveTerminationType::FAILURE;
+                    }
+                }
+                active  = ok;
+                
+                // 次の反復の正規方程式と一緒に新しいコストを得る
+                double prevCost[Lanes];
+                std::copy(ws.cost, ws.cost + Lanes, prevCost);
+                const LaneMask evaluated    = Accumulate(functor, group, active, ws);
+                for (int l=0; l<Lanes; ++l)
+                {
+                    if (!active(l))
+                    {
+                        continue;
+                    }
+                    KSSolveSummary& summary = pSummaries[l];
+                    ParamType& x            = m_Params[group * Lanes + l];
+                    ++summary.iterations;
+                    if (!evaluated(l) || !std::isfinite(ws.cost[l]))
+                    {
+                        x                   = ws.prevParams[l];
+                        summary.termination = SolveTerminationType::FAILURE;
+                        active(l)           = false;
+                        continue;
+                    }
+                    summary.finalCost   = ws.cost[l];
+                    summary.stepNorm    = (x - ws.prevParams[l]).norm();
+                    if (options.functionTolerance > 0.0
+                        && std::fabs(prevCost[l] - ws.cost[l]) <= options.functionTolerance * prevCost[l])
+                    {
+                        summary.termination = SolveTerminationType::COST_CONVERGENCE;
+                        active(l)           = false;
+                    }
+                    else if (options.parameterTolerance > 0.0
+                             && summary.stepNorm <= options.parameterTolerance * (ws.prevParams[l].norm() + options.parameterTolerance))
+                    {
+                        summary.termination = SolveTerminationType::STEP_CONVERGENCE;
+                        active(l)           = false;
+                    }
+                }
+                lastStepTime    = timer.GetElapsedSeconds() - stepStart;
+            }
+            
+            const double elapsed    = timer.GetElapsedSeconds();
+            for (int l=0; l<Lanes; ++l)
+            {
+                if (valid(l))
+                {
+                    pSummaries[l].totalTimeInSeconds    = elapsed;
+                }
+            }
+        }
+    
+    private:
+        //! 問題ごとのパラメータ
+        ParamArray                  m_Params;
+        //! 問題ごとの最適化ループの結果
+        std::vector<KSSolveSummary> m_Summaries;
+        //! ワーカーごとの作業領域
+        std::vector<std::unique_ptr<Workspace> >    m_Workspaces;
+        //! 初期化されているかどうか
+        bool                        m_IsInitialized;
+    };
+
+} //namespace Kosakasakas {
+
+#endif /* KSBatchOptimizer_h */
@@ -14,7 +14,10 @@
 #define KSCholeskyDecomposition_h
 
 #include "KSNormalEquationSolver.h"
+#include "KSNormalEquationAccumulator.h"
 #include <eigen3/Eigen/SparseCholesky>
+#include <algorithm>
+#include <vector>
 
 namespace Kosakasakas {
     
@@ -27,6 +30,11 @@ namespace Kosakasakas {
     public:
         //! コンストラクタ
         KSCholeskyDecomposition()
+        : m_DenseType(CholeskyType::CHOLESKY_LDLT)
+        , m_SparseType(CholeskyType::CHOLESKY_LLT)
+        , m_HasSparsePattern(false)
+        , m_PatternRows(0)
+        , m_PatternCols(0)
         {};
         
         //! デストラクタ
@@ -36,12 +44,70 @@ namespace Kosakasakas {
         //! 初期化
         inline bool Initialize()
         {
+            ResetSparsePattern();
             return true;
         };
         
         //! 終了処理
         inline void Finalize()
-        {};
+        {
+            ResetSparsePattern();
+        };
+        
+        /**
+         @brief 計算精度のセット
+         
+         MIXED_PRECISIONでは、密行列はJ^tJをチャンクごとにfloatで計算してdoubleで累積し、
+         スパース行列はJ^tJをdoubleで計算します. 分解はどちらもdoubleで行います.
+         @param precision   計算精度
+         */
+        inline void SetPrecision(PrecisionType precision)
+        {
+            if (precision != m_Precision)
+            {
+                ResetSparsePattern();
+            }
+            m_Precision = precision;
+        }
+        
+        /**
+         @brief 密行列の分解の種類のセット
+         
+         デフォルトはLDL^t分解です.
+         @param type    分解の種類
+         */
+        inline void SetDenseFactorization(CholeskyType type)
+        {
+            m_DenseType = type;
+        }
+        
+        /**
+         @brief スパース行列の分解の種類のセット
+         
+         デフォルトはLL^t分解(Eigen::SimplicialLLT)です.
+         @param type    分解の種類
+         */
+        inline void SetSparseFactorization(CholeskyType type)
+        {
+            if (type != m_SparseType)
+            {
+                ResetSparsePattern();
+            }
+            m_SparseType    = type;
+        }
+        
+        /**
+         @brief シンボリック解析結果の破棄
+         
+         キャッシュしている非ゼロパターンを破棄し、次の計算でシンボリック解析をやり直します.
+         通常はパターンの変化を自動で検出するため、呼ぶ必要はありません.
+         */
+        inline void ResetSparsePattern()
+        {
+            m_HasSparsePattern  = false;
+            m_OuterPattern.clear();
+            m_InnerPattern.clear();
+        };
         
         /**
          @brief 計算実行
@@ -56,14 +122,27 @@ namespace Kosakasakas {
          */
         inline bool Solve(KSMatrixXf& dst, KSMatrixXf& y, KSMatrixXf& j, int maxIterations)
         {
+            if (m_Precision == PrecisionType::MIXED_PRECISION)
+            {
+                KSMatrixXd A;
+                KSVectorXd b;
+                m_Accumulator.Accumulate(A, b, j, y.col(0));
+                
+                KSVectorXd s;
+                if (!SolveDense(A, -b, s))
+                {
+                    return false;
+                }
+                dst.col(0)  += s.cast<float>();
+                return true;
+            }
+            
             KSMatrixXf jt   = j.transpose();
-            auto llt        = (jt * j).ldlt();
-            if (llt.info()  != Eigen::Success)
+            KSMatrixXf s;
+            if (!SolveDense(KSMatrixXf(jt * j), jt * y * -1.0, s))
             {
                 return false;
             }
-            
-            KSMatrixXf s    = llt.solve(jt * y * -1.0);
             dst             = dst + s;
             return true;
         };
@@ -73,28 +152,156 @@ namespace Kosakasakas {
          
          実際に計算を行う関数です.
          コレスキー分解により正規方程式を解きます.
-         @param dst     出力パラメータ行列
-         @param y       残差関数
-         @param j       残差関数のヤコビアン
+         J^tJの非ゼロパターンが前回と同じ場合は、並べ替えとシンボリック解析の結果を再利用して数値分解だけを行います.
+         @param dst     出力パラメータベクトル
+         @param y       残差ベクトル
+         @param j       残差関数のスパースヤコビアン
          @param maxIterations   演算の試行回数(本手法ではこのパラメータは意味は無い)
          @return 計算の成否
          */
-        inline bool Solve(KSMatrixSparsef& dst, KSMatrixSparsef& y, KSMatrixSparsef& j, int maxIterations)
+        inline bool Solve(KSVectorXf& dst, KSVectorXf& y, KSMatrixSparsef& j, int maxIterations)
+        {
+            if (m_Precision == PrecisionType::MIXED_PRECISION)
+            {
+                return SolveMixed(dst, y, j);
+            }
+            
+            KSMatrixSparsef A   = KSMatrixSparsef(j.transpose()) * j;
+            KSVectorXf b        = -(j.transpose() * y);
+            A.makeCompressed();
+            
+            KSVectorXf s;
+            const bool succeeded    = (m_SparseType == CholeskyType::CHOLESKY_LDLT)
+                ? SolveSparse(m_SparseSolverLDLT, A, b, s)
+                : SolveSparse(m_SparseSolver, A, b, s);
+            if (!succeeded)
+            {
+                return false;
+            }
+            dst                 += s;
+            return true;
+        };
+    
+    private:
+        //! 混合精度での計算(スパース行列)
+        inline bool SolveMixed(KSVectorXf& dst, KSVectorXf& y, KSMatrixSparsef& j)
         {
-            KSMatrixSparsef jt  = j.transpose();
-            KSMatrixSparsef A   = jt * j;
-            KSMatrixSparsef b   = jt * y * -1.0;
-            Eigen::SimplicialLLT<KSMatrixSparsef> solver;
-            solver.compute(A);
-            if(solver.info()!=Eigen::Success)
+            KSMatrixSparsed jd  = j.cast<double>();
+            KSMatrixSparsed A   = KSMatrixSparsed(jd.transpose()) * jd;
+            KSVectorXd b        = -(jd.transpose() * y.cast<double>());
+            A.makeCompressed();
+            
+            KSVectorXd s;
+            const bool succeeded    = (m_SparseType == CholeskyType::CHOLESKY_LDLT)
+                ? SolveSparse(m_SparseSolverLDLTd, A, b, s)
+                : SolveSparse(m_SparseSolverd, A, b, s);
+            if (!succeeded)
+            {
+                return false;
+            }
+            dst                 += s.cast<float>();
+            return true;
+        };
+        
+        //! 密行列の分解と求解
+        template <typename MatrixType, typename RhsType, typename ResultType>
+        inline bool SolveDense(const MatrixType& A, const RhsType& b, ResultType& x) const
+        {
+            if (m_DenseType == CholeskyType::CHOLESKY_LLT)
+            {
+                Eigen::LLT<MatrixType> llt(A);
+                if (llt.info() != Eigen::Success)
+                {
+                    return false;
+                }
+                x   = llt.solve(b);
+                return true;
+            }
+            
+            Eigen::LDLT<MatrixType> ldlt(A);
+            if (ldlt.info() != Eigen::Success)
             {
                 return false;
             }
+            x   = ldlt.solve(b);
+            return true;
+        };
+        
+        //! スパース行列の分解と求解(パターンが変わった時だけシンボリック解析をやり直す)
+        template <typename SolverType, typename SparseMatrixType, typename VectorType>
+        inline bool SolveSparse(SolverType& solver, const SparseMatrixType& A, const VectorType& b, VectorType& x)
+        {
+            if (!IsSameSparsePattern(A))
+            {
+                solver.analyzePattern(A);
+                if (solver.info() != Eigen::Success)
+                {
+                    ResetSparsePattern();
+                    return false;
+                }
+                CacheSparsePattern(A);
+            }
             
-            KSMatrixSparsef s   = solver.solve(b);
-            dst                 = dst + s;
+            solver.factorize(A);
+            if (solver.info() != Eigen::Success)
+            {
+                return false;
+            }
+            x   = solver.solve(b);
             return true;
         };
+        
+        //! 非ゼロパターンが前回のシンボリック解析時と同じかどうか
+        template <typename SparseMatrixType>
+        inline bool IsSameSparsePattern(const SparseMatrixType& A) const
+        {
+            if (!m_HasSparsePattern
+                || A.rows() != m_PatternRows
+                || A.cols() != m_PatternCols
+                || A.nonZeros() != static_cast<int>(m_InnerPattern.size()))
+            {
+                return false;
+            }
+            return std::equal(m_OuterPattern.begin(), m_OuterPattern.end(), A.outerIndexPtr())
+                && std::equal(m_InnerPattern.begin(), m_InnerPattern.end(), A.innerIndexPtr());
+        };
+        
+        //! 非ゼロパターンのキャッシュ
+        template <typename SparseMatrixType>
+        inline void CacheSparsePattern(const SparseMatrixType& A)
+        {
+            m_PatternRows   = static_cast<int>(A.rows());
+            m_PatternCols   = static_cast<int>(A.cols());
+            m_OuterPattern.assign(A.outerIndexPtr(), A.outerIndexPtr() + A.outerSize() + 1);
+            m_InnerPattern.assign(A.innerIndexPtr(), A.innerIndexPtr() + A.nonZeros());
+            m_HasSparsePattern  = true;
+        };
+    
+    private:
+        //! スパース行列用のソルバ(シンボリック解析結果を保持する)
+        Eigen::SimplicialLLT<KSMatrixSparsef>   m_SparseSolver;
+        //! 混合精度で使うスパース行列用のソルバ
+        Eigen::SimplicialLLT<KSMatrixSparsed>   m_SparseSolverd;
+        //! スパース行列用のLDL^t分解のソルバ
+        Eigen::SimplicialLDLT<KSMatrixSparsef>  m_SparseSolverLDLT;
+        //! 混合精度で使うスパース行列用のLDL^t分解のソルバ
+        Eigen::SimplicialLDLT<KSMatrixSparsed>  m_SparseSolverLDLTd;
+        //! 密行列の分解の種類
+        CholeskyType                            m_DenseType;
+        //! スパース行列の分解の種類
+        CholeskyType                            m_SparseType;
+        //! 混合精度で使う正規方程式の累積
+        KSNormalEquationAccumulator             m_Accumulator;
+        //! シンボリック解析済みかどうか
+        bool    m_HasSparsePattern;
+        //! シンボリック解析時の行数
+        int     m_PatternRows;
+        //! シンボリック解析時の列数
+        int     m_PatternCols;
+        //! シンボリック解析時の列ごとの先頭インデックス
+        std::vector<int>    m_OuterPattern;
+        //! シンボリック解析時の行インデックス
+        std::vector<int>    m_InnerPattern;
 
     };
     
@@ -14,6 +14,7 @@
 #define KSConjugateGradient_h
 
 #include "KSNormalEquationSolver.h"
+#include "KSPreconditioner.h"
 #include <eigen3/Eigen/SparseCholesky>
 #include <eigen3/Eigen/IterativeLinearSolvers>
 
@@ -21,14 +22,21 @@
 namespace Kosakasakas {
     
     /**
-     @brief 正規方程式のコレスキー分解によるソルバ
-     正規方程式をコレスキー分解により解くクラスです.
+     @brief 正規方程式の前処理付き共役勾配法によるソルバ
+     
+     正規方程式を前処理付き共役勾配法により解くクラスです.
+     前処理はJacobi、パラメータグループごとのブロックJacobi、不完全コレスキー分解から選べます.
+     前回の解(前フレームのステップ)を初期値に使うウォームスタートと、相対残差による打ち切りに対応しています.
      */
     class KSConjugateGradient : public KSNormalEquationSolver
     {
     public:
         //! コンストラクタ
         KSConjugateGradient()
+        : m_Tolerance(1.0e-6f)
+        , m_UseWarmStart(true)
+        , m_LastIterations(0)
+        , m_LastRelativeResidual(0.0f)
         {};
         
         //! デストラクタ
@@ -38,37 +46,101 @@ namespace Kosakasakas {
         //! 初期化
         inline bool Initialize()
         {
+            ResetWarmStart();
             return true;
         };
         
         //! 終了処理
         inline void Finalize()
-        {};
+        {
+            ResetWarmStart();
+        };
+        
+        /**
+         @brief 前処理のタイプのセット
+         
+         デフォルトではJacobi前処理が指定されています.
+         @param type    前処理のタイプ
+         */
+        inline void SetPreconditioner(PreconditionerType type)
+        {
+            m_Preconditioner.SetType(type);
+        }
+        
+        /**
+         @brief パラメータグループのセット
+         
+         ブロックJacobi前処理で使うパラメータグループの要素数を先頭から順に指定します.
+         @param blockSizes  パラメータグループごとの要素数
+         */
+        inline void SetBlockSizes(const std::vector<int>& blockSizes)
+        {
+            m_Preconditioner.SetBlockSizes(blockSizes);
+        }
+        
+        /**
+         @brief 収束判定の閾値のセット
+         
+         残差ノルムが右辺ノルムのtolerance倍以下になった時点で反復を打ち切ります.
+         @param tolerance   相対残差の閾値
+         */
+        inline void SetTolerance(float tolerance)
+        {
+            m_Tolerance = tolerance;
+        }
+        
+        /**
+         @brief ウォームスタートの有効化
+         
+         有効な場合、前回の解を反復の初期値に使います.
+         @param enable  有効にするかどうか
+         */
+        inline void SetWarmStart(bool enable)
+        {
+            m_UseWarmStart  = enable;
+        }
+        
+        //! ウォームスタート用に保持している前回の解を破棄
+        inline void ResetWarmStart()
+        {
+            m_PrevStep.resize(0);
+        }
+        
+        //! 前回の計算の反復回数
+        inline int  GetLastIterations() const
+        {
+            return m_LastIterations;
+        }
+        
+        //! 前回の計算の相対残差
+        inline float    GetLastRelativeResidual() const
+        {
+            return m_LastRelativeResidual;
+        }
         
         /**
          @brief 計算実行
          
          実際に計算を行う関数です.
-         コレスキー分解により正規方程式を解きます.
+         前処理付き共役勾配法により正規方程式を解きます.
          @param dst     出力パラメータ行列
          @param y       残差関数
          @param j       残差関数のヤコビアン
+         @param maxIterations   共役勾配法の最大反復回数
          @return 計算の成否
          */
         inline bool Solve(KSMatrixXf& dst, KSMatrixXf& y, KSMatrixXf& j, int maxIterations)
         {
-            KSMatrixXf jt  = j.transpose();
-            KSMatrixXf A   = jt * j;
-            KSMatrixXf b   = jt * y * -1.0;
-            Eigen::ConjugateGradient<KSMatrixXf> solver;
-            solver.compute(A);
-            if(solver.info()!=Eigen::Success)
+            KSMatrixXf A;
+            A.noalias()     = j.transpose() * j;
+            KSVectorXf b    = -(j.transpose() * y.col(0));
+            
+            KSVectorXf s;
+            if (!SolvePCG(s, A, b, maxIterations))
             {
                 return false;
             }
-            solver.setMaxIterations(maxIterations);
-            KSMatrixXf s   = solver.solve(b);
-            dst                 = dst + s;
+            dst.col(0)      += s;
             return true;
         };
         
@@ -76,29 +148,120 @@ namespace Kosakasakas {
          @brief 計算実行
          
          実際に計算を行う関数です.
-         コレスキー分解により正規方程式を解きます.
-         @param dst     出力パラメータ行列
-         @param y       残差関数
-         @param j       残差関数のヤコビアン
+         前処理付き共役勾配法により正規方程式を解きます.
+         @param dst     出力パラメータベクトル
+         @param y       残差ベクトル
+         @param j       残差関数のスパースヤコビアン
+         @param maxIterations   共役勾配法の最大反復回数
          @return 計算の成否
          */
-        inline bool Solve(KSMatrixSparsef& dst, KSMatrixSparsef& y, KSMatrixSparsef& j, int maxIterations)
+        inline bool Solve(KSVectorXf& dst, KSVectorXf& y, KSMatrixSparsef& j, int maxIterations)
         {
-            KSMatrixSparsef jt  = j.transpose();
-            KSMatrixSparsef A   = jt * j;
-            KSMatrixSparsef b   = jt * y * -1.0;
-            Eigen::ConjugateGradient<KSMatrixSparsef> solver;
-            solver.compute(A);
-            if(solver.info()!=Eigen::Success)
+            KSMatrixSparsef A   = KSMatrixSparsef(j.transpose()) * j;
+            KSVectorXf b        = -(j.transpose() * y);
+            
+            KSVectorXf s;
+            if (!SolvePCG(s, A, b, maxIterations))
             {
                 return false;
             }
-            solver.setMaxIterations(maxIterations);
-            KSMatrixSparsef s   = solver.solve(b);
-            dst                 = dst + s;
+            dst                 += s;
             return true;
         };
         
+    private:
+        /**
+         @brief 前処理付き共役勾配法の反復
+         @param x       出力の解ベクトル
+         @param A       係数行列
+         @param b       右辺ベクトル
+         @param maxIterations   最大反復回数
+         @return 計算の成否
+         */
+        template <typename MatrixType>
+        inline bool SolvePCG(KSVectorXf& x, const MatrixType& A, const KSVectorXf& b, int maxIterations)
+        {
+            const int n = static_cast<int>(b.size());
+            if (A.rows() != n || A.cols() != n || !m_Preconditioner.Compute(A))
+            {
+                return false;
+            }
+            
+            // 初期値(ウォームスタート)
+            if (m_UseWarmStart && m_PrevStep.size() == n && m_PrevStep.allFinite())
+            {
+                x   = m_PrevStep;
+            }
+            else
+            {
+                x.setZero(n);
+            }
+            
+            const float bNorm   = b.norm();
+            if (bNorm <= 0.0f)
+            {
+                x.setZero(n);
+                m_PrevStep              = x;
+                m_LastIterations        = 0;
+                m_LastRelativeResidual  = 0.0f;
+                return true;
+            }
+            
+            KSVectorXf r    = b - A * x;
+            KSVectorXf z, p, Ap;
+            m_Preconditioner.Apply(z, r);
+            p               = z;
+            float rz        = r.dot(z);
+            
+            int k = 0;
+            for (; k < maxIterations; ++k)
+            {
+                if (r.norm() <= m_Tolerance * bNorm)
+                {
+                    break;
+                }
+                
+                Ap.noalias()    = A * p;
+                const float pAp = p.dot(Ap);
+                if (pAp <= 0.0f)
+                {
+                    break;
+                }
+                
+                const float alpha   = rz / pAp;
+                x               += alpha * p;
+                r               -= alpha * Ap;
+                
+                m_Preconditioner.Apply(z, r);
+                const float rzNew   = r.dot(z);
+                p               = z + (rzNew / rz) * p;
+                rz              = rzNew;
+            }
+            
+            m_LastIterations        = k;
+            m_LastRelativeResidual  = r.norm() / bNorm;
+            if (!x.allFinite())
+            {
+                ResetWarmStart();
+                return false;
+            }
+            m_PrevStep  = x;
+            return true;
+        }
+    
+    private:
+        //! 前処理
+        KSPreconditioner    m_Preconditioner;
+        //! 相対残差の閾値
+        float       m_Tolerance;
+        //! ウォームスタートを使うかどうか
+        bool        m_UseWarmStart;
+        //! 前回の解
+        KSVectorXf  m_PrevStep;
+        //! 前回の計算の反復回数
+        int         m_LastIterations;
+        //! 前回の計算の相対残差
+        float       m_LastRelativeResidual;
     };
     
 } //namespace Kosakasakas {
@@ -19,6 +19,7 @@ KSDenseOptimizer::KSDenseOptimizer()
 : m_IsInitialized(false)
 , m_pNESolver(nullptr)
 , m_MaxIterations(4)
+, m_Precision(PrecisionType::SINGLE_PRECISION)
 {}
 
 // デストラクタ
@@ -33,6 +34,8 @@ bool    KSDenseOptimizer::Initialize(KSFunction& residual,
 {
     m_FuncResidual  = std::move(residual);
     m_FuncJacobian  = std::move(jaconian);
+    m_FuncJv        = nullptr;
+    m_FuncJtv       = nullptr;
     m_MatParam      = std::move(initParam);
     m_MatData       = std::move(data);
     m_IsInitialized = true;
@@ -45,11 +48,38 @@ bool    KSDenseOptimizer::Initialize(KSFunction& residual,
     if (!m_pNESolver)
     {
         m_pNESolver     = m_NESolverFactory.Create(NESolverType::CHOLESKY);
+        ApplyPrecision();
     }
 
     return true;
 }
 
+// 行列フリーでの初期化
+bool    KSDenseOptimizer::InitializeMatrixFree(KSFunction& residual,
+                                               KSJacobianProduct& jv,
+                                               KSJacobianProduct& jtv,
+                                               KSMatrixXf& initParam,
+                                               KSMatrixXf& data)
+{
+    m_FuncResidual  = std::move(residual);
+    m_FuncJacobian  = nullptr;
+    m_FuncJv        = std::move(jv);
+    m_FuncJtv       = std::move(jtv);
+    m_MatParam      = std::move(initParam);
+    m_MatData       = std::move(data);
+    m_IsInitialized = true;
+    
+    if (!m_NESolverFactory.Initialize())
+    {
+        return false;
+    }
+    
+    m_pNESolver     = m_NESolverFactory.Create(NESolverType::MATRIX_FREE_PCG);
+    ApplyPrecision();
+    
+    return true;
+}
+
 // 最適化ステップの実行（ガウス-ニュートン法）
 bool    KSDenseOptimizer::DoGaussNewtonStep()
 {
@@ -58,52 +88,410 @@ bool    KSDenseOptimizer::DoGaussNewtonStep()
         return false;
     }
     
-    KSMatrixXf j    = m_FuncJacobian(m_MatParam);
-    if (j.rows() < j.cols())
+    KSMatrixXf y    = m_FuncResidual(m_MatParam);
+    
+    return ComputeStep(y, false, nullptr, 0.0, nullptr);
+}
+
+// IRLS最適化ステップの実行（ガウス-ニュートン法）
+bool    KSDenseOptimizer::DoGaussNewtonStepIRLS()
+{
+    if (!m_IsInitialized || !m_pNESolver)
     {
         return false;
     }
     
     KSMatrixXf y    = m_FuncResidual(m_MatParam);
     
-    return m_pNESolver->Solve(m_MatParam, y, j, m_MaxIterations);
+    return ComputeStep(y, true, nullptr, 0.0, nullptr);
 }
 
-// IRLS最適化ステップの実行（ガウス-ニュートン法）
-bool    KSDenseOptimizer::DoGaussNewtonStepIRLS()
+// 収束するまで最適化ステップを実行
+KSSolveSummary  KSDenseOptimizer::Solve(const KSSolveOptions& options)
 {
-    if (!m_IsInitialized)
+    KSSolveSummary  summary;
+    KSSolveTimer    timer;
+    if (!m_IsInitialized || !m_pNESolver)
+    {
+        return summary;
+    }
+    
+    // 残差はステップの計算とコストの評価で使い回す
+    KSMatrixXf y        = m_FuncResidual(m_MatParam);
+    double cost         = GetCost(y, options.useIRLS);
+    summary.initialCost = cost;
+    summary.termination = SolveTerminationType::MAX_ITERATIONS;
+    
+    const bool useDogleg    = (options.stepStrategy == StepStrategyType::DOGLEG);
+    if (useDogleg && options.useIRLS)
+    {
+        // IRLSの重みは反復ごとに変わるので、重み付きの二次モデルの予測とロバストなコストの減少量を比べられない
+        summary.termination = SolveTerminationType::FAILURE;
+        summary.finalCost   = cost;
+        return summary;
+    }
+    double radius           = options.initialTrustRadius;
+    double lastStepTime     = 0.0;
+    for (int i = 0; i < options.maxIterations; ++i)
+    {
+        // 次のステップが予算内に収まらない場合は打ち切る
+        const double stepStart  = timer.GetElapsedSeconds();
+        if (options.maxSolveTimeInSeconds > 0.0
+            && stepStart + lastStepTime > options.maxSolveTimeInSeconds)
+        {
+            summary.termination = SolveTerminationType::TIME_BUDGET;
+            break;
+        }
+        
+        const KSMatrixXf prevParam  = m_MatParam;
+        double gradientNorm         = 0.0;
+        double newCost              = cost;
+        const bool succeeded        = useDogleg
+            ? DoDoglegStep(y, newCost, radius, options, gradientNorm)
+            : ComputeStep(y, options.useIRLS, &gradientNorm, options.gradientTolerance, nullptr);
+        if (!succeeded)
+        {
+            summary.termination = SolveTerminationType::FAILURE;
+            break;
+        }
+        summary.gradientNorm    = gradientNorm;
+        if (options.gradientTolerance > 0.0 && gradientNorm <= options.gradientTolerance)
+        {
+            summary.stepNorm    = 0.0;
+            summary.termination = SolveTerminationType::GRADIENT_CONVERGENCE;
+            break;
+        }
+        ++summary.iterations;
+        
+        if (!useDogleg)
+        {
+            // ドッグレッグ法では採択したステップの残差とコストが既に求まっている
+            y       = m_FuncResidual(m_MatParam);
+            newCost = GetCost(y, options.useIRLS);
+        }
+        if (!std::isfinite(newCost))
+        {
+            // 発散した場合はステップ前のパラメータに戻す
+            m_MatParam          = prevParam;
+            summary.termination = SolveTerminationType::FAILURE;
+            break;
+        }
+        
+        const double paramNorm  = prevParam.norm();
+        summary.stepNorm        = (m_MatParam - prevParam).norm();
+        const double costChange = std::fabs(cost - newCost);
+        const double prevCost   = cost;
+        cost                    = newCost;
+        lastStepTime            = timer.GetElapsedSeconds() - stepStart;
+        
+        if (options.functionTolerance > 0.0 && costChange <= options.functionTolerance * prevCost)
+        {
+            summary.termination = SolveTerminationType::COST_CONVERGENCE;
+            break;
+        }
+        if (options.parameterTolerance > 0.0
+            && summary.stepNorm <= options.parameterTolerance * (paramNorm + options.parameterTolerance))
+        {
+            summary.termination = SolveTerminationType::STEP_CONVERGENCE;
+            break;
+        }
+    }
+    
+    summary.finalCost           = cost;
+    summary.totalTimeInSeconds  = timer.GetElapsedSeconds();
+    return summary;
+}
+
+// ドッグレッグ法による最適化ステップの実行
+bool    KSDenseOptimizer::DoDoglegStep(KSMatrixXf& y,
+                                       double& cost,
+                                       double& radius,
+                                       const KSSolveOptions& options,
+                                       double& gradientNorm)
+{
+    // 線形化と正規方程式の求解は1回だけ行う(IRLSとは組み合わせないので残差はそのまま使う)
+    if (!ComputeStep(y, false, &gradientNorm, options.gradientTolerance, &m_Dogleg))
     {
         return false;
     }
+    if (options.gradientTolerance > 0.0 && gradientNorm <= options.gradientTolerance)
+    {
+        return true;
+    }
+    if (radius <= 0.0)
+    {
+        radius  = m_Dogleg.GetGaussNewtonNorm();
+    }
+    
+    // 棄却された場合は半径だけを縮めてステップを作り直す
+    const KSMatrixXf x      = m_MatParam;
+    const double minRadius  = options.parameterTolerance * (x.norm() + options.parameterTolerance);
+    const int maxTrials     = 32;
+    KSVectorXf step;
+    for (int trial = 0; trial < maxTrials && radius > minRadius; ++trial)
+    {
+        double predicted        = 0.0;
+        const double stepNorm   = m_Dogleg.ComputeStep(radius, step, predicted);
+        m_MatParam              = x;
+        if (m_ParamMask.IsActive())
+        {
+            m_ParamMask.AddStep(m_MatParam, step);
+        }
+        else
+        {
+            m_MatParam.col(0)   += step;
+        }
+        
+        KSMatrixXf yNew         = m_FuncResidual(m_MatParam);
+        const double newCost    = GetCost(yNew, false);
+        const double rho        = (predicted > 0.0) ? (cost - newCost) / predicted : -1.0;
+        if (std::isfinite(newCost) && rho > 0.0)
+        {
+            if (rho > 0.75)
+            {
+                radius  = std::max(radius, 3.0 * stepNorm);
+            }
+            else if (rho < 0.25)
+            {
+                radius  *= 0.5;
+            }
+            y.swap(yNew);
+            cost    = newCost;
+            return true;
+        }
+        radius  = 0.5 * std::min(radius, stepNorm);
+    }
+    
+    // コストを下げるステップが見つからなかった場合はパラメータを戻す
+    // (コストが変化しないので、呼び出し側では収束として扱われる)
+    m_MatParam  = x;
+    return true;
+}
+
+// 最適化ステップの計算
+bool    KSDenseOptimizer::ComputeStep(KSMatrixXf& y,
+                                      bool useIRLS,
+                                      double* pGradientNorm,
+                                      double gradientTolerance,
+                                      KSDoglegModel* pDogleg)
+{
+    // IRLS用のweightを算出
+    KSVectorXf w;
+    if (useIRLS)
+    {
+        ComputeIRLSRowScale(w, y.col(0));
+        y.array().colwise() *= w.array();
+    }
+    
+    m_ParamMask.Update(static_cast<int>(m_MatParam.rows()));
+    
+    if (m_FuncJv)
+    {
+        return DoMatrixFreeStep(y, w, pGradientNorm, gradientTolerance, pDogleg);
+    }
     
     KSMatrixXf j    = m_FuncJacobian(m_MatParam);
+    if (m_ParamMask.IsActive())
+    {
+        // 固定したパラメータの列を取り除く
+        KSMatrixXf jf;
+        m_ParamMask.GatherColumns(jf, j);
+        j.swap(jf);
+    }
     if (j.rows() < j.cols())
     {
         return false;
     }
-    KSMatrixXf y    = m_FuncResidual(m_MatParam);
+    if (useIRLS)
+    {
+        j.array().colwise() *= w.array();
+    }
+    
+    // 勾配が十分小さければステップを解かずに終了
+    if (pGradientNorm)
+    {
+        *pGradientNorm  = (j.transpose() * y.col(0)).cwiseAbs().maxCoeff();
+        if (gradientTolerance > 0.0 && *pGradientNorm <= gradientTolerance)
+        {
+            return true;
+        }
+    }
+    
+    if (!m_ParamMask.IsActive() && !pDogleg)
+    {
+        return m_pNESolver->Solve(m_MatParam, y, j, m_MaxIterations);
+    }
+    
+    // 自由なパラメータだけのステップを解いて元の位置に加算する
+    KSMatrixXf step = KSMatrixXf::Zero(j.cols(), 1);
+    if (!m_pNESolver->Solve(step, y, j, m_MaxIterations))
+    {
+        return false;
+    }
+    if (pDogleg)
+    {
+        // パラメータは更新せず、ドッグレッグ法のモデルを作る
+        const KSVectorXf g  = j.transpose() * y.col(0);
+        pDogleg->Set(y.col(0), g, j * g, step.col(0), j * step.col(0));
+        return true;
+    }
+    m_ParamMask.AddStep(m_MatParam, step.col(0));
+    return true;
+}
+
+// コストの評価
+double  KSDenseOptimizer::GetCost(const KSMatrixXf& y, bool useIRLS) const
+{
+    if (useIRLS)
+    {
+        return ComputeResidualBlockCost(y.col(0), m_ResidualBlocks);
+    }
+    return y.squaredNorm();
+}
+
+// IRLSの行スケールの算出
+void    KSDenseOptimizer::ComputeIRLSRowScale(KSVectorXf& w, const KSVectorXf& r) const
+{
+    if (m_ResidualBlocks.empty())
+    {
+        w   = r.cwiseAbs().cwiseMax(0.00001).cwiseInverse();
+    }
+    else
+    {
+        ComputeResidualBlockRowScale(w, r, m_ResidualBlocks);
+    }
+}
+
+// 行列フリーでの最適化ステップの実行
+bool    KSDenseOptimizer::DoMatrixFreeStep(KSMatrixXf& y,
+                                           const KSVectorXf& w,
+                                           double* pGradientNorm,
+                                           double gradientTolerance,
+                                           KSDoglegModel* pDogleg)
+{
+    auto pSolver    = std::dynamic_pointer_cast<KSMatrixFreeConjugateGradient>(m_pNESolver);
+    if (!pSolver)
+    {
+        return false;
+    }
+    
+    // 作用素の評価中はパラメータを固定しておく
+    const KSMatrixXf x  = m_MatParam;
+    const bool useScale = (w.size() == y.rows());
+    const bool useMask  = m_ParamMask.IsActive();
+    KSVectorXf full;
     
-    // IRLS用のweightを算出して乗算
-    KSMatrixXf w    = y.col(0).cwiseAbs().cwiseMax(0.00001).cwiseInverse().asDiagonal();
-    for (int i=0,n=j.cols(); i<n; ++i)
+    // パラメータを固定する場合、作用素は自由なパラメータの空間で働く
+    KSLinearOperator jv = [&](KSVectorXf& dst, const KSVectorXf& v)
     {
-        j.col(i) = w * j.col(i);
+        if (useMask)
+        {
+            m_ParamMask.Scatter(full, v);
+            dst = m_FuncJv(x, full);
+        }
+        else
+        {
+            dst = m_FuncJv(x, v);
+        }
+        if (useScale)
+        {
+            dst.array() *= w.array();
+        }
+    };
+    KSLinearOperator jtv = [&](KSVectorXf& dst, const KSVectorXf& v)
+    {
+        if (useScale)
+        {
+            full = m_FuncJtv(x, v.cwiseProduct(w));
+        }
+        else
+        {
+            full = m_FuncJtv(x, v);
+        }
+        if (useMask)
+        {
+            m_ParamMask.Gather(dst, full);
+        }
+        else
+        {
+            dst.swap(full);
+        }
+    };
+    
+    // 勾配が十分小さければステップを解かずに終了
+    if (pGradientNorm)
+    {
+        KSVectorXf g;
+        jtv(g, y.col(0));
+        *pGradientNorm  = g.cwiseAbs().maxCoeff();
+        if (gradientTolerance > 0.0 && *pGradientNorm <= gradientTolerance)
+        {
+            return true;
+        }
     }
-    y = w * y;
     
-    return m_pNESolver->Solve(m_MatParam, y, j, m_MaxIterations);
+    if (!useMask && !pDogleg)
+    {
+        return pSolver->Solve(m_MatParam, y, jv, jtv, m_MaxIterations);
+    }
+    
+    KSMatrixXf step = KSMatrixXf::Zero(useMask ? m_ParamMask.GetNumFree() : x.rows(), 1);
+    if (!pSolver->Solve(step, y, jv, jtv, m_MaxIterations))
+    {
+        return false;
+    }
+    if (pDogleg)
+    {
+        KSVectorXf g, jg, jh;
+        jtv(g, y.col(0));
+        jv(jg, g);
+        jv(jh, step.col(0));
+        pDogleg->Set(y.col(0), g, jg, step.col(0), jh);
+        return true;
+    }
+    m_ParamMask.AddStep(m_MatParam, step.col(0));
+    return true;
+}
+
+// ロバストコストの取得
+double KSDenseOptimizer::GetRobustCost()
+{
+    return ComputeResidualBlockCost(m_FuncResidual(m_MatParam).col(0), m_ResidualBlocks);
 }
 
 // 残差平方和の取得
 double KSDenseOptimizer::GetSquaredResidualsSum()
 {
-    return fabs((m_FuncResidual(m_MatParam).transpose() * m_FuncResidual(m_MatParam))(0));
+    return m_FuncResidual(m_MatParam).squaredNorm();
 }
 
 // 正規方程式ソルバの変更
 void    KSDenseOptimizer::SwitchNormalEquationSolver(NESolverType type)
 {
     m_pNESolver = m_NESolverFactory.Create(type);
+    ApplyPrecision();
+}
+
+// シューア補行列の正規方程式ソルバへの変更
+void    KSDenseOptimizer::SwitchToSchurComplementSolver(int sharedSize, const std::vector<int>& frameSizes)
+{
+    m_pNESolver = m_NESolverFactory.CreateSchurComplement(sharedSize, frameSizes);
+    ApplyPrecision();
+}
+
+// 計算精度のセット
+void    KSDenseOptimizer::SetPrecision(PrecisionType precision)
+{
+    m_Precision = precision;
+    ApplyPrecision();
+}
+
+// 正規方程式ソルバへの計算精度の反映
+void    KSDenseOptimizer::ApplyPrecision()
+{
+    if (m_pNESolver)
+    {
+        m_pNESolver->SetPrecision(m_Precision);
+    }
 }
 
@@ -18,6 +18,11 @@
 #include <functional>
 #include "KSNormalEquationSolver.h"
 #include "KSNESolverFactory.h"
+#include "KSMatrixFreeConjugateGradient.h"
+#include "KSRobustLoss.h"
+#include "KSSolveOptions.h"
+#include "KSParameterMask.h"
+#include "KSDoglegModel.h"
 
 namespace Kosakasakas {
     
@@ -50,6 +55,25 @@ namespace Kosakasakas {
                            KSMatrixXf& initParam,
                            KSMatrixXf& data);
         
+        /**
+         @brief 行列フリーでの初期化
+         
+         ヤコビアンを陽に作らず、J・vとJ^t・vの積を返す関数だけで最適化計算クラスを初期化します.
+         正規方程式ソルバは行列フリーの共役勾配法に切り替わります.
+         各パラメータは内部でstd::moveされ、所有権がこのクラスに渡ってしまう点に注意して下さい。
+         @param residual    残差関数
+         @param jv          パラメータxでのJ・vを返す関数
+         @param jtv         パラメータxでのJ^t・vを返す関数
+         @param param       パラメータの初期値マトリックス
+         @param data        サンプルデータマトリック
+         @return 初期化の成否
+         */
+        bool    InitializeMatrixFree(KSFunction& residual,
+                                     KSJacobianProduct& jv,
+                                     KSJacobianProduct& jtv,
+                                     KSMatrixXf& initParam,
+                                     KSMatrixXf& data);
+        
         /**
          @brief 最適化ステップの実行（ガウス-ニュートン法）
          
@@ -64,13 +88,37 @@ namespace Kosakasakas {
          @brief IRLS最適化ステップの実行（ガウス-ニュートン法）
          
          Iteratively reweighted least squaresをガウス-ニュートン法により最適化計算します。
-         重みの計算は、前ステップの解による残差の逆数を絶対値で使っています。
+         残差ブロックがセットされている場合は、ブロックごとの損失関数から重みを算出します。
+         セットされていない場合は、前ステップの解による残差の逆数を絶対値で使っています。
          内部では1回しか最適化計算を行わないため、アプリケーション側で複数回計算ステップを実行してください。
          実行前に必ずInitializeを呼んでください。
          @return 初期化の成否
          */
         bool    DoGaussNewtonStepIRLS();
         
+        /**
+         @brief 収束するまで最適化ステップを実行
+         
+         コストの相対減少量、勾配のノルム、ステップのノルムのいずれかが閾値を下回るか、
+         最大反復回数・計算時間の予算に達するまでステップを繰り返します.
+         残差はステップの計算とコストの評価で使い回すため、1反復あたりの残差関数の評価は1回です.
+         options.stepStrategyにDOGLEGを指定すると信頼領域ステップを使います. ステップが棄却された場合も
+         正規方程式は解き直さないので、追加の計算は残差関数の評価だけです.
+         実行前に必ずInitializeを呼んでください。
+         @param options     収束判定と計算予算の設定
+         @return 最適化ループの結果
+         */
+        KSSolveSummary  Solve(const KSSolveOptions& options);
+        
+        /**
+         @brief ロバストコストの取得
+         
+         現在のパラメータでの、残差ブロックごとの損失関数の総和を取得します。
+         残差ブロックがセットされていない場合は残差平方和と同じ値になります。
+         @return ロバストコスト
+         */
+        double  GetRobustCost();
+        
         /**
          @brief 残差平方和の取得
          
@@ -110,6 +158,37 @@ namespace Kosakasakas {
          */
         void    SwitchNormalEquationSolver(NESolverType type);
         
+        /**
+         @brief シューア補行列の正規方程式ソルバへの変更
+         
+         SwitchNormalEquationSolver(SCHUR_COMPLEMENT)ではブロック構造が決まらないので、こちらを使います.
+         @param sharedSize  共有ブロックの要素数(パラメータの先頭に並べます)
+         @param frameSizes  フレームごとのブロックの要素数(共有ブロックの後ろに順に並べます)
+         */
+        void    SwitchToSchurComplementSolver(int sharedSize, const std::vector<int>& frameSizes);
+        
+        /**
+         @brief 計算精度のセット
+         
+         MIXED_PRECISIONを指定すると、残差とヤコビアンはfloatのまま、
+         正規方程式の累積と分解をdoubleで行います(コレスキー分解のソルバのみ対応).
+         画素単位の残差のように要素数が多い場合に、桁落ちによる余分な反復を減らせます.
+         デフォルトはSINGLE_PRECISIONです.
+         @param precision   計算精度
+         */
+        void    SetPrecision(PrecisionType precision);
+        
+        /**
+         @brief 正規方程式ソルバの取得
+         
+         前処理や収束判定など、ソルバ固有の設定を行う場合に使います.
+         @return 正規方程式ソルバへのシェアードポインタ
+         */
+        inline std::shared_ptr<KSNormalEquationSolver>  GetNormalEquationSolver() const
+        {
+            return m_pNESolver;
+        }
+        
         /**
          @brief パラメータ行列のセット
          
@@ -122,6 +201,32 @@ namespace Kosakasakas {
             m_MatParam  = std::move(paramMat);
         }
         
+        /**
+         @brief 残差ブロックのセット
+         
+         IRLSで使う残差ブロックと損失関数をセットします.
+         ブロックがセットされている場合、DoGaussNewtonStepIRLSは各ブロックの損失関数から重みを算出します.
+         空のリストをセットすると従来の重み(残差の絶対値の逆数)に戻ります.
+         @param blocks  残差ブロックのリスト
+         */
+        inline void SetResidualBlocks(const std::vector<KSResidualBlock>& blocks)
+        {
+            m_ResidualBlocks    = blocks;
+        }
+        
+        /**
+         @brief 固定するパラメータブロックのセット
+         
+         指定したブロックのパラメータを固定し、残りのパラメータだけを最適化します.
+         固定した列は正規方程式から取り除くので、J^tJは自由なパラメータ数の2乗の大きさになります.
+         空のリストをセットすると全てのパラメータが最適化の対象に戻ります.
+         @param blocks  固定するパラメータブロックのリスト
+         */
+        inline void SetConstantParameterBlocks(const std::vector<KSParameterBlock>& blocks)
+        {
+            m_ParamMask.SetConstantBlocks(blocks);
+        }
+        
         /**
          @brief ソルバ試行回数のセット
          
@@ -134,6 +239,77 @@ namespace Kosakasakas {
             m_MaxIterations = iterations;
         }
         
+    private:
+        /**
+         @brief 行列フリーでの最適化ステップの実行
+         @param y                   残差(スケーリング済み)
+         @param w                   残差の行スケール(空の場合はスケーリングしない)
+         @param pGradientNorm       出力の勾配の最大絶対値(nullptrの場合は計算しない)
+         @param gradientTolerance   勾配の閾値
+         @param pDogleg             ドッグレッグ法のモデル(nullptrでない場合はパラメータを更新せずにモデルを作る)
+         @return 計算の成否
+         */
+        bool    DoMatrixFreeStep(KSMatrixXf& y,
+                                 const KSVectorXf& w,
+                                 double* pGradientNorm,
+                                 double gradientTolerance,
+                                 KSDoglegModel* pDogleg);
+        
+        /**
+         @brief 最適化ステップの計算
+         
+         与えられた残差からステップを解いてパラメータを更新します.
+         pGradientNormが指定された場合は勾配の最大絶対値を返し、閾値以下ならステップを解かずに終了します.
+         pDoglegが指定された場合はパラメータを更新せず、ガウス-ニュートンステップと勾配からドッグレッグ法のモデルを作ります.
+         @param y                   現在のパラメータでの残差(IRLSの場合はスケーリングされます)
+         @param useIRLS             IRLSの重みを使うかどうか
+         @param pGradientNorm       出力の勾配の最大絶対値(nullptrの場合は計算しない)
+         @param gradientTolerance   勾配の閾値
+         @param pDogleg             ドッグレッグ法のモデル(nullptrの場合はガウス-ニュートンステップで更新する)
+         @return 計算の成否
+         */
+        bool    ComputeStep(KSMatrixXf& y,
+                            bool useIRLS,
+                            double* pGradientNorm,
+                            double gradientTolerance,
+                            KSDoglegModel* pDogleg);
+        
+        /**
+         @brief ドッグレッグ法による最適化ステップの実行
+         
+         1回の線形化で得たモデルを使い、コストが下がるまで信頼半径を縮めてステップを試します.
+         採択した場合は残差とコストを新しいパラメータでの値に更新します.
+         @param y               現在のパラメータでの残差(採択した場合は更新されます)
+         @param cost            現在のコスト(採択した場合は更新されます)
+         @param radius          信頼半径(次の反復のために更新されます)
+         @param options         収束判定の設定
+         @param gradientNorm    出力の勾配の最大絶対値
+         @return 計算の成否
+         */
+        bool    DoDoglegStep(KSMatrixXf& y,
+                             double& cost,
+                             double& radius,
+                             const KSSolveOptions& options,
+                             double& gradientNorm);
+        
+        /**
+         @brief コストの評価
+         @param y       残差
+         @param useIRLS IRLSの場合は残差ブロックごとのロバストコスト
+         @return コスト
+         */
+        double  GetCost(const KSMatrixXf& y, bool useIRLS) const;
+        
+        /**
+         @brief IRLSの行スケールの算出
+         @param w   出力の行スケール
+         @param r   残差ベクトル
+         */
+        void    ComputeIRLSRowScale(KSVectorXf& w, const KSVectorXf& r) const;
+        
+        //! 正規方程式ソルバへの計算精度の反映
+        void    ApplyPrecision();
+    
     private:
         //! 正規方程式ソルバへのシェアードポインタ
         typedef std::shared_ptr<KSNormalEquationSolver> NESolverPtr;
@@ -144,6 +320,10 @@ namespace Kosakasakas {
         KSFunction  m_FuncResidual;
         //! 残差のヤコビアンを保持するオブジェクト
         KSFunction  m_FuncJacobian;
+        //! J・vを計算する関数(行列フリーの場合)
+        KSJacobianProduct   m_FuncJv;
+        //! J^t・vを計算する関数(行列フリーの場合)
+        KSJacobianProduct   m_FuncJtv;
         //! パラメータマトリックスを保持するオブジェクト
         KSMatrixXf  m_MatParam;
         //! サンプルデータマトリックスを保持するオブジェクト
@@ -155,6 +335,14 @@ namespace Kosakasakas {
         NESolverPtr         m_pNESolver;
         //! 正規方程式を解く試行回数
         int m_MaxIterations;
+        //! 正規方程式の計算精度
+        PrecisionType   m_Precision;
+        //! IRLSで使う残差ブロックのリスト
+        std::vector<KSResidualBlock>    m_ResidualBlocks;
+        //! 固定するパラメータブロック
+        KSParameterMask                 m_ParamMask;
+        //! ドッグレッグ法のモデル
+        KSDoglegModel                   m_Dogleg;
     };
     
 } //namespace Kosakasakas {
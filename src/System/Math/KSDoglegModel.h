@@ -0,0 +1,163 @@
+//
+//  KSDoglegModel.h
+//
+//  Powellのドッグレッグ法による信頼領域ステップの計算クラス
+//
+//  Copyright (c) 2016年 Takahiro Kosaka. All rights reserved.
+//  Created by Takahiro Kosaka on 2016/07/16.
+//
+//  This Source Code Form is subject to the terms of the Mozilla
+//  Public License v. 2.0. If a copy of the MPL was not distributed
+//  with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef KSDoglegModel_h
+#define KSDoglegModel_h
+
+#include "KSTypeDef.h"
+#include <algorithm>
+#include <cmath>
+
+namespace Kosakasakas {
+    
+    /**
+     @brief ドッグレッグ法による信頼領域ステップの計算クラス
+     
+     1回の線形化で得たガウス-ニュートンステップh_gnと勾配g=J^t・rを保持し、
+     信頼半径ごとのステップを h = c_g・g + c_gn・h_gn の形で求めます.
+     J・gとJ・h_gnの内積も保持しておくので、モデルの予測減少量 |r|^2 - |r + J・h|^2 も係数だけから計算できます.
+     ステップが棄却されて半径を縮める場合も、正規方程式の再分解やヤコビアンの積は不要です.
+     */
+    class KSDoglegModel
+    {
+    public:
+        //! コンストラクタ
+        KSDoglegModel()
+        : m_GG(0.0)
+        , m_GH(0.0)
+        , m_HH(0.0)
+        , m_RJg(0.0)
+        , m_RJh(0.0)
+        , m_JgJg(0.0)
+        , m_JgJh(0.0)
+        , m_JhJh(0.0)
+        {};
+        
+        //! デストラクタ
+        virtual ~KSDoglegModel()
+        {};
+        
+        /**
+         @brief 線形化した問題のセット
+         @param r       残差
+         @param g       勾配 J^t・r
+         @param jg      J・g
+         @param hgn     ガウス-ニュートンステップ
+         @param jhgn    J・h_gn
+         */
+        inline void Set(const KSVectorXf& r,
+                        const KSVectorXf& g,
+                        const KSVectorXf& jg,
+                        const KSVectorXf& hgn,
+                        const KSVectorXf& jhgn)
+        {
+            m_Gradient      = g;
+            m_GaussNewton   = hgn;
+            
+            // 内積は桁落ちを避けるためdoubleで累積する
+            const KSVectorXd rd     = r.cast<double>();
+            const KSVectorXd gd     = g.cast<double>();
+            const KSVectorXd hd     = hgn.cast<double>();
+            const KSVectorXd jgd    = jg.cast<double>();
+            const KSVectorXd jhd    = jhgn.cast<double>();
+            m_GG    = gd.squaredNorm();
+            m_GH    = gd.dot(hd);
+            m_HH    = hd.squaredNorm();
+            m_RJg   = rd.dot(jgd);
+            m_RJh   = rd.dot(jhd);
+            m_JgJg  = jgd.squaredNorm();
+            m_JgJh  = jgd.dot(jhd);
+            m_JhJh  = jhd.squaredNorm();
+        }
+        
+        //! ガウス-ニュートンステップのノルム
+        inline double   GetGaussNewtonNorm() const
+        {
+            return std::sqrt(m_HH);
+        }
+        
+        /**
+         @brief 信頼半径に対するステップの計算
+         
+         h_gnが半径内ならそのまま、最急降下方向の最小点(コーシー点)が半径外なら勾配方向に半径まで、
+         それ以外はコーシー点からh_gnへの線分と半径の交点をステップとします.
+         @param radius      信頼半径
+         @param step        出力のステップ
+         @param predicted   出力のモデルの予測減少量 |r|^2 - |r + J・h|^2
+         @return ステップのノルム
+         */
+        inline double   ComputeStep(double radius, KSVectorXf& step, double& predicted) const
+        {
+            double cg   = 0.0;
+            double ch   = 0.0;
+            if (m_HH <= radius * radius)
+            {
+                ch  = 1.0;
+            }
+            else if (m_GG <= 0.0)
+            {
+                ch  = radius / std::sqrt(m_HH);
+            }
+            else
+            {
+                const double gNorm  = std::sqrt(m_GG);
+                // コーシー点 a = -alpha・g
+                const double alpha  = m_GG / m_JgJg;
+                if (m_JgJg <= 0.0 || alpha * gNorm >= radius)
+                {
+                    cg  = -radius / gNorm;
+                }
+                else
+                {
+                    // |a + beta・(h_gn - a)| = radius を解く
+                    const double aa = alpha * alpha * m_GG;
+                    const double ab = -alpha * m_GH;
+                    const double dd = m_HH - 2.0 * ab + aa;
+                    const double ad = ab - aa;
+                    const double beta   = (-ad + std::sqrt(std::max(ad * ad + dd * (radius * radius - aa), 0.0))) / dd;
+                    cg  = -(1.0 - beta) * alpha;
+                    ch  = beta;
+                }
+            }
+            
+            step        = static_cast<float>(cg) * m_Gradient + static_cast<float>(ch) * m_GaussNewton;
+            predicted   = -(2.0 * (cg * m_RJg + ch * m_RJh)
+                            + cg * cg * m_JgJg + 2.0 * cg * ch * m_JgJh + ch * ch * m_JhJh);
+            return std::sqrt(std::max(cg * cg * m_GG + 2.0 * cg * ch * m_GH + ch * ch * m_HH, 0.0));
+        }
+    
+    private:
+        //! 勾配 g
+        KSVectorXf  m_Gradient;
+        //! ガウス-ニュートンステップ h_gn
+        KSVectorXf  m_GaussNewton;
+        //! g・g
+        double      m_GG;
+        //! g・h_gn
+        double      m_GH;
+        //! h_gn・h_gn
+        double      m_HH;
+        //! r・Jg
+        double      m_RJg;
+        //! r・Jh_gn
+        double      m_RJh;
+        //! Jg・Jg
+        double      m_JgJg;
+        //! Jg・Jh_gn
+        double      m_JgJh;
+        //! Jh_gn・Jh_gn
+        double      m_JhJh;
+    };
+
+} //namespace Kosakasakas {
+
+#endif /* KSDoglegModel_h */
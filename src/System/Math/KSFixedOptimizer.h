@@ -0,0 +1,289 @@
+//
+//  KSFixedOptimizer.h
+//
+//  固定長パラメータの非線形最小二乗問題のための最適化計算クラス
+//
+//  Copyright (c) 2016年 Takahiro Kosaka. All rights reserved.
+//  Created by Takahiro Kosaka on 2016/07/15.
+//
+//  This Source Code Form is subject to the terms of the Mozilla
+//  Public License v. 2.0. If a copy of the MPL was not distributed
+//  with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef KSFixedOptimizer_h
+#define KSFixedOptimizer_h
+
+#include "KSTypeDef.h"
+#include "KSSolveOptions.h"
+#include <eigen3/Eigen/Cholesky>
+#include <limits>
+#include <type_traits>
+#include <cmath>
+
+namespace Kosakasakas {
+    
+    /**
+     @brief 固定長パラメータの非線形最小二乗問題のための最適化計算クラス
+     
+     パラメータ数Nをコンパイル時に固定し、J^tJ、J^tr、分解を固定長のEigen型で扱います.
+     姿勢だけ、照明だけといった小さな問題で、動的確保と仮想関数呼び出しを避けるためのクラスです.
+     J^tJがEigenのスタック確保の上限を超える大きさのNでは、J^tJだけ動的行列にして初期化時に一度だけ確保します.
+     
+     残差ファンクタはテンプレート引数で渡すので、呼び出しはインライン展開されます. ファンクタは次の形式です.
+        
+        int  GetNumResiduals() const;
+        bool operator()(const ParamType& x, int i, float& r, JacobianRowType* pJacobianRow) const;
+     
+     i番目の残差をrに、そのヤコビアンの行をpJacobianRowに書き込みます(pJacobianRowがnullptrの場合は残差のみ).
+     ヤコビアンは1行ずつJ^tJへ累積されるので、残差数×Nのヤコビアン行列は作りません.
+     AccumScalarにdoubleを指定すると、残差とヤコビアンはfloatのまま、J^tJの累積と分解をdoubleで行います.
+     */
+    template <int N, typename AccumScalar = float>
+    class KSFixedOptimizer
+    {
+    public:
+        //! パラメータベクトルの型
+        typedef Eigen::Matrix<float, N, 1>  ParamType;
+        //! ヤコビアンの行の型
+        typedef Eigen::Matrix<float, 1, N>  JacobianRowType;
+        //! 累積用のベクトルの型
+        typedef Eigen::Matrix<AccumScalar, N, 1>    AccumVectorType;
+        //! J^tJの型(スタックに載る大きさなら固定長)
+        typedef typename std::conditional<(N * N * sizeof(AccumScalar) <= EIGEN_STACK_ALLOCATION_LIMIT),
+                                          Eigen::Matrix<AccumScalar, N, N>,
+                                          Eigen::Matrix<AccumScalar, Eigen::Dynamic, Eigen::Dynamic> >::type NormalMatrixType;
+        
+        //! コンストラクタ
+        KSFixedOptimizer()
+        : m_JtJ(N, N)
+        , m_Solver(N)
+        , m_IsInitialized(false)
+        {
+            m_Param.setZero();
+        };
+        
+        //! デストラクタ
+        virtual ~KSFixedOptimizer()
+        {};
+        
+        /**
+         @brief 初期化
+         @param initParam   パラメータの初期値
+         @return 初期化の成否
+         */
+        inline bool Initialize(const ParamType& initParam)
+        {
+            m_Param         = initParam;
+            m_IsInitialized = true;
+            return true;
+        }
+        
+        //! 終了処理
+        inline void Finalize()
+        {
+            m_IsInitialized = false;
+        }
+        
+        //! パラメータベクトルの取得
+        inline const ParamType& GetParamVec() const
+        {
+            return m_Param;
+        }
+        
+        //! パラメータベクトルのセット
+        inline void SetParamVec(const ParamType& param)
+        {
+            m_Param = param;
+        }
+        
+        /**
+         @brief 最適化ステップの実行（ガウス-ニュートン法）
+         @param functor 残差ファンクタ
+         @return 計算の成否
+         */
+        template <typename Functor>
+        bool    DoGaussNewtonStep(const Functor& functor)
+        {
+            double cost, gradientNorm;
+            if (!m_IsInitialized || !Accumulate(functor, cost, gradientNorm))
+            {
+                return false;
+            }
+            return SolveStep();
+        }
+        
+        /**
+         @brief 残差平方和の取得
+         @param functor 残差ファンクタ
+         @return 残差平方和
+         */
+        template <typename Functor>
+        double  GetSquaredResidualsSum(const Functor& functor) const
+        {
+            double cost = 0.0;
+            float r;
+            for (int i = 0, n = functor.GetNumResiduals(); i < n; ++i)
+            {
+                if (!functor(m_Param, i, r, nullptr))
+                {
+                    return std::numeric_limits<double>::infinity();
+                }
+                cost    += static_cast<double>(r) * r;
+            }
+            return cost;
+        }
+        
+        /**
+         @brief 収束するまで最適化ステップを実行
+         
+         J^tJの累積で残差も同時に評価するので、1反復あたりのファンクタの評価は各残差につき1回です.
+         options.useIRLSは使いません(重みが必要な場合はファンクタ側で掛けてください).
+         @param functor 残差ファンクタ
+         @param options 収束判定と計算予算の設定
+         @return 最適化ループの結果
+         */
+        template <typename Functor>
+        KSSolveSummary  Solve(const Functor& functor, const KSSolveOptions& options)
+        {
+            KSSolveSummary  summary;
+            KSSolveTimer    timer;
+            if (!m_IsInitialized)
+            {
+                return summary;
+            }
+            
+            double cost, gradientNorm;
+            if (!Accumulate(functor, cost, gradientNorm))
+            {
+                return summary;
+            }
+            summary.initialCost = cost;
+            summary.termination = SolveTerminationType::MAX_ITERATIONS;
+            
+            double lastStepTime = 0.0;
+            for (int i = 0; i < options.maxIterations; ++i)
+            {
+                const double stepStart  = timer.GetElapsedSeconds();
+                if (options.maxSolveTimeInSeconds > 0.0
+                    && stepStart + lastStepTime > options.maxSolveTimeInSeconds)
+                {
+                    summary.termination = SolveTerminationType::TIME_BUDGET;
+                    break;
+                }
+                
+                summary.gradientNorm    = gradientNorm;
+                if (options.gradientTolerance > 0.0 && gradientNorm <= options.gradientTolerance)
+                {
+                    summary.termination = SolveTerminationType::GRADIENT_CONVERGENCE;
+                    break;
+                }
+                
+                const ParamType prevParam   = m_Param;
+                if (!SolveStep())
+                {
+                    summary.termination = SolveTerminationType::FAILURE;
+                    break;
+                }
+                ++summary.iterations;
+                
+                // 次の反復のJ^tJと一緒に新しいコストを得る
+                const double prevCost   = cost;
+                if (!Accumulate(functor, cost, gradientNorm) || !std::isfinite(cost))
+                {
+                    m_Param             = prevParam;
+                    cost                = prevCost;
+                    summary.termination = SolveTerminationType::FAILURE;
+                    break;
+                }
+                summary.stepNorm    = (m_Param - prevParam).norm();
+                lastStepTime        = timer.GetElapsedSeconds() - stepStart;
+                
+                if (options.functionTolerance > 0.0 && std::fabs(prevCost - cost) <= options.functionTolerance * prevCost)
+                {
+                    summary.termination = SolveTerminationType::COST_CONVERGENCE;
+                    break;
+                }
+                if (options.parameterTolerance > 0.0
+                    && summary.stepNorm <= options.parameterTolerance * (prevParam.norm() + options.parameterTolerance))
+                {
+                    summary.termination = SolveTerminationType::STEP_CONVERGENCE;
+                    break;
+                }
+            }
+            
+            summary.finalCost           = cost;
+            summary.totalTimeInSeconds  = timer.GetElapsedSeconds();
+            return summary;
+        }
+    
+    private:
+        /**
+         @brief J^tJとJ^trの累積
+         @param functor         残差ファンクタ
+         @param cost            出力の残差平方和
+         @param gradientNorm    出力の勾配の最大絶対値
+         @return 計算の成否
+         */
+        template <typename Functor>
+        bool    Accumulate(const Functor& functor, double& cost, double& gradientNorm)
+        {
+            m_JtJ.setZero();
+            m_Jtr.setZero();
+            cost    = 0.0;
+            
+            float r;
+            JacobianRowType jrow;
+            for (int i = 0, n = functor.GetNumResiduals(); i < n; ++i)
+            {
+                if (!functor(m_Param, i, r, &jrow))
+                {
+                    return false;
+                }
+                // 下三角だけ更新する(分解も下三角しか読まない)
+                const AccumVectorType jcol  = jrow.transpose().template cast<AccumScalar>();
+                m_JtJ.template selfadjointView<Eigen::Lower>().rankUpdate(jcol);
+                m_Jtr.noalias() += jcol * static_cast<AccumScalar>(r);
+                cost    += static_cast<double>(r) * r;
+            }
+            gradientNorm    = m_Jtr.cwiseAbs().maxCoeff();
+            return true;
+        }
+        
+        //! 累積した正規方程式を解いてパラメータを更新
+        bool    SolveStep()
+        {
+            m_Solver.compute(m_JtJ);
+            if (m_Solver.info() != Eigen::Success)
+            {
+                return false;
+            }
+            m_Step  = m_Solver.solve(-m_Jtr);
+            if (!m_Step.allFinite())
+            {
+                return false;
+            }
+            m_Param += m_Step.template cast<float>();
+            return true;
+        }
+    
+    private:
+        //! パラメータ
+        ParamType                   m_Param;
+        //! J^tJ
+        NormalMatrixType            m_JtJ;
+        //! J^tr
+        AccumVectorType             m_Jtr;
+        //! ステップ
+        AccumVectorType             m_Step;
+        //! J^tJの分解
+        Eigen::LDLT<NormalMatrixType, Eigen::Lower>  m_Solver;
+        //! 初期化されているかどうか
+        bool                        m_IsInitialized;
+    
+    public:
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+
+} //namespace Kosakasakas {
+
+#endif /* KSFixedOptimizer_h */
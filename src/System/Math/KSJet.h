@@ -0,0 +1,215 @@
+//
+//  KSJet.h
+//
+//  自動微分(フォワードモード)のための二重数クラス
+//
+//  Copyright (c) 2016年 Takahiro Kosaka. All rights reserved.
+//  Created by Takahiro Kosaka on 2016/07/15.
+//
+//  This Source Code Form is subject to the terms of the Mozilla
+//  Public License v. 2.0. If a copy of the MPL was not distributed
+//  with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef KSJet_h
+#define KSJet_h
+
+#include <eigen3/Eigen/Core>
+#include <cmath>
+
+namespace Kosakasakas {
+    
+    /**
+     @brief 自動微分(フォワードモード)のための二重数クラス
+     
+     値aと、N個のパラメータに対する偏微分vを同時に持ちます.
+     vは固定長のEigenベクトルなので、Nを4の倍数にすると微分の各レーンがSIMDレジスタにまとめて載ります.
+     残差関数をKSJetでテンプレート化しておけば、1回の評価でN列分のヤコビアンが得られます.
+     数学関数は sin(x) のように名前空間を付けずに呼んでください(using std::sin; を併用します).
+     */
+    template <typename T, int N>
+    struct KSJet
+    {
+        //! 微分ベクトルの型
+        typedef Eigen::Matrix<T, N, 1>  DerivativeType;
+        
+        //! コンストラクタ(ゼロ)
+        KSJet()
+        : a(T(0))
+        {
+            v.setZero();
+        }
+        
+        //! 定数からのコンストラクタ(微分はゼロ)
+        explicit KSJet(const T& value)
+        : a(value)
+        {
+            v.setZero();
+        }
+        
+        //! k番目のパラメータとしてのコンストラクタ(k番目の微分が1)
+        KSJet(const T& value, int k)
+        : a(value)
+        {
+            v.setZero();
+            v(k)    = T(1);
+        }
+        
+        //! 値と微分からのコンストラクタ
+        template <typename Derived>
+        KSJet(const T& value, const Eigen::DenseBase<Derived>& derivative)
+        : a(value)
+        , v(derivative)
+        {}
+        
+        KSJet&  operator+=(const KSJet& y)  { a += y.a; v += y.v; return *this; }
+        KSJet&  operator-=(const KSJet& y)  { a -= y.a; v -= y.v; return *this; }
+        KSJet&  operator*=(const KSJet& y)  { v = v * y.a + y.v * a; a *= y.a; return *this; }
+        KSJet&  operator/=(const KSJet& y)  { const T inv = T(1) / y.a; a *= inv; v = (v - a * y.v) * inv; return *this; }
+        KSJet&  operator+=(const T& s)      { a += s; return *this; }
+        KSJet&  operator-=(const T& s)      { a -= s; return *this; }
+        KSJet&  operator*=(const T& s)      { a *= s; v *= s; return *this; }
+        KSJet&  operator/=(const T& s)      { const T inv = T(1) / s; a *= inv; v *= inv; return *this; }
+        
+        //! 値
+        T               a;
+        //! 偏微分
+        DerivativeType  v;
+        
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+    
+    // 四則演算
+    
+    template <typename T, int N> inline KSJet<T, N> operator+(const KSJet<T, N>& f) { return f; }
+    template <typename T, int N> inline KSJet<T, N> operator-(const KSJet<T, N>& f) { return KSJet<T, N>(-f.a, -f.v); }
+    
+    template <typename T, int N> inline KSJet<T, N> operator+(const KSJet<T, N>& f, const KSJet<T, N>& g) { return KSJet<T, N>(f.a + g.a, f.v + g.v); }
+    template <typename T, int N> inline KSJet<T, N> operator+(const KSJet<T, N>& f, const T& s)           { return KSJet<T, N>(f.a + s, f.v); }
+    template <typename T, int N> inline KSJet<T, N> operator+(const T& s, const KSJet<T, N>& f)           { return KSJet<T, N>(f.a + s, f.v); }
+    
+    template <typename T, int N> inline KSJet<T, N> operator-(const KSJet<T, N>& f, const KSJet<T, N>& g) { return KSJet<T, N>(f.a - g.a, f.v - g.v); }
+    template <typename T, int N> inline KSJet<T, N> operator-(const KSJet<T, N>& f, const T& s)           { return KSJet<T, N>(f.a - s, f.v); }
+    template <typename T, int N> inline KSJet<T, N> operator-(const T& s, const KSJet<T, N>& f)           { return KSJet<T, N>(s - f.a, -f.v); }
+    
+    template <typename T, int N> inline KSJet<T, N> operator*(const KSJet<T, N>& f, const KSJet<T, N>& g) { return KSJet<T, N>(f.a * g.a, f.a * g.v + f.v * g.a); }
+    template <typename T, int N> inline KSJet<T, N> operator*(const KSJet<T, N>& f, const T& s)           { return KSJet<T, N>(f.a * s, f.v * s); }
+    template <typename T, int N> inline KSJet<T, N> operator*(const T& s, const KSJet<T, N>& f)           { return KSJet<T, N>(f.a * s, f.v * s); }
+    
+    template <typename T, int N> inline KSJet<T, N> operator/(const KSJet<T, N>& f, const KSJet<T, N>& g)
+    {
+        // (f/g)' = (f' - (f/g) g') / g
+        const T inv     = T(1) / g.a;
+        const T value   = f.a * inv;
+        return KSJet<T, N>(value, (f.v - value * g.v) * inv);
+    }
+    template <typename T, int N> inline KSJet<T, N> operator/(const KSJet<T, N>& f, const T& s)
+    {
+        const T inv     = T(1) / s;
+        return KSJet<T, N>(f.a * inv, f.v * inv);
+    }
+    template <typename T, int N> inline KSJet<T, N> operator/(const T& s, const KSJet<T, N>& g)
+    {
+        const T value   = s / g.a;
+        return KSJet<T, N>(value, g.v * (-value / g.a));
+    }
+    
+    // 比較演算(値のみで比較)
+    
+    template <typename T, int N> inline bool operator<(const KSJet<T, N>& f, const KSJet<T, N>& g)  { return f.a < g.a; }
+    template <typename T, int N> inline bool operator>(const KSJet<T, N>& f, const KSJet<T, N>& g)  { return f.a > g.a; }
+    template <typename T, int N> inline bool operator<=(const KSJet<T, N>& f, const KSJet<T, N>& g) { return f.a <= g.a; }
+    template <typename T, int N> inline bool operator>=(const KSJet<T, N>& f, const KSJet<T, N>& g) { return f.a >= g.a; }
+    template <typename T, int N> inline bool operator<(const KSJet<T, N>& f, const T& s)            { return f.a < s; }
+    template <typename T, int N> inline bool operator>(const KSJet<T, N>& f, const T& s)            { return f.a > s; }
+    template <typename T, int N> inline bool operator<=(const KSJet<T, N>& f, const T& s)           { return f.a <= s; }
+    template <typename T, int N> inline bool operator>=(const KSJet<T, N>& f, const T& s)           { return f.a >= s; }
+    
+    // 数学関数
+    
+    template <typename T, int N> inline KSJet<T, N> abs(const KSJet<T, N>& f)
+    {
+        return f.a < T(0) ? -f : f;
+    }
+    
+    template <typename T, int N> inline KSJet<T, N> sqrt(const KSJet<T, N>& f)
+    {
+        const T s   = std::sqrt(f.a);
+        return KSJet<T, N>(s, f.v * (T(0.5) / s));
+    }
+    
+    template <typename T, int N> inline KSJet<T, N> exp(const KSJet<T, N>& f)
+    {
+        const T e   = std::exp(f.a);
+        return KSJet<T, N>(e, f.v * e);
+    }
+    
+    template <typename T, int N> inline KSJet<T, N> log(const KSJet<T, N>& f)
+    {
+        return KSJet<T, N>(std::log(f.a), f.v * (T(1) / f.a));
+    }
+    
+    template <typename T, int N> inline KSJet<T, N> sin(const KSJet<T, N>& f)
+    {
+        return KSJet<T, N>(std::sin(f.a), f.v * std::cos(f.a));
+    }
+    
+    template <typename T, int N> inline KSJet<T, N> cos(const KSJet<T, N>& f)
+    {
+        return KSJet<T, N>(std::cos(f.a), f.v * (-std::sin(f.a)));
+    }
+    
+    template <typename T, int N> inline KSJet<T, N> tan(const KSJet<T, N>& f)
+    {
+        const T t   = std::tan(f.a);
+        return KSJet<T, N>(t, f.v * (T(1) + t * t));
+    }
+    
+    template <typename T, int N> inline KSJet<T, N> asin(const KSJet<T, N>& f)
+    {
+        return KSJet<T, N>(std::asin(f.a), f.v * (T(1) / std::sqrt(T(1) - f.a * f.a)));
+    }
+    
+    template <typename T, int N> inline KSJet<T, N> acos(const KSJet<T, N>& f)
+    {
+        return KSJet<T, N>(std::acos(f.a), f.v * (T(-1) / std::sqrt(T(1) - f.a * f.a)));
+    }
+    
+    template <typename T, int N> inline KSJet<T, N> atan(const KSJet<T, N>& f)
+    {
+        return KSJet<T, N>(std::atan(f.a), f.v * (T(1) / (T(1) + f.a * f.a)));
+    }
+    
+    template <typename T, int N> inline KSJet<T, N> tanh(const KSJet<T, N>& f)
+    {
+        const T t   = std::tanh(f.a);
+        return KSJet<T, N>(t, f.v * (T(1) - t * t));
+    }
+    
+    template <typename T, int N> inline KSJet<T, N> atan2(const KSJet<T, N>& y, const KSJet<T, N>& x)
+    {
+        // d atan2(y, x) = (x dy - y dx) / (x^2 + y^2)
+        const T inv = T(1) / (x.a * x.a + y.a * y.a);
+        return KSJet<T, N>(std::atan2(y.a, x.a), (y.v * x.a - x.v * y.a) * inv);
+    }
+    
+    template <typename T, int N> inline KSJet<T, N> pow(const KSJet<T, N>& f, const T& g)
+    {
+        const T p   = std::pow(f.a, g);
+        return KSJet<T, N>(p, f.v * (g * std::pow(f.a, g - T(1))));
+    }
+    
+    template <typename T, int N> inline KSJet<T, N> pow(const KSJet<T, N>& f, const KSJet<T, N>& g)
+    {
+        // d f^g = f^g (g' log f + g f' / f)
+        const T p   = std::pow(f.a, g.a);
+        return KSJet<T, N>(p, (g.v * std::log(f.a) + f.v * (g.a / f.a)) * p);
+    }
+    
+    template <typename T, int N> inline bool isfinite(const KSJet<T, N>& f)
+    {
+        return std::isfinite(f.a) && f.v.allFinite();
+    }
+
+} //namespace Kosakasakas {
+
+#endif /* KSJet_h */
@@ -0,0 +1,358 @@
+//
+//  KSLBFGSOptimizer.cpp
+//
+//  L-BFGS法による非線形最小二乗問題のための最適化計算クラス
+//
+//  Copyright (c) 2016年 Takahiro Kosaka. All rights reserved.
+//  Created by Takahiro Kosaka on 2016/07/16.
+//
+//  This Source Code Form is subject to the terms of the Mozilla
+//  Public License v. 2.0. If a copy of the MPL was not distributed
+//  with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "KSLBFGSOptimizer.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+using namespace Kosakasakas;
+
+// コンストラクタ
+KSLBFGSOptimizer::KSLBFGSOptimizer()
+: m_IsInitialized(false)
+, m_HistorySize(8)
+, m_HistoryHead(0)
+, m_HistoryCount(0)
+, m_MaxLineSearchEvaluations(20)
+, m_WolfeC1(1.0e-4)
+, m_WolfeC2(0.9)
+{}
+
+// デストラクタ
+KSLBFGSOptimizer::~KSLBFGSOptimizer()
+{}
+
+// 初期化
+bool    KSLBFGSOptimizer::Initialize(KSVectorFunction& residual,
+                                     KSGradientFunction& gradient,
+                                     KSVectorXf& initParam,
+                                     KSMatrixXf& data)
+{
+    m_FuncResidual  = std::move(residual);
+    m_FuncGradient  = std::move(gradient);
+    m_Param         = std::move(initParam);
+    m_MatData       = std::move(data);
+    ResetHistory();
+    m_IsInitialized = true;
+    
+    return m_HistorySize > 0;
+}
+
+// 収束するまで最適化ステップを実行
+KSSolveSummary  KSLBFGSOptimizer::Solve(const KSSolveOptions& options)
+{
+    KSSolveSummary  summary;
+    KSSolveTimer    timer;
+    if (!m_IsInitialized || m_HistorySize <= 0)
+    {
+        return summary;
+    }
+    if (m_HistoryS.rows() != m_Param.size())
+    {
+        ResetHistory();
+    }
+    
+    // 内部では 0.5 * |r|^2 を最小化する(勾配がJ^t・rになる)
+    KSVectorXf r        = m_FuncResidual(m_Param);
+    KSVectorXf g        = m_FuncGradient(m_Param, r);
+    double value        = 0.5 * r.squaredNorm();
+    summary.initialCost = 2.0 * value;
+    summary.termination = SolveTerminationType::MAX_ITERATIONS;
+    
+    KSVectorXf d;
+    double lastStepTime = 0.0;
+    for (int i = 0; i < options.maxIterations; ++i)
+    {
+        // 次のステップが予算内に収まらない場合は打ち切る
+        const double stepStart  = timer.GetElapsedSeconds();
+        if (options.maxSolveTimeInSeconds > 0.0
+            && stepStart + lastStepTime > options.maxSolveTimeInSeconds)
+        {
+            summary.termination = SolveTerminationType::TIME_BUDGET;
+            break;
+        }
+        
+        summary.gradientNorm    = g.cwiseAbs().maxCoeff();
+        if (options.gradientTolerance > 0.0 && summary.gradientNorm <= options.gradientTolerance)
+        {
+            summary.stepNorm    = 0.0;
+            summary.termination = SolveTerminationType::GRADIENT_CONVERGENCE;
+            break;
+        }
+        
+        ComputeDirection(d, g);
+        double slope0   = g.dot(d);
+        if (!(slope0 < 0.0))
+        {
+            // 降下方向にならない場合は履歴を捨てて最急降下方向を使う
+            ResetHistory();
+            d       = -g;
+            slope0  = -g.squaredNorm();
+        }
+        
+        // 履歴が無い時はヘッセ行列のスケールが分からないので、最初のステップの長さを1に抑える
+        int numEvals    = 0;
+        bool found      = LineSearch(d, value, slope0, (m_HistoryCount > 0) ? 1.0 : std::min(1.0, 1.0 / d.norm()), numEvals);
+        if (!found && m_HistoryCount > 0)
+        {
+            ResetHistory();
+            d       = -g;
+            slope0  = -g.squaredNorm();
+            found   = LineSearch(d, value, slope0, std::min(1.0, 1.0 / d.norm()), numEvals);
+        }
+        if (!found)
+        {
+            // 最急降下方向でもコストが下がらない場合は、floatの精度で表せる改善が無いとみなして収束扱いにする
+            // (KSDenseOptimizerのドッグレッグ法でステップが見つからない場合と同じ扱い)
+            summary.stepNorm    = 0.0;
+            summary.termination = SolveTerminationType::COST_CONVERGENCE;
+            break;
+        }
+        ++summary.iterations;
+        
+        PushHistory(m_TrialParam - m_Param, m_TrialGradient - g);
+        
+        const double paramNorm  = m_Param.norm();
+        summary.stepNorm        = (m_TrialParam - m_Param).norm();
+        m_Param.swap(m_TrialParam);
+        r.swap(m_TrialResidual);
+        g.swap(m_TrialGradient);
+        
+        const double newValue   = 0.5 * r.squaredNorm();
+        const double costChange = 2.0 * std::fabs(value - newValue);
+        const double prevCost   = 2.0 * value;
+        value                   = newValue;
+        lastStepTime            = timer.GetElapsedSeconds() - stepStart;
+        
+        if (options.functionTolerance > 0.0 && costChange <= options.functionTolerance * prevCost)
+        {
+            summary.termination = SolveTerminationType::COST_CONVERGENCE;
+            break;
+        }
+        if (options.parameterTolerance > 0.0
+            && summary.stepNorm <= options.parameterTolerance * (paramNorm + options.parameterTolerance))
+        {
+            summary.termination = SolveTerminationType::STEP_CONVERGENCE;
+            break;
+        }
+    }
+    
+    summary.finalCost           = 2.0 * value;
+    summary.totalTimeInSeconds  = timer.GetElapsedSeconds();
+    return summary;
+}
+
+// 残差平方和の取得
+double  KSLBFGSOptimizer::GetSquaredResidualsSum()
+{
+    return m_FuncResidual(m_Param).squaredNorm();
+}
+
+// 履歴の長さのセット
+void    KSLBFGSOptimizer::SetHistorySize(int size)
+{
+    m_HistorySize   = size;
+    ResetHistory();
+}
+
+// 履歴の破棄
+void    KSLBFGSOptimizer::ResetHistory()
+{
+    const int n     = static_cast<int>(m_Param.size());
+    const int m     = std::max(m_HistorySize, 0);
+    m_HistoryS.resize(n, m);
+    m_HistoryY.resize(n, m);
+    m_HistoryRho.resize(m);
+    m_HistoryHead   = 0;
+    m_HistoryCount  = 0;
+}
+
+// 2ループ再帰による探索方向の計算
+void    KSLBFGSOptimizer::ComputeDirection(KSVectorXf& d, const KSVectorXf& g) const
+{
+    const int m = m_HistorySize;
+    d   = g;
+    if (m_HistoryCount == 0)
+    {
+        d   = -d;
+        return;
+    }
+    
+    // 新しい組から順に
+    KSVectorXd a(m_HistoryCount);
+    for (int k=0; k<m_HistoryCount; ++k)
+    {
+        const int idx   = (m_HistoryHead - 1 - k + m) % m;
+        a(k)    = m_HistoryRho(idx) * m_HistoryS.col(idx).dot(d);
+        d.noalias() -= static_cast<float>(a(k)) * m_HistoryY.col(idx);
+    }
+    
+    // 初期ヘッセ行列の逆行列は最新の組による γI (γ = s^t・y / y^t・y)
+    const int newest    = (m_HistoryHead - 1 + m) % m;
+    const double gamma  = 1.0 / (m_HistoryRho(newest) * m_HistoryY.col(newest).squaredNorm());
+    d   *= static_cast<float>(gamma);
+    
+    // 古い組から順に
+    for (int k=m_HistoryCount-1; k>=0; --k)
+    {
+        const int idx   = (m_HistoryHead - 1 - k + m) % m;
+        const double b  = m_HistoryRho(idx) * m_HistoryY.col(idx).dot(d);
+        d.noalias() += static_cast<float>(a(k) - b) * m_HistoryS.col(idx);
+    }
+    d   = -d;
+}
+
+// 履歴への追加
+void    KSLBFGSOptimizer::PushHistory(const KSVectorXf& s, const KSVectorXf& y)
+{
+    const double sy = s.dot(y);
+    const double yy = y.squaredNorm();
+    if (!(sy > std::numeric_limits<float>::epsilon() * yy))
+    {
+        return;
+    }
+    
+    // 一番古い組を上書きする
+    m_HistoryS.col(m_HistoryHead)   = s;
+    m_HistoryY.col(m_HistoryHead)   = y;
+    m_HistoryRho(m_HistoryHead)     = 1.0 / sy;
+    m_HistoryHead   = (m_HistoryHead + 1) % m_HistorySize;
+    m_HistoryCount  = std::min(m_HistoryCount + 1, m_HistorySize);
+}
+
+// 試行点の評価
+KSLBFGSOptimizer::LineSearchPoint   KSLBFGSOptimizer::Evaluate(double alpha, const KSVectorXf& d)
+{
+    m_TrialParam    = m_Param + static_cast<float>(alpha) * d;
+    m_TrialResidual = m_FuncResidual(m_TrialParam);
+    m_TrialGradient = m_FuncGradient(m_TrialParam, m_TrialResidual);
+    
+    LineSearchPoint point;
+    point.alpha = alpha;
+    point.value = 0.5 * m_TrialResidual.squaredNorm();
+    point.slope = m_TrialGradient.dot(d);
+    return point;
+}
+
+// 強Wolfe条件による直線探索
+bool    KSLBFGSOptimizer::LineSearch(const KSVectorXf& d,
+                                     double value0,
+                                     double slope0,
+                                     double alphaInit,
+                                     int& numEvals)
+{
+    LineSearchPoint prev    = {0.0, value0, slope0};
+    double alpha            = alphaInit;
+    while (numEvals < m_MaxLineSearchEvaluations)
+    {
+        const LineSearchPoint cur   = Evaluate(alpha, d);
+        ++numEvals;
+        
+        if (!std::isfinite(cur.value)
+            || cur.value > value0 + m_WolfeC1 * alpha * slope0
+            || (prev.alpha > 0.0 && cur.value >= prev.value))
+        {
+            return Zoom(d, value0, slope0, prev, cur, numEvals);
+        }
+        if (std::fabs(cur.slope) <= -m_WolfeC2 * slope0)
+        {
+            return true;
+        }
+        if (cur.slope >= 0.0)
+        {
+            return Zoom(d, value0, slope0, cur, prev, numEvals);
+        }
+        
+        // まだ下り坂なのでステップを延ばす
+        prev    = cur;
+        alpha   *= 2.0;
+    }
+    
+    // 評価回数を使い切った場合は、最後の点が十分減少条件を満たしていれば採用する
+    return prev.alpha > 0.0;
+}
+
+// 直線探索の区間の絞り込み
+bool    KSLBFGSOptimizer::Zoom(const KSVectorXf& d,
+                               double value0,
+                               double slope0,
+                               LineSearchPoint lo,
+                               LineSearchPoint hi,
+                               int& numEvals)
+{
+    bool isTrialLo  = false;
+    while (numEvals < m_MaxLineSearchEvaluations)
+    {
+        // 両端の値と傾きによる3次補間(区間の内側10%に制限し、補間できない場合は中点)
+        const double width  = hi.alpha - lo.alpha;
+        double alpha        = lo.alpha + 0.5 * width;
+        if (std::isfinite(hi.value) && std::isfinite(hi.slope))
+        {
+            const double d1     = lo.slope + hi.slope - 3.0 * (lo.value - hi.value) / (lo.alpha - hi.alpha);
+            const double disc   = d1 * d1 - lo.slope * hi.slope;
+            if (disc >= 0.0)
+            {
+                const double d2 = std::copysign(std::sqrt(disc), width);
+                const double c  = hi.alpha - width * (hi.slope + d2 - d1) / (hi.slope - lo.slope + 2.0 * d2);
+                if (std::isfinite(c))
+                {
+                    alpha   = c;
+                }
+            }
+        }
+        const double lower  = std::min(lo.alpha, hi.alpha) + 0.1 * std::fabs(width);
+        const double upper  = std::max(lo.alpha, hi.alpha) - 0.1 * std::fabs(width);
+        alpha               = std::min(std::max(alpha, lower), upper);
+        
+        const LineSearchPoint cur   = Evaluate(alpha, d);
+        ++numEvals;
+        isTrialLo   = false;
+        
+        if (!std::isfinite(cur.value)
+            || cur.value > value0 + m_WolfeC1 * alpha * slope0
+            || cur.value >= lo.value)
+        {
+            hi  = cur;
+        }
+        else
+        {
+            if (std::fabs(cur.slope) <= -m_WolfeC2 * slope0)
+            {
+                return true;
+            }
+            if (cur.slope * (hi.alpha - lo.alpha) >= 0.0)
+            {
+                hi  = lo;
+            }
+            lo          = cur;
+            isTrialLo   = true;
+        }
+        
+        if (std::fabs(hi.alpha - lo.alpha) <= std::numeric_limits<float>::epsilon() * std::max(lo.alpha, hi.alpha))
+        {
+            break;
+        }
+    }
+    
+    // 曲率条件を満たす点が見つからない場合は、十分減少条件を満たす点で妥協する
+    if (lo.alpha <= 0.0)
+    {
+        return false;
+    }
+    if (!isTrialLo)
+    {
+        Evaluate(lo.alpha, d);
+        ++numEvals;
+    }
+    return true;
+}
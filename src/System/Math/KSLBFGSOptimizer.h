@@ -0,0 +1,257 @@
+//
+//  KSLBFGSOptimizer.h
+//
+//  L-BFGS法による非線形最小二乗問題のための最適化計算クラス
+//
+//  Copyright (c) 2016年 Takahiro Kosaka. All rights reserved.
+//  Created by Takahiro Kosaka on 2016/07/16.
+//
+//  This Source Code Form is subject to the terms of the Mozilla
+//  Public License v. 2.0. If a copy of the MPL was not distributed
+//  with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef KSLBFGSOptimizer_h
+#define KSLBFGSOptimizer_h
+
+#include "KSTypeDef.h"
+#include <functional>
+#include "KSSolveOptions.h"
+#include "KSSparseJacobian.h"
+
+namespace Kosakasakas {
+    
+    /**
+     @brief 勾配ファンクタ
+     パラメータxとその点での残差rから、勾配J^t・rを返します。
+     行列フリーのJ^t・vや自動微分で計算することを想定しています。
+     */
+    typedef std::function<KSVectorXf(const KSVectorXf &x, const KSVectorXf &r)>    KSGradientFunction;
+    
+    /**
+     @brief L-BFGS法による非線形最小二乗問題の最適化計算クラスです。
+     
+     残差と勾配J^t・rだけを使い、正規方程式を作らずに最適化します.
+     頂点ごとの補正量のように、パラメータが数万を超えてJ^tJを作れない場合のためのクラスです.
+     過去m回分のステップと勾配の差を固定長のリングバッファに持ち、2ループ再帰で探索方向を求めます.
+     ステップ幅は強Wolfe条件を満たす直線探索で決めます.
+     ガウス-ニュートン法より反復回数は多くなるので、J^tJを作れる規模の問題にはKSDenseOptimizerなどを使ってください.
+     */
+    class KSLBFGSOptimizer
+    {
+    public:
+        //! コンストラクタ
+        KSLBFGSOptimizer();
+        //! デストラクタ
+        ~KSLBFGSOptimizer();
+        
+        /**
+         @brief 初期化
+         
+         最適化計算クラスを初期化します.
+         各パラメータは内部でstd::moveされ、所有権がこのクラスに渡ってしまう点に注意して下さい。
+         @param residual    残差関数
+         @param gradient    勾配J^t・rを返す関数
+         @param param       パラメータの初期値ベクトル
+         @param data        サンプルデータマトリック
+         @return 初期化の成否
+         */
+        bool    Initialize(KSVectorFunction& residual,
+                           KSGradientFunction& gradient,
+                           KSVectorXf& initParam,
+                           KSMatrixXf& data);
+        
+        /**
+         @brief 収束するまで最適化ステップを実行
+         
+         コストの相対減少量、勾配のノルム、ステップのノルムのいずれかが閾値を下回るか、
+         最大反復回数・計算時間の予算に達するまでステップを繰り返します.
+         1反復あたりの残差関数と勾配の評価回数は直線探索の試行回数と同じで、多くの場合は1回です.
+         最急降下方向でも直線探索でコストが下がらない場合は、改善の余地が無いとみなしてCOST_CONVERGENCEで終了します.
+         options.useIRLSとoptions.stepStrategyは使いません.
+         履歴はSolveを跨いで保持するので、パラメータを大きく変えた場合はResetHistoryを呼んでください.
+         実行前に必ずInitializeを呼んでください。
+         @param options     収束判定と計算予算の設定
+         @return 最適化ループの結果
+         */
+        KSSolveSummary  Solve(const KSSolveOptions& options);
+        
+        /**
+         @brief 残差平方和の取得
+         
+         現在のパラメータでのサンプルデータとの残差平方和を取得します。
+         @return 残差平方和
+         */
+        double  GetSquaredResidualsSum();
+        
+        /**
+         @brief パラメータベクトルの取得
+         
+         現在のパラメータベクトルを取得します。
+         @return パラメータベクトル
+         */
+        inline const KSVectorXf&    GetParamVec() const
+        {
+            return m_Param;
+        }
+        
+        /**
+         @brief パラメータベクトルのセット
+         
+         最適化するパラメータベクトルの初期値をセットします. 履歴は破棄されます.
+         各パラメータは内部でstd::moveされ、所有権がこのクラスに渡ってしまう点に注意して下さい.
+         @param param   パラメータベクトル
+         */
+        inline void SetParamVec(KSVectorXf& param)
+        {
+            m_Param     = std::move(param);
+            ResetHistory();
+        }
+        
+        /**
+         @brief サンプルデータマトリックスの取得
+         
+         サンプルデータマトリックスを取得します。
+         @return パラメータマトリックス
+         */
+        inline const KSMatrixXf&    GetDataMat() const
+        {
+            return m_MatData;
+        }
+        
+        /**
+         @brief 履歴の長さのセット
+         
+         保持するステップと勾配の差の組の数をセットします. 履歴は破棄されます.
+         メモリ使用量は 2 × 履歴の長さ × パラメータ数 です. デフォルトは8です.
+         @param size    履歴の長さ
+         */
+        void    SetHistorySize(int size);
+        
+        /**
+         @brief 直線探索の最大評価回数のセット
+         
+         1反復の直線探索で残差関数と勾配を評価する回数の最大値です. デフォルトは20です.
+         @param evaluations 最大評価回数
+         */
+        inline void SetMaxLineSearchEvaluations(int evaluations)
+        {
+            m_MaxLineSearchEvaluations  = evaluations;
+        }
+        
+        //! 履歴の破棄(次の反復は最急降下方向から始まります)
+        void    ResetHistory();
+    
+    private:
+        //! 直線探索の試行点
+        struct LineSearchPoint
+        {
+            //! ステップ幅
+            double  alpha;
+            //! コスト(0.5 * |r|^2)
+            double  value;
+            //! 探索方向の方向微分
+            double  slope;
+        };
+        
+        /**
+         @brief 2ループ再帰による探索方向の計算
+         @param d   出力の探索方向(-H・g)
+         @param g   現在の勾配
+         */
+        void    ComputeDirection(KSVectorXf& d, const KSVectorXf& g) const;
+        
+        /**
+         @brief 履歴への追加
+         
+         曲率条件 s^t・y > 0 を満たさない組は追加しません.
+         @param s   パラメータの差
+         @param y   勾配の差
+         */
+        void    PushHistory(const KSVectorXf& s, const KSVectorXf& y);
+        
+        /**
+         @brief 試行点の評価
+         
+         m_Param + alpha・d での残差と勾配を評価し、m_TrialParam、m_TrialResidual、m_TrialGradientに書き込みます.
+         @param alpha   ステップ幅
+         @param d       探索方向
+         @return 試行点
+         */
+        LineSearchPoint Evaluate(double alpha, const KSVectorXf& d);
+        
+        /**
+         @brief 強Wolfe条件による直線探索
+         
+         条件を満たした試行点の値がm_TrialParam、m_TrialResidual、m_TrialGradientに残ります.
+         @param d           探索方向
+         @param value0      現在のコスト(0.5 * |r|^2)
+         @param slope0      現在の点での方向微分(負)
+         @param alphaInit   ステップ幅の初期値
+         @param numEvals    出力の評価回数
+         @return 条件を満たす点が見つかったかどうか
+         */
+        bool    LineSearch(const KSVectorXf& d,
+                           double value0,
+                           double slope0,
+                           double alphaInit,
+                           int& numEvals);
+        
+        /**
+         @brief 直線探索の区間の絞り込み
+         @param d       探索方向
+         @param value0  現在のコスト
+         @param slope0  現在の点での方向微分
+         @param lo      十分減少条件を満たす側の端点
+         @param hi      もう一方の端点
+         @param numEvals    評価回数(加算されます)
+         @return 条件を満たす点が見つかったかどうか
+         */
+        bool    Zoom(const KSVectorXf& d,
+                     double value0,
+                     double slope0,
+                     LineSearchPoint lo,
+                     LineSearchPoint hi,
+                     int& numEvals);
+    
+    private:
+        //! 内部初期化されているかどうか
+        bool        m_IsInitialized;
+        //! 残差の関数を保持するオブジェクト
+        KSVectorFunction    m_FuncResidual;
+        //! 勾配の関数を保持するオブジェクト
+        KSGradientFunction  m_FuncGradient;
+        //! パラメータベクトルを保持するオブジェクト
+        KSVectorXf          m_Param;
+        //! サンプルデータマトリックスを保持するオブジェクト
+        KSMatrixXf          m_MatData;
+        
+        //! 履歴の長さ
+        int         m_HistorySize;
+        //! パラメータの差のリングバッファ(列ごとに1組)
+        KSMatrixXf  m_HistoryS;
+        //! 勾配の差のリングバッファ(列ごとに1組)
+        KSMatrixXf  m_HistoryY;
+        //! 1 / (s^t・y)
+        KSVectorXd  m_HistoryRho;
+        //! 次に書き込む列
+        int         m_HistoryHead;
+        //! 保持している組の数
+        int         m_HistoryCount;
+        
+        //! 直線探索の最大評価回数
+        int         m_MaxLineSearchEvaluations;
+        //! 十分減少条件の係数
+        double      m_WolfeC1;
+        //! 曲率条件の係数
+        double      m_WolfeC2;
+        //! 試行点のパラメータ
+        KSVectorXf  m_TrialParam;
+        //! 試行点の残差
+        KSVectorXf  m_TrialResidual;
+        //! 試行点の勾配
+        KSVectorXf  m_TrialGradient;
+    };
+
+} //namespace Kosakasakas {
+
+#endif /* KSLBFGSOptimizer_h */
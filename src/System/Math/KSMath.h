@@ -16,5 +16,10 @@
 #include "KSTypeDef.h"
 #include "KSDenseOptimizer.h"
 #include "KSSparseOptimizer.h"
+#include "KSRobustLossFactory.h"
+#include "KSAutoDiffFunction.h"
+#include "KSFixedOptimizer.h"
+#include "KSBatchOptimizer.h"
+#include "KSLBFGSOptimizer.h"
 
 #endif /* KSMath_h */
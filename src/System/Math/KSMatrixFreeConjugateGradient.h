@@ -0,0 +1,372 @@
+//
+//  KSMatrixFreeConjugateGradient.h
+//
+//  正規方程式の行列フリー共役勾配法によるソルバ
+//
+//  Copyright (c) 2016年 Takahiro Kosaka. All rights reserved.
+//  Created by Takahiro Kosaka on 2016/07/13.
+//
+//  This Source Code Form is subject to the terms of the Mozilla
+//  Public License v. 2.0. If a copy of the MPL was not distributed
+//  with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef KSMatrixFreeConjugateGradient_h
+#define KSMatrixFreeConjugateGradient_h
+
+#include "KSNormalEquationSolver.h"
+#include "KSPreconditioner.h"
+#include "KSThreadPool.h"
+#include <functional>
+
+namespace Kosakasakas {
+    
+    /**
+     @brief 線形作用素のファンクタ
+     dst = J・v(またはJ^t・v)を計算します.
+     */
+    typedef std::function<void(KSVectorXf& dst, const KSVectorXf& v)>  KSLinearOperator;
+    
+    /**
+     @brief 正規方程式の行列フリー共役勾配法によるソルバ
+     
+     J^tJを陽に作らず、J・vとJ^t・vの積だけで正規方程式を前処理付き共役勾配法で解くクラスです.
+     1反復あたりのメモリと計算量は残差数×パラメータ数に比例します.
+     ヤコビアン行列が与えられた場合は、残差の行をチャンクに分けてスレッドプールで並列に積を計算します.
+     */
+    class KSMatrixFreeConjugateGradient : public KSNormalEquationSolver
+    {
+    public:
+        //! コンストラクタ
+        KSMatrixFreeConjugateGradient()
+        : m_Tolerance(1.0e-6f)
+        , m_UseWarmStart(true)
+        , m_RowGrain(1024)
+        , m_LastIterations(0)
+        , m_LastRelativeResidual(0.0f)
+        {};
+        
+        //! デストラクタ
+        virtual ~KSMatrixFreeConjugateGradient()
+        {};
+        
+        //! 初期化
+        inline bool Initialize()
+        {
+            ResetWarmStart();
+            return true;
+        };
+        
+        //! 終了処理
+        inline void Finalize()
+        {
+            ResetWarmStart();
+        };
+        
+        //! 収束判定の閾値(相対残差)のセット
+        inline void SetTolerance(float tolerance)
+        {
+            m_Tolerance = tolerance;
+        }
+        
+        //! ウォームスタートの有効化
+        inline void SetWarmStart(bool enable)
+        {
+            m_UseWarmStart  = enable;
+        }
+        
+        //! ウォームスタート用に保持している前回の解を破棄
+        inline void ResetWarmStart()
+        {
+            m_PrevStep.resize(0);
+        }
+        
+        //! 並列化する際の1チャンクあたりの残差の行数のセット
+        inline void SetRowGrain(int grain)
+        {
+            m_RowGrain  = std::max(grain, 1);
+        }
+        
+        //! 前回の計算の反復回数
+        inline int  GetLastIterations() const
+        {
+            return m_LastIterations;
+        }
+        
+        //! 前回の計算の相対残差
+        inline float    GetLastRelativeResidual() const
+        {
+            return m_LastRelativeResidual;
+        }
+        
+        /**
+         @brief 計算実行
+         
+         実際に計算を行う関数です.
+         ヤコビアンとベクトルの積だけを使って正規方程式を解きます.
+         @param dst     出力パラメータ行列
+         @param y       残差関数
+         @param j       残差関数のヤコビアン
+         @param maxIterations   共役勾配法の最大反復回数
+         @return 計算の成否
+         */
+        inline bool Solve(KSMatrixXf& dst, KSMatrixXf& y, KSMatrixXf& j, int maxIterations)
+        {
+            const int rows  = static_cast<int>(j.rows());
+            const int cols  = static_cast<int>(j.cols());
+            KSThreadPool& pool  = KSThreadPool::GetDefault();
+            std::vector<KSVectorXf> partials(pool.GetNumWorkers());
+            
+            KSLinearOperator jv = [&](KSVectorXf& out, const KSVectorXf& v)
+            {
+                out.resize(rows);
+                pool.ParallelFor(0, rows, m_RowGrain, [&](int b, int e, int /*worker*/)
+                {
+                    out.segment(b, e - b).noalias() = j.middleRows(b, e - b) * v;
+                });
+            };
+            
+            KSLinearOperator jtv = [&](KSVectorXf& out, const KSVectorXf& v)
+            {
+                for (auto& partial : partials)
+                {
+                    partial.setZero(cols);
+                }
+                pool.ParallelFor(0, rows, m_RowGrain, [&](int b, int e, int worker)
+                {
+                    partials[worker].noalias() += j.middleRows(b, e - b).transpose() * v.segment(b, e - b);
+                });
+                out = partials[0];
+                for (int i=1, n=static_cast<int>(partials.size()); i<n; ++i)
+                {
+                    out += partials[i];
+                }
+            };
+            
+            // J^tJの対角成分(列ごとのノルムの二乗)からJacobi前処理を作る
+            KSVectorXf diag = j.colwise().squaredNorm().transpose();
+            
+            KSVectorXf s;
+            if (!SolveOperator(s, y.col(0), jv, jtv, diag, maxIterations))
+            {
+                return false;
+            }
+            dst.col(0)  += s;
+            return true;
+        };
+        
+        /**
+         @brief 計算実行
+         
+         実際に計算を行う関数です.
+         ヤコビアンとベクトルの積だけを使って正規方程式を解きます.
+         @param dst     出力パラメータベクトル
+         @param y       残差ベクトル
+         @param j       残差関数のスパースヤコビアン
+         @param maxIterations   共役勾配法の最大反復回数
+         @return 計算の成否
+         */
+        inline bool Solve(KSVectorXf& dst, KSVectorXf& y, KSMatrixSparsef& j, int maxIterations)
+        {
+            typedef Eigen::SparseMatrix<float, Eigen::RowMajor> RowMajorMatrix;
+            
+            // 行ごとに分割できるように行優先に並べ替えておく
+            const RowMajorMatrix    jr(j);
+            const int rows  = static_cast<int>(jr.rows());
+            const int cols  = static_cast<int>(jr.cols());
+            KSThreadPool& pool  = KSThreadPool::GetDefault();
+            std::vector<KSVectorXf> partials(pool.GetNumWorkers());
+            
+            KSLinearOperator jv = [&](KSVectorXf& out, const KSVectorXf& v)
+            {
+                out.resize(rows);
+                pool.ParallelFor(0, rows, m_RowGrain, [&](int b, int e, int /*worker*/)
+                {
+                    out.segment(b, e - b) = jr.middleRows(b, e - b) * v;
+                });
+            };
+            
+            KSLinearOperator jtv = [&](KSVectorXf& out, const KSVectorXf& v)
+            {
+                for (auto& partial : partials)
+                {
+                    partial.setZero(cols);
+                }
+                pool.ParallelFor(0, rows, m_RowGrain, [&](int b, int e, int worker)
+                {
+                    partials[worker] += jr.middleRows(b, e - b).transpose() * v.segment(b, e - b);
+                });
+                out = partials[0];
+                for (int i=1, n=static_cast<int>(partials.size()); i<n; ++i)
+                {
+                    out += partials[i];
+                }
+            };
+            
+            KSVectorXf diag = KSVectorXf::Zero(cols);
+            for (int k=0; k<jr.outerSize(); ++k)
+            {
+                for (RowMajorMatrix::InnerIterator it(jr, k); it; ++it)
+                {
+                    diag(it.col()) += it.value() * it.value();
+                }
+            }
+            
+            KSVectorXf s;
+            if (!SolveOperator(s, y, jv, jtv, diag, maxIterations))
+            {
+                return false;
+            }
+            dst         += s;
+            return true;
+        };
+        
+        /**
+         @brief 作用素による計算実行
+         
+         ヤコビアンを陽に持たず、J・vとJ^t・vを計算する作用素だけで正規方程式を解きます.
+         @param dst     出力パラメータ行列(解いたステップが加算されます)
+         @param y       残差関数
+         @param jv      J・vを計算する作用素
+         @param jtv     J^t・vを計算する作用素
+         @param maxIterations   共役勾配法の最大反復回数
+         @return 計算の成否
+         */
+        inline bool Solve(KSMatrixXf& dst,
+                          KSMatrixXf& y,
+                          const KSLinearOperator& jv,
+                          const KSLinearOperator& jtv,
+                          int maxIterations)
+        {
+            KSVectorXf s;
+            if (!SolveOperator(s, y.col(0), jv, jtv, KSVectorXf(), maxIterations))
+            {
+                return false;
+            }
+            dst.col(0)  += s;
+            return true;
+        };
+        
+        /**
+         @brief 作用素による正規方程式の求解
+         
+         (J^tJ)s = -J^t・yを解きます.
+         @param s       出力のステップ
+         @param y       残差ベクトル
+         @param jv      J・vを計算する作用素
+         @param jtv     J^t・vを計算する作用素
+         @param diag    J^tJの対角成分(空の場合は前処理なし)
+         @param maxIterations   共役勾配法の最大反復回数
+         @return 計算の成否
+         */
+        inline bool SolveOperator(KSVectorXf& s,
+                                  const KSVectorXf& y,
+                                  const KSLinearOperator& jv,
+                                  const KSLinearOperator& jtv,
+                                  const KSVectorXf& diag,
+                                  int maxIterations)
+        {
+            KSVectorXf b;
+            jtv(b, y);
+            b   = -b;
+            const int n = static_cast<int>(b.size());
+            
+            if (diag.size() == n)
+            {
+                m_Preconditioner.ComputeFromDiagonal(diag);
+            }
+            else
+            {
+                m_Preconditioner.ComputeFromDiagonal(KSVectorXf::Ones(n));
+            }
+            
+            // A・v = J^t(J・v)
+            KSVectorXf jvTmp;
+            auto applyA = [&](KSVectorXf& out, const KSVectorXf& v)
+            {
+                jv(jvTmp, v);
+                jtv(out, jvTmp);
+            };
+            
+            // 初期値(ウォームスタート)
+            if (m_UseWarmStart && m_PrevStep.size() == n && m_PrevStep.allFinite())
+            {
+                s   = m_PrevStep;
+            }
+            else
+            {
+                s.setZero(n);
+            }
+            
+            const float bNorm   = b.norm();
+            if (bNorm <= 0.0f)
+            {
+                s.setZero(n);
+                m_PrevStep              = s;
+                m_LastIterations        = 0;
+                m_LastRelativeResidual  = 0.0f;
+                return true;
+            }
+            
+            KSVectorXf r, z, p, Ap;
+            applyA(Ap, s);
+            r               = b - Ap;
+            m_Preconditioner.Apply(z, r);
+            p               = z;
+            float rz        = r.dot(z);
+            
+            int k = 0;
+            for (; k < maxIterations; ++k)
+            {
+                if (r.norm() <= m_Tolerance * bNorm)
+                {
+                    break;
+                }
+                
+                applyA(Ap, p);
+                const float pAp = p.dot(Ap);
+                if (pAp <= 0.0f)
+                {
+                    break;
+                }
+                
+                const float alpha   = rz / pAp;
+                s               += alpha * p;
+                r               -= alpha * Ap;
+                
+                m_Preconditioner.Apply(z, r);
+                const float rzNew   = r.dot(z);
+                p               = z + (rzNew / rz) * p;
+                rz              = rzNew;
+            }
+            
+            m_LastIterations        = k;
+            m_LastRelativeResidual  = r.norm() / bNorm;
+            if (!s.allFinite())
+            {
+                ResetWarmStart();
+                return false;
+            }
+            m_PrevStep  = s;
+            return true;
+        }
+    
+    private:
+        //! 前処理(対角スケーリング)
+        KSPreconditioner    m_Preconditioner;
+        //! 相対残差の閾値
+        float       m_Tolerance;
+        //! ウォームスタートを使うかどうか
+        bool        m_UseWarmStart;
+        //! 並列化する際の1チャンクあたりの行数
+        int         m_RowGrain;
+        //! 前回の解
+        KSVectorXf  m_PrevStep;
+        //! 前回の計算の反復回数
+        int         m_LastIterations;
+        //! 前回の計算の相対残差
+        float       m_LastRelativeResidual;
+    };
+
+} //namespace Kosakasakas {
+
+#endif /* KSMatrixFreeConjugateGradient_h */
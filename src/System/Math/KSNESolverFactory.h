@@ -17,6 +17,9 @@
 #include "KSNormalEquationSolver.h"
 #include "KSCholeskyDecomposition.h"
 #include "KSConjugateGradient.h"
+#include "KSMatrixFreeConjugateGradient.h"
+#include "KSSchurComplementSolver.h"
+#include "KSAutoSolver.h"
 #include "memory.h"
 
 namespace Kosakasakas {
@@ -66,12 +69,45 @@ namespace Kosakasakas {
                     pSolver = std::make_shared<KSConjugateGradient>();
                     break;
                     
+                case NESolverType::MATRIX_FREE_PCG:
+                    pSolver = std::make_shared<KSMatrixFreeConjugateGradient>();
+                    break;
+                
+                case NESolverType::SCHUR_COMPLEMENT:
+                    // ブロック構造をセットするまでSolveは失敗する(CreateSchurComplementを使うこと)
+                    pSolver = std::make_shared<KSSchurComplementSolver>();
+                    break;
+                
+                case NESolverType::AUTO:
+                {
+                    auto pAutoSolver    = std::make_shared<KSAutoSolver>();
+                    pAutoSolver->Initialize();
+                    pSolver = pAutoSolver;
+                    break;
+                }
+                
                 default:
                     pSolver = nullptr;
                     break;
             }
             return pSolver;
         }
+        
+        /**
+         @brief シューア補行列のソルバの生成
+         
+         シューア補行列のソルバはブロック構造が無いと解けないため、構造と一緒に生成します.
+         @param sharedSize  共有ブロックの要素数
+         @param frameSizes  フレームごとのブロックの要素数
+         @return 生成されたソルバインスタンス
+         */
+        inline std::shared_ptr<KSNormalEquationSolver> CreateSchurComplement(int sharedSize,
+                                                                             const std::vector<int>& frameSizes)
+        {
+            auto pSolver    = std::make_shared<KSSchurComplementSolver>();
+            pSolver->SetBlockStructure(sharedSize, frameSizes);
+            return pSolver;
+        }
     };
     
 } //namespace Kosakasakas {
@@ -0,0 +1,109 @@
+//
+//  KSNormalEquationAccumulator.h
+//
+//  混合精度による正規方程式の累積クラス
+//
+//  Copyright (c) 2016年 Takahiro Kosaka. All rights reserved.
+//  Created by Takahiro Kosaka on 2016/07/16.
+//
+//  This Source Code Form is subject to the terms of the Mozilla
+//  Public License v. 2.0. If a copy of the MPL was not distributed
+//  with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef KSNormalEquationAccumulator_h
+#define KSNormalEquationAccumulator_h
+
+#include "KSTypeDef.h"
+#include "KSThreadPool.h"
+#include <vector>
+
+namespace Kosakasakas {
+    
+    /**
+     @brief 混合精度による正規方程式の累積クラス
+     
+     残差とヤコビアンはfloatのまま受け取り、J^tJとJ^tyの累積だけをdoubleで行います.
+     floatどうしの積はdoubleで正確に表せるので、誤差は足し合わせの分だけになります.
+     画素数分の残差をfloatで足し込むと桁落ちで反復回数が増えるため、その対策として使います.
+     残差の行をチャンクに分け、チャンクごとにdoubleへ変換してからスレッドプールで並列に累積し、
+     ワーカーごとの部分和を最後にまとめます. 変換用のバッファはチャンク分だけなのでキャッシュに収まります.
+     */
+    class KSNormalEquationAccumulator
+    {
+    public:
+        //! コンストラクタ
+        KSNormalEquationAccumulator()
+        : m_RowChunk(256)
+        {};
+        
+        //! デストラクタ
+        virtual ~KSNormalEquationAccumulator()
+        {};
+        
+        //! 1チャンクあたりの残差の行数のセット
+        inline void SetRowChunk(int rowChunk)
+        {
+            m_RowChunk  = std::max(rowChunk, 1);
+        }
+        
+        /**
+         @brief 正規方程式の累積
+         
+         A = J^tJ、b = J^tyをdoubleで求めます. Aは対称になるように両方の三角を埋めます.
+         @param A   出力の係数行列
+         @param b   出力の右辺ベクトル
+         @param j   ヤコビアン
+         @param y   残差ベクトル
+         */
+        void    Accumulate(KSMatrixXd& A,
+                           KSVectorXd& b,
+                           const KSMatrixXf& j,
+                           const Eigen::Ref<const KSVectorXf>& y)
+        {
+            const int rows  = static_cast<int>(j.rows());
+            const int cols  = static_cast<int>(j.cols());
+            KSThreadPool& pool  = KSThreadPool::GetDefault();
+            const int numWorkers    = pool.GetNumWorkers();
+            
+            m_ChunkJ.resize(numWorkers);
+            m_PartialA.resize(numWorkers);
+            m_PartialB.resize(numWorkers);
+            for (int i=0; i<numWorkers; ++i)
+            {
+                m_PartialA[i].setZero(cols, cols);
+                m_PartialB[i].setZero(cols);
+            }
+            
+            pool.ParallelFor(0, rows, m_RowChunk, [&](int begin, int end, int worker)
+            {
+                // チャンクをdoubleに変換して累積
+                KSMatrixXd& jb  = m_ChunkJ[worker];
+                jb              = j.middleRows(begin, end - begin).cast<double>();
+                m_PartialA[worker].selfadjointView<Eigen::Lower>().rankUpdate(jb.transpose());
+                m_PartialB[worker].noalias()    += jb.transpose() * y.segment(begin, end - begin).cast<double>();
+            });
+            
+            A   = m_PartialA[0];
+            b   = m_PartialB[0];
+            for (int i=1; i<numWorkers; ++i)
+            {
+                A.triangularView<Eigen::Lower>()    += m_PartialA[i];
+                b   += m_PartialB[i];
+            }
+            A.triangularView<Eigen::StrictlyUpper>()    = A.transpose().eval();
+        }
+    
+    private:
+        //! 1チャンクあたりの行数
+        int     m_RowChunk;
+        //! ワーカーごとのdoubleに変換したチャンク
+        std::vector<KSMatrixXd> m_ChunkJ;
+        //! ワーカーごとのJ^tJの部分和(double)
+        std::vector<KSMatrixXd> m_PartialA;
+        //! ワーカーごとのJ^tyの部分和(double)
+        std::vector<KSVectorXd> m_PartialB;
+    };
+
+} //namespace Kosakasakas {
+
+#endif /* KSNormalEquationAccumulator_h */
@@ -26,12 +26,31 @@ namespace Kosakasakas {
     public:
         //! コンストラクタ
         KSNormalEquationSolver()
+        : m_Precision(PrecisionType::SINGLE_PRECISION)
         {};
         
         //! デストラクタ
         virtual ~KSNormalEquationSolver()
         {};
         
+        /**
+         @brief 計算精度のセット
+         
+         MIXED_PRECISIONを指定すると、J^tJの累積と分解をdoubleで行います.
+         対応していないソルバでは無視されます.
+         @param precision   計算精度
+         */
+        virtual void    SetPrecision(PrecisionType precision)
+        {
+            m_Precision = precision;
+        }
+        
+        //! 計算精度の取得
+        inline PrecisionType    GetPrecision() const
+        {
+            return m_Precision;
+        }
+        
         /**
          @brief 計算実行
          
@@ -50,13 +69,17 @@ namespace Kosakasakas {
          
          実際に計算を行う関数です.
          実装は継承先で定義して下さい.
-         @param dst     出力パラメータ行列
-         @param y       残差関数
-         @param j       残差関数のヤコビアン
+         @param dst     出力パラメータベクトル
+         @param y       残差ベクトル
+         @param j       残差関数のスパースヤコビアン
          @param maxIterations   演算の試行回数
          @return 計算の成否
          */
-        virtual bool    Solve(KSMatrixSparsef& dst, KSMatrixSparsef& y, KSMatrixSparsef& j, int maxIterations) = 0;
+        virtual bool    Solve(KSVectorXf& dst, KSVectorXf& y, KSMatrixSparsef& j, int maxIterations) = 0;
+    
+    protected:
+        //! 計算精度
+        PrecisionType   m_Precision;
     };
     
 } //namespace Kosakasakas {
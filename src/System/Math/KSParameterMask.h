@@ -0,0 +1,201 @@
+//
+//  KSParameterMask.h
+//
+//  パラメータブロックの固定を扱うクラス
+//
+//  Copyright (c) 2016年 Takahiro Kosaka. All rights reserved.
+//  Created by Takahiro Kosaka on 2016/07/15.
+//
+//  This Source Code Form is subject to the terms of the Mozilla
+//  Public License v. 2.0. If a copy of the MPL was not distributed
+//  with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef KSParameterMask_h
+#define KSParameterMask_h
+
+#include "KSTypeDef.h"
+#include <algorithm>
+#include <vector>
+
+namespace Kosakasakas {
+    
+    /**
+     @brief パラメータブロック
+     
+     パラメータベクトルのうち、[offset, offset+size)の要素をまとめて扱います.
+     */
+    struct KSParameterBlock
+    {
+        //! ブロック先頭の要素
+        int offset;
+        //! ブロックの要素数
+        int size;
+    };
+    
+    /**
+     @brief パラメータブロックの固定を扱うクラス
+     
+     固定するブロックのリストから、固定されていない要素(自由な要素)の添字と、
+     パラメータの添字から縮小した正規方程式での添字への対応表を作ります.
+     オプティマイザは自由な要素の列だけで正規方程式を作り、解いたステップを元の添字に戻して加算します.
+     */
+    class KSParameterMask
+    {
+    public:
+        //! コンストラクタ
+        KSParameterMask()
+        : m_NumParams(-1)
+        {};
+        
+        //! デストラクタ
+        virtual ~KSParameterMask()
+        {};
+        
+        /**
+         @brief 固定するパラメータブロックのセット
+         
+         空のリストをセットすると全てのパラメータが最適化の対象に戻ります.
+         @param blocks  固定するパラメータブロックのリスト
+         */
+        inline void SetConstantBlocks(const std::vector<KSParameterBlock>& blocks)
+        {
+            m_ConstantBlocks    = blocks;
+            m_NumParams         = -1;
+        }
+        
+        //! 固定するパラメータブロックのリストの取得
+        inline const std::vector<KSParameterBlock>& GetConstantBlocks() const
+        {
+            return m_ConstantBlocks;
+        }
+        
+        /**
+         @brief 対応表の更新
+         
+         パラメータの要素数が前回と同じ場合は何もしません. 範囲外のブロックは要素数に合わせて切り詰めます.
+         @param numParams   パラメータの要素数
+         */
+        inline void Update(int numParams)
+        {
+            if (numParams == m_NumParams)
+            {
+                return;
+            }
+            m_NumParams = numParams;
+            
+            m_ColumnMap.assign(numParams, 0);
+            for (const auto& block : m_ConstantBlocks)
+            {
+                const int begin = std::max(block.offset, 0);
+                const int end   = std::min(block.offset + block.size, numParams);
+                for (int i=begin; i<end; ++i)
+                {
+                    m_ColumnMap[i]  = -1;
+                }
+            }
+            
+            m_FreeIndices.clear();
+            for (int i=0; i<numParams; ++i)
+            {
+                if (m_ColumnMap[i] >= 0)
+                {
+                    m_ColumnMap[i]  = static_cast<int>(m_FreeIndices.size());
+                    m_FreeIndices.push_back(i);
+                }
+            }
+        }
+        
+        //! 固定されている要素があるかどうか
+        inline bool IsActive() const
+        {
+            return m_NumParams >= 0 && static_cast<int>(m_FreeIndices.size()) < m_NumParams;
+        }
+        
+        //! 自由な要素数の取得
+        inline int  GetNumFree() const
+        {
+            return static_cast<int>(m_FreeIndices.size());
+        }
+        
+        //! 自由な要素の添字の取得
+        inline const std::vector<int>&  GetFreeIndices() const
+        {
+            return m_FreeIndices;
+        }
+        
+        //! パラメータの添字から縮小した添字への対応表の取得(固定された要素は-1)
+        inline const std::vector<int>&  GetColumnMap() const
+        {
+            return m_ColumnMap;
+        }
+        
+        /**
+         @brief 自由な列の抜き出し
+         @param dst     出力の縮小した行列
+         @param src     全てのパラメータの列を持つ行列
+         */
+        inline void GatherColumns(KSMatrixXf& dst, const KSMatrixXf& src) const
+        {
+            dst.resize(src.rows(), GetNumFree());
+            for (int k=0, n=GetNumFree(); k<n; ++k)
+            {
+                dst.col(k)  = src.col(m_FreeIndices[k]);
+            }
+        }
+        
+        /**
+         @brief 自由な要素の抜き出し
+         @param dst     出力の縮小したベクトル
+         @param src     全てのパラメータの要素を持つベクトル
+         */
+        inline void Gather(KSVectorXf& dst, const KSVectorXf& src) const
+        {
+            dst.resize(GetNumFree());
+            for (int k=0, n=GetNumFree(); k<n; ++k)
+            {
+                dst(k)  = src(m_FreeIndices[k]);
+            }
+        }
+        
+        /**
+         @brief 縮小したベクトルを元の添字へ展開(固定された要素は0)
+         @param dst     出力の全てのパラメータの要素を持つベクトル
+         @param src     縮小したベクトル
+         */
+        inline void Scatter(KSVectorXf& dst, const KSVectorXf& src) const
+        {
+            dst.setZero(m_NumParams);
+            for (int k=0, n=GetNumFree(); k<n; ++k)
+            {
+                dst(m_FreeIndices[k])   = src(k);
+            }
+        }
+        
+        /**
+         @brief 縮小したステップを元の添字のパラメータに加算
+         @param dst     パラメータ
+         @param step    縮小したステップ
+         */
+        template <typename Derived>
+        inline void AddStep(Eigen::MatrixBase<Derived>& dst, const KSVectorXf& step) const
+        {
+            for (int k=0, n=GetNumFree(); k<n; ++k)
+            {
+                dst(m_FreeIndices[k])   += step(k);
+            }
+        }
+    
+    private:
+        //! 固定するパラメータブロックのリスト
+        std::vector<KSParameterBlock>   m_ConstantBlocks;
+        //! 対応表を作った時のパラメータの要素数(未作成の場合は-1)
+        int                 m_NumParams;
+        //! 自由な要素の添字
+        std::vector<int>    m_FreeIndices;
+        //! パラメータの添字から縮小した添字への対応表
+        std::vector<int>    m_ColumnMap;
+    };
+
+} //namespace Kosakasakas {
+
+#endif /* KSParameterMask_h */
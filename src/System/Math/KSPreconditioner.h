@@ -0,0 +1,213 @@
+//
+//  KSPreconditioner.h
+//
+//  共役勾配法のための前処理クラス
+//
+//  Copyright (c) 2016年 Takahiro Kosaka. All rights reserved.
+//  Created by Takahiro Kosaka on 2016/07/12.
+//
+//  This Source Code Form is subject to the terms of the Mozilla
+//  Public License v. 2.0. If a copy of the MPL was not distributed
+//  with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef KSPreconditioner_h
+#define KSPreconditioner_h
+
+#include "KSTypeDef.h"
+#include <eigen3/Eigen/Cholesky>
+#include <eigen3/Eigen/IterativeLinearSolvers>
+#include <vector>
+
+namespace Kosakasakas {
+    
+    /**
+     @brief 共役勾配法のための前処理クラス
+     
+     正規方程式の係数行列Aから前処理行列Mを構築し、z = M^-1 rを計算します.
+     ブロックJacobi前処理ではSetBlockSizesで指定したパラメータグループごとに
+     Aの対角ブロックをコレスキー分解しておきます.
+     */
+    class KSPreconditioner
+    {
+    public:
+        //! コンストラクタ
+        KSPreconditioner()
+        : m_Type(PreconditionerType::JACOBI)
+        , m_ActiveType(PreconditionerType::JACOBI)
+        {};
+        
+        //! デストラクタ
+        virtual ~KSPreconditioner()
+        {};
+        
+        //! 前処理のタイプのセット
+        inline void SetType(PreconditionerType type)
+        {
+            m_Type  = type;
+        }
+        
+        //! 前処理のタイプの取得
+        inline PreconditionerType   GetType() const
+        {
+            return m_Type;
+        }
+        
+        /**
+         @brief パラメータグループのセット
+         
+         ブロックJacobi前処理で使うパラメータグループの要素数を先頭から順に指定します.
+         合計がパラメータ数に満たない場合、残りは対角スケーリングになります.
+         @param blockSizes  パラメータグループごとの要素数
+         */
+        inline void SetBlockSizes(const std::vector<int>& blockSizes)
+        {
+            m_BlockSizes    = blockSizes;
+        }
+        
+        /**
+         @brief 前処理行列の構築(密行列)
+         @param A   正規方程式の係数行列
+         @return 構築の成否
+         */
+        inline bool Compute(const KSMatrixXf& A)
+        {
+            m_InvDiag   = A.diagonal();
+            return Build(A);
+        }
+        
+        /**
+         @brief 前処理行列の構築(スパース行列)
+         @param A   正規方程式の係数行列
+         @return 構築の成否
+         */
+        inline bool Compute(const KSMatrixSparsef& A)
+        {
+            m_InvDiag   = A.diagonal();
+            return Build(A);
+        }
+        
+        /**
+         @brief 対角成分からの前処理行列の構築
+         
+         係数行列を陽に持たない場合に、対角成分だけからJacobi前処理を構築します.
+         @param diag    係数行列の対角成分
+         */
+        inline void ComputeFromDiagonal(const KSVectorXf& diag)
+        {
+            m_InvDiag       = diag;
+            m_ActiveType    = PreconditionerType::JACOBI;
+            InvertDiagonal();
+            m_Blocks.clear();
+        }
+        
+        /**
+         @brief 前処理の適用
+         
+         z = M^-1 rを計算します.
+         @param z   出力ベクトル
+         @param r   入力ベクトル
+         */
+        inline void Apply(KSVectorXf& z, const KSVectorXf& r) const
+        {
+            switch (m_ActiveType) {
+                case PreconditionerType::INCOMPLETE_CHOLESKY:
+                    z   = m_IncompleteCholesky.solve(r);
+                    break;
+                
+                case PreconditionerType::BLOCK_JACOBI:
+                {
+                    z   = m_InvDiag.cwiseProduct(r);
+                    int offset  = 0;
+                    for (const auto& llt : m_Blocks)
+                    {
+                        const int size  = static_cast<int>(llt.rows());
+                        z.segment(offset, size) = llt.solve(r.segment(offset, size));
+                        offset  += size;
+                    }
+                    break;
+                }
+                
+                default:
+                    z   = m_InvDiag.cwiseProduct(r);
+                    break;
+            }
+        }
+    
+    private:
+        //! 前処理行列の構築
+        template <typename MatrixType>
+        inline bool Build(const MatrixType& A)
+        {
+            InvertDiagonal();
+            m_Blocks.clear();
+            m_ActiveType    = m_Type;
+            
+            if (m_Type == PreconditionerType::BLOCK_JACOBI)
+            {
+                int offset  = 0;
+                for (int size : m_BlockSizes)
+                {
+                    if (size <= 0 || offset + size > A.rows())
+                    {
+                        break;
+                    }
+                    KSMatrixXf block    = A.block(offset, offset, size, size);
+                    m_Blocks.push_back(Eigen::LLT<KSMatrixXf>(block));
+                    if (m_Blocks.back().info() != Eigen::Success)
+                    {
+                        // 正定値でないブロックがあれば対角スケーリングに落とす
+                        m_Blocks.clear();
+                        m_ActiveType    = PreconditionerType::JACOBI;
+                        break;
+                    }
+                    offset  += size;
+                }
+            }
+            else if (m_Type == PreconditionerType::INCOMPLETE_CHOLESKY)
+            {
+                ComputeIncompleteCholesky(A);
+            }
+            return true;
+        }
+        
+        //! 不完全コレスキー分解(密行列はスパース表現に変換してから分解する)
+        inline void ComputeIncompleteCholesky(const KSMatrixXf& A)
+        {
+            KSMatrixSparsef sparseA = A.sparseView();
+            ComputeIncompleteCholesky(sparseA);
+        }
+        
+        //! 不完全コレスキー分解
+        inline void ComputeIncompleteCholesky(const KSMatrixSparsef& A)
+        {
+            m_IncompleteCholesky.compute(A);
+            if (m_IncompleteCholesky.info() != Eigen::Success)
+            {
+                m_ActiveType    = PreconditionerType::JACOBI;
+            }
+        }
+        
+        //! 対角成分の逆数を取る(ゼロ除算は避ける)
+        inline void InvertDiagonal()
+        {
+            m_InvDiag   = (m_InvDiag.array().abs() > 1.0e-12f).select(m_InvDiag.array().inverse(), 1.0f).matrix();
+        }
+    
+    private:
+        //! 指定された前処理のタイプ
+        PreconditionerType  m_Type;
+        //! 実際に使われている前処理のタイプ(分解に失敗した場合はJacobiになる)
+        PreconditionerType  m_ActiveType;
+        //! ブロックJacobi前処理のブロックサイズ
+        std::vector<int>    m_BlockSizes;
+        //! 対角成分の逆数
+        KSVectorXf          m_InvDiag;
+        //! ブロックごとのコレスキー分解
+        std::vector<Eigen::LLT<KSMatrixXf> >    m_Blocks;
+        //! 不完全コレスキー分解
+        Eigen::IncompleteCholesky<float, Eigen::Lower, Eigen::AMDOrdering<int> >    m_IncompleteCholesky;
+    };
+
+} //namespace Kosakasakas {
+
+#endif /* KSPreconditioner_h */
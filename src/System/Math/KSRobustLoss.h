@@ -0,0 +1,310 @@
+//
+//  KSRobustLoss.h
+//
+//  IRLSのためのロバスト損失関数クラス
+//
+//  Copyright (c) 2016年 Takahiro Kosaka. All rights reserved.
+//  Created by Takahiro Kosaka on 2016/07/11.
+//
+//  This Source Code Form is subject to the terms of the Mozilla
+//  Public License v. 2.0. If a copy of the MPL was not distributed
+//  with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef KSRobustLoss_h
+#define KSRobustLoss_h
+
+#include "KSTypeDef.h"
+#include <memory>
+#include <vector>
+
+namespace Kosakasakas {
+    
+    /**
+     @brief ロバスト損失関数のインターフェース
+     
+     損失関数ρ(r)は残差が小さい領域でr^2と一致するように正規化しています.
+     IRLSの重みはw(r) = ρ'(r) / 2rで、残差とヤコビアンの各行にはsqrt(w)を掛けます.
+     各関数は残差ブロック単位でまとめて(Eigenの配列演算で)評価します.
+     */
+    class KSRobustLoss
+    {
+    public:
+        //! コンストラクタ
+        KSRobustLoss(float scale)
+        : m_Scale(scale)
+        {};
+        
+        //! デストラクタ
+        virtual ~KSRobustLoss()
+        {};
+        
+        /**
+         @brief 行スケールの計算
+         
+         残差ブロックに対してIRLSの行スケール(重みの平方根)を計算します.
+         @param dst         出力の行スケール(rと同じ要素数)
+         @param r           残差ブロック
+         @param groupSize   グループの要素数(L2,1ノルム以外では使いません)
+         */
+        virtual void    ComputeRowScale(Eigen::Ref<KSVectorXf> dst,
+                                        const Eigen::Ref<const KSVectorXf>& r,
+                                        int groupSize) const = 0;
+        
+        /**
+         @brief コストの計算
+         
+         残差ブロックに対する損失関数の総和を計算します.
+         @param r           残差ブロック
+         @param groupSize   グループの要素数(L2,1ノルム以外では使いません)
+         @return 損失関数の総和
+         */
+        virtual double  ComputeCost(const Eigen::Ref<const KSVectorXf>& r,
+                                    int groupSize) const = 0;
+        
+        //! スケールパラメータ(外れ値とみなす残差の閾値)の取得
+        inline float    GetScale() const
+        {
+            return m_Scale;
+        }
+        
+        //! スケールパラメータのセット
+        inline void     SetScale(float scale)
+        {
+            m_Scale = scale;
+        }
+    
+    protected:
+        //! スケールパラメータ
+        float   m_Scale;
+    };
+    
+    /**
+     @brief 二乗誤差
+     重みは常に1で、通常のガウス-ニュートン法と同じ結果になります.
+     */
+    class KSL2Loss : public KSRobustLoss
+    {
+    public:
+        KSL2Loss(float scale = 1.0f)
+        : KSRobustLoss(scale)
+        {};
+        
+        inline void ComputeRowScale(Eigen::Ref<KSVectorXf> dst,
+                                    const Eigen::Ref<const KSVectorXf>& /*r*/,
+                                    int /*groupSize*/) const
+        {
+            dst.setOnes();
+        };
+        
+        inline double ComputeCost(const Eigen::Ref<const KSVectorXf>& r,
+                                  int /*groupSize*/) const
+        {
+            return r.squaredNorm();
+        };
+    };
+    
+    /**
+     @brief Huber損失
+     |r| <= kでr^2、それ以外で2k|r| - k^2となります.
+     */
+    class KSHuberLoss : public KSRobustLoss
+    {
+    public:
+        KSHuberLoss(float scale = 1.0f)
+        : KSRobustLoss(scale)
+        {};
+        
+        inline void ComputeRowScale(Eigen::Ref<KSVectorXf> dst,
+                                    const Eigen::Ref<const KSVectorXf>& r,
+                                    int /*groupSize*/) const
+        {
+            // w = min(1, k/|r|)
+            dst = (m_Scale / r.array().abs().cwiseMax(1.0e-12f)).cwiseMin(1.0f).sqrt().matrix();
+        };
+        
+        inline double ComputeCost(const Eigen::Ref<const KSVectorXf>& r,
+                                  int /*groupSize*/) const
+        {
+            const float k   = m_Scale;
+            auto a          = r.array().abs();
+            return (a <= k).select(a.square(), 2.0f * k * a - k * k).cast<double>().sum();
+        };
+    };
+    
+    /**
+     @brief TukeyのBiweight損失
+     |r| > kの残差は重み0となり、完全に無視されます.
+     */
+    class KSTukeyLoss : public KSRobustLoss
+    {
+    public:
+        KSTukeyLoss(float scale = 1.0f)
+        : KSRobustLoss(scale)
+        {};
+        
+        inline void ComputeRowScale(Eigen::Ref<KSVectorXf> dst,
+                                    const Eigen::Ref<const KSVectorXf>& r,
+                                    int /*groupSize*/) const
+        {
+            // w = (1 - (r/k)^2)^2 なので、行スケールは 1 - (r/k)^2 (ただし0以上)
+            dst = (1.0f - (r.array() / m_Scale).square()).cwiseMax(0.0f).matrix();
+        };
+        
+        inline double ComputeCost(const Eigen::Ref<const KSVectorXf>& r,
+                                  int /*groupSize*/) const
+        {
+            const float c   = m_Scale * m_Scale / 3.0f;
+            auto u          = (1.0f - (r.array() / m_Scale).square()).cwiseMax(0.0f);
+            return (c * (1.0f - u.cube())).cast<double>().sum();
+        };
+    };
+    
+    /**
+     @brief Cauchy損失
+     k^2 log(1 + (r/k)^2)となります.
+     */
+    class KSCauchyLoss : public KSRobustLoss
+    {
+    public:
+        KSCauchyLoss(float scale = 1.0f)
+        : KSRobustLoss(scale)
+        {};
+        
+        inline void ComputeRowScale(Eigen::Ref<KSVectorXf> dst,
+                                    const Eigen::Ref<const KSVectorXf>& r,
+                                    int /*groupSize*/) const
+        {
+            // w = 1 / (1 + (r/k)^2)
+            dst = (1.0f + (r.array() / m_Scale).square()).rsqrt().matrix();
+        };
+        
+        inline double ComputeCost(const Eigen::Ref<const KSVectorXf>& r,
+                                  int /*groupSize*/) const
+        {
+            const float k2  = m_Scale * m_Scale;
+            return (k2 * (1.0f + r.array().square() / k2).log()).cast<double>().sum();
+        };
+    };
+    
+    /**
+     @brief L2,1ノルム
+     
+     groupSize個ずつの残差(例えばRGBの3成分)をひとまとまりとして、グループのL2ノルムの和を取ります.
+     損失は2k||r_g||で、グループ内の行は全て同じ重みk/||r_g||になります.
+     */
+    class KSL21Loss : public KSRobustLoss
+    {
+    public:
+        KSL21Loss(float scale = 1.0f)
+        : KSRobustLoss(scale)
+        {};
+        
+        inline void ComputeRowScale(Eigen::Ref<KSVectorXf> dst,
+                                    const Eigen::Ref<const KSVectorXf>& r,
+                                    int groupSize) const
+        {
+            const int g     = std::max(groupSize, 1);
+            const int n     = static_cast<int>(r.size()) / g;
+            Eigen::Map<const Eigen::ArrayXXf>   rg(r.data(), g, n);
+            Eigen::Map<Eigen::ArrayXXf>         dg(dst.data(), g, n);
+            
+            // グループごとのノルムから重みを算出して、グループ内の行に展開
+            Eigen::ArrayXf  s   = (m_Scale / rg.square().colwise().sum().sqrt().cwiseMax(1.0e-12f)).sqrt().transpose();
+            dg  = s.transpose().replicate(g, 1);
+            
+            // 端数(グループに満たない行)は個別に扱う
+            for (int i=n*g, m=static_cast<int>(r.size()); i<m; ++i)
+            {
+                dst(i)  = std::sqrt(m_Scale / std::max(std::fabs(r(i)), 1.0e-12f));
+            }
+        };
+        
+        inline double ComputeCost(const Eigen::Ref<const KSVectorXf>& r,
+                                  int groupSize) const
+        {
+            const int g     = std::max(groupSize, 1);
+            const int n     = static_cast<int>(r.size()) / g;
+            Eigen::Map<const Eigen::ArrayXXf>   rg(r.data(), g, n);
+            
+            double cost = 2.0 * m_Scale * rg.square().colwise().sum().sqrt().cast<double>().sum();
+            for (int i=n*g, m=static_cast<int>(r.size()); i<m; ++i)
+            {
+                cost += 2.0 * m_Scale * std::fabs(r(i));
+            }
+            return cost;
+        };
+    };
+    
+    //! ロバスト損失関数へのシェアードポインタ
+    typedef std::shared_ptr<KSRobustLoss>   KSRobustLossPtr;
+    
+    /**
+     @brief 残差ブロック
+     
+     残差ベクトルのうち、[offset, offset+size)の行に同じ損失関数を適用します.
+     例えば色の残差にはL2,1ノルム(groupSize=3)、ランドマークにはHuber損失といった使い分けができます.
+     */
+    struct KSResidualBlock
+    {
+        //! ブロック先頭の行
+        int             offset;
+        //! ブロックの行数
+        int             size;
+        //! L2,1ノルムでまとめる行数
+        int             groupSize;
+        //! 適用する損失関数
+        KSRobustLossPtr pLoss;
+    };
+    
+    /**
+     @brief 残差ブロックごとの行スケールの計算
+     
+     ブロックに含まれない行のスケールは1になります.
+     @param dst     出力の行スケール
+     @param r       残差ベクトル
+     @param blocks  残差ブロックのリスト
+     */
+    inline void ComputeResidualBlockRowScale(KSVectorXf& dst,
+                                             const Eigen::Ref<const KSVectorXf>& r,
+                                             const std::vector<KSResidualBlock>& blocks)
+    {
+        dst.setOnes(r.size());
+        for (const auto& block : blocks)
+        {
+            if (!block.pLoss || block.offset < 0 || block.offset + block.size > r.size())
+            {
+                continue;
+            }
+            block.pLoss->ComputeRowScale(dst.segment(block.offset, block.size),
+                                         r.segment(block.offset, block.size),
+                                         block.groupSize);
+        }
+    }
+    
+    /**
+     @brief 残差ブロックごとのロバストコストの計算
+     
+     ブロックに含まれない行は二乗誤差として扱います.
+     @param r       残差ベクトル
+     @param blocks  残差ブロックのリスト
+     @return ロバストコスト
+     */
+    inline double ComputeResidualBlockCost(const Eigen::Ref<const KSVectorXf>& r,
+                                           const std::vector<KSResidualBlock>& blocks)
+    {
+        double  cost    = r.squaredNorm();
+        for (const auto& block : blocks)
+        {
+            if (!block.pLoss || block.offset < 0 || block.offset + block.size > r.size())
+            {
+                continue;
+            }
+            auto seg    = r.segment(block.offset, block.size);
+            cost    += block.pLoss->ComputeCost(seg, block.groupSize) - seg.squaredNorm();
+        }
+        return cost;
+    }
+
+} //namespace Kosakasakas {
+
+#endif /* KSRobustLoss_h */
@@ -0,0 +1,89 @@
+//
+//  KSRobustLossFactory.h
+//
+//  ロバスト損失関数クラスのファクトリクラス
+//
+//  Copyright (c) 2016年 Takahiro Kosaka. All rights reserved.
+//  Created by Takahiro Kosaka on 2016/07/11.
+//
+//  This Source Code Form is subject to the terms of the Mozilla
+//  Public License v. 2.0. If a copy of the MPL was not distributed
+//  with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef KSRobustLossFactory_h
+#define KSRobustLossFactory_h
+
+#include "KSTypeDef.h"
+#include "KSRobustLoss.h"
+
+namespace Kosakasakas {
+    
+    /**
+     @brief ロバスト損失関数クラスのファクトリクラス
+     ロバスト損失関数クラスを生成するファクトリクラスです.
+     */
+    class KSRobustLossFactory
+    {
+    public:
+        //! コンストラクタ
+        KSRobustLossFactory()
+        {};
+        
+        //! デストラクタ
+        virtual ~KSRobustLossFactory()
+        {};
+        
+        //! 初期化
+        bool    Initialize()
+        {
+            return true;
+        };
+        
+        //! 終了処理
+        void    Finalize()
+        {};
+        
+        /**
+         @brief 生成処理
+         
+         実際にインスタンスの生成を行う関数です.
+         生成されるインスタンスはシェアードポインタ型で生成されます.
+         @param type    生成する損失関数のタイプ
+         @param scale   スケールパラメータ(外れ値とみなす残差の閾値)
+         @return 生成された損失関数インスタンス
+         */
+        inline KSRobustLossPtr Create(RobustLossType type, float scale = 1.0f)
+        {
+            KSRobustLossPtr pLoss;
+            switch (type) {
+                case RobustLossType::L2:
+                    pLoss = std::make_shared<KSL2Loss>(scale);
+                    break;
+                
+                case RobustLossType::HUBER:
+                    pLoss = std::make_shared<KSHuberLoss>(scale);
+                    break;
+                
+                case RobustLossType::TUKEY:
+                    pLoss = std::make_shared<KSTukeyLoss>(scale);
+                    break;
+                
+                case RobustLossType::CAUCHY:
+                    pLoss = std::make_shared<KSCauchyLoss>(scale);
+                    break;
+                
+                case RobustLossType::L21:
+                    pLoss = std::make_shared<KSL21Loss>(scale);
+                    break;
+                
+                default:
+                    pLoss = nullptr;
+                    break;
+            }
+            return pLoss;
+        }
+    };
+
+} //namespace Kosakasakas {
+
+#endif /* KSRobustLossFactory_h */
@@ -0,0 +1,402 @@
+//
+//  KSSchurComplementSolver.h
+//
+//  シューア補行列による正規方程式のソルバクラス
+//
+//  Copyright (c) 2016年 Takahiro Kosaka. All rights reserved.
+//  Created by Takahiro Kosaka on 2016/07/15.
+//
+//  This Source Code Form is subject to the terms of the Mozilla
+//  Public License v. 2.0. If a copy of the MPL was not distributed
+//  with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef KSSchurComplementSolver_h
+#define KSSchurComplementSolver_h
+
+#include "KSNormalEquationSolver.h"
+#include "KSThreadPool.h"
+#include <eigen3/Eigen/Cholesky>
+#include <algorithm>
+#include <vector>
+
+namespace Kosakasakas {
+    
+    /**
+     @brief シューア補行列による正規方程式のソルバ
+     
+     パラメータが、全フレームで共有するブロック(形状、アルベドなど)と、
+     フレームごとのブロック(表情、姿勢、照明など)に分かれている問題のためのソルバです.
+     各残差が共有ブロックと高々1つのフレームブロックにしか依存しない場合、J^tJは矢じり型になります.
+        
+        | U    W_1  W_2  ... |
+        | W_1t V_1           |
+        | W_2t      V_2      |
+        | ...            ... |
+     
+     フレームごとのV_kを並列に消去して共有ブロックだけのシューア補行列 S = U - Σ W_k V_k^-1 W_k^t を作り、
+     Sを解いた後に各フレームのステップを並列に戻します. 計算量はフレーム数に対して線形です.
+     パラメータの並びは [共有ブロック | フレーム0 | フレーム1 | ...] としてSetBlockStructureで指定します.
+     指定しないまま解くと、ただの密なLDLT分解に黙って落ちないようにSolveは失敗します
+     (全てを共有ブロックとして解きたい場合は、フレームごとのブロックを空にして指定してください).
+     オプティマイザから使う場合は、KSNESolverFactory::CreateSchurComplementか
+     各オプティマイザのSwitchToSchurComplementSolverでブロック構造と一緒に生成します.
+     */
+    class KSSchurComplementSolver : public KSNormalEquationSolver
+    {
+    public:
+        //! コンストラクタ
+        KSSchurComplementSolver()
+        : m_SharedSize(-1)
+        , m_NumShared(0)
+        {};
+        
+        //! デストラクタ
+        virtual ~KSSchurComplementSolver()
+        {};
+        
+        //! 初期化
+        inline bool Initialize()
+        {
+            return true;
+        };
+        
+        //! 終了処理
+        inline void Finalize()
+        {};
+        
+        /**
+         @brief ブロック構造のセット
+         @param sharedSize  共有ブロックの要素数(パラメータの先頭に並べます)
+         @param frameSizes  フレームごとのブロックの要素数(共有ブロックの後ろに順に並べます)
+         */
+        inline void SetBlockStructure(int sharedSize, const std::vector<int>& frameSizes)
+        {
+            m_SharedSize    = sharedSize;
+            m_FrameSizes    = frameSizes;
+        }
+        
+        /**
+         @brief 計算実行
+         
+         実際に計算を行う関数です.
+         フレームごとのブロックを消去したシューア補行列により正規方程式を解きます.
+         @param dst     出力パラメータ行列
+         @param y       残差関数
+         @param j       残差関数のヤコビアン
+         @param maxIterations   演算の試行回数(本手法ではこのパラメータは意味は無い)
+         @return 計算の成否
+         */
+        inline bool Solve(KSMatrixXf& dst, KSMatrixXf& y, KSMatrixXf& j, int /*maxIterations*/)
+        {
+            const int rows  = static_cast<int>(j.rows());
+            if (!ResolveStructure(static_cast<int>(j.cols())))
+            {
+                return false;
+            }
+            
+            // 各行がどのフレームに依存するかを調べる
+            std::vector<int> rowFrames(rows, -1);
+            for (int i=0; i<rows; ++i)
+            {
+                for (int k=0, n=static_cast<int>(m_Offsets.size()); k<n; ++k)
+                {
+                    if ((j.row(i).segment(m_Offsets[k], m_FrameSizes[k]).array() != 0.0f).any())
+                    {
+                        if (rowFrames[i] >= 0)
+                        {
+                            return false;
+                        }
+                        rowFrames[i]    = k;
+                    }
+                }
+            }
+            PrepareBuckets(rowFrames);
+            
+            // フレームごとに行を集める
+            for (int i=0; i<rows; ++i)
+            {
+                const int k     = rowFrames[i];
+                Bucket& bucket  = GetBucket(k);
+                const int local = bucket.filled++;
+                bucket.Js.row(local)    = j.row(i).head(m_NumShared);
+                if (k >= 0)
+                {
+                    bucket.Jf.row(local)    = j.row(i).segment(m_Offsets[k], m_FrameSizes[k]);
+                }
+                bucket.r(local) = y(i, 0);
+            }
+            
+            KSVectorXf step;
+            if (!SolveBuckets(step))
+            {
+                return false;
+            }
+            dst.col(0)  += step;
+            return true;
+        };
+        
+        /**
+         @brief 計算実行
+         
+         実際に計算を行う関数です.
+         フレームごとのブロックを消去したシューア補行列により正規方程式を解きます.
+         @param dst     出力パラメータベクトル
+         @param y       残差ベクトル
+         @param j       残差関数のスパースヤコビアン
+         @param maxIterations   演算の試行回数(本手法ではこのパラメータは意味は無い)
+         @return 計算の成否
+         */
+        inline bool Solve(KSVectorXf& dst, KSVectorXf& y, KSMatrixSparsef& j, int /*maxIterations*/)
+        {
+            typedef Eigen::SparseMatrix<float, Eigen::RowMajor> RowMajorMatrix;
+            
+            const int cols  = static_cast<int>(j.cols());
+            if (!ResolveStructure(cols))
+            {
+                return false;
+            }
+            
+            // 列からフレームへの対応表
+            std::vector<int> colFrames(cols, -1);
+            for (int k=0, n=static_cast<int>(m_Offsets.size()); k<n; ++k)
+            {
+                std::fill(colFrames.begin() + m_Offsets[k], colFrames.begin() + m_Offsets[k] + m_FrameSizes[k], k);
+            }
+            
+            const RowMajorMatrix jr(j);
+            const int rows  = static_cast<int>(jr.rows());
+            std::vector<int> rowFrames(rows, -1);
+            for (int i=0; i<rows; ++i)
+            {
+                for (RowMajorMatrix::InnerIterator it(jr, i); it; ++it)
+                {
+                    const int k = colFrames[it.col()];
+                    if (k >= 0 && it.value() != 0.0f)
+                    {
+                        if (rowFrames[i] >= 0 && rowFrames[i] != k)
+                        {
+                            return false;
+                        }
+                        rowFrames[i]    = k;
+                    }
+                }
+            }
+            PrepareBuckets(rowFrames);
+            
+            for (int i=0; i<rows; ++i)
+            {
+                const int k     = rowFrames[i];
+                Bucket& bucket  = GetBucket(k);
+                const int local = bucket.filled++;
+                for (RowMajorMatrix::InnerIterator it(jr, i); it; ++it)
+                {
+                    const int col   = static_cast<int>(it.col());
+                    if (col < m_NumShared)
+                    {
+                        bucket.Js(local, col)   = it.value();
+                    }
+                    else if (k >= 0)
+                    {
+                        bucket.Jf(local, col - m_Offsets[k])    = it.value();
+                    }
+                }
+                bucket.r(local) = y(i);
+            }
+            
+            KSVectorXf step;
+            if (!SolveBuckets(step))
+            {
+                return false;
+            }
+            dst += step;
+            return true;
+        };
+    
+    private:
+        //! フレームごとに集めた行
+        struct Bucket
+        {
+            //! 共有ブロックの列
+            KSMatrixXf  Js;
+            //! フレームブロックの列
+            KSMatrixXf  Jf;
+            //! 残差
+            KSVectorXf  r;
+            //! 書き込み済みの行数
+            int         filled;
+        };
+        
+        //! ブロック構造をパラメータ数に合わせて確定する
+        inline bool ResolveStructure(int cols)
+        {
+            if (m_SharedSize < 0)
+            {
+                // ブロック構造が未指定
+                return false;
+            }
+            
+            m_NumShared = m_SharedSize;
+            m_Offsets.resize(m_FrameSizes.size());
+            int offset  = m_SharedSize;
+            for (int k=0, n=static_cast<int>(m_FrameSizes.size()); k<n; ++k)
+            {
+                m_Offsets[k]    = offset;
+                offset          += m_FrameSizes[k];
+            }
+            return offset == cols;
+        }
+        
+        //! 行の振り分けに合わせてフレームごとの行列を確保する
+        inline void PrepareBuckets(const std::vector<int>& rowFrames)
+        {
+            const int numFrames = static_cast<int>(m_Offsets.size());
+            std::vector<int> counts(numFrames + 1, 0);
+            for (int k : rowFrames)
+            {
+                ++counts[k < 0 ? numFrames : k];
+            }
+            
+            m_Buckets.resize(numFrames + 1);
+            for (int k=0; k<=numFrames; ++k)
+            {
+                Bucket& bucket  = m_Buckets[k];
+                bucket.Js.setZero(counts[k], m_NumShared);
+                bucket.Jf.setZero(counts[k], k < numFrames ? m_FrameSizes[k] : 0);
+                bucket.r.resize(counts[k]);
+                bucket.filled   = 0;
+            }
+        }
+        
+        //! フレームの行(k<0の場合は共有ブロックだけに依存する行)
+        inline Bucket&  GetBucket(int k)
+        {
+            return m_Buckets[k < 0 ? m_Offsets.size() : k];
+        }
+        
+        //! 計算精度に合わせて縮約と求解を行う
+        inline bool SolveBuckets(KSVectorXf& step)
+        {
+            if (m_Precision == PrecisionType::MIXED_PRECISION)
+            {
+                return ReduceAndSolve<double>(step);
+            }
+            return ReduceAndSolve<float>(step);
+        }
+        
+        /**
+         @brief フレームブロックの消去と求解
+         
+         フレームごとにV_k、W_kを作ってシューア補行列への寄与をワーカーごとに累積し、
+         共有ブロックを解いた後にフレームごとのステップを求めます.
+         @param step    出力のステップ
+         @return 計算の成否
+         */
+        template <typename Scalar>
+        bool    ReduceAndSolve(KSVectorXf& step)
+        {
+            typedef Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>   Matrix;
+            typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1>                Vector;
+            
+            const int s         = m_NumShared;
+            const int numFrames = static_cast<int>(m_Offsets.size());
+            KSThreadPool& pool  = KSThreadPool::GetDefault();
+            
+            // ワーカーごとのSと右辺(-g_s + Σ W_k V_k^-1 g_k)
+            std::vector<Matrix> partialS(pool.GetNumWorkers(), Matrix::Zero(s, s));
+            std::vector<Vector> partialRhs(pool.GetNumWorkers(), Vector::Zero(s));
+            // 後退代入で使うV_k^-1 W_k^t と V_k^-1 g_k
+            std::vector<Matrix> vinvWt(numFrames);
+            std::vector<Vector> vinvG(numFrames);
+            std::vector<char>   succeeded(numFrames, 1);
+            
+            auto addShared = [&](const Matrix& Js, const Vector& r, int worker)
+            {
+                partialS[worker].template selfadjointView<Eigen::Lower>().rankUpdate(Js.transpose());
+                partialRhs[worker].noalias()    -= Js.transpose() * r;
+            };
+            
+            pool.ParallelFor(0, numFrames, 1, [&](int begin, int end, int worker)
+            {
+                for (int k=begin; k<end; ++k)
+                {
+                    const Bucket& bucket    = m_Buckets[k];
+                    const Matrix Js = bucket.Js.cast<Scalar>();
+                    const Matrix Jf = bucket.Jf.cast<Scalar>();
+                    const Vector r  = bucket.r.cast<Scalar>();
+                    addShared(Js, r, worker);
+                    
+                    Matrix V    = Matrix::Zero(Jf.cols(), Jf.cols());
+                    V.template selfadjointView<Eigen::Lower>().rankUpdate(Jf.transpose());
+                    const Matrix W  = Js.transpose() * Jf;
+                    const Vector g  = Jf.transpose() * r;
+                    
+                    Eigen::LDLT<Matrix, Eigen::Lower> ldlt(V);
+                    if (ldlt.info() != Eigen::Success || !ldlt.isPositive())
+                    {
+                        succeeded[k]    = 0;
+                        continue;
+                    }
+                    vinvWt[k]   = ldlt.solve(W.transpose());
+                    vinvG[k]    = ldlt.solve(g);
+                    partialS[worker].noalias()      -= W * vinvWt[k];
+                    partialRhs[worker].noalias()    += W * vinvG[k];
+                }
+            });
+            if (std::find(succeeded.begin(), succeeded.end(), 0) != succeeded.end())
+            {
+                return false;
+            }
+            
+            // 共有ブロックだけに依存する行
+            const Bucket& sharedBucket  = m_Buckets[numFrames];
+            addShared(sharedBucket.Js.cast<Scalar>(), sharedBucket.r.cast<Scalar>(), 0);
+            
+            // rankUpdateは下三角だけを更新するので、合計してから下三角で分解する
+            Matrix S    = partialS[0];
+            Vector rhs  = partialRhs[0];
+            for (int w=1, n=pool.GetNumWorkers(); w<n; ++w)
+            {
+                S   += partialS[w];
+                rhs += partialRhs[w];
+            }
+            
+            Vector ds   = Vector::Zero(s);
+            if (s > 0)
+            {
+                Eigen::LDLT<Matrix, Eigen::Lower> ldlt(S);
+                if (ldlt.info() != Eigen::Success)
+                {
+                    return false;
+                }
+                ds  = ldlt.solve(rhs);
+            }
+            
+            step.resize(m_Offsets.empty() ? s : m_Offsets.back() + m_FrameSizes.back());
+            step.head(s)    = ds.template cast<float>();
+            pool.ParallelFor(0, numFrames, 1, [&](int begin, int end, int /*worker*/)
+            {
+                for (int k=begin; k<end; ++k)
+                {
+                    // V_k dx_k = -g_k - W_k^t ds
+                    step.segment(m_Offsets[k], m_FrameSizes[k])  = (-vinvG[k] - vinvWt[k] * ds).template cast<float>();
+                }
+            });
+            return step.allFinite();
+        }
+    
+    private:
+        //! 共有ブロックの要素数(未指定の場合は-1)
+        int                 m_SharedSize;
+        //! フレームごとのブロックの要素数
+        std::vector<int>    m_FrameSizes;
+        //! 計算で使う共有ブロックの要素数
+        int                 m_NumShared;
+        //! フレームごとのブロックの先頭の列
+        std::vector<int>    m_Offsets;
+        //! フレームごとに集めた行(最後は共有ブロックだけに依存する行)
+        std::vector<Bucket> m_Buckets;
+    };
+
+} //namespace Kosakasakas {
+
+#endif /* KSSchurComplementSolver_h */
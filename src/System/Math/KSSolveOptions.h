@@ -0,0 +1,123 @@
+//
+//  KSSolveOptions.h
+//
+//  最適化ループの設定と結果
+//
+//  Copyright (c) 2016年 Takahiro Kosaka. All rights reserved.
+//  Created by Takahiro Kosaka on 2016/07/14.
+//
+//  This Source Code Form is subject to the terms of the Mozilla
+//  Public License v. 2.0. If a copy of the MPL was not distributed
+//  with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef KSSolveOptions_h
+#define KSSolveOptions_h
+
+#include "KSTypeDef.h"
+#include <chrono>
+
+namespace Kosakasakas {
+    
+    /**
+     @brief 最適化ループの設定
+     
+     各オプティマイザのSolveに渡す、収束判定と計算予算の設定です.
+     閾値に0以下を指定した判定は行いません.
+     */
+    struct KSSolveOptions
+    {
+        //! コンストラクタ
+        KSSolveOptions()
+        : maxIterations(10)
+        , functionTolerance(1.0e-6)
+        , gradientTolerance(1.0e-10)
+        , parameterTolerance(1.0e-8)
+        , maxSolveTimeInSeconds(0.0)
+        , useIRLS(false)
+        , stepStrategy(StepStrategyType::GAUSS_NEWTON)
+        , initialTrustRadius(0.0)
+        {};
+        
+        //! 最大反復回数
+        int     maxIterations;
+        //! コストの相対減少量の閾値 |cost_k - cost_k+1| / cost_k
+        double  functionTolerance;
+        //! 勾配(J^t・r)の最大絶対値の閾値
+        double  gradientTolerance;
+        //! ステップのノルムの相対閾値 |dx| / (|x| + parameterTolerance)
+        double  parameterTolerance;
+        //! 計算時間の予算[秒](0以下で無制限)
+        double  maxSolveTimeInSeconds;
+        //! IRLSステップを使うかどうか(DOGLEGとは組み合わせられません)
+        bool    useIRLS;
+        //! ステップの決め方(DOGLEGとuseIRLSを両方指定した場合、Solveは反復せずにFAILUREで終わります)
+        StepStrategyType    stepStrategy;
+        //! ドッグレッグ法の信頼半径の初期値(0以下の場合は最初のガウス-ニュートンステップのノルム)
+        double  initialTrustRadius;
+    };
+    
+    /**
+     @brief 最適化ループの結果
+     */
+    struct KSSolveSummary
+    {
+        //! コンストラクタ
+        KSSolveSummary()
+        : termination(SolveTerminationType::FAILURE)
+        , iterations(0)
+        , initialCost(0.0)
+        , finalCost(0.0)
+        , gradientNorm(0.0)
+        , stepNorm(0.0)
+        , totalTimeInSeconds(0.0)
+        {};
+        
+        //! 収束して終了したかどうか
+        inline bool IsConverged() const
+        {
+            return termination == SolveTerminationType::COST_CONVERGENCE
+                || termination == SolveTerminationType::GRADIENT_CONVERGENCE
+                || termination == SolveTerminationType::STEP_CONVERGENCE;
+        }
+        
+        //! 終了理由
+        SolveTerminationType    termination;
+        //! 実行した反復回数
+        int     iterations;
+        //! 初期コスト
+        double  initialCost;
+        //! 最終コスト
+        double  finalCost;
+        //! 最後に評価した勾配の最大絶対値
+        double  gradientNorm;
+        //! 最後のステップのノルム
+        double  stepNorm;
+        //! 計算時間[秒]
+        double  totalTimeInSeconds;
+    };
+    
+    /**
+     @brief 最適化ループの計時
+     */
+    class KSSolveTimer
+    {
+    public:
+        //! コンストラクタ(計時を開始します)
+        KSSolveTimer()
+        : m_Start(std::chrono::steady_clock::now())
+        {};
+        
+        //! 経過時間[秒]
+        inline double   GetElapsedSeconds() const
+        {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_Start).count();
+        }
+    
+    private:
+        //! 計時開始の時刻
+        std::chrono::steady_clock::time_point   m_Start;
+    };
+
+} //namespace Kosakasakas {
+
+#endif /* KSSolveOptions_h */
@@ -0,0 +1,232 @@
+//
+//  KSSparseJacobian.h
+//
+//  非ゼロパターンを再利用するスパースヤコビアンの組み立てクラス
+//
+//  Copyright (c) 2016年 Takahiro Kosaka. All rights reserved.
+//  Created by Takahiro Kosaka on 2016/07/15.
+//
+//  This Source Code Form is subject to the terms of the Mozilla
+//  Public License v. 2.0. If a copy of the MPL was not distributed
+//  with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef KSSparseJacobian_h
+#define KSSparseJacobian_h
+
+#include "KSTypeDef.h"
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+namespace Kosakasakas {
+    
+    /**
+     @brief 非ゼロパターンを再利用するスパースヤコビアンの組み立てクラス
+     
+     Begin、Add、Endの順に(行, 列, 値)を追加してヤコビアンを組み立てます.
+     三つ組のバッファはステップを跨いで使い回すので、2回目以降の組み立てでは確保が起きません.
+     追加した(行, 列)の並びが前回と同じ場合は、圧縮列形式(CSC)の構造をそのまま使い、値だけを書き込みます.
+     パターンを固定するため、構造的に非ゼロの要素は値が0でも毎回同じ順に追加してください.
+     同じ(行, 列)を複数回追加した場合は値が加算されます.
+     */
+    class KSSparseJacobian
+    {
+    public:
+        //! コンストラクタ
+        KSSparseJacobian()
+        : m_Rows(0)
+        , m_Cols(0)
+        , m_pColumnMap(nullptr)
+        , m_HasPattern(false)
+        , m_IsPatternReused(false)
+        {};
+        
+        //! デストラクタ
+        virtual ~KSSparseJacobian()
+        {};
+        
+        /**
+         @brief 組み立ての開始
+         
+         pColumnMapを指定すると、Addで渡された列を対応表で付け替え、-1の列は捨てます.
+         固定したパラメータの列を組み立ての時点で落とすのに使います. 対応表はEndまで有効である必要があります.
+         @param rows        行数(残差の要素数)
+         @param cols        列数(対応表を使う場合は付け替え後の列数)
+         @param pColumnMap  パラメータの列から組み立てる列への対応表(nullptrの場合は付け替えない)
+         */
+        inline void Begin(int rows, int cols, const std::vector<int>* pColumnMap = nullptr)
+        {
+            m_Rows          = rows;
+            m_Cols          = cols;
+            m_pColumnMap    = pColumnMap;
+            m_RowIndices.clear();
+            m_ColIndices.clear();
+            m_Values.clear();
+        }
+        
+        /**
+         @brief 要素の追加
+         @param row     行
+         @param col     列
+         @param value   値
+         */
+        inline void Add(int row, int col, float value)
+        {
+            if (m_pColumnMap)
+            {
+                if (col < 0 || col >= static_cast<int>(m_pColumnMap->size()))
+                {
+                    // 範囲外としてEndで失敗させる
+                    col = -1;
+                }
+                else if ((col = (*m_pColumnMap)[col]) < 0)
+                {
+                    return;
+                }
+            }
+            m_RowIndices.push_back(row);
+            m_ColIndices.push_back(col);
+            m_Values.push_back(value);
+        }
+        
+        /**
+         @brief 組み立ての終了
+         
+         前回とパターンが同じ場合は値だけを書き込み、異なる場合は構造を作り直します.
+         @return 組み立ての成否(範囲外の要素があった場合は失敗)
+         */
+        bool    End()
+        {
+            m_IsPatternReused   = IsSamePattern();
+            if (m_IsPatternReused)
+            {
+                // 構造はそのままで値だけを書き込む
+                float* pValues  = m_Matrix.valuePtr();
+                std::fill(pValues, pValues + m_Matrix.nonZeros(), 0.0f);
+                for (int k=0, n=static_cast<int>(m_Values.size()); k<n; ++k)
+                {
+                    pValues[m_ValueIndices[k]]  += m_Values[k];
+                }
+                return true;
+            }
+            return BuildPattern();
+        }
+        
+        //! 組み立てたヤコビアンの取得
+        inline KSMatrixSparsef&         GetMatrix()
+        {
+            return m_Matrix;
+        }
+        
+        //! 組み立てたヤコビアンの取得
+        inline const KSMatrixSparsef&   GetMatrix() const
+        {
+            return m_Matrix;
+        }
+        
+        //! 前回のEndでパターンを再利用したかどうか
+        inline bool IsPatternReused() const
+        {
+            return m_IsPatternReused;
+        }
+        
+        //! 保持しているパターンの破棄
+        inline void ResetPattern()
+        {
+            m_HasPattern        = false;
+            m_IsPatternReused   = false;
+        }
+    
+    private:
+        //! 追加された(行, 列)の並びが保持しているパターンと同じかどうか
+        inline bool IsSamePattern() const
+        {
+            return m_HasPattern
+                && m_Rows == m_Matrix.rows()
+                && m_Cols == m_Matrix.cols()
+                && m_RowIndices == m_PatternRows
+                && m_ColIndices == m_PatternCols;
+        }
+        
+        //! 圧縮列形式の構造と、追加順から値の位置への対応を作り直す
+        bool    BuildPattern()
+        {
+            m_HasPattern    = false;
+            const int n     = static_cast<int>(m_Values.size());
+            m_Triplets.clear();
+            m_Triplets.reserve(n);
+            for (int k=0; k<n; ++k)
+            {
+                if (m_RowIndices[k] < 0 || m_RowIndices[k] >= m_Rows
+                    || m_ColIndices[k] < 0 || m_ColIndices[k] >= m_Cols)
+                {
+                    return false;
+                }
+                m_Triplets.push_back(Eigen::Triplet<float>(m_RowIndices[k], m_ColIndices[k], m_Values[k]));
+            }
+            
+            m_Matrix.resize(m_Rows, m_Cols);
+            m_Matrix.setFromTriplets(m_Triplets.begin(), m_Triplets.end());
+            m_Matrix.makeCompressed();
+            
+            // 各要素が値配列のどこに入るかを列内の二分探索で求めておく
+            const int* pOuter   = m_Matrix.outerIndexPtr();
+            const int* pInner   = m_Matrix.innerIndexPtr();
+            m_ValueIndices.resize(n);
+            for (int k=0; k<n; ++k)
+            {
+                const int col   = m_ColIndices[k];
+                const int* it   = std::lower_bound(pInner + pOuter[col], pInner + pOuter[col + 1], m_RowIndices[k]);
+                m_ValueIndices[k]   = static_cast<int>(it - pInner);
+            }
+            
+            m_PatternRows   = m_RowIndices;
+            m_PatternCols   = m_ColIndices;
+            m_HasPattern    = true;
+            return true;
+        }
+    
+    private:
+        //! 組み立てたヤコビアン
+        KSMatrixSparsef     m_Matrix;
+        //! 行数
+        int                 m_Rows;
+        //! 列数
+        int                 m_Cols;
+        //! 列の対応表
+        const std::vector<int>* m_pColumnMap;
+        //! 追加された要素の行
+        std::vector<int>    m_RowIndices;
+        //! 追加された要素の列
+        std::vector<int>    m_ColIndices;
+        //! 追加された要素の値
+        std::vector<float>  m_Values;
+        //! 構造を作り直す時に使う三つ組のバッファ
+        std::vector<Eigen::Triplet<float> > m_Triplets;
+        //! 保持しているパターンの行
+        std::vector<int>    m_PatternRows;
+        //! 保持しているパターンの列
+        std::vector<int>    m_PatternCols;
+        //! 追加順の要素ごとの値配列での位置
+        std::vector<int>    m_ValueIndices;
+        //! パターンを保持しているかどうか
+        bool                m_HasPattern;
+        //! 前回のEndでパターンを再利用したかどうか
+        bool                m_IsPatternReused;
+    };
+    
+    /**
+     @brief ベクトル引数の残差ファンクタ
+     現状最適化処理専用です。
+     */
+    typedef std::function<KSVectorXf(const KSVectorXf &x)>                          KSVectorFunction;
+    
+    /**
+     @brief スパースヤコビアンの組み立てファンクタ
+     パラメータxでのヤコビアンの要素をKSSparseJacobian::Addで追加します(Begin、Endは呼び出し側が行います)。
+     */
+    typedef std::function<void(const KSVectorXf &x, KSSparseJacobian &j)>          KSSparseJacobianFunction;
+
+} //namespace Kosakasakas {
+
+#endif /* KSSparseJacobian_h */
@@ -19,6 +19,7 @@ KSSparseOptimizer::KSSparseOptimizer()
 : m_IsInitialized(false)
 , m_pNESolver(nullptr)
 , m_MaxIterations(4)
+, m_Precision(PrecisionType::SINGLE_PRECISION)
 {}
 
 // デストラクタ
@@ -26,15 +27,16 @@ KSSparseOptimizer::~KSSparseOptimizer()
 {}
 
 // 初期化
-bool    KSSparseOptimizer::Initialize(KSFunctionSparse& residual,
-                                     KSFunctionSparse& jaconian,
-                                     KSMatrixSparsef& initParam,
-                                     KSMatrixSparsef& data)
+bool    KSSparseOptimizer::Initialize(KSVectorFunction& residual,
+                                     KSSparseJacobianFunction& jaconian,
+                                     KSVectorXf& initParam,
+                                     KSMatrixXf& data)
 {
     m_FuncResidual  = std::move(residual);
     m_FuncJacobian  = std::move(jaconian);
-    m_MatParam      = std::move(initParam);
+    m_Param         = std::move(initParam);
     m_MatData       = std::move(data);
+    m_Jacobian.ResetPattern();
     m_IsInitialized = true;
     
     if (!m_NESolverFactory.Initialize())
@@ -45,6 +47,7 @@ bool    KSSparseOptimizer::Initialize(KSFunctionSparse& residual,
     if (!m_pNESolver)
     {
         m_pNESolver     = m_NESolverFactory.Create(NESolverType::CHOLESKY);
+        ApplyPrecision();
     }
     
     return true;
@@ -58,57 +61,318 @@ bool    KSSparseOptimizer::DoGaussNewtonStep()
         return false;
     }
     
-    KSMatrixSparsef j    = m_FuncJacobian(m_MatParam);
-    if (j.rows() < j.cols())
+    KSVectorXf y    = m_FuncResidual(m_Param);
+    
+    return ComputeStep(y, false, nullptr, 0.0, nullptr);
+}
+
+// IRLS最適化ステップの実行（ガウス-ニュートン法）
+bool    KSSparseOptimizer::DoGaussNewtonStepIRLS()
+{
+    if (!m_IsInitialized || !m_pNESolver)
     {
         return false;
     }
     
-    KSMatrixSparsef y    = m_FuncResidual(m_MatParam);
+    KSVectorXf y    = m_FuncResidual(m_Param);
     
-    return m_pNESolver->Solve(m_MatParam, y, j, m_MaxIterations);
+    return ComputeStep(y, true, nullptr, 0.0, nullptr);
 }
 
-// IRLS最適化ステップの実行（ガウス-ニュートン法）
-bool    KSSparseOptimizer::DoGaussNewtonStepIRLS()
+// 収束するまで最適化ステップを実行
+KSSolveSummary  KSSparseOptimizer::Solve(const KSSolveOptions& options)
 {
-    if (!m_IsInitialized)
+    KSSolveSummary  summary;
+    KSSolveTimer    timer;
+    if (!m_IsInitialized || !m_pNESolver)
+    {
+        return summary;
+    }
+    
+    // 残差はステップの計算とコストの評価で使い回す
+    KSVectorXf y        = m_FuncResidual(m_Param);
+    double cost         = GetCost(y, options.useIRLS);
+    summary.initialCost = cost;
+    summary.termination = SolveTerminationType::MAX_ITERATIONS;
+    
+    const bool useDogleg    = (options.stepStrategy == StepStrategyType::DOGLEG);
+    if (useDogleg && options.useIRLS)
+    {
+        // IRLSの重みは反復ごとに変わるので、重み付きの二次モデルの予測とロバストなコストの減少量を比べられない
+        summary.termination = SolveTerminationType::FAILURE;
+        summary.finalCost   = cost;
+        return summary;
+    }
+    double radius           = options.initialTrustRadius;
+    double lastStepTime     = 0.0;
+    for (int i = 0; i < options.maxIterations; ++i)
+    {
+        // 次のステップが予算内に収まらない場合は打ち切る
+        const double stepStart  = timer.GetElapsedSeconds();
+        if (options.maxSolveTimeInSeconds > 0.0
+            && stepStart + lastStepTime > options.maxSolveTimeInSeconds)
+        {
+            summary.termination = SolveTerminationType::TIME_BUDGET;
+            break;
+        }
+        
+        const KSVectorXf prevParam  = m_Param;
+        double gradientNorm         = 0.0;
+        double newCost              = cost;
+        const bool succeeded        = useDogleg
+            ? DoDoglegStep(y, newCost, radius, options, gradientNorm)
+            : ComputeStep(y, options.useIRLS, &gradientNorm, options.gradientTolerance, nullptr);
+        if (!succeeded)
+        {
+            summary.termination = SolveTerminationType::FAILURE;
+            break;
+        }
+        summary.gradientNorm    = gradientNorm;
+        if (options.gradientTolerance > 0.0 && gradientNorm <= options.gradientTolerance)
+        {
+            summary.stepNorm    = 0.0;
+            summary.termination = SolveTerminationType::GRADIENT_CONVERGENCE;
+            break;
+        }
+        ++summary.iterations;
+        
+        if (!useDogleg)
+        {
+            // ドッグレッグ法では採択したステップの残差とコストが既に求まっている
+            y       = m_FuncResidual(m_Param);
+            newCost = GetCost(y, options.useIRLS);
+        }
+        if (!std::isfinite(newCost))
+        {
+            // 発散した場合はステップ前のパラメータに戻す
+            m_Param             = prevParam;
+            summary.termination = SolveTerminationType::FAILURE;
+            break;
+        }
+        
+        const double paramNorm  = prevParam.norm();
+        summary.stepNorm        = (m_Param - prevParam).norm();
+        const double costChange = std::fabs(cost - newCost);
+        const double prevCost   = cost;
+        cost                    = newCost;
+        lastStepTime            = timer.GetElapsedSeconds() - stepStart;
+        
+        if (options.functionTolerance > 0.0 && costChange <= options.functionTolerance * prevCost)
+        {
+            summary.termination = SolveTerminationType::COST_CONVERGENCE;
+            break;
+        }
+        if (options.parameterTolerance > 0.0
+            && summary.stepNorm <= options.parameterTolerance * (paramNorm + options.parameterTolerance))
+        {
+            summary.termination = SolveTerminationType::STEP_CONVERGENCE;
+            break;
+        }
+    }
+    
+    summary.finalCost           = cost;
+    summary.totalTimeInSeconds  = timer.GetElapsedSeconds();
+    return summary;
+}
+
+// ドッグレッグ法による最適化ステップの実行
+bool    KSSparseOptimizer::DoDoglegStep(KSVectorXf& y,
+                                        double& cost,
+                                        double& radius,
+                                        const KSSolveOptions& options,
+                                        double& gradientNorm)
+{
+    // 線形化と正規方程式の求解は1回だけ行う(IRLSとは組み合わせないので残差はそのまま使う)
+    if (!ComputeStep(y, false, &gradientNorm, options.gradientTolerance, &m_Dogleg))
     {
         return false;
     }
+    if (options.gradientTolerance > 0.0 && gradientNorm <= options.gradientTolerance)
+    {
+        return true;
+    }
+    if (radius <= 0.0)
+    {
+        radius  = m_Dogleg.GetGaussNewtonNorm();
+    }
     
-    KSMatrixSparsef j    = m_FuncJacobian(m_MatParam);
-    if (j.rows() < j.cols())
+    // 棄却された場合は半径だけを縮めてステップを作り直す
+    const KSVectorXf x      = m_Param;
+    const double minRadius  = options.parameterTolerance * (x.norm() + options.parameterTolerance);
+    const int maxTrials     = 32;
+    KSVectorXf step;
+    for (int trial = 0; trial < maxTrials && radius > minRadius; ++trial)
+    {
+        double predicted        = 0.0;
+        const double stepNorm   = m_Dogleg.ComputeStep(radius, step, predicted);
+        m_Param                 = x;
+        if (m_ParamMask.IsActive())
+        {
+            m_ParamMask.AddStep(m_Param, step);
+        }
+        else
+        {
+            m_Param             += step;
+        }
+        
+        KSVectorXf yNew         = m_FuncResidual(m_Param);
+        const double newCost    = GetCost(yNew, false);
+        const double rho        = (predicted > 0.0) ? (cost - newCost) / predicted : -1.0;
+        if (std::isfinite(newCost) && rho > 0.0)
+        {
+            if (rho > 0.75)
+            {
+                radius  = std::max(radius, 3.0 * stepNorm);
+            }
+            else if (rho < 0.25)
+            {
+                radius  *= 0.5;
+            }
+            y.swap(yNew);
+            cost    = newCost;
+            return true;
+        }
+        radius  = 0.5 * std::min(radius, stepNorm);
+    }
+    
+    // コストを下げるステップが見つからなかった場合はパラメータを戻す
+    // (コストが変化しないので、呼び出し側では収束として扱われる)
+    m_Param = x;
+    return true;
+}
+
+// 最適化ステップの計算
+bool    KSSparseOptimizer::ComputeStep(KSVectorXf& y,
+                                       bool useIRLS,
+                                       double* pGradientNorm,
+                                       double gradientTolerance,
+                                       KSDoglegModel* pDogleg)
+{
+    m_ParamMask.Update(static_cast<int>(m_Param.size()));
+    const bool useMask  = m_ParamMask.IsActive();
+    
+    const int rows  = static_cast<int>(y.size());
+    const int cols  = useMask ? m_ParamMask.GetNumFree() : static_cast<int>(m_Param.size());
+    if (rows < cols)
     {
         return false;
     }
-    KSMatrixSparsef y    = m_FuncResidual(m_MatParam);
     
-    // IRLS用のweightを算出して乗算
-    KSVectorXf v = y.col(0);
-    auto w = v.cwiseAbs().cwiseMax(0.00001).cwiseInverse().asDiagonal();
-    for (int i=0,n=j.cols(); i<n; ++i)
+    // 前回のバッファとパターンを使い回してヤコビアンを組み立てる
+    // (固定したパラメータの列は組み立ての時点で落とす)
+    m_Jacobian.Begin(rows, cols, useMask ? &m_ParamMask.GetColumnMap() : nullptr);
+    m_FuncJacobian(m_Param, m_Jacobian);
+    if (!m_Jacobian.End())
     {
-        j.col(i) = w * j.col(i);
+        return false;
     }
-    y = w * y;
+    KSMatrixSparsef& j  = m_Jacobian.GetMatrix();
     
-    return m_pNESolver->Solve(m_MatParam, y, j, m_MaxIterations);
+    if (useIRLS)
+    {
+        // IRLS用のweightを算出
+        KSVectorXf w;
+        if (m_ResidualBlocks.empty())
+        {
+            w   = y.cwiseAbs().cwiseMax(0.00001).cwiseInverse();
+        }
+        else
+        {
+            ComputeResidualBlockRowScale(w, y, m_ResidualBlocks);
+        }
+        
+        // 非ゼロ要素だけをその場でスケーリングする
+        const int* pInner   = j.innerIndexPtr();
+        float* pValues      = j.valuePtr();
+        for (int k=0, n=static_cast<int>(j.nonZeros()); k<n; ++k)
+        {
+            pValues[k]  *= w(pInner[k]);
+        }
+        y.array()   *= w.array();
+    }
+    
+    // 勾配が十分小さければステップを解かずに終了
+    if (pGradientNorm)
+    {
+        *pGradientNorm  = (j.transpose() * y).cwiseAbs().maxCoeff();
+        if (gradientTolerance > 0.0 && *pGradientNorm <= gradientTolerance)
+        {
+            return true;
+        }
+    }
+    
+    if (!useMask && !pDogleg)
+    {
+        return m_pNESolver->Solve(m_Param, y, j, m_MaxIterations);
+    }
+    
+    // 自由なパラメータだけのステップを解いて元の位置に加算する
+    KSVectorXf step = KSVectorXf::Zero(cols);
+    if (!m_pNESolver->Solve(step, y, j, m_MaxIterations))
+    {
+        return false;
+    }
+    if (pDogleg)
+    {
+        // パラメータは更新せず、ドッグレッグ法のモデルを作る
+        const KSVectorXf g  = j.transpose() * y;
+        pDogleg->Set(y, g, j * g, step, j * step);
+        return true;
+    }
+    m_ParamMask.AddStep(m_Param, step);
+    return true;
+}
+
+// コストの評価
+double  KSSparseOptimizer::GetCost(const KSVectorXf& y, bool useIRLS) const
+{
+    if (useIRLS)
+    {
+        return ComputeResidualBlockCost(y, m_ResidualBlocks);
+    }
+    return y.squaredNorm();
+}
+
+// ロバストコストの取得
+double KSSparseOptimizer::GetRobustCost()
+{
+    return ComputeResidualBlockCost(m_FuncResidual(m_Param), m_ResidualBlocks);
 }
 
 // 残差平方和の取得
 double KSSparseOptimizer::GetSquaredResidualsSum()
 {
-    KSMatrixSparsef m   = m_FuncResidual(m_MatParam);
-    KSMatrixSparsef mt  = m.transpose();
-    KSMatrixSparsef res = mt * m;
-    return fabs(res.coeff(0, 0));
+    return m_FuncResidual(m_Param).squaredNorm();
 }
 
 // 正規方程式ソルバの変更
 void    KSSparseOptimizer::SwitchNormalEquationSolver(NESolverType type)
 {
     m_pNESolver = m_NESolverFactory.Create(type);
+    ApplyPrecision();
+}
+
+// シューア補行列の正規方程式ソルバへの変更
+void    KSSparseOptimizer::SwitchToSchurComplementSolver(int sharedSize, const std::vector<int>& frameSizes)
+{
+    m_pNESolver = m_NESolverFactory.CreateSchurComplement(sharedSize, frameSizes);
+    ApplyPrecision();
+}
+
+// 計算精度のセット
+void    KSSparseOptimizer::SetPrecision(PrecisionType precision)
+{
+    m_Precision = precision;
+    ApplyPrecision();
+}
+
+// 正規方程式ソルバへの計算精度の反映
+void    KSSparseOptimizer::ApplyPrecision()
+{
+    if (m_pNESolver)
+    {
+        m_pNESolver->SetPrecision(m_Precision);
+    }
 }
 
 
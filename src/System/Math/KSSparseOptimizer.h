@@ -18,6 +18,11 @@
 #include <functional>
 #include "KSNormalEquationSolver.h"
 #include "KSNESolverFactory.h"
+#include "KSRobustLoss.h"
+#include "KSSolveOptions.h"
+#include "KSSparseJacobian.h"
+#include "KSParameterMask.h"
+#include "KSDoglegModel.h"
 
 namespace Kosakasakas {
     
@@ -25,6 +30,8 @@ namespace Kosakasakas {
      @brief 非線形最小二乗問題を扱うための最適化計算クラスです。
      線形問題も扱えます。
      ソルバにはガウス-ニュートン法を用います。
+     パラメータと残差は密ベクトルで持ち、ヤコビアンだけをスパース行列として組み立てます.
+     ヤコビアンの組み立てバッファはステップを跨いで使い回し、非ゼロパターンが変わらない限り構造も再利用します.
      */
     class KSSparseOptimizer
     {
@@ -40,15 +47,15 @@ namespace Kosakasakas {
          最適化計算クラスを初期化します.
          各パラメータは内部でstd::moveされ、所有権がこのクラスに渡ってしまう点に注意して下さい。
          @param residual    残差関数
-         @param jacobian    残差関数のヤコビアン（一次微分）
-         @param param       パラメータの初期値マトリックス
+         @param jacobian    残差関数のヤコビアン（一次微分）の組み立て関数
+         @param param       パラメータの初期値ベクトル
          @param data        サンプルデータマトリック
          @return 初期化の成否
          */
-        bool    Initialize(KSFunctionSparse& residual,
-                           KSFunctionSparse& jaconian,
-                           KSMatrixSparsef& initParam,
-                           KSMatrixSparsef& data);
+        bool    Initialize(KSVectorFunction& residual,
+                           KSSparseJacobianFunction& jaconian,
+                           KSVectorXf& initParam,
+                           KSMatrixXf& data);
         
         /**
          @brief 最適化ステップの実行（ガウス-ニュートン法）
@@ -64,13 +71,36 @@ namespace Kosakasakas {
          @brief IRLS最適化ステップの実行（ガウス-ニュートン法）
          
          Iteratively reweighted least squaresをガウス-ニュートン法により最適化計算します。
-         重みの計算は、前ステップの解による残差の逆数を絶対値で使っています。
+         残差ブロックがセットされている場合は、ブロックごとの損失関数から重みを算出します。
+         セットされていない場合は、前ステップの解による残差の逆数を絶対値で使っています。
          内部では1回しか最適化計算を行わないため、アプリケーション側で複数回計算ステップを実行してください。
          実行前に必ずInitializeを呼んでください。
          @return 初期化の成否
          */
         bool    DoGaussNewtonStepIRLS();
         
+        /**
+         @brief 収束するまで最適化ステップを実行
+         
+         コストの相対減少量、勾配のノルム、ステップのノルムのいずれかが閾値を下回るか、
+         最大反復回数・計算時間の予算に達するまでステップを繰り返します.
+         残差はステップの計算とコストの評価で使い回すため、1反復あたりの残差関数の評価は1回です.
+         options.stepStrategyにDOGLEGを指定すると信頼領域ステップを使います.
+         実行前に必ずInitializeを呼んでください。
+         @param options     収束判定と計算予算の設定
+         @return 最適化ループの結果
+         */
+        KSSolveSummary  Solve(const KSSolveOptions& options);
+        
+        /**
+         @brief ロバストコストの取得
+         
+         現在のパラメータでの、残差ブロックごとの損失関数の総和を取得します。
+         残差ブロックがセットされていない場合は残差平方和と同じ値になります。
+         @return ロバストコスト
+         */
+        double  GetRobustCost();
+        
         /**
          @brief 残差平方和の取得
          
@@ -80,14 +110,14 @@ namespace Kosakasakas {
         double  GetSquaredResidualsSum();
         
         /**
-         @brief パラメータマトリックスの取得
+         @brief パラメータベクトルの取得
          
-         現在のパラメータマトリックスを取得します。
-         @return パラメータマトリックス
+         現在のパラメータベクトルを取得します。
+         @return パラメータベクトル
          */
-        inline const KSMatrixSparsef&    GetParamMat() const
+        inline const KSVectorXf&    GetParamVec() const
         {
-            return m_MatParam;
+            return m_Param;
         }
         
         /**
@@ -96,11 +126,23 @@ namespace Kosakasakas {
          サンプルデータマトリックスを取得します。
          @return パラメータマトリックス
          */
-        inline const KSMatrixSparsef&    GetDataMat() const
+        inline const KSMatrixXf&    GetDataMat() const
         {
             return m_MatData;
         }
         
+        /**
+         @brief スパースヤコビアンの取得
+         
+         最後のステップで組み立てたヤコビアンを取得します.
+         非ゼロパターンを再利用できたかどうかの確認にも使えます.
+         @return スパースヤコビアン
+         */
+        inline const KSSparseJacobian&  GetJacobian() const
+        {
+            return m_Jacobian;
+        }
+        
         /**
          @brief 正規方程式ソルバの変更
          
@@ -111,15 +153,72 @@ namespace Kosakasakas {
         void    SwitchNormalEquationSolver(NESolverType type);
         
         /**
-         @brief パラメータ行列のセット
+         @brief シューア補行列の正規方程式ソルバへの変更
+         
+         SwitchNormalEquationSolver(SCHUR_COMPLEMENT)ではブロック構造が決まらないので、こちらを使います.
+         @param sharedSize  共有ブロックの要素数(パラメータの先頭に並べます)
+         @param frameSizes  フレームごとのブロックの要素数(共有ブロックの後ろに順に並べます)
+         */
+        void    SwitchToSchurComplementSolver(int sharedSize, const std::vector<int>& frameSizes);
+        
+        /**
+         @brief 計算精度のセット
+         
+         MIXED_PRECISIONを指定すると、残差とヤコビアンはfloatのまま、
+         正規方程式の累積と分解をdoubleで行います(コレスキー分解のソルバのみ対応).
+         画素単位の残差のように要素数が多い場合に、桁落ちによる余分な反復を減らせます.
+         デフォルトはSINGLE_PRECISIONです.
+         @param precision   計算精度
+         */
+        void    SetPrecision(PrecisionType precision);
+        
+        /**
+         @brief 正規方程式ソルバの取得
          
-         最適化するパラメータ行列の初期値をセットします.
+         前処理や収束判定など、ソルバ固有の設定を行う場合に使います.
+         @return 正規方程式ソルバへのシェアードポインタ
+         */
+        inline std::shared_ptr<KSNormalEquationSolver>  GetNormalEquationSolver() const
+        {
+            return m_pNESolver;
+        }
+        
+        /**
+         @brief パラメータベクトルのセット
+         
+         最適化するパラメータベクトルの初期値をセットします.
          各パラメータは内部でstd::moveされ、所有権がこのクラスに渡ってしまう点に注意して下さい.
-         @param paramMat    パラメータ行列
+         @param param   パラメータベクトル
+         */
+        inline void SetParamVec(KSVectorXf& param)
+        {
+            m_Param     = std::move(param);
+        }
+        
+        /**
+         @brief 残差ブロックのセット
+         
+         IRLSで使う残差ブロックと損失関数をセットします.
+         ブロックがセットされている場合、DoGaussNewtonStepIRLSは各ブロックの損失関数から重みを算出します.
+         空のリストをセットすると従来の重み(残差の絶対値の逆数)に戻ります.
+         @param blocks  残差ブロックのリスト
+         */
+        inline void SetResidualBlocks(const std::vector<KSResidualBlock>& blocks)
+        {
+            m_ResidualBlocks    = blocks;
+        }
+        
+        /**
+         @brief 固定するパラメータブロックのセット
+         
+         指定したブロックのパラメータを固定し、残りのパラメータだけを最適化します.
+         固定した列は正規方程式から取り除くので、J^tJは自由なパラメータ数の2乗の大きさになります.
+         空のリストをセットすると全てのパラメータが最適化の対象に戻ります.
+         @param blocks  固定するパラメータブロックのリスト
          */
-        inline void SetParamMat(KSMatrixSparsef& paramMat)
+        inline void SetConstantParameterBlocks(const std::vector<KSParameterBlock>& blocks)
         {
-            m_MatParam  = std::move(paramMat);
+            m_ParamMask.SetConstantBlocks(blocks);
         }
         
         /**
@@ -135,6 +234,55 @@ namespace Kosakasakas {
         }
         
 
+    private:
+        /**
+         @brief 最適化ステップの計算
+         
+         与えられた残差からステップを解いてパラメータを更新します.
+         pGradientNormが指定された場合は勾配の最大絶対値を返し、閾値以下ならステップを解かずに終了します.
+         pDoglegが指定された場合はパラメータを更新せず、ガウス-ニュートンステップと勾配からドッグレッグ法のモデルを作ります.
+         @param y                   現在のパラメータでの残差(IRLSの場合はスケーリングされます)
+         @param useIRLS             IRLSの重みを使うかどうか
+         @param pGradientNorm       出力の勾配の最大絶対値(nullptrの場合は計算しない)
+         @param gradientTolerance   勾配の閾値
+         @param pDogleg             ドッグレッグ法のモデル(nullptrの場合はガウス-ニュートンステップで更新する)
+         @return 計算の成否
+         */
+        bool    ComputeStep(KSVectorXf& y,
+                            bool useIRLS,
+                            double* pGradientNorm,
+                            double gradientTolerance,
+                            KSDoglegModel* pDogleg);
+        
+        /**
+         @brief ドッグレッグ法による最適化ステップの実行
+         
+         1回の線形化で得たモデルを使い、コストが下がるまで信頼半径を縮めてステップを試します.
+         採択した場合は残差とコストを新しいパラメータでの値に更新します.
+         @param y               現在のパラメータでの残差(採択した場合は更新されます)
+         @param cost            現在のコスト(採択した場合は更新されます)
+         @param radius          信頼半径(次の反復のために更新されます)
+         @param options         収束判定の設定
+         @param gradientNorm    出力の勾配の最大絶対値
+         @return 計算の成否
+         */
+        bool    DoDoglegStep(KSVectorXf& y,
+                             double& cost,
+                             double& radius,
+                             const KSSolveOptions& options,
+                             double& gradientNorm);
+        
+        /**
+         @brief コストの評価
+         @param y       残差
+         @param useIRLS IRLSの場合は残差ブロックごとのロバストコスト
+         @return コスト
+         */
+        double  GetCost(const KSVectorXf& y, bool useIRLS) const;
+        
+        //! 正規方程式ソルバへの計算精度の反映
+        void    ApplyPrecision();
+    
     private:
         //! 正規方程式ソルバへのシェアードポインタ
         typedef std::shared_ptr<KSNormalEquationSolver> NESolverPtr;
@@ -142,13 +290,15 @@ namespace Kosakasakas {
         //! 内部初期化されているかどうか
         bool        m_IsInitialized;
         //! 残差の関数を保持するオブジェクト
-        KSFunctionSparse  m_FuncResidual;
-        //! 残差のヤコビアンを保持するオブジェクト
-        KSFunctionSparse  m_FuncJacobian;
-        //! パラメータマトリックスを保持するオブジェクト
-        KSMatrixSparsef  m_MatParam;
+        KSVectorFunction            m_FuncResidual;
+        //! 残差のヤコビアンの組み立て関数を保持するオブジェクト
+        KSSparseJacobianFunction    m_FuncJacobian;
+        //! パラメータベクトルを保持するオブジェクト
+        KSVectorXf                  m_Param;
         //! サンプルデータマトリックスを保持するオブジェクト
-        KSMatrixSparsef  m_MatData;
+        KSMatrixXf                  m_MatData;
+        //! ステップを跨いで使い回すスパースヤコビアン
+        KSSparseJacobian            m_Jacobian;
         
         //! 正規方程式ソルバのファクトリオブジェクト
         KSNESolverFactory   m_NESolverFactory;
@@ -156,6 +306,14 @@ namespace Kosakasakas {
         NESolverPtr         m_pNESolver;
         //! 正規方程式を解く試行回数
         int m_MaxIterations;
+        //! 正規方程式の計算精度
+        PrecisionType   m_Precision;
+        //! IRLSで使う残差ブロックのリスト
+        std::vector<KSResidualBlock>    m_ResidualBlocks;
+        //! 固定するパラメータブロック
+        KSParameterMask                 m_ParamMask;
+        //! ドッグレッグ法のモデル
+        KSDoglegModel                   m_Dogleg;
     };
     
 } //namespace Kosakasakas {
@@ -77,6 +77,12 @@ namespace Kosakasakas {
      */
     typedef std::function<KSMatrixSparsef(const KSMatrixSparsef &x)>    KSFunctionSparse;
     
+    /**
+     @brief ヤコビアンとベクトルの積のファンクタ
+     パラメータxでのJ・v(またはJ^t・v)を返します。行列フリーのソルバで使います。
+     */
+    typedef std::function<KSVectorXf(const KSMatrixXf &x, const KSVectorXf &v)>   KSJacobianProduct;
+    
     /**
      @brief 正規方程式のソルバータイプ
      正規方程式の直接解を解くソルバーで、このライブラリで指定できるソルバーです。
@@ -86,9 +92,98 @@ namespace Kosakasakas {
         //! コレスキー分解
         CHOLESKY,
         //! 前処理付き共役勾配法
-        PCG
+        PCG,
+        //! 行列フリーの前処理付き共役勾配法(J^tJを作らない)
+        MATRIX_FREE_PCG,
+        //! シューア補行列(フレームごとのブロックを消去して共有ブロックを解く)
+        SCHUR_COMPLEMENT,
+        //! 最初の数回の計算で候補のソルバを計測し、問題の形ごとに最速のものを使う
+        AUTO
     };
     
+    /**
+     @brief コレスキー分解の種類
+     */
+    enum CholeskyType
+    {
+        //! LL^t分解
+        CHOLESKY_LLT,
+        //! LDL^t分解(ピボットを取るので半正定値に近い行列でも安定)
+        CHOLESKY_LDLT
+    };
+    
+    /**
+     @brief 正規方程式の計算精度
+     */
+    enum PrecisionType
+    {
+        //! 全てfloatで計算する
+        SINGLE_PRECISION,
+        //! 残差とヤコビアンはfloatのまま、J^tJの累積と分解をdoubleで行う
+        MIXED_PRECISION
+    };
+    
+    /**
+     @brief 前処理付き共役勾配法の前処理のタイプ
+     */
+    enum PreconditionerType
+    {
+        //! 対角スケーリング(Jacobi前処理)
+        JACOBI,
+        //! パラメータグループごとのブロック対角(ブロックJacobi前処理)
+        BLOCK_JACOBI,
+        //! 不完全コレスキー分解
+        INCOMPLETE_CHOLESKY
+    };
+    
+    /**
+     @brief ロバスト損失関数のタイプ
+     IRLSで残差ブロックごとに指定できる損失関数です。
+     */
+    enum RobustLossType
+    {
+        //! 二乗誤差(重みは常に1)
+        L2,
+        //! Huber損失
+        HUBER,
+        //! TukeyのBiweight損失
+        TUKEY,
+        //! Cauchy損失
+        CAUCHY,
+        //! L2,1ノルム(グループごとのL2ノルムの和)
+        L21
+    };
+    
+    /**
+     @brief 最適化ループのステップの決め方
+     */
+    enum StepStrategyType
+    {
+        //! ガウス-ニュートンステップをそのまま使う
+        GAUSS_NEWTON,
+        //! Powellのドッグレッグ法による信頼領域ステップ
+        DOGLEG
+    };
+    
+    /**
+     @brief 最適化ループの終了理由
+     */
+    enum SolveTerminationType
+    {
+        //! コストの相対減少量が閾値以下になった
+        COST_CONVERGENCE,
+        //! 勾配のノルムが閾値以下になった
+        GRADIENT_CONVERGENCE,
+        //! ステップのノルムが閾値以下になった
+        STEP_CONVERGENCE,
+        //! 最大反復回数に達した
+        MAX_ITERATIONS,
+        //! 計算時間の予算を使い切った
+        TIME_BUDGET,
+        //! 計算ステップに失敗した
+        FAILURE
+    };
+
     
 } //namespace Kosakasakas {
 
@@ -20,6 +20,8 @@
 #include <vtkPolyDataWriter.h>
 #include <vtkVersion.h>
 #include <vtkTriangle.h>
+#include <vtkIdList.h>
+#include <vtkSmartPointer.h>
 
 #include "DataManager.h"
 #include "PCAModelBuilder.h"
@@ -496,3 +498,82 @@ bool    ofKsBaselFaceModel::CacheMeanShapeNormal()
     m_aNormalCache.clear();
     return DrawMean(true);
 }
+
+/**
+ @brief シェイプの線形モデルを取得
+ 
+ 頂点座標を 平均 + 基底 × 係数 で表す平均と基底を取得します.
+ 基底は主成分に標準偏差を掛けたもので、DrawSampleに渡す係数と同じ単位です.
+ @param mean    出力の平均(3 × 頂点数)
+ @param basis   出力の基底(3 × 頂点数, 主成分数)
+ @return 成功可否
+ */
+bool    ofKsBaselFaceModel::GetShapeModel(KSVectorXf& mean, KSMatrixXf& basis) const
+{
+    if (!m_pBaselModelVertices)
+    {
+        ofLog(OF_LOG_ERROR, "モデルがロードされていません.");
+        return false;
+    }
+    
+    mean    = m_pBaselModelVertices->GetMeanVector();
+    basis   = m_pBaselModelVertices->GetPCABasisMatrix();
+    return true;
+}
+
+/**
+ @brief アルベドの線形モデルを取得
+ 
+ 頂点カラーを 平均 + 基底 × 係数 で表す平均と基底を取得します.
+ @param mean    出力の平均(3 × 頂点数)
+ @param basis   出力の基底(3 × 頂点数, 主成分数)
+ @return 成功可否
+ */
+bool    ofKsBaselFaceModel::GetColorModel(KSVectorXf& mean, KSMatrixXf& basis) const
+{
+    if (!m_pBaselModelColors)
+    {
+        ofLog(OF_LOG_ERROR, "モデルがロードされていません.");
+        return false;
+    }
+    
+    mean    = m_pBaselModelColors->GetMeanVector();
+    basis   = m_pBaselModelColors->GetPCABasisMatrix();
+    return true;
+}
+
+/**
+ @brief 三角形の頂点番号を取得
+ 
+ リファレンスメッシュのセルから三角形ごとに3つの頂点番号を取得します.
+ @param indices 出力の頂点番号(3 × 三角形数)
+ @return 成功可否
+ */
+bool    ofKsBaselFaceModel::GetTriangles(std::vector<int>& indices) const
+{
+    if (!m_pBaselModelVertices)
+    {
+        ofLog(OF_LOG_ERROR, "モデルがロードされていません.");
+        return false;
+    }
+    
+    vtkPolyData* pReference = const_cast<vtkPolyData*>(m_pBaselModelVertices->GetRepresenter()->GetReference());
+    vtkSmartPointer<vtkIdList> pIds = vtkSmartPointer<vtkIdList>::New();
+    
+    indices.clear();
+    int numCells    = pReference->GetNumberOfCells();
+    for (int i=0; i<numCells; ++i)
+    {
+        pReference->GetCellPoints(i, pIds);
+        if (pIds->GetNumberOfIds() != 3)
+        {
+            ofLog(OF_LOG_ERROR, "TriangleでないCellが見つかりました.");
+            indices.clear();
+            return false;
+        }
+        indices.push_back(static_cast<int>(pIds->GetId(0)));
+        indices.push_back(static_cast<int>(pIds->GetId(1)));
+        indices.push_back(static_cast<int>(pIds->GetId(2)));
+    }
+    return true;
+}
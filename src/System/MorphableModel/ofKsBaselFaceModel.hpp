@@ -51,6 +51,12 @@ namespace Kosakasakas
         bool    DrawSample(KSVectorXf& shapeCoeff, KSVectorXf& albedoCoeff, bool useCachedNormal = false);
         //! ミーンシェイプの法線をキャッシュしておく
         bool    CacheMeanShapeNormal();
+        //! シェイプの線形モデル(平均と標準偏差倍の主成分)を取得
+        bool    GetShapeModel(KSVectorXf& mean, KSMatrixXf& basis) const;
+        //! アルベドの線形モデル(平均と標準偏差倍の主成分)を取得
+        bool    GetColorModel(KSVectorXf& mean, KSMatrixXf& basis) const;
+        //! 三角形の頂点番号を取得
+        bool    GetTriangles(std::vector<int>& indices) const;
         
     protected:
         //! モデルの読み込み
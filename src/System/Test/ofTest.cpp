@@ -14,9 +14,202 @@
 #include "System/Math/KSMath.h"
 #include "System/Util/KSUtil.h"
 #include "ofxTimeMeasurements.h"
+#include "FaceImage.hpp"
+#include "ImagePyramid.hpp"
+#include "LandmarkEnergy.hpp"
+#include "PhotometricEnergy.hpp"
+#include "PixelSampler.hpp"
+#include "StatisticalPrior.hpp"
 
 using namespace std;
 using namespace Kosakasakas;
+using namespace Facehack;
+
+namespace
+{
+    /**
+     @brief 例題No.2の残差ファンクタ(自動微分用)
+     floatとKSJetの両方で評価できるようにテンプレート化しておく
+     */
+    struct Example2Residual
+    {
+        Example2Residual(const KSMatrixXf& data)
+        : m_Data(data)
+        {}
+        
+        template <typename T>
+        bool operator()(const T* x, T* r) const
+        {
+            for(int i=0, n=m_Data.cols(); i<n; ++i)
+            {
+                r[i]    = T(m_Data(1,i)) - (x[0] * m_Data(0,i)) / (x[1] + m_Data(0,i));
+            }
+            return true;
+        }
+        
+        KSMatrixXf  m_Data;
+    };
+    
+    /**
+     @brief 例題No.6の残差ファンクタ
+     例題No.2の観測値yを問題ごとに定数倍したものを、まとめて解く
+     */
+    struct Example6Residual
+    {
+        Example6Residual(const KSMatrixXf& data, const std::vector<float>& scales)
+        : m_Data(data)
+        , m_Scales(scales)
+        {}
+        
+        int     GetNumResiduals(int /*problem*/) const
+        {
+            return m_Data.cols();
+        }
+        
+        bool    operator()(int problem,
+                           const Eigen::Matrix<float, 2, 1>& x,
+                           int i,
+                           float& r,
+                           Eigen::Matrix<float, 1, 2>* pJacobianRow) const
+        {
+            const float denom   = x(1) + m_Data(0,i);
+            r                   = m_Scales[problem] * m_Data(1,i) - (x(0) * m_Data(0,i)) / denom;
+            if (pJacobianRow)
+            {
+                (*pJacobianRow)(0)  = -m_Data(0,i) / denom;
+                (*pJacobianRow)(1)  = (x(0) * m_Data(0,i)) / (denom * denom);
+            }
+            return true;
+        }
+        
+        KSMatrixXf          m_Data;
+        std::vector<float>  m_Scales;
+    };
+    
+    /**
+     @brief Facehackの例題で使う小さいパラメータ配列のレイアウト
+     照明は各チャンネル9個、係数は形状4個、アルベド4個、表情3個
+     */
+    FaceParamLayout ExampleFaceLayout()
+    {
+        FaceParamLayout layout;
+        layout.camPos       = 0;
+        layout.camLookAt    = 3;
+        layout.camFov       = 6;
+        layout.camAspect    = 7;
+        layout.gammaR       = 8;
+        layout.gammaG       = 17;
+        layout.gammaB       = 26;
+        layout.alpha        = 35;
+        layout.beta         = 39;
+        layout.delta        = 43;
+        layout.faceQuat     = 46;
+        layout.faceTrans    = 50;
+        layout.total        = 53;
+        return layout;
+    }
+    
+    /**
+     @brief Facehackの例題で使う格子状の顔の線形モデル
+     gridWidth × gridHeight頂点のお椀型の面で、基底は頂点の位置の三角関数で作る
+     */
+    bool    ExampleFaceBasis(int gridWidth, int gridHeight, MorphableBasis& basis)
+    {
+        const int numVertices   = gridWidth * gridHeight;
+        KSVectorXf meanShape(3 * numVertices);
+        KSVectorXf meanAlbedo(3 * numVertices);
+        KSMatrixXf shapeBasis(3 * numVertices, 4);
+        KSMatrixXf albedoBasis(3 * numVertices, 4);
+        KSMatrixXf exprBasis(3 * numVertices, 3);
+        for (int y = 0; y < gridHeight; ++y)
+        {
+            for (int x = 0; x < gridWidth; ++x)
+            {
+                const int i     = y * gridWidth + x;
+                const float u   = x / (gridWidth - 1.0f) - 0.5f;
+                const float v   = 0.5f - y / (gridHeight - 1.0f);
+                meanShape.segment<3>(3 * i)     << 150.0f * u, 180.0f * v, 60.0f - 100.0f * (u * u + v * v);
+                meanAlbedo.segment<3>(3 * i)    << 0.6f + 0.2f * sin(9.0f * u) * cos(7.0f * v), 0.45f, 0.4f + 0.1f * cos(11.0f * u);
+                for (int c = 0; c < 4; ++c)
+                {
+                    shapeBasis.block<3, 1>(3 * i, c)    << 3.0f * sin((c + 1) * u + 2.0f * v), 3.0f * cos(u - (c + 1) * v), 6.0f * sin((c + 2) * u * v + c);
+                    albedoBasis.block<3, 1>(3 * i, c)   << 0.05f * sin((c + 3) * u + c), 0.05f * cos((c + 2) * v), 0.05f * sin((c + 1) * (u + v));
+                }
+                for (int c = 0; c < 3; ++c)
+                {
+                    exprBasis.block<3, 1>(3 * i, c) << 2.0f * cos((c + 2) * u), 2.0f * sin((c + 1) * v + u), 4.0f * cos((c + 1) * u * v);
+                }
+            }
+        }
+        MorphableBasis::TriangleArray triangles(3, 2 * (gridWidth - 1) * (gridHeight - 1));
+        int t   = 0;
+        for (int y = 0; y < gridHeight - 1; ++y)
+        {
+            for (int x = 0; x < gridWidth - 1; ++x)
+            {
+                const int i = y * gridWidth + x;
+                triangles.col(t++)  << i, i + gridWidth, i + 1;
+                triangles.col(t++)  << i + 1, i + gridWidth, i + gridWidth + 1;
+            }
+        }
+        return basis.Initialize(meanShape, shapeBasis, meanAlbedo, albedoBasis, triangles, 4, 4, 3)
+            && basis.SetExpressionBasis(exprBasis);
+    }
+    
+    /**
+     @brief Facehackの例題で使うパラメータ配列
+     原点を向いたカメラの前に、少し回した顔を置く
+     */
+    KSVectorXf  ExampleFaceParams(const FaceParamLayout& layout, float aspect)
+    {
+        KSVectorXf params   = KSVectorXf::Zero(layout.total);
+        params.segment<3>(layout.camPos)    << 0.0f, 0.0f, 500.0f;
+        params(layout.camFov)               = 40.0f;
+        params(layout.camAspect)            = aspect;
+        for (int c = 0; c < 9; ++c)
+        {
+            params(layout.gammaR + c)   = 0.1f * sin(1.0f + c);
+            params(layout.gammaG + c)   = 0.1f * cos(2.0f + c);
+            params(layout.gammaB + c)   = 0.1f * sin(3.0f + 2.0f * c);
+        }
+        params(layout.gammaR)   = params(layout.gammaG) = params(layout.gammaB) = 0.8f;
+        params.segment<4>(layout.alpha)     << 0.5f, -0.3f, 0.2f, 0.1f;
+        params.segment<4>(layout.beta)      << 0.3f, 0.2f, -0.4f, 0.1f;
+        params.segment<3>(layout.delta)     << 0.2f, -0.1f, 0.3f;
+        params.segment<4>(layout.faceQuat)  << 0.08f, -0.12f, 0.03f, 1.0f;
+        params.segment<3>(layout.faceTrans) << 4.0f, -3.0f, 80.0f;
+        return params;
+    }
+    
+    /**
+     @brief ヤコビアンの列を残差の中心差分と比べる
+     列ごとに ||数値微分 - 解析微分|| / max(||解析微分||, 1) を計算し、その最大値を返す
+     */
+    template <typename Residual>
+    float   MaxJacobianColumnError(const Residual& residual,
+                                   const KSVectorXf& params,
+                                   const KSMatrixXf& jacobian,
+                                   int begin,
+                                   int end,
+                                   float step)
+    {
+        float maxError  = 0.0f;
+        for (int c = begin; c < end; ++c)
+        {
+            KSVectorXf plus     = params;
+            KSVectorXf minus    = params;
+            plus(c)             += step;
+            minus(c)            -= step;
+            KSVectorXf residualPlus;
+            KSVectorXf residualMinus;
+            residual(plus, residualPlus);
+            residual(minus, residualMinus);
+            const KSVectorXf numerical  = (residualPlus - residualMinus) / (2.0f * step);
+            maxError    = std::max(maxError, (numerical - jacobian.col(c)).norm() / std::max(jacobian.col(c).norm(), 1.0f));
+        }
+        return maxError;
+    }
+}
 
 ofTest::ofTest()
 {}
@@ -130,13 +323,48 @@ bool    ofTest::DoTest()
               optimizer.GetParamMat()(0),
               optimizer.GetParamMat()(1));
         
+        // パラメータ行列の初期値を再設定
+        KSMatrixXf param2(2,1);
+        param2 << 5.0, 5.0;
+        optimizer.SetParamMat(param2);
+        
+        // 残差全体をひとつのブロックとしてCauchy損失を適用
+        KSRobustLossFactory lossFactory;
+        std::vector<KSResidualBlock> blocks(1);
+        blocks[0].offset    = 0;
+        blocks[0].size      = data.cols();
+        blocks[0].groupSize = 1;
+        blocks[0].pLoss     = lossFactory.Create(RobustLossType::CAUCHY, 0.01f);
+        optimizer.SetResidualBlocks(blocks);
+        
+        // 計算開始(ロバスト損失によるIRLS計算)
+        TS_START("optimization exmple 1-3");
+        for (int i = 0; i < numStep; ++i)
+        {
+            if (!optimizer.DoGaussNewtonStepIRLS())
+            {
+                ofLog(OF_LOG_ERROR, "ガウス-ニュートン計算ステップに失敗しました。");
+                return false;
+            }
+        }
+        TS_STOP("optimization exmple 1-3");
+        
+        // 解の確認
+        ofLog(OF_LOG_NOTICE,
+              "ex1-3: param0: %lf, param1: %lf, cost: %lf",
+              optimizer.GetParamMat()(0),
+              optimizer.GetParamMat()(1),
+              optimizer.GetRobustCost());
+        
         // ================================
         // 結果:
         // [notice ] ex1-1: param0: 1.996821, param1: 1.000021
         // [notice ] ex1-2: param0: 2.000000, param1: 1.000000
+        // [notice ] ex1-3: param0: 1.996831, param1: 1.000021, cost: 0.000001
         //
         // IRLSの方が誤差を含むデータに対して高精度な解が得られる。
         // ただし、0.1msほど計算が遅い。
+        // Cauchy損失はスケール以下の残差を二乗誤差と同様に扱うため、この程度の誤差では通常計算とほぼ同じ解になる。
         // ================================
 
     }
@@ -220,6 +448,55 @@ bool    ofTest::DoTest()
         // 残差平方和はステップごとに縮まっていて、
         // wikiの正解値である0.00784と同値(0.007844)が得られる。
         // ================================
+        
+        // 同じ問題を収束判定付きのSolveで解く
+        KSMatrixXf param2(2,1);
+        param2 << 0.9, 0.2;
+        optimizer.SetParamMat(param2);
+        
+        KSSolveOptions options;
+        options.maxIterations       = 20;
+        options.functionTolerance   = 1.0e-4;
+        
+        TS_START("optimization exmple 2-2");
+        KSSolveSummary summary = optimizer.Solve(options);
+        TS_STOP("optimization exmple 2-2");
+        
+        ofLog(OF_LOG_NOTICE,
+              "ex2-2: iterations:%d, termination:%d, initial cost:%lf, final cost:%lf",
+              summary.iterations,
+              summary.termination,
+              summary.initialCost,
+              summary.finalCost);
+        
+        ofASSERT(summary.IsConverged(), "収束判定で終了していません。");
+        ofASSERT(fabs(summary.finalCost - 0.00784) < 0.0001, "残差平方和の収束値が正解と異なります。");
+        
+        // ヤコビアンを自動微分で求めて同じ問題を解く
+        KSAutoDiffFunction<Example2Residual> autoDiff(Example2Residual(optimizer.GetDataMat()),
+                                                      optimizer.GetDataMat().cols());
+        KSFunction  autoResidual    = autoDiff.GetResidualFunction();
+        KSFunction  autoJacobian    = autoDiff.GetJacobianFunction();
+        
+        KSMatrixXf param3(2,1);
+        param3 << 0.9, 0.2;
+        KSMatrixXf data3 = optimizer.GetDataMat();
+        
+        KSDenseOptimizer autoOptimizer;
+        autoOptimizer.Initialize(autoResidual, autoJacobian, param3, data3);
+        
+        TS_START("optimization exmple 2-3");
+        summary = autoOptimizer.Solve(options);
+        TS_STOP("optimization exmple 2-3");
+        
+        ofLog(OF_LOG_NOTICE,
+              "ex2-3: param0: %lf, param1: %lf, final cost:%lf",
+              autoOptimizer.GetParamMat()(0),
+              autoOptimizer.GetParamMat()(1),
+              summary.finalCost);
+        
+        ofASSERT(fabs(autoOptimizer.GetParamMat()(0) - 0.362) < 0.01, "パラメータ推定結果が異なります。");
+        ofASSERT(fabs(autoOptimizer.GetParamMat()(1) - 0.556) < 0.01, "パラメータ推定結果が異なります。");
     }
     
     // 例題No.3
@@ -230,21 +507,21 @@ bool    ofTest::DoTest()
         // ==================================
     
         // データセットを登録
-        KSMatrixSparsef  data(2, 7);
-        data.insert(0, 0) = 0.038;
-        data.insert(0, 1) = 0.194;
-        data.insert(0, 2) = 0.425;
-        data.insert(0, 3) = 0.626;
-        data.insert(0, 4) = 1.253;
-        data.insert(0, 5) = 2.500;
-        data.insert(0, 6) = 3.740;
-        data.insert(1, 0) = 0.050;
-        data.insert(1, 1) = 0.127;
-        data.insert(1, 2) = 0.094;
-        data.insert(1, 3) = 0.2122;
-        data.insert(1, 4) = 0.2729;
-        data.insert(1, 5) = 0.2665;
-        data.insert(1, 6) = 0.3317;
+        KSMatrixXf  data(2, 7);
+        data(0, 0) = 0.038;
+        data(0, 1) = 0.194;
+        data(0, 2) = 0.425;
+        data(0, 3) = 0.626;
+        data(0, 4) = 1.253;
+        data(0, 5) = 2.500;
+        data(0, 6) = 3.740;
+        data(1, 0) = 0.050;
+        data(1, 1) = 0.127;
+        data(1, 2) = 0.094;
+        data(1, 3) = 0.2122;
+        data(1, 4) = 0.2729;
+        data(1, 5) = 0.2665;
+        data(1, 6) = 0.3317;
         
         // オプティマイザの宣言
         KSSparseOptimizer  optimizer;
@@ -256,10 +533,10 @@ bool    ofTest::DoTest()
         optimizer.SetMaxIterations(4);
         
         // 残差関数
-        KSFunctionSparse  residual    = [&optimizer](const KSMatrixSparsef &x)->KSMatrixSparsef
+        KSVectorFunction  residual    = [&optimizer](const KSVectorXf &x)->KSVectorXf
         {
-            const KSMatrixSparsef& data = optimizer.GetDataMat();
-            KSMatrixSparsef y(data.cols(), 1);
+            const KSMatrixXf& data = optimizer.GetDataMat();
+            KSVectorXf y(data.cols());
             
             for(int i=0, n=y.rows(); i<n; ++i)
             {
@@ -269,24 +546,22 @@ bool    ofTest::DoTest()
         };
         
         // 残差のヤコビアン
-        KSFunctionSparse jacobian     = [&optimizer](const KSMatrixSparsef &x)->KSMatrixSparsef
+        KSSparseJacobianFunction jacobian     = [&optimizer](const KSVectorXf &x, KSSparseJacobian &d)
         {
-            const KSMatrixSparsef& data = optimizer.GetDataMat();
-            KSMatrixSparsef d(data.cols(), x.rows());
+            const KSMatrixXf& data = optimizer.GetDataMat();
             
-            for(int i=0,n=d.rows(); i<n; ++i)
+            for(int i=0,n=data.cols(); i<n; ++i)
             {
                 double denom    = (x.coeff(1, 0) + data.coeff(0,i)) * (x.coeff(1, 0) + data.coeff(0,i));
-                d.coeffRef(i, 0)         = -data.coeff(0,i) / (x.coeff(1, 0) + data.coeff(0,i));
-                d.coeffRef(i, 1)         = (x.coeff(1, 0) * data.coeff(0, i)) / denom;
+                d.Add(i, 0, -data.coeff(0,i) / (x.coeff(1, 0) + data.coeff(0,i)));
+                d.Add(i, 1, (x.coeff(1, 0) * data.coeff(0, i)) / denom);
             }
-            return d;
         };
         
         // 正解値マトリックスの初期値を設定
-        KSMatrixSparsef param(2,1);
-        param.insert(0, 0) = 0.9;
-        param.insert(1, 0) = 0.2;
+        KSVectorXf param(2);
+        param(0) = 0.9;
+        param(1) = 0.2;
         
         // オプティマイザの初期化
         optimizer.Initialize(residual, jacobian, param, data);
@@ -310,8 +585,8 @@ bool    ofTest::DoTest()
         
         ofASSERT((optimizer.GetSquaredResidualsSum() - 0.00784) < 0.01, "残差平方和の収束値が正解と異なります。");
         
-        ofASSERT(fabs(optimizer.GetParamMat().coeff(0, 0) - 0.362) < 0.01, "パラメータ推定結果が異なります。");
-        ofASSERT(fabs(optimizer.GetParamMat().coeff(1, 0) - 0.556) < 0.01, "パラメータ推定結果が異なります。");
+        ofASSERT(fabs(optimizer.GetParamVec()(0) - 0.362) < 0.01, "パラメータ推定結果が異なります。");
+        ofASSERT(fabs(optimizer.GetParamVec()(1) - 0.556) < 0.01, "パラメータ推定結果が異なります。");
     }
     
     // 例題No.4
@@ -341,7 +616,7 @@ bool    ofTest::DoTest()
         
         // 適当に入力データサンプルを作る
         int sampleVecNum = 20;
-        KSMatrixSparsef data(2, 3 * sampleVecNum);
+        KSMatrixXf data(2, 3 * sampleVecNum);
         for (int i = 0; i < sampleVecNum; ++i)
         {
             ofVec3f v;
@@ -352,13 +627,13 @@ bool    ofTest::DoTest()
             ofVec3f a = ofMatrix4x4::transform3x3(m, v);
             a += t;
             
-            data.insert(0, 3*i+0) = v.x;
-            data.insert(0, 3*i+1) = v.y;
-            data.insert(0, 3*i+2) = v.z;
+            data(0, 3*i+0) = v.x;
+            data(0, 3*i+1) = v.y;
+            data(0, 3*i+2) = v.z;
             
-            data.insert(1, 3*i+0) = a.x;
-            data.insert(1, 3*i+1) = a.y;
-            data.insert(1, 3*i+2) = a.z;
+            data(1, 3*i+0) = a.x;
+            data(1, 3*i+1) = a.y;
+            data(1, 3*i+2) = a.z;
         }
         
         // オプティマイザの宣言
@@ -371,10 +646,10 @@ bool    ofTest::DoTest()
         optimizer.SetMaxIterations(4);
         
         // 残差関数
-        KSFunctionSparse  residual    = [&optimizer](const KSMatrixSparsef &x)->KSMatrixSparsef
+        KSVectorFunction  residual    = [&optimizer](const KSVectorXf &x)->KSVectorXf
         {
-            const KSMatrixSparsef& data = optimizer.GetDataMat();
-            KSMatrixSparsef d(data.cols(), 1);
+            const KSMatrixXf& data = optimizer.GetDataMat();
+            KSVectorXf d(data.cols());
             
             float a = x.coeff(0, 0); // X軸回転角
             float b = x.coeff(1, 0); // Y軸回転角
@@ -465,16 +740,15 @@ bool    ofTest::DoTest()
         };
         
         // 残差のヤコビアン
-        KSFunctionSparse jacobian     = [&optimizer](const KSMatrixSparsef &x)->KSMatrixSparsef
+        KSSparseJacobianFunction jacobian     = [&optimizer](const KSVectorXf &x, KSSparseJacobian &d)
         {
-            const KSMatrixSparsef& data = optimizer.GetDataMat();
-            KSMatrixSparsef d(data.cols(), x.rows());
+            const KSMatrixXf& data = optimizer.GetDataMat();
             
             float a = x.coeff(0, 0);
             float b = x.coeff(1, 0);
             float c = x.coeff(2, 0);
             
-            for(int i=0,n=d.rows()/3; i<n; ++i)
+            for(int i=0,n=data.cols()/3; i<n; ++i)
             {
                 // 極めてΘが小さい場合は
                 // cosΘ = 1, sinΘ = Θ
@@ -498,120 +772,118 @@ bool    ofTest::DoTest()
                 float vz = data.coeff(0, 3*i+2);
                 
                 //6個入れる
-                d.coeffRef(3*i, 0) = 0.0;
-                d.coeffRef(3*i, 1) = -(-vz);
-                d.coeffRef(3*i, 2) = -(vy);
-                d.coeffRef(3*i, 3) = -1.0;
-                d.coeffRef(3*i, 4) = 0.0;
-                d.coeffRef(3*i, 5) = 0.0;
+                d.Add(3*i, 0, 0.0);
+                d.Add(3*i, 1, -(-vz));
+                d.Add(3*i, 2, -(vy));
+                d.Add(3*i, 3, -1.0);
+                d.Add(3*i, 4, 0.0);
+                d.Add(3*i, 5, 0.0);
                 
                 //6個入れる
-                d.coeffRef(3*i+1, 0) = -(vz);
-                d.coeffRef(3*i+1, 1) = 0.0;
-                d.coeffRef(3*i+1, 2) = -(-vx);
-                d.coeffRef(3*i+1, 3) = 0.0;
-                d.coeffRef(3*i+1, 4) = -1.0;
-                d.coeffRef(3*i+1, 5) = 0.0;
+                d.Add(3*i+1, 0, -(vz));
+                d.Add(3*i+1, 1, 0.0);
+                d.Add(3*i+1, 2, -(-vx));
+                d.Add(3*i+1, 3, 0.0);
+                d.Add(3*i+1, 4, -1.0);
+                d.Add(3*i+1, 5, 0.0);
                 
                 //6個入れる
-                d.coeffRef(3*i+2, 0) = -(-vy);
-                d.coeffRef(3*i+2, 1) = -(vx);
-                d.coeffRef(3*i+2, 2) = 0.0;
-                d.coeffRef(3*i+2, 3) = 0.0;
-                d.coeffRef(3*i+2, 4) = 0.0;
-                d.coeffRef(3*i+2, 5) = -1.0;
+                d.Add(3*i+2, 0, -(-vy));
+                d.Add(3*i+2, 1, -(vx));
+                d.Add(3*i+2, 2, 0.0);
+                d.Add(3*i+2, 3, 0.0);
+                d.Add(3*i+2, 4, 0.0);
+                d.Add(3*i+2, 5, -1.0);
                 
                 // 以下は各軸の検証
                     /*
                      // X軸回転
                      //6個入れる
-                     d.coeffRef(3*i, 0) = 0.0;
-                     d.coeffRef(3*i, 1) = 0.0;
-                     d.coeffRef(3*i, 2) = 0.0;
-                     d.coeffRef(3*i, 3) = -1.0;
-                     d.coeffRef(3*i, 4) = 0.0;
-                     d.coeffRef(3*i, 5) = 0.0;
+                     d.Add(3*i, 0, 0.0);
+                     d.Add(3*i, 1, 0.0);
+                     d.Add(3*i, 2, 0.0);
+                     d.Add(3*i, 3, -1.0);
+                     d.Add(3*i, 4, 0.0);
+                     d.Add(3*i, 5, 0.0);
                      
                      //6個入れる
-                     d.coeffRef(3*i+1, 0) = -(vx);
-                     d.coeffRef(3*i+1, 1) = 0.0;
-                     d.coeffRef(3*i+1, 2) = 0.0;
-                     d.coeffRef(3*i+1, 3) = 0.0;
-                     d.coeffRef(3*i+1, 4) = -1.0;
-                     d.coeffRef(3*i+1, 5) = 0.0;
+                     d.Add(3*i+1, 0, -(vx));
+                     d.Add(3*i+1, 1, 0.0);
+                     d.Add(3*i+1, 2, 0.0);
+                     d.Add(3*i+1, 3, 0.0);
+                     d.Add(3*i+1, 4, -1.0);
+                     d.Add(3*i+1, 5, 0.0);
                      
                      //6個入れる
-                     d.coeffRef(3*i+2, 0) = -(-vy);
-                     d.coeffRef(3*i+2, 1) = 0.0;
-                     d.coeffRef(3*i+2, 2) = 0.0;
-                     d.coeffRef(3*i+2, 3) = 0.0;
-                     d.coeffRef(3*i+2, 4) = 0.0;
-                     d.coeffRef(3*i+2, 5) = -1.0;
+                     d.Add(3*i+2, 0, -(-vy));
+                     d.Add(3*i+2, 1, 0.0);
+                     d.Add(3*i+2, 2, 0.0);
+                     d.Add(3*i+2, 3, 0.0);
+                     d.Add(3*i+2, 4, 0.0);
+                     d.Add(3*i+2, 5, -1.0);
                     */
                     
                     /*
                      // Y軸回転
                     //6個入れる
-                    d.coeffRef(3*i, 0) = 0.0;
-                    d.coeffRef(3*i, 1) = -(-vz);
-                    d.coeffRef(3*i, 2) = 0.0;
-                    d.coeffRef(3*i, 3) = -1.0;
-                    d.coeffRef(3*i, 4) = 0.0;
-                    d.coeffRef(3*i, 5) = 0.0;
+                    d.Add(3*i, 0, 0.0);
+                    d.Add(3*i, 1, -(-vz));
+                    d.Add(3*i, 2, 0.0);
+                    d.Add(3*i, 3, -1.0);
+                    d.Add(3*i, 4, 0.0);
+                    d.Add(3*i, 5, 0.0);
                     
                     //6個入れる
-                    d.coeffRef(3*i+1, 0) = 0.0;
-                    d.coeffRef(3*i+1, 1) = 0.0;
-                    d.coeffRef(3*i+1, 2) = 0.0;
-                    d.coeffRef(3*i+1, 3) = 0.0;
-                    d.coeffRef(3*i+1, 4) = -1.0;
-                    d.coeffRef(3*i+1, 5) = 0.0;
+                    d.Add(3*i+1, 0, 0.0);
+                    d.Add(3*i+1, 1, 0.0);
+                    d.Add(3*i+1, 2, 0.0);
+                    d.Add(3*i+1, 3, 0.0);
+                    d.Add(3*i+1, 4, -1.0);
+                    d.Add(3*i+1, 5, 0.0);
                     
                     //6個入れる
-                    d.coeffRef(3*i+2, 0) = 0.0;
-                    d.coeffRef(3*i+2, 1) = -(vx);
-                    d.coeffRef(3*i+2, 2) = 0.0;
-                    d.coeffRef(3*i+2, 3) = 0.0;
-                    d.coeffRef(3*i+2, 4) = 0.0;
-                    d.coeffRef(3*i+2, 5) = -1.0;
+                    d.Add(3*i+2, 0, 0.0);
+                    d.Add(3*i+2, 1, -(vx));
+                    d.Add(3*i+2, 2, 0.0);
+                    d.Add(3*i+2, 3, 0.0);
+                    d.Add(3*i+2, 4, 0.0);
+                    d.Add(3*i+2, 5, -1.0);
                     */
                     
                     /*
                      // Z軸回転
                      //6個入れる
-                     d.coeffRef(3*i, 0) = 0.0;
-                     d.coeffRef(3*i, 1) = 0.0;
-                     d.coeffRef(3*i, 2) = -(vy);
-                     d.coeffRef(3*i, 3) = -1.0;
-                     d.coeffRef(3*i, 4) = 0.0;
-                     d.coeffRef(3*i, 5) = 0.0;
+                     d.Add(3*i, 0, 0.0);
+                     d.Add(3*i, 1, 0.0);
+                     d.Add(3*i, 2, -(vy));
+                     d.Add(3*i, 3, -1.0);
+                     d.Add(3*i, 4, 0.0);
+                     d.Add(3*i, 5, 0.0);
                      
                      //6個入れる
-                     d.coeffRef(3*i+1, 0) = 0.0;
-                     d.coeffRef(3*i+1, 1) = 0.0;
-                     d.coeffRef(3*i+1, 2) = -(-vx);
-                     d.coeffRef(3*i+1, 3) = 0.0;
-                     d.coeffRef(3*i+1, 4) = -1.0;
-                     d.coeffRef(3*i+1, 5) = 0.0;
+                     d.Add(3*i+1, 0, 0.0);
+                     d.Add(3*i+1, 1, 0.0);
+                     d.Add(3*i+1, 2, -(-vx));
+                     d.Add(3*i+1, 3, 0.0);
+                     d.Add(3*i+1, 4, -1.0);
+                     d.Add(3*i+1, 5, 0.0);
                      
                      //6個入れる
-                     d.coeffRef(3*i+2, 0) = 0.0;
-                     d.coeffRef(3*i+2, 1) = 0.0;
-                     d.coeffRef(3*i+2, 2) = 0.0;
-                     d.coeffRef(3*i+2, 3) = 0.0;
-                     d.coeffRef(3*i+2, 4) = 0.0;
-                     d.coeffRef(3*i+2, 5) = -1.0;
+                     d.Add(3*i+2, 0, 0.0);
+                     d.Add(3*i+2, 1, 0.0);
+                     d.Add(3*i+2, 2, 0.0);
+                     d.Add(3*i+2, 3, 0.0);
+                     d.Add(3*i+2, 4, 0.0);
+                     d.Add(3*i+2, 5, -1.0);
                      */
             }
-            
-            return d;
         };
         
         // 正解値マトリックスの初期値を設定
-        KSMatrixSparsef param(paramNum,1);
+        KSVectorXf param(paramNum);
         for (int i = 0; i < paramNum; ++i)
         {
-            param.coeffRef(i, 0) = 0.0;
+            param(i) = 0.0;
         }
         
         // オプティマイザの初期化
@@ -638,8 +910,8 @@ bool    ofTest::DoTest()
         // 最適化結果パラメータを照会
         for (int i =0; i < paramNum; ++i)
         {
-            ofLog(OF_LOG_NOTICE, "%dth param: [opt]%lf, [ans]%lf", i, optimizer.GetParamMat().coeff(i, 0), anser[i]);
-            ofASSERT(fabs(optimizer.GetParamMat().coeff(i, 0) - anser[i]) < 0.01, "パラメータ推定結果が異なります。");
+            ofLog(OF_LOG_NOTICE, "%dth param: [opt]%lf, [ans]%lf", i, optimizer.GetParamVec()(i), anser[i]);
+            ofASSERT(fabs(optimizer.GetParamVec()(i) - anser[i]) < 0.01, "パラメータ推定結果が異なります。");
         }
 
     }
@@ -733,7 +1005,7 @@ bool    ofTest::DoTest()
         
         // 適当に入力データサンプルを作る
         int sampleVecNum = 1;
-        KSMatrixSparsef data(2, 3 * sampleVecNum);
+        KSMatrixXf data(2, 3 * sampleVecNum);
         for (int i = 0; i < sampleVecNum; ++i)
         {
             ofVec4f v;
@@ -749,13 +1021,13 @@ bool    ofTest::DoTest()
             
             ofVec4f a = v * cam.getProjectionMatrix();
              
-            data.insert(0, 3*i+0) = v.x;
-            data.insert(0, 3*i+1) = v.y;
-            data.insert(0, 3*i+2) = v.z;
+            data(0, 3*i+0) = v.x;
+            data(0, 3*i+1) = v.y;
+            data(0, 3*i+2) = v.z;
             
-            data.insert(1, 3*i+0) = a.x;
-            data.insert(1, 3*i+1) = a.y;
-            data.insert(1, 3*i+2) = a.z;
+            data(1, 3*i+0) = a.x;
+            data(1, 3*i+1) = a.y;
+            data(1, 3*i+2) = a.z;
         }
         
         // オプティマイザの宣言
@@ -768,10 +1040,10 @@ bool    ofTest::DoTest()
         optimizer.SetMaxIterations(4);
         
         // 残差関数
-        KSFunctionSparse  residual    = [&optimizer](const KSMatrixSparsef &x)->KSMatrixSparsef
+        KSVectorFunction  residual    = [&optimizer](const KSVectorXf &x)->KSVectorXf
         {
-            const KSMatrixSparsef& data = optimizer.GetDataMat();
-            KSMatrixSparsef d(data.cols(), 1);
+            const KSMatrixXf& data = optimizer.GetDataMat();
+            KSVectorXf d(data.cols());
             
             float l = x.coeff(0, 0);
             float t = x.coeff(1, 0);
@@ -805,17 +1077,16 @@ bool    ofTest::DoTest()
         };
         
         // 残差のヤコビアン
-        KSFunctionSparse jacobian     = [&optimizer](const KSMatrixSparsef &x)->KSMatrixSparsef
+        KSSparseJacobianFunction jacobian     = [&optimizer](const KSVectorXf &x, KSSparseJacobian &d)
         {
-            const KSMatrixSparsef& data = optimizer.GetDataMat();
-            KSMatrixSparsef d(data.cols(), x.rows());
+            const KSMatrixXf& data = optimizer.GetDataMat();
             
             float l = x.coeff(0, 0);
             float t = x.coeff(1, 0);
             float n = 1.0f;
             float f = 1000.0f;
             
-            for(int i=0,n=d.rows()/3; i<n; ++i)
+            for(int i=0,n=data.cols()/3; i<n; ++i)
             {
                 //     n/l, 0,    0,            0
                 // M = 0,   n/t,  0,            0
@@ -828,26 +1099,24 @@ bool    ofTest::DoTest()
                 float vz = data.coeff(0, 3*i+2);
                 
                 //2個入れる
-                d.coeffRef(3*i, 0) = -(-n*vx/(l*l));
-                d.coeffRef(3*i, 1) = 0.0;
+                d.Add(3*i, 0, -(-n*vx/(l*l)));
+                d.Add(3*i, 1, 0.0);
                 
                 //2個入れる
-                d.coeffRef(3*i+1, 0) = 0.0;
-                d.coeffRef(3*i+1, 1) = -(-n*vy/(t*t));
+                d.Add(3*i+1, 0, 0.0);
+                d.Add(3*i+1, 1, -(-n*vy/(t*t)));
                 
                 //2個入れる
-                d.coeffRef(3*i+2, 0) = 0.0;
-                d.coeffRef(3*i+2, 1) = 0.0;
+                d.Add(3*i+2, 0, 0.0);
+                d.Add(3*i+2, 1, 0.0);
             }
-            
-            return d;
         };
         
         // 正解値マトリックスの初期値を設定
-        KSMatrixSparsef param(paramNum,1);
+        KSVectorXf param(paramNum);
         for (int i = 0; i < paramNum; ++i)
         {
-            param.coeffRef(i, 0) = 100.0;
+            param(i) = 100.0;
         }
         
         // オプティマイザの初期化
@@ -874,10 +1143,820 @@ bool    ofTest::DoTest()
         // 最適化結果パラメータを照会
         for (int i =0; i < paramNum; ++i)
         {
-            ofLog(OF_LOG_NOTICE, "%dth param: [opt]%lf, [ans]%lf", i, optimizer.GetParamMat().coeff(i, 0), anser[i]);
-            ofASSERT(fabs(optimizer.GetParamMat().coeff(i, 0) - anser[i]) < 0.01, "パラメータ推定結果が異なります。");
+            ofLog(OF_LOG_NOTICE, "%dth param: [opt]%lf, [ans]%lf", i, optimizer.GetParamVec()(i), anser[i]);
+            ofASSERT(fabs(optimizer.GetParamVec()(i) - anser[i]) < 0.01, "パラメータ推定結果が異なります。");
+        }
+        
+    }
+    
+    // 例題No.6
+    {
+        // ==================================
+        // 例題No.2の観測値yを定数倍した問題を多数まとめて解く
+        // y = ax/(b+x) のyをs倍すると、解はaだけがs倍になる
+        // ==================================
+        
+        KSMatrixXf  data(2, 7);
+        data <<  0.038, 0.194, 0.425, 0.626,  1.253,  2.500,  3.740,
+        0.050, 0.127, 0.094, 0.2122, 0.2729, 0.2665, 0.3317;
+        
+        // レーン数(8)で割り切れない問題数にして、端数のグループも確認する
+        const int numProblems = 37;
+        std::vector<float> scales(numProblems);
+        for (int i = 0; i < numProblems; ++i)
+        {
+            scales[i]   = (i == 0) ? 1.0f : 0.8f + 0.01f * i;
+        }
+        Example6Residual residual(data, scales);
+        
+        KSBatchOptimizer<2>::ParamArray params(numProblems, Eigen::Matrix<float, 2, 1>(0.9f, 0.2f));
+        KSBatchOptimizer<2> optimizer;
+        ofASSERT(optimizer.Initialize(params), "初期化に失敗しました。");
+        
+        KSSolveOptions options;
+        options.maxIterations   = 50;
+        
+        TS_START("optimization exmple 6");
+        const std::vector<KSSolveSummary>& summaries = optimizer.Solve(residual, options);
+        TS_STOP("optimization exmple 6");
+        
+        ofLog(OF_LOG_NOTICE,
+              "ex6: param0: %lf, param1: %lf, iterations:%d, final cost:%lf",
+              optimizer.GetParamVec(0)(0),
+              optimizer.GetParamVec(0)(1),
+              summaries[0].iterations,
+              summaries[0].finalCost);
+        
+        ofASSERT(fabs(summaries[0].finalCost - 0.00784) < 0.0001, "残差平方和の収束値が正解と異なります。");
+        for (int i = 0; i < numProblems; ++i)
+        {
+            ofASSERT(summaries[i].IsConverged(), "収束判定で終了していません。");
+            ofASSERT(fabs(optimizer.GetParamVec(i)(0) - 0.362 * scales[i]) < 0.01, "パラメータ推定結果が異なります。");
+            ofASSERT(fabs(optimizer.GetParamVec(i)(1) - 0.556) < 0.01, "パラメータ推定結果が異なります。");
+        }
+    }
+    
+    // 例題No.7
+    {
+        // ==================================
+        // 共有ブロックとフレームごとのブロックを持つ矢じり型の問題を、
+        // シューア補行列とコレスキー分解で解いて比べる
+        // ==================================
+        
+        const int sharedSize    = 4;
+        const int numFrames     = 5;
+        const int frameSize     = 3;
+        const int rowsPerFrame  = 8;
+        const int numParams     = sharedSize + numFrames * frameSize;
+        const int numRows       = numFrames * rowsPerFrame + 2;
+        const std::vector<int> frameSizes(numFrames, frameSize);
+        
+        // 各行は共有ブロックと高々1つのフレームブロックにだけ依存する(最後の2行は共有ブロックだけ)
+        KSMatrixXf j    = KSMatrixXf::Zero(numRows, numParams);
+        KSMatrixXf y(numRows, 1);
+        for (int i = 0; i < numRows; ++i)
+        {
+            const int frame = i / rowsPerFrame;
+            for (int c = 0; c < sharedSize; ++c)
+            {
+                j(i, c) = sin(0.37 * i * (c + 1) + c);
+            }
+            for (int c = 0; frame < numFrames && c < frameSize; ++c)
+            {
+                j(i, sharedSize + frame * frameSize + c)    = cos(0.9 * i * (c + 1) + 0.3 * c);
+            }
+            y(i)    = sin(1.7 * i + 0.5);
+        }
+        
+        KSCholeskyDecomposition cholesky;
+        KSMatrixXf choleskyStep = KSMatrixXf::Zero(numParams, 1);
+        KSMatrixXf y0 = y, j0 = j;
+        ofASSERT(cholesky.Solve(choleskyStep, y0, j0, 1), "コレスキー分解に失敗しました。");
+        
+        // ブロック構造が無い場合は密なLDLT分解に落ちずに失敗する
+        KSSchurComplementSolver unstructured;
+        KSMatrixXf unusedStep   = KSMatrixXf::Zero(numParams, 1);
+        KSMatrixXf y1 = y, j1 = j;
+        ofASSERT(!unstructured.Solve(unusedStep, y1, j1, 1), "ブロック構造が無いのに解けています。");
+        
+        KSNESolverFactory factory;
+        std::shared_ptr<KSNormalEquationSolver> pSchur  = factory.CreateSchurComplement(sharedSize, frameSizes);
+        KSMatrixXf schurStep    = KSMatrixXf::Zero(numParams, 1);
+        KSMatrixXf y2 = y, j2 = j;
+        TS_START("optimization exmple 7");
+        ofASSERT(pSchur->Solve(schurStep, y2, j2, 1), "シューア補行列による求解に失敗しました。");
+        TS_STOP("optimization exmple 7");
+        
+        const double difference = (schurStep - choleskyStep).norm() / choleskyStep.norm();
+        ofLog(OF_LOG_NOTICE, "ex7-1: relative difference: %e", difference);
+        ofASSERT(difference < 1.0e-5, "シューア補行列とコレスキー分解の解が異なります。");
+        
+        // 残差が線形の場合、オプティマイザの1ステップで同じ解になる
+        KSDenseOptimizer optimizer;
+        KSFunction residual     = [&j, &y](const KSVectorXf &x)->KSMatrixXf
+        {
+            return j * x + y;
+        };
+        KSFunction jacobian     = [&j](const KSVectorXf &)->KSMatrixXf
+        {
+            return j;
+        };
+        KSMatrixXf param    = KSMatrixXf::Zero(numParams, 1);
+        KSMatrixXf data     = y;
+        optimizer.Initialize(residual, jacobian, param, data);
+        optimizer.SwitchToSchurComplementSolver(sharedSize, frameSizes);
+        ofASSERT(optimizer.DoGaussNewtonStep(), "ガウス-ニュートン計算ステップに失敗しました。");
+        
+        const double optimizerDifference    = (optimizer.GetParamMat() - choleskyStep).norm() / choleskyStep.norm();
+        ofLog(OF_LOG_NOTICE, "ex7-2: relative difference: %e", optimizerDifference);
+        ofASSERT(optimizerDifference < 1.0e-5, "シューア補行列とコレスキー分解の解が異なります。");
+    }
+    
+    // 例題No.8
+    {
+        // ==================================
+        // Rosenbrock関数を最小二乗問題 r = (10(x1 - x0^2), 1 - x0) として、
+        // ドッグレッグ法で密と疎の両方のオプティマイザで解く. 解は(1, 1)
+        // ==================================
+        
+        KSSolveOptions options;
+        options.maxIterations       = 100;
+        options.functionTolerance   = 0.0;
+        options.stepStrategy        = StepStrategyType::DOGLEG;
+        
+        KSDenseOptimizer denseOptimizer;
+        KSFunction residual     = [](const KSVectorXf &x)->KSMatrixXf
+        {
+            KSMatrixXf r(2, 1);
+            r << 10.0f * (x(1) - x(0) * x(0)), 1.0f - x(0);
+            return r;
+        };
+        KSFunction jacobian     = [](const KSVectorXf &x)->KSMatrixXf
+        {
+            KSMatrixXf d(2, 2);
+            d << -20.0f * x(0), 10.0f,
+                 -1.0f,         0.0f;
+            return d;
+        };
+        KSMatrixXf param(2, 1);
+        param << -1.2, 1.0;
+        KSMatrixXf data = KSMatrixXf::Zero(1, 1);
+        denseOptimizer.Initialize(residual, jacobian, param, data);
+        
+        TS_START("optimization exmple 8-1");
+        KSSolveSummary summary  = denseOptimizer.Solve(options);
+        TS_STOP("optimization exmple 8-1");
+        
+        ofLog(OF_LOG_NOTICE,
+              "ex8-1: param0: %lf, param1: %lf, iterations:%d, termination:%d, final cost:%e",
+              denseOptimizer.GetParamMat()(0),
+              denseOptimizer.GetParamMat()(1),
+              summary.iterations,
+              summary.termination,
+              summary.finalCost);
+        
+        ofASSERT(summary.termination != SolveTerminationType::FAILURE, "ドッグレッグ法の計算ステップに失敗しました。");
+        ofASSERT(summary.finalCost <= summary.initialCost, "コストが増えています。");
+        ofASSERT(fabs(denseOptimizer.GetParamMat()(0) - 1.0) < 0.001, "パラメータ推定結果が異なります。");
+        ofASSERT(fabs(denseOptimizer.GetParamMat()(1) - 1.0) < 0.001, "パラメータ推定結果が異なります。");
+        
+        KSSparseOptimizer sparseOptimizer;
+        KSVectorFunction sparseResidual = [](const KSVectorXf &x)->KSVectorXf
+        {
+            KSVectorXf r(2);
+            r << 10.0f * (x(1) - x(0) * x(0)), 1.0f - x(0);
+            return r;
+        };
+        KSSparseJacobianFunction sparseJacobian = [](const KSVectorXf &x, KSSparseJacobian &d)
+        {
+            d.Add(0, 0, -20.0f * x(0));
+            d.Add(0, 1, 10.0f);
+            d.Add(1, 0, -1.0f);
+        };
+        KSVectorXf sparseParam(2);
+        sparseParam << -1.2, 1.0;
+        KSMatrixXf sparseData = KSMatrixXf::Zero(1, 1);
+        sparseOptimizer.Initialize(sparseResidual, sparseJacobian, sparseParam, sparseData);
+        
+        TS_START("optimization exmple 8-2");
+        summary = sparseOptimizer.Solve(options);
+        TS_STOP("optimization exmple 8-2");
+        
+        ofLog(OF_LOG_NOTICE,
+              "ex8-2: param0: %lf, param1: %lf, iterations:%d, termination:%d, final cost:%e",
+              sparseOptimizer.GetParamVec()(0),
+              sparseOptimizer.GetParamVec()(1),
+              summary.iterations,
+              summary.termination,
+              summary.finalCost);
+        
+        ofASSERT(summary.termination != SolveTerminationType::FAILURE, "ドッグレッグ法の計算ステップに失敗しました。");
+        ofASSERT(fabs(sparseOptimizer.GetParamVec()(0) - 1.0) < 0.001, "パラメータ推定結果が異なります。");
+        ofASSERT(fabs(sparseOptimizer.GetParamVec()(1) - 1.0) < 0.001, "パラメータ推定結果が異なります。");
+        
+        // IRLSとは組み合わせられない
+        options.useIRLS = true;
+        summary = denseOptimizer.Solve(options);
+        ofASSERT(summary.termination == SolveTerminationType::FAILURE && summary.iterations == 0,
+                 "ドッグレッグ法とIRLSの組み合わせが拒否されていません。");
+        summary = sparseOptimizer.Solve(options);
+        ofASSERT(summary.termination == SolveTerminationType::FAILURE && summary.iterations == 0,
+                 "ドッグレッグ法とIRLSの組み合わせが拒否されていません。");
+    }
+    
+    // 例題No.9
+    {
+        // ==================================
+        // 拡張Rosenbrock関数(例題No.8の問題を独立に並べたもの)をL-BFGS法で解く
+        // 正規方程式を作らず、残差と勾配J^t・rだけを使う. 解は全て1
+        // ==================================
+        
+        const int numParams = 1000;
+        KSVectorFunction residual   = [](const KSVectorXf &x)->KSVectorXf
+        {
+            KSVectorXf r(x.size());
+            for (int i = 0, n = x.size(); i < n; i += 2)
+            {
+                r(i)    = 10.0f * (x(i+1) - x(i) * x(i));
+                r(i+1)  = 1.0f - x(i);
+            }
+            return r;
+        };
+        KSGradientFunction gradient = [](const KSVectorXf &x, const KSVectorXf &r)->KSVectorXf
+        {
+            KSVectorXf g(x.size());
+            for (int i = 0, n = x.size(); i < n; i += 2)
+            {
+                g(i)    = -20.0f * x(i) * r(i) - r(i+1);
+                g(i+1)  = 10.0f * r(i);
+            }
+            return g;
+        };
+        KSVectorXf param(numParams);
+        for (int i = 0; i < numParams; i += 2)
+        {
+            param(i)    = -1.2f;
+            param(i+1)  = 1.0f;
+        }
+        KSMatrixXf data = KSMatrixXf::Zero(1, 1);
+        
+        KSLBFGSOptimizer optimizer;
+        ofASSERT(optimizer.Initialize(residual, gradient, param, data), "初期化に失敗しました。");
+        
+        KSSolveOptions options;
+        options.maxIterations       = 200;
+        options.functionTolerance   = 0.0;
+        options.gradientTolerance   = 1.0e-3;
+        options.parameterTolerance  = 0.0;
+        
+        TS_START("optimization exmple 9");
+        KSSolveSummary summary  = optimizer.Solve(options);
+        TS_STOP("optimization exmple 9");
+        
+        const double maxError   = (optimizer.GetParamVec().array() - 1.0f).abs().maxCoeff();
+        ofLog(OF_LOG_NOTICE,
+              "ex9: iterations:%d, termination:%d, initial cost:%lf, final cost:%e, max error:%e",
+              summary.iterations,
+              summary.termination,
+              summary.initialCost,
+              summary.finalCost,
+              maxError);
+        
+        ofASSERT(summary.termination == SolveTerminationType::GRADIENT_CONVERGENCE, "勾配の収束判定で終了していません。");
+        ofASSERT(summary.finalCost < 1.0e-4, "残差平方和の収束値が正解と異なります。");
+        ofASSERT(maxError < 0.01, "パラメータ推定結果が異なります。");
+    }
+    
+    // 例題No.10
+    {
+        // ==================================
+        // 帯状のスパースなヤコビアンを持つ線形最小二乗問題を、ソルバの自動選択で繰り返し解く
+        // 記録した候補が使えなくなっても、同じ計算の中で選び直して解を返す
+        // ==================================
+        
+        const int numRows   = 60;
+        const int numParams = 20;
+        std::vector<Eigen::Triplet<float> > triplets;
+        for (int i = 0; i < numRows; ++i)
+        {
+            const int col   = (i * numParams) / numRows;
+            for (int c = std::max(col - 1, 0); c <= std::min(col + 1, numParams - 1); ++c)
+            {
+                triplets.push_back(Eigen::Triplet<float>(i, c, static_cast<float>(cos(0.3 * i + 1.1 * c) + 2.0)));
+            }
+        }
+        KSMatrixSparsef j(numRows, numParams);
+        j.setFromTriplets(triplets.begin(), triplets.end());
+        KSVectorXf y(numRows);
+        for (int i = 0; i < numRows; ++i)
+        {
+            y(i)    = sin(0.9 * i);
+        }
+        
+        KSCholeskyDecomposition cholesky;
+        KSVectorXf reference    = KSVectorXf::Zero(numParams);
+        KSVectorXf y0 = y;
+        KSMatrixSparsef j0 = j;
+        ofASSERT(cholesky.Solve(reference, y0, j0, 1), "コレスキー分解に失敗しました。");
+        
+        KSAutoSolver autoSolver;
+        autoSolver.Initialize();
+        autoSolver.SetNumTrials(2);
+        
+        // 反復回数0の共役勾配法と密行列への変換を禁止して、スパース行列の直接法の候補だけが残るようにする
+        autoSolver.SetMaxDenseElements(0);
+        
+        // 計測の2回と、選んだ候補だけを使う1回
+        TS_START("optimization exmple 10");
+        for (int trial = 0; trial < 3; ++trial)
+        {
+            KSVectorXf step = KSVectorXf::Zero(numParams);
+            KSVectorXf y1 = y;
+            KSMatrixSparsef j1 = j;
+            ofASSERT(autoSolver.Solve(step, y1, j1, 0), "ソルバの自動選択による求解に失敗しました。");
+            ofASSERT((step - reference).norm() < 1.0e-3 * reference.norm(), "コレスキー分解の解と異なります。");
+        }
+        TS_STOP("optimization exmple 10");
+        
+        const std::string selected  = autoSolver.GetCandidateName(autoSolver.GetLastCandidate());
+        ofLog(OF_LOG_NOTICE, "ex10-1: selected solver: %s", selected.c_str());
+        ofASSERT(selected.compare(0, 6, "SPARSE") == 0, "スパース行列の直接法が選ばれていません。");
+        
+        // 最後のパラメータの列を値0にした特異な問題(非ゼロパターンは同じなので問題の形も同じ)
+        // スパース行列の分解は失敗するが、同じ計算の中で選び直して密行列のLDL^t分解で解く
+        autoSolver.SetMaxDenseElements(1 << 22);
+        std::vector<Eigen::Triplet<float> > singularTriplets;
+        for (const Eigen::Triplet<float>& t : triplets)
+        {
+            singularTriplets.push_back(Eigen::Triplet<float>(t.row(), t.col(), (t.col() == numParams - 1) ? 0.0f : t.value()));
+        }
+        KSMatrixSparsef singularJ(numRows, numParams);
+        singularJ.setFromTriplets(singularTriplets.begin(), singularTriplets.end());
+        KSVectorXf step = KSVectorXf::Zero(numParams);
+        KSVectorXf y2 = y;
+        ofASSERT(autoSolver.Solve(step, y2, singularJ, 0), "選んだ候補の失敗後に選び直せていません。");
+        ofASSERT(step.allFinite() && step(numParams - 1) == 0.0f, "特異な問題の解が異なります。");
+        
+        const std::string reselected    = autoSolver.GetCandidateName(autoSolver.GetLastCandidate());
+        ofLog(OF_LOG_NOTICE, "ex10-2: selected solver: %s", reselected.c_str());
+        ofASSERT(reselected == "DENSE_LDLT", "選び直した候補が異なります。");
+    }
+    
+    // 例題No.11
+    {
+        // ==================================
+        // CPU側の画像の取り込みと、写真的整合性のエネルギー(L2とL2,1ノルム)を手計算と比べる
+        // ==================================
+        
+        const int width     = 8;
+        const int height    = 6;
+        const int numPixels = width * height;
+        
+        // RGBAの画素列(左端の列はアルファ0で顔の外)
+        std::vector<unsigned char> pixels(4 * numPixels);
+        for (int i = 0; i < numPixels; ++i)
+        {
+            for (int c = 0; c < 3; ++c)
+            {
+                pixels[4 * i + c]   = static_cast<unsigned char>((17 * i + 31 * c) % 256);
+            }
+            pixels[4 * i + 3]   = (i % width == 0) ? 0 : 255;
+        }
+        FaceImage input;
+        ofASSERT(input.SetPixels(pixels.data(), width, height, 4), "画素の取り込みに失敗しました。");
+        ofASSERT(input.GetWidth() == width && input.GetHeight() == height, "取り込んだ画像のサイズが異なります。");
+        ofASSERT(input.GetMask().sum() == static_cast<float>(numPixels - height), "アルファから作ったマスクが異なります。");
+        ofASSERT(std::abs(input.GetColor()(2, 5) - pixels[4 * 5 + 2] / 255.0f) < 1.0e-6f, "取り込んだ色が異なります。");
+        ofASSERT(!input.SetPixels(pixels.data(), width, height, 2), "不正なチャンネル数を受け付けました。");
+        
+        // 上4行だけに描画した合成画像
+        FaceImage synthesized;
+        ofASSERT(synthesized.Initialize(width, height), "合成画像の確保に失敗しました。");
+        for (int i = 0; i < numPixels; ++i)
+        {
+            synthesized.GetColor().col(i)   = input.GetColor().col(i) + Eigen::Array3f(0.1f, -0.2f, 0.05f * (i % 3 + 1));
+            synthesized.GetMask()(i)        = (i / width < 4) ? 1.0f : 0.0f;
+        }
+        
+        // 両方のマスクが1の画素だけを手で集計する
+        double expectedL2   = 0.0;
+        double expectedL21  = 0.0;
+        int numVisible      = 0;
+        for (int i = 0; i < numPixels; ++i)
+        {
+            if (input.GetMask()(i) > 0.0f && synthesized.GetMask()(i) > 0.0f)
+            {
+                const double norm2  = (synthesized.GetColor().col(i) - input.GetColor().col(i)).matrix().squaredNorm();
+                expectedL2  += norm2;
+                expectedL21 += sqrt(norm2);
+                ++numVisible;
+            }
+        }
+        
+        PhotometricEnergy energy;
+        ofASSERT(energy.Initialize(PHOTOMETRIC_L2), "写真的整合性の初期化に失敗しました。");
+        KSVectorXf residual;
+        const double l2 = energy.Evaluate(input, synthesized, residual);
+        ofLog(OF_LOG_NOTICE, "ex11: visible:%d, L2:%f, L21 expected:%f", energy.GetNumVisiblePixels(), l2, expectedL21);
+        ofASSERT(energy.GetNumVisiblePixels() == numVisible && residual.size() == 3 * numVisible, "可視画素数が異なります。");
+        ofASSERT(std::abs(l2 - expectedL2) < 1.0e-5 * expectedL2, "L2ノルムのエネルギーが異なります。");
+        ofASSERT(std::abs(residual.squaredNorm() - l2) < 1.0e-5 * l2, "L2ノルムの残差の二乗和がエネルギーと異なります。");
+        
+        // 残差は画素番号の順に (合成 - 入力) を詰めて並べる
+        bool isOrdered  = true;
+        for (int k = 0; k < numVisible; ++k)
+        {
+            const int i = energy.GetPixelIndices()[k];
+            isOrdered   = isOrdered && (k == 0 || energy.GetPixelIndices()[k - 1] < i)
+                       && (residual.segment<3>(3 * k) - (synthesized.GetColor().col(i) - input.GetColor().col(i)).matrix()).norm() < 1.0e-6f;
+        }
+        ofASSERT(isOrdered, "残差の並びが画素番号と対応していません。");
+        
+        // L2,1ノルムは残差の二乗和がノルムの和になるように重み付けされる
+        energy.SetNormType(PHOTOMETRIC_L21);
+        const double l21 = energy.Evaluate(input, synthesized, residual);
+        ofASSERT(std::abs(l21 - expectedL21) < 1.0e-5 * expectedL21, "L2,1ノルムのエネルギーが異なります。");
+        ofASSERT(std::abs(residual.squaredNorm() - l21) < 1.0e-4 * l21, "L2,1ノルムの残差の二乗和がエネルギーと異なります。");
+        // 残差を作らない計算は画素番号を残さないので、先に控えておく
+        const std::vector<int> samples  = energy.GetPixelIndices();
+        ofASSERT(std::abs(energy.Evaluate(input, synthesized) - l21) < 1.0e-9, "残差を作らない計算とエネルギーが異なります。");
+        
+        // 全ての可視画素を重み1で選んだ場合は全画素の計算と一致する
+        KSVectorXf sampled;
+        ofASSERT(std::abs(energy.Evaluate(input, synthesized, samples, 1.0f, sampled) - l21) < 1.0e-5 * l21, "選んだ画素のエネルギーが異なります。");
+        ofASSERT((sampled - residual).norm() < 1.0e-6f, "選んだ画素の残差が異なります。");
+        
+        FaceImage small;
+        small.Initialize(width - 1, height);
+        ofASSERT(energy.Evaluate(input, small) < 0.0, "サイズの違う画像を受け付けました。");
+    }
+    
+    // 例題No.12
+    {
+        // ==================================
+        // 写真的整合性の画素の間引きが三角形の面積に比例して選び、重み付きのエネルギーが全画素の和の推定になることを確かめる
+        // ==================================
+        
+        const int width     = 16;
+        const int height    = 12;
+        const int numPixels = width * height;
+        
+        // 2〜9行目に描画し、左の4列を三角形0、残りを三角形1とする(可視画素は32と96)
+        FaceImage input;
+        FaceImage synthesized;
+        ofASSERT(input.Initialize(width, height) && synthesized.Initialize(width, height), "画像の確保に失敗しました。");
+        input.GetMask().setOnes();
+        for (int i = 0; i < numPixels; ++i)
+        {
+            const int x = i % width;
+            const int y = i / width;
+            const bool isFace   = (y >= 2 && y < 10);
+            input.GetColor().col(i)             = Eigen::Array3f(0.5f, 0.4f, 0.3f);
+            synthesized.GetColor().col(i)       = Eigen::Array3f(0.5f + 0.3f * sin(0.7f * i), 0.4f, 0.3f + 0.1f * cos(1.3f * i));
+            synthesized.GetMask()(i)            = isFace ? 1.0f : 0.0f;
+            synthesized.GetTriangleIds()(i)     = isFace ? ((x < 4) ? 0 : 1) : -1;
+        }
+        const int numVisible    = 8 * width;
+        
+        PixelSampler sampler;
+        ofASSERT(sampler.Initialize(16, 3), "画素の間引きの初期化に失敗しました。");
+        ofASSERT(sampler.Sample(input, synthesized), "画素の選択に失敗しました。");
+        const std::vector<int> samples  = sampler.GetSamples();
+        ofASSERT(sampler.GetNumVisiblePixels() == numVisible, "可視画素数が異なります。");
+        ofASSERT(static_cast<int>(samples.size()) == 16, "選んだ画素数が異なります。");
+        ofASSERT(std::abs(sampler.GetWeight() * samples.size() - numVisible) < 1.0e-4f, "選んだ画素の重みの和が可視画素数と異なります。");
+        
+        // 走査順に並んだ可視画素で、三角形ごとに面積に比例した数が選ばれる
+        int numInTriangle0  = 0;
+        bool isValid        = true;
+        for (size_t k = 0; k < samples.size(); ++k)
+        {
+            isValid = isValid && synthesized.GetMask()(samples[k]) > 0.0f && (k == 0 || samples[k - 1] < samples[k]);
+            numInTriangle0  += (synthesized.GetTriangleIds()(samples[k]) == 0) ? 1 : 0;
+        }
+        ofLog(OF_LOG_NOTICE, "ex12: weight:%f, samples in triangle 0:%d", sampler.GetWeight(), numInTriangle0);
+        ofASSERT(isValid, "選んだ画素が可視画素の走査順になっていません。");
+        ofASSERT(numInTriangle0 == 4, "三角形ごとの画素数が面積に比例していません。");
+        
+        // 同じシードなら同じ画素列になる
+        ofASSERT(sampler.Sample(input, synthesized) && sampler.GetSamples() != samples, "呼び出しごとに別の画素列になっていません。");
+        sampler.SetSeed(3);
+        ofASSERT(sampler.Sample(input, synthesized) && sampler.GetSamples() == samples, "同じシードで同じ画素列になりません。");
+        
+        // 重み付きのエネルギーの平均は全画素のエネルギーに近づく
+        PhotometricEnergy energy;
+        energy.Initialize(PHOTOMETRIC_L2);
+        const double fullEnergy = energy.Evaluate(input, synthesized);
+        const int numDraws      = 400;
+        double meanEnergy       = 0.0;
+        KSVectorXf residual;
+        for (int draw = 0; draw < numDraws; ++draw)
+        {
+            sampler.Sample(input, synthesized);
+            meanEnergy  += energy.Evaluate(input, synthesized, sampler.GetSamples(), sampler.GetWeight(), residual) / numDraws;
+        }
+        ofLog(OF_LOG_NOTICE, "ex12: full energy:%f, mean sampled energy:%f", fullEnergy, meanEnergy);
+        ofASSERT(std::abs(meanEnergy - fullEnergy) < 0.05 * fullEnergy, "間引いたエネルギーの平均が全画素のエネルギーと異なります。");
+        
+        // 可視画素数が選択数以下なら全ての可視画素を重み1で使う
+        sampler.SetNumSamples(numVisible);
+        ofASSERT(sampler.Sample(input, synthesized), "画素の選択に失敗しました。");
+        ofASSERT(static_cast<int>(sampler.GetSamples().size()) == numVisible && sampler.GetWeight() == 1.0f, "間引かない場合の選択が異なります。");
+        
+        FaceImage small;
+        small.Initialize(width, height - 1);
+        ofASSERT(!sampler.Sample(input, small), "サイズの違う画像を受け付けました。");
+    }
+    
+    // 例題No.13
+    {
+        // ==================================
+        // ガウシアンピラミッドの各レベルの解像度、色、マスクを、端を折り返す5×5の二項フィルタの直接計算と比べる
+        // ==================================
+        
+        // 奇数サイズで、中央の1画素だけアルファ0
+        const int width     = 13;
+        const int height    = 9;
+        std::vector<unsigned char> pixels(4 * width * height);
+        for (int i = 0; i < width * height; ++i)
+        {
+            for (int c = 0; c < 3; ++c)
+            {
+                pixels[4 * i + c]   = static_cast<unsigned char>((37 * i + 91 * c + (i * i) % 23) % 256);
+            }
+            pixels[4 * i + 3]   = (i == (height / 2) * width + width / 2) ? 0 : 255;
+        }
+        
+        ImagePyramid pyramid;
+        ofASSERT(pyramid.Initialize(6), "ピラミッドの初期化に失敗しました。");
+        ofASSERT(pyramid.Build(pixels.data(), width, height, 4), "ピラミッドの構築に失敗しました。");
+        
+        // 幅と高さは半分(切り上げ)ずつになり、1×1で打ち切る
+        const int expectedWidths[]  = {13, 7, 4, 2, 1};
+        const int expectedHeights[] = { 9, 5, 3, 2, 1};
+        ofLog(OF_LOG_NOTICE, "ex13: levels:%d", pyramid.GetNumLevels());
+        ofASSERT(pyramid.GetNumLevels() == 5, "ピラミッドのレベル数が異なります。");
+        for (int level = 0; level < pyramid.GetNumLevels(); ++level)
+        {
+            int w   = width;
+            int h   = height;
+            ImagePyramid::GetLevelSize(level, w, h);
+            ofASSERT(pyramid.GetLevel(level).GetWidth() == expectedWidths[level] && pyramid.GetLevel(level).GetHeight() == expectedHeights[level],
+                     "ピラミッドのレベルの解像度が異なります。");
+            ofASSERT(w == expectedWidths[level] && h == expectedHeights[level], "計算したレベルの解像度が異なります。");
+        }
+        
+        // 各レベルを1つ下のレベルからの直接計算と比べる
+        const float weights[5]  = {1.0f / 16.0f, 4.0f / 16.0f, 6.0f / 16.0f, 4.0f / 16.0f, 1.0f / 16.0f};
+        float maxColorError     = 0.0f;
+        bool isMaskValid        = true;
+        for (int level = 1; level < pyramid.GetNumLevels(); ++level)
+        {
+            const FaceImage& src    = pyramid.GetLevel(level - 1);
+            const FaceImage& dst    = pyramid.GetLevel(level);
+            for (int y = 0; y < dst.GetHeight(); ++y)
+            {
+                for (int x = 0; x < dst.GetWidth(); ++x)
+                {
+                    Eigen::Array3f color    = Eigen::Array3f::Zero();
+                    bool isInside           = true;
+                    for (int a = 0; a < 5; ++a)
+                    {
+                        for (int b = 0; b < 5; ++b)
+                        {
+                            const int sy    = std::min(std::max(2 * y + a - 2, 0), src.GetHeight() - 1);
+                            const int sx    = std::min(std::max(2 * x + b - 2, 0), src.GetWidth() - 1);
+                            color           += weights[a] * weights[b] * src.GetColor().col(sy * src.GetWidth() + sx);
+                            isInside        = isInside && src.GetMask()(sy * src.GetWidth() + sx) > 0.0f;
+                        }
+                    }
+                    const int i     = y * dst.GetWidth() + x;
+                    maxColorError   = std::max(maxColorError, (dst.GetColor().col(i) - color).abs().maxCoeff());
+                    isMaskValid     = isMaskValid && (dst.GetMask()(i) == (isInside ? 1.0f : 0.0f));
+                }
+            }
+        }
+        ofLog(OF_LOG_NOTICE, "ex13: max color error:%e", maxColorError);
+        ofASSERT(maxColorError < 1.0e-5f, "縮小した色がフィルタの直接計算と異なります。");
+        ofASSERT(isMaskValid, "縮小したマスクが近傍の全画素の有効判定と異なります。");
+        ofASSERT(pyramid.GetLevel(1).GetMask().sum() < pyramid.GetLevel(1).GetNumPixels(), "無効な画素がマスクに反映されていません。");
+        
+        // 一様な画像はどのレベルでも同じ色
+        FaceImage constant;
+        constant.Initialize(width, height);
+        constant.GetColor().colwise()   = Eigen::Array3f(0.2f, 0.5f, 0.8f);
+        constant.GetMask().setOnes();
+        ofASSERT(pyramid.Build(constant), "ピラミッドの構築に失敗しました。");
+        const FaceImage& top    = pyramid.GetLevel(pyramid.GetNumLevels() - 1);
+        ofASSERT((top.GetColor().col(0) - Eigen::Array3f(0.2f, 0.5f, 0.8f)).abs().maxCoeff() < 1.0e-6f && top.GetMask()(0) == 1.0f,
+                 "一様な画像の縮小結果が異なります。");
+        ofASSERT(!pyramid.Build(pixels.data(), width, height, 2), "不正なチャンネル数を受け付けました。");
+    }
+    
+    // 例題No.14
+    {
+        // ==================================
+        // 顔の投影とランドマークの特徴点整合の残差とヤコビアンを、中心差分と比べる
+        // ==================================
+        
+        const int width     = 320;
+        const int height    = 240;
+        const FaceParamLayout layout    = ExampleFaceLayout();
+        MorphableBasis basis;
+        ofASSERT(ExampleFaceBasis(9, 11, basis), "顔の線形モデルの初期化に失敗しました。");
+        const KSVectorXf params = ExampleFaceParams(layout, static_cast<float>(width) / height);
+        
+        // 投影の点、クォータニオン、平行移動に関する微分
+        FaceProjection projection;
+        ofASSERT(projection.Set(params.data(), layout, width, height), "投影のセットに失敗しました。");
+        const Eigen::Vector3f point(20.0f, -35.0f, 40.0f);
+        Eigen::Vector2f uv;
+        FaceProjection::PointJacobian dPoint;
+        FaceProjection::QuatJacobian dQuat;
+        FaceProjection::PointJacobian dTrans;
+        ofASSERT(projection.ProjectWithJacobian(point, uv, dPoint, dQuat, dTrans), "カメラの前の点を投影できません。");
+        float maxProjectionError    = 0.0f;
+        for (int c = 0; c < 7; ++c)
+        {
+            const float step    = (c < 4) ? 1.0e-3f : 1.0e-2f;
+            const int column    = (c < 4) ? layout.faceQuat + c : layout.faceTrans + c - 4;
+            KSVectorXf plus     = params;
+            KSVectorXf minus    = params;
+            plus(column)        += step;
+            minus(column)       -= step;
+            FaceProjection projectionPlus;
+            FaceProjection projectionMinus;
+            Eigen::Vector2f uvPlus;
+            Eigen::Vector2f uvMinus;
+            projectionPlus.Set(plus.data(), layout, width, height);
+            projectionMinus.Set(minus.data(), layout, width, height);
+            projectionPlus.Project(point, uvPlus);
+            projectionMinus.Project(point, uvMinus);
+            const Eigen::Vector2f analytic  = (c < 4) ? Eigen::Vector2f(dQuat.col(c)) : Eigen::Vector2f(dTrans.col(c - 4));
+            maxProjectionError  = std::max(maxProjectionError, ((uvPlus - uvMinus) / (2.0f * step) - analytic).norm() / std::max(analytic.norm(), 1.0f));
+        }
+        for (int c = 0; c < 3; ++c)
+        {
+            Eigen::Vector2f uvPlus;
+            Eigen::Vector2f uvMinus;
+            projection.Project(point + 1.0e-2f * Eigen::Vector3f::Unit(c), uvPlus);
+            projection.Project(point - 1.0e-2f * Eigen::Vector3f::Unit(c), uvMinus);
+            maxProjectionError  = std::max(maxProjectionError, ((uvPlus - uvMinus) / 2.0e-2f - dPoint.col(c)).norm() / std::max(dPoint.col(c).norm(), 1.0f));
+        }
+        ofLog(OF_LOG_NOTICE, "ex14: projection: uv:(%f, %f), max jacobian error:%e", uv.x(), uv.y(), maxProjectionError);
+        ofASSERT(maxProjectionError < 1.0e-2f, "投影の微分が中心差分と異なります。");
+        
+        // 切り出した範囲への投影は画素座標を拡大縮小したもの
+        FaceRegion region;
+        region.x        = 100.0f;
+        region.y        = 60.0f;
+        region.width    = 160.0f;
+        region.height   = 120.0f;
+        FaceProjection regionProjection = projection;
+        ofASSERT(regionProjection.SetRegion(region, 80, 60), "切り出した範囲のセットに失敗しました。");
+        Eigen::Vector2f regionUv;
+        regionProjection.Project(point, regionUv);
+        ofASSERT((regionUv - Eigen::Vector2f((uv.x() - region.x) * 0.5f, (uv.y() - region.y) * 0.5f)).norm() < 1.0e-3f, "切り出した範囲への投影が異なります。");
+        
+        // 観測は正解の投影から少しずらし、1つは信頼度0にする
+        std::vector<int> vertexIndices;
+        for (int i = 5; i < basis.GetNumVertices(); i += 13)
+        {
+            vertexIndices.push_back(i);
+        }
+        const int numLandmarks  = static_cast<int>(vertexIndices.size());
+        LandmarkEnergy energy;
+        ofASSERT(energy.Initialize(basis, vertexIndices), "ランドマークの初期化に失敗しました。");
+        KSVectorXf vertices;
+        energy.ComputeVertices(params.data(), layout, vertices);
+        std::vector<float> points(2 * numLandmarks);
+        std::vector<float> confidences(numLandmarks, 1.0f);
+        for (int k = 0; k < numLandmarks; ++k)
+        {
+            Eigen::Vector2f observed;
+            projection.Project(vertices.segment<3>(3 * k), observed);
+            points[2 * k]       = observed.x() + 2.0f * sin(1.0f + k);
+            points[2 * k + 1]   = observed.y() - 1.5f * cos(2.0f + k);
+            confidences[k]      = 0.5f + 0.1f * k;
+        }
+        confidences[1]  = 0.0f;
+        ofASSERT(energy.SetObservations(points.data(), confidences.data()), "観測のセットに失敗しました。");
+        
+        // 残差は信頼度の平方根で重み付けした 投影 - 観測
+        KSVectorXf residual;
+        KSMatrixXf jacobian;
+        const double cost   = energy.Evaluate(projection, params.data(), layout, residual, jacobian);
+        double expectedCost = 0.0;
+        bool isResidualValid    = true;
+        for (int k = 0; k < numLandmarks; ++k)
+        {
+            Eigen::Vector2f projected;
+            projection.Project(vertices.segment<3>(3 * k), projected);
+            const Eigen::Vector2f expected  = sqrt(confidences[k]) * (projected - Eigen::Vector2f(points[2 * k], points[2 * k + 1]));
+            isResidualValid = isResidualValid && (residual.segment<2>(2 * k) - expected).norm() < 1.0e-3f;
+            expectedCost    += expected.squaredNorm();
+        }
+        ofASSERT(isResidualValid && residual.segment<2>(2).isZero(), "ランドマークの残差が異なります。");
+        ofASSERT(std::abs(cost - expectedCost) < 1.0e-4 * expectedCost, "ランドマークのエネルギーが異なります。");
+        ofASSERT(jacobian.rows() == 2 * numLandmarks && jacobian.cols() == layout.total && jacobian.middleRows(2, 2).isZero(), "ランドマークのヤコビアンの形が異なります。");
+        
+        // 形状、表情、姿勢、画角、アスペクト比の列を中心差分と比べ、照明とアルベドの列は0
+        auto evaluate   = [&](const KSVectorXf& x, KSVectorXf& r)
+        {
+            FaceProjection p;
+            p.Set(x.data(), layout, width, height);
+            energy.Evaluate(p, x.data(), layout, r);
+        };
+        float maxLandmarkError  = 0.0f;
+        maxLandmarkError    = std::max(maxLandmarkError, MaxJacobianColumnError(evaluate, params, jacobian, layout.camFov, layout.camAspect + 1, 1.0e-2f));
+        maxLandmarkError    = std::max(maxLandmarkError, MaxJacobianColumnError(evaluate, params, jacobian, layout.alpha, layout.alpha + 4, 1.0e-2f));
+        maxLandmarkError    = std::max(maxLandmarkError, MaxJacobianColumnError(evaluate, params, jacobian, layout.delta, layout.delta + 3, 1.0e-2f));
+        maxLandmarkError    = std::max(maxLandmarkError, MaxJacobianColumnError(evaluate, params, jacobian, layout.faceQuat, layout.faceQuat + 4, 1.0e-3f));
+        maxLandmarkError    = std::max(maxLandmarkError, MaxJacobianColumnError(evaluate, params, jacobian, layout.faceTrans, layout.faceTrans + 3, 1.0e-2f));
+        ofLog(OF_LOG_NOTICE, "ex14: landmarks:%d, cost:%f, max jacobian error:%e", numLandmarks, cost, maxLandmarkError);
+        ofASSERT(maxLandmarkError < 1.0e-2f, "ランドマークのヤコビアンが中心差分と異なります。");
+        ofASSERT(jacobian.middleCols(layout.gammaR, layout.alpha - layout.gammaR).isZero()
+                 && jacobian.middleCols(layout.beta, layout.delta - layout.beta).isZero(), "ランドマークに効かない列が0になっていません。");
+    }
+    
+    // 例題No.15
+    {
+        // ==================================
+        // 統計的正則化の対角成分、エネルギー、正規方程式への足し込みを確かめる
+        // ==================================
+        
+        const FaceParamLayout layout    = ExampleFaceLayout();
+        const KSVectorXf params         = ExampleFaceParams(layout, 4.0f / 3.0f);
+        const float weight              = 0.7f;
+        const float alphaVariance[4]    = {1.0f, 2.0f, 0.5f, 4.0f};
+        const float betaVariance[4]     = {0.25f, 1.0f, 3.0f, 1.5f};
+        const float deltaVariance[3]    = {2.0f, 0.8f, 1.2f};
+        
+        StatisticalPrior prior;
+        ofASSERT(prior.Initialize(layout, alphaVariance, 4, betaVariance, 4, deltaVariance, 3, weight), "統計的正則化の初期化に失敗しました。");
+        
+        // 対角成分は W_reg / σ^2 で、係数以外は0
+        KSVectorXf expectedDiagonal = KSVectorXf::Zero(layout.total);
+        for (int c = 0; c < 4; ++c)
+        {
+            expectedDiagonal(layout.alpha + c)  = weight / alphaVariance[c];
+            expectedDiagonal(layout.beta + c)   = weight / betaVariance[c];
+        }
+        for (int c = 0; c < 3; ++c)
+        {
+            expectedDiagonal(layout.delta + c)  = weight / deltaVariance[c];
+        }
+        ofASSERT((prior.GetDiagonal() - expectedDiagonal).norm() < 1.0e-6f, "統計的正則化の対角成分が異なります。");
+        
+        const double energy         = prior.Evaluate(params.data());
+        const double expectedEnergy = expectedDiagonal.dot(params.cwiseProduct(params));
+        ofLog(OF_LOG_NOTICE, "ex15: energy:%f", energy);
+        ofASSERT(std::abs(energy - expectedEnergy) < 1.0e-6 * expectedEnergy, "統計的正則化のエネルギーが異なります。");
+        
+        // A = J^tJ の対角に d_i、b = J^ty に d_i p_i(エネルギーの勾配の1/2)を足す
+        KSMatrixXd A    = KSMatrixXd::Constant(layout.total, layout.total, 0.5);
+        KSVectorXd b    = KSVectorXd::Constant(layout.total, -1.0);
+        prior.Accumulate(params.data(), A, b);
+        KSMatrixXd expectedA    = KSMatrixXd::Constant(layout.total, layout.total, 0.5);
+        expectedA.diagonal()    += expectedDiagonal.cast<double>();
+        ofASSERT((A - expectedA).norm() < 1.0e-6, "統計的正則化の係数行列への足し込みが異なります。");
+        float maxGradientError  = 0.0f;
+        for (int c = 0; c < layout.total; ++c)
+        {
+            KSVectorXf plus     = params;
+            KSVectorXf minus    = params;
+            plus(c)             += 1.0e-2f;
+            minus(c)            -= 1.0e-2f;
+            const double gradient   = (prior.Evaluate(plus.data()) - prior.Evaluate(minus.data())) / 2.0e-2;
+            maxGradientError    = std::max(maxGradientError, static_cast<float>(std::abs(0.5 * gradient - (b(c) + 1.0))));
+        }
+        ofLog(OF_LOG_NOTICE, "ex15: max gradient error:%e", maxGradientError);
+        ofASSERT(maxGradientError < 1.0e-4f, "統計的正則化の右辺への足し込みがエネルギーの勾配と異なります。");
+        
+        KSVectorXd gradient = KSVectorXd::Constant(layout.total, -1.0);
+        prior.AccumulateGradient(params.data(), gradient);
+        ofASSERT((gradient - b).norm() < 1.0e-9, "右辺だけの足し込みが異なります。");
+        
+        // 固定するパラメータを除いた縮小した正規方程式
+        std::vector<int> activeParams;
+        activeParams.push_back(layout.camFov);
+        activeParams.push_back(layout.alpha + 1);
+        activeParams.push_back(layout.delta + 2);
+        KSMatrixXd reducedA = KSMatrixXd::Zero(3, 3);
+        KSVectorXd reducedB = KSVectorXd::Zero(3);
+        prior.Accumulate(params.data(), activeParams, reducedA, reducedB);
+        bool isReducedValid = reducedA.isDiagonal();
+        for (int k = 0; k < 3; ++k)
+        {
+            const int i     = activeParams[k];
+            isReducedValid  = isReducedValid && std::abs(reducedA(k, k) - expectedDiagonal(i)) < 1.0e-6
+                           && std::abs(reducedB(k) - expectedDiagonal(i) * params(i)) < 1.0e-6;
         }
+        ofASSERT(isReducedValid, "縮小した正規方程式への足し込みが異なります。");
         
+        const float invalidVariance[4]  = {1.0f, 0.0f, 1.0f, 1.0f};
+        StatisticalPrior invalid;
+        ofASSERT(!invalid.Initialize(layout, invalidVariance, 4, betaVariance, 4, deltaVariance, 3, weight), "正でない分散を受け付けました。");
     }
     
     return true;
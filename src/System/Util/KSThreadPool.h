@@ -0,0 +1,236 @@
+//
+//  KSThreadPool.h
+//
+//  並列計算のためのスレッドプール
+//
+//  Copyright (c) 2016年 Takahiro Kosaka. All rights reserved.
+//  Created by Takahiro Kosaka on 2016/07/13.
+//
+//  This Source Code Form is subject to the terms of the Mozilla
+//  Public License v. 2.0. If a copy of the MPL was not distributed
+//  with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef KSThreadPool_h
+#define KSThreadPool_h
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Kosakasakas
+{
+    /**
+     @brief 並列計算のためのスレッドプール
+     
+     ワーカースレッドを起動したまま保持し、ParallelForで区間を分割して並列に処理します.
+     呼び出し元のスレッドも計算に参加します.
+     並列処理の中(呼び出し元のスレッドが処理しているチャンクも含む)からの入れ子の呼び出しや、
+     別スレッドから同時に呼ばれた場合は呼び出し元で逐次処理します.
+     */
+    class KSThreadPool
+    {
+    public:
+        /**
+         @brief 区間処理の関数
+         [begin, end)の要素を処理します. workerは0からGetNumWorkers()-1までのワーカー番号で、
+         ワーカーごとの作業領域を使い分けるために使えます.
+         */
+        typedef std::function<void(int begin, int end, int worker)> RangeFunction;
+        
+        /**
+         @brief コンストラクタ
+         @param numThreads  起動するワーカースレッド数(0以下の場合はコア数-1)
+         */
+        explicit KSThreadPool(int numThreads = 0)
+        : m_pFunc(nullptr)
+        , m_Begin(0)
+        , m_End(0)
+        , m_Grain(1)
+        , m_NumChunks(0)
+        , m_NextChunk(0)
+        , m_Pending(0)
+        , m_Generation(0)
+        , m_Stop(false)
+        {
+            if (numThreads <= 0)
+            {
+                numThreads  = std::max(1, static_cast<int>(std::thread::hardware_concurrency())) - 1;
+            }
+            for (int i=0; i<numThreads; ++i)
+            {
+                m_Workers.push_back(std::thread(&KSThreadPool::WorkerLoop, this, i + 1));
+            }
+        }
+        
+        //! デストラクタ
+        ~KSThreadPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                m_Stop  = true;
+            }
+            m_WorkCondition.notify_all();
+            for (auto& worker : m_Workers)
+            {
+                worker.join();
+            }
+        }
+        
+        //! 共有のスレッドプールを取得
+        static KSThreadPool&    GetDefault()
+        {
+            static KSThreadPool pool;
+            return pool;
+        }
+        
+        //! 呼び出し元を含めたワーカー数
+        inline int  GetNumWorkers() const
+        {
+            return static_cast<int>(m_Workers.size()) + 1;
+        }
+        
+        /**
+         @brief 区間の並列処理
+         
+         [begin, end)をgrainSize個ずつのチャンクに分割し、ワーカーで分担して処理します.
+         全てのチャンクの処理が終わるまで戻りません.
+         @param begin       区間の先頭
+         @param end         区間の終端(これを含まない)
+         @param grainSize   1チャンクの要素数
+         @param func        区間処理の関数
+         */
+        void    ParallelFor(int begin, int end, int grainSize, const RangeFunction& func)
+        {
+            if (end <= begin)
+            {
+                return;
+            }
+            grainSize           = std::max(grainSize, 1);
+            const int numChunks = (end - begin + grainSize - 1) / grainSize;
+            
+            // 並列化できない場合は逐次処理
+            // 入れ子の呼び出しは投入の排他を既に持っている可能性があるため、ロックを試す前に判定する
+            if (m_Workers.empty() || numChunks == 1 || IsInParallelRegion())
+            {
+                func(begin, end, 0);
+                return;
+            }
+            std::unique_lock<std::mutex> submit(m_SubmitMutex, std::try_to_lock);
+            if (!submit.owns_lock())
+            {
+                func(begin, end, 0);
+                return;
+            }
+            
+            {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                m_pFunc     = &func;
+                m_Begin     = begin;
+                m_End       = end;
+                m_Grain     = grainSize;
+                m_NumChunks = numChunks;
+                m_NextChunk.store(0);
+                m_Pending   = static_cast<int>(m_Workers.size());
+                ++m_Generation;
+            }
+            m_WorkCondition.notify_all();
+            
+            RunChunks(0);
+            
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_DoneCondition.wait(lock, [this]{ return m_Pending == 0; });
+            m_pFunc = nullptr;
+        }
+    
+    private:
+        //! チャンクを取り出して処理する
+        void    RunChunks(int worker)
+        {
+            bool& isInParallelRegion    = IsInParallelRegion();
+            const bool wasInParallelRegion  = isInParallelRegion;
+            isInParallelRegion  = true;
+            while (true)
+            {
+                const int chunk = m_NextChunk.fetch_add(1);
+                if (chunk >= m_NumChunks)
+                {
+                    break;
+                }
+                const int b = m_Begin + chunk * m_Grain;
+                const int e = std::min(b + m_Grain, m_End);
+                (*m_pFunc)(b, e, worker);
+            }
+            isInParallelRegion  = wasInParallelRegion;
+        }
+        
+        //! ワーカースレッドのループ
+        void    WorkerLoop(int worker)
+        {
+            IsInParallelRegion()    = true;
+            unsigned long long  seen = 0;
+            while (true)
+            {
+                std::unique_lock<std::mutex> lock(m_Mutex);
+                m_WorkCondition.wait(lock, [this, seen]{ return m_Stop || m_Generation != seen; });
+                if (m_Stop)
+                {
+                    return;
+                }
+                seen    = m_Generation;
+                lock.unlock();
+                
+                RunChunks(worker);
+                
+                lock.lock();
+                if (--m_Pending == 0)
+                {
+                    m_DoneCondition.notify_one();
+                }
+            }
+        }
+        
+        //! このスレッドが並列処理の中にいるかどうか(ワーカースレッドは常に真)
+        static bool&    IsInParallelRegion()
+        {
+            static thread_local bool isInParallelRegion = false;
+            return isInParallelRegion;
+        }
+    
+    private:
+        //! ワーカースレッド
+        std::vector<std::thread>    m_Workers;
+        //! 投入の排他
+        std::mutex                  m_SubmitMutex;
+        //! 状態の排他
+        std::mutex                  m_Mutex;
+        //! 仕事の通知
+        std::condition_variable     m_WorkCondition;
+        //! 完了の通知
+        std::condition_variable     m_DoneCondition;
+        
+        //! 実行中の関数
+        const RangeFunction*    m_pFunc;
+        //! 区間の先頭
+        int                     m_Begin;
+        //! 区間の終端
+        int                     m_End;
+        //! チャンクの要素数
+        int                     m_Grain;
+        //! チャンク数
+        int                     m_NumChunks;
+        //! 次に処理するチャンク
+        std::atomic<int>        m_NextChunk;
+        //! 処理中のワーカー数
+        int                     m_Pending;
+        //! 投入ごとに進む世代番号
+        unsigned long long      m_Generation;
+        //! 終了フラグ
+        bool                    m_Stop;
+    };
+}
+
+#endif /* KSThreadPool_h */